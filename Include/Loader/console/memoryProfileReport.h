@@ -0,0 +1,178 @@
+/*
+ * Copyright (c) 2008-2016, Integrity Project Ltd. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * Neither the name of the Integrity Project nor the names of its contributors
+ * may be used to endorse or promote products derived from this software
+ * without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE
+ */
+
+
+#ifndef __TBA_XDKLOADER_CONSOLE_MEMORYPROFILEREPORT_H
+#define __TBA_XDKLOADER_CONSOLE_MEMORYPROFILEREPORT_H
+
+/*
+ * memoryProfileReport.h
+ *
+ * Ring3 reporting tool for the dumps of the driver sampling heap profiler
+ * (See MemoryProfiler and cConsoleDeviceIoctl::queryMemoryProfile).
+ */
+#include "xStl/types.h"
+#include "xStl/data/string.h"
+#include "XDK/memory/MemoryProfile.h"
+
+/*
+ * Aggregates the samples of a MemoryProfileDump by their call-site (The
+ * complete return addresses chain) and prints the call-sites ordered by the
+ * estimated number of live bytes.
+ *
+ * Each sample stands for all the bytes which were allocated since the previous
+ * sample, so a sampled block of 'length' bytes is accounted as
+ *     length / (1 - exp(-length / sampleRate))
+ * bytes. The estimation is unbiased, but it is only meaningful for call-sites
+ * which hold a few samples.
+ *
+ * Usage:
+ *     MemoryProfileDump* dump = new MemoryProfileDump;
+ *     pooler.queryMemoryProfile(*dump);
+ *     cMemoryProfileReport report(*dump);
+ *     report.symbolize("c:\\drivers\\mydriver.sys");
+ *     report.print();
+ *
+ * NOTE: This class is not thread-safe!
+ */
+class cMemoryProfileReport {
+public:
+    /*
+     * Constructor. Aggregates the samples of 'dump'. The dump must live as
+     * long as the report.
+     *
+     * Throw exception if the dump isn't valid.
+     */
+    cMemoryProfileReport(const MemoryProfileDump& dump);
+
+    /*
+     * Destructor. Frees the symbols engine.
+     */
+    ~cMemoryProfileReport();
+
+    /*
+     * Loads the symbols of the profiled module, so the return addresses are
+     * printed as 'function+offset'. The module is loaded at the image base of
+     * the dump. Without symbols, the return addresses are printed as module
+     * offsets.
+     *
+     * Return false if the symbols cannot be loaded.
+     */
+    bool symbolize(const cString& moduleFilename);
+
+    /*
+     * Prints the summary of the dump and the 'maxCallSites' heaviest
+     * call-sites.
+     */
+    void print(uint maxCallSites = DEFAULT_CALL_SITES) const;
+
+    /*
+     * Returns the number of different call-sites of the dump.
+     */
+    uint getNumberOfCallSites() const;
+
+    /*
+     * Returns the estimated number of live bytes of the whole dump.
+     */
+    uint64 getEstimatedBytes() const;
+
+    /*
+     * Writes 'dump' into 'filename' as is.
+     *
+     * Throw exception if the file cannot be written.
+     */
+    static void saveDump(const MemoryProfileDump& dump,
+                         const cString& filename);
+
+    /*
+     * Reads a dump which was written by saveDump().
+     *
+     * Throw exception if the file cannot be read or isn't a valid dump.
+     */
+    static void loadDump(MemoryProfileDump& dump,
+                         const cString& filename);
+
+    // The default number of printed call-sites
+    enum { DEFAULT_CALL_SITES = 20 };
+
+private:
+    // Deny copy-constructor and operator =
+    cMemoryProfileReport(const cMemoryProfileReport& other);
+    cMemoryProfileReport& operator = (const cMemoryProfileReport& other);
+
+    /*
+     * All the samples which share the same return addresses chain
+     */
+    struct CallSite {
+        // One of the samples of the call-site, holds the return addresses
+        const MemoryProfileSample* m_sample;
+        // The number of samples
+        uint m_numberOfSamples;
+        // The total length of the sampled blocks
+        uint64 m_sampledBytes;
+        // The estimated number of live bytes
+        double m_estimatedBytes;
+        // The time of the oldest sample, in milliseconds
+        uint32 m_oldestTime;
+    };
+
+    /*
+     * Returns true if both samples were allocated from the same call-site
+     */
+    static bool isSameCallSite(const MemoryProfileSample& a,
+                               const MemoryProfileSample& b);
+
+    /*
+     * Orders call-sites by descending estimated bytes. qsort callback.
+     */
+    static int __cdecl compareCallSites(const void* a, const void* b);
+
+    /*
+     * Returns the estimated number of bytes for a sample of 'length' bytes.
+     */
+    double estimateBytes(uint32 length) const;
+
+    /*
+     * Prints a single return address
+     */
+    void printFrame(uint64 address) const;
+
+    // The aggregated dump
+    const MemoryProfileDump& m_dump;
+    // The call-sites, ordered by descending estimated bytes
+    CallSite m_callSites[MemoryProfileDump::MAX_SAMPLES];
+    // The number of valid entries of 'm_callSites'
+    uint m_numberOfCallSites;
+    // The handle used by the symbols engine, or NULL if there aren't symbols
+    void* m_symbolsHandle;
+};
+
+#endif // __TBA_XDKLOADER_CONSOLE_MEMORYPROFILEREPORT_H
@@ -43,6 +43,12 @@
 #include "xStl/os/thread.h"
 #include "xStl/os/threadedClass.h"
 #include "xStl/data/list.h"
+#include "xdk/memory/MemoryStatistics.h"
+#include "xdk/memory/MemoryProfiler.h"
+#include "xdk/memory/MemoryTraceRecorder.h"
+#include "xdk/memory/DeferredFreeQueue.h"
+#include "xdk/memory/MemoryArena.h"
+#include "xdk/memory/MemorySlabPool.h"
 #include "xdk/memory/SuperiorMemoryManager.h"
 #include "xdk/memory/SuperiorMemoryManagerInterface.h"
 
@@ -68,6 +74,142 @@ void * __cdecl operator new(unsigned int cbSize);
  */
 void __cdecl operator delete(void* memory);
 
+/*
+ * The argument of the aligned operator new. Usage:
+ *
+ *     Descriptor* descriptor = new(XdkAlignment(64)) Descriptor();
+ *     ...
+ *     delete descriptor;
+ */
+struct XdkAlignment {
+    // Constructor. 'alignment' must be a power of 2. See
+    // SuperiorMemoryManager::allocateAligned
+    explicit XdkAlignment(uint alignment) : m_alignment(alignment) {}
+
+    uint m_alignment;
+};
+
+/*
+ * Aligned operator new
+ *
+ * The memory is allocated from cXdkDriverMemoryManager in any IRQL, since the
+ * operating system pool cannot be aligned. The normal operator delete frees
+ * it.
+ */
+void * __cdecl operator new(unsigned int cbSize, const XdkAlignment& alignment);
+
+/*
+ * Matching operator delete for the aligned operator new. Called only when the
+ * constructor throws.
+ */
+void __cdecl operator delete(void* memory, const XdkAlignment& alignment);
+
+/*
+ * Base class for small objects which are allocated and freed often. The
+ * objects are allocated from cXdkDriverMemoryManager in any IRQL, and freed
+ * by their size, so they are returned into the processor cache without
+ * reading the block descriptor. See SuperiorMemoryManager::free
+ *
+ * NOTE: Classes which are deleted through a base pointer must have a virtual
+ *       destructor, so the operator delete gets the real size.
+ */
+class cXdkSizedObject {
+public:
+    /*
+     * Allocate the object. Throws exception if there isn't enough memory.
+     */
+    static void* operator new(unsigned int cbSize);
+
+    /*
+     * Free the object by it's size.
+     */
+    static void operator delete(void* memory, unsigned int cbSize);
+};
+
+/*
+ * The pool of a class which inherits cXdkPooledObject. The pool is created
+ * when the first object is allocated, and destroyed when the memory manager
+ * is terminated.
+ */
+struct XdkPoolSlot {
+    // The pool of the class, or NULL
+    MemorySlabPool* volatile m_pool;
+    // The next slot which has a pool. See cXdkDriverMemoryManager::createPool
+    XdkPoolSlot* m_next;
+};
+
+/*
+ * An arena for the temporary objects of a request (Or of an interrupt). While
+ * the scope is alive, the global operator new of the current thread (at the
+ * current IRQL) allocates from the arena, and operator delete of these
+ * objects does nothing. All of them are released at once when the scope
+ * ends. Usage:
+ *
+ *     void handleRequest(...)
+ *     {
+ *         cXdkArenaScope arena;
+ *         cString name = ...;    // Allocated from the arena
+ *         ...
+ *     }                          // Released here
+ *
+ * The chunks of the arena are allocated from cXdkDriverMemoryManager, so the
+ * scope can be used in any IRQL. Scopes can be nested, the inner scope is
+ * the current one until it ends. Objects of the outer scopes can still be
+ * deleted inside the inner scope. See MemoryArena
+ *
+ * NOTE: Objects which are allocated inside the scope must not be used (or
+ *       deleted) after the scope ends.
+ * NOTE: Interrupts and DPCs which run on top of the thread are not routed
+ *       into it's arena, since they run at a different IRQL.
+ */
+class cXdkArenaScope {
+public:
+    /*
+     * Constructor. Make the arena the current one.
+     *
+     * chunkLength, initialBuffer, initialBufferLength - See
+     *     MemoryArena::MemoryArena
+     *
+     * Throw exception if the memory manager isn't initialized.
+     */
+    cXdkArenaScope(uint chunkLength = MemoryArena::DEFAULT_CHUNK_LENGTH,
+                   void* initialBuffer = NULL,
+                   uint initialBufferLength = 0);
+
+    /*
+     * Destructor. Restore the previous scope and release all blocks.
+     */
+    ~cXdkArenaScope();
+
+    /*
+     * Return the arena of the scope. Allocations can be made directly from
+     * it even when the scope couldn't become the current one.
+     */
+    MemoryArena& getArena();
+
+    /*
+     * Return true if operator new is routed into the arena. There is a
+     * limited number of threads which can route at the same time. See
+     * cXdkDriverMemoryManager::setCurrentScope
+     */
+    bool isRouted() const;
+
+private:
+    // Deny copy-constructor and operator =
+    cXdkArenaScope(const cXdkArenaScope& other);
+    cXdkArenaScope& operator = (const cXdkArenaScope& other);
+
+    // The operator delete walks the scopes
+    friend class cXdkDriverMemoryManager;
+
+    // The arena
+    MemoryArena m_arena;
+    // The scope which was current before this scope
+    cXdkArenaScope* m_previousScope;
+    // See isRouted
+    bool m_isRouted;
+};
+
 /*
  * Allocates memory for functions that executed above DISPATCH_LEVEL.
  *
@@ -83,34 +225,96 @@ void __cdecl operator delete(void* memory);
  * The operator new and operator delete divide the allocation into two groups:
  * - Normal mode. Executed at PASSIVE_LEVEL to DISPATCH_LEVEL.
  *      Operator new will allocate memory using ExAllocatePool(NonPaged)
- *      Operator new will delete memory that free at interrupt-time
  *      Operator delete will delete memory which allocate by the ExAllocatePool
  *         using ExFreePool
  *      Operator delete will delete memory which allocate in interrupt time
  *         using cXdkDriverMemoryManager.
- *      Operator delete will delete memory that free at interrupt-time
  *
  * - Interrupt mode. Executed at IRQL higher than DISPATCH_LEVEL
  *      Operator new will allocate memory using cXdkDriverMemoryManager
  *      Operator delete will delete memory that allocated at interrupt time
  *      Operator delete will queue memory that allocated at normal time
  *
+ * The queued memory is freed in batches by the expandor thread (See
+ * clearDtorQueue), so neither operator new nor operator delete pays for it.
+ *
+ * When compiled with the preprocessor flag XDK_MEMORY_LARGE_PAGES, the
+ * superblocks of the heap are backed by large pages. See
+ * MemoryLargePageAllocator.
+ *
  * TODO! After the final algorithm will be written, please document the way
  *       heaps are allocated.
  */
 class cXdkDriverMemoryManager {
+public:
+    /*
+     * Fill 'statistics' with a snapshot of the driver memory manager.
+     * See SuperiorMemoryManager::getStatistics
+     *
+     * Return false if the memory manager isn't initialized, or if it's
+     * compiled without SUPERIOR_MEMORY_MANAGER_STATISTICS.
+     */
+    static bool getStatistics(MemoryStatistics& statistics);
+
+    /*
+     * Fill 'dump' with the live samples of the heap profiler. The profiler
+     * samples the allocations of operator new, from both the operating
+     * system pool and the interrupt-time memory. See MemoryProfiler
+     *
+     * Return false if the memory manager isn't initialized.
+     */
+    static bool getProfile(MemoryProfileDump& dump);
+
+    /*
+     * Change the average number of bytes between two samples of the heap
+     * profiler. Set to 0 in order to stop the profiler.
+     * See MemoryProfiler::setSampleRate
+     */
+    static void setProfilerSampleRate(uint sampleRate);
+
+    /*
+     * Start recording the allocations and the frees of operator new/delete
+     * into the trace ring. The ring is allocated by the first call, so it
+     * must be called in PASSIVE_LEVEL. See MemoryTraceRecorder
+     *
+     * Return false if the memory manager isn't initialized, or if the ring
+     * cannot be allocated.
+     */
+    static bool startTrace();
+
+    /*
+     * Stop recording. The records are kept until they are drained.
+     */
+    static void stopTrace();
+
+    /*
+     * Move the next batch of records from the trace ring into 'dump'.
+     * See MemoryTraceRecorder::drain
+     *
+     * Return false if the memory manager isn't initialized.
+     */
+    static bool drainTrace(MemoryTraceDump& dump);
+
+    /*
+     * Return the arena which operator new of the current thread (at the
+     * current IRQL) is routed into, or NULL. See cXdkArenaScope
+     */
+    static MemoryArena* getCurrentArena();
+
 private:
     // Only the memory-management utilities can access this API
     class MemoryBlockDescriptor;
     friend void * __cdecl operator new(unsigned int cbSize);
     friend void __cdecl operator delete(void* memory);
+    friend void * __cdecl operator new(unsigned int cbSize,
+                                       const XdkAlignment& alignment);
+    friend class cXdkSizedObject;
+    template <class T> friend class cXdkPooledObject;
+    friend class cXdkArenaScope;
     friend class cXDKLibCPP;
     friend class XdkMemoryTestSingleton;
     friend class MemoryBlockDescriptor;
 
-    // The memory-address destructor value
-    typedef cList<addressNumericValue> DtorWorkItem;
-
     /////////////////////////////////////////////
     // Functions
 
@@ -144,41 +348,118 @@ private:
      */
     static bool free(void* address);
 
-    //////////////////////////////////////////////////////////////////////////
-    // The dtor queue-item.
-    #ifndef XDK_TEST
+    /*
+     * Allocate an object of 'length' bytes aligned to 'alignment', for the
+     * aligned operator new and for cXdkSizedObject.
+     *
+     * Throw exception if the memory cannot be allocated.
+     */
+    static void* allocateObject(uint length, uint alignment);
 
     /*
-     * Free all objects which destructed at interrupt time.
-     * Called in IRQL PASSIVE_LEVEL to DISPATCH_LEVEL and free memory that dtor
-     * at higher IRQL than DISPATCH_LEVEL.
+     * Free an object of cXdkSizedObject by it's length. See
+     * SuperiorMemoryManager::free
      */
-    static void clearDtorQueue();
+    static void freeObject(void* address, uint length);
 
     /*
-     * Called by the 'clearDtorQueue'. Used as atomic, exception safe module
-     * for the acquire/releasing mutex
+     * Allocate an object of cXdkPooledObject from the pool of 'slot'. The
+     * pool is created by the first call. Objects of derived classes, which
+     * are not 'objectLength' bytes long, are allocated by allocateObject.
+     *
+     * Throw exception if the memory cannot be allocated.
      */
-    static void clearingProcess();
+    static void* allocatePooled(XdkPoolSlot& slot,
+                                uint objectLength,
+                                uint length);
 
     /*
-     * Return true if clearing in progress was acquire.
-     * Return false if another clearing operation already active
+     * Free an object which was allocated by allocatePooled.
      */
-    static bool acquireClearing();
+    static void freePooled(XdkPoolSlot& slot,
+                           void* address,
+                           uint objectLength,
+                           uint length);
 
     /*
-     * Notify that the clearing operation completed.
+     * Create the pool of 'slot' and register it for 'terminate()'. Another
+     * thread might win the race, in that case it's pool is returned.
+     *
+     * Return NULL if the pool cannot be allocated.
      */
-    static void releaseClearing();
+    static MemorySlabPool* createPool(XdkPoolSlot& slot, uint objectLength);
 
     /*
-     * Safely retrieves the memory to be deleted and remove it from the queue
+     * Report an allocation/free of operator new/delete to the heap profiler
+     * and to the trace recorder. Ignored while the memory manager isn't
+     * initialized.
+     */
+    static void recordAllocation(void* address, uint length);
+    static void recordFree(void* address);
+
+    /*
+     * Route operator new of the current thread (at the current IRQL) into
+     * the arena of 'scope'. Set to NULL in order to stop the routing.
      *
-     * Return the next/first element to be free.
-     * Return NULL if the list is empty
+     * Return false if there isn't a free context for the thread. See
+     * Members::MAX_ARENA_CONTEXTS
+     */
+    static bool setCurrentScope(cXdkArenaScope* scope);
+
+    /*
+     * Return the scope which operator new of the current thread (at the
+     * current IRQL) is routed into, or NULL.
+     */
+    static cXdkArenaScope* getCurrentScope();
+
+    /*
+     * Return true if 'address' is a block of the current scope, or of the
+     * scopes which the current scope is nested in. Such blocks are not freed
+     * by operator delete.
+     */
+    static bool isArenaBlock(void* address);
+
+    /*
+     * Return the heap of the XDK. Throw exception if the memory manager
+     * isn't initialized.
+     */
+    static SuperiorMemoryManager& getHeap();
+
+    #ifndef XDK_TEST
+    /*
+     * The current scope of a thread at a single IRQL. The interrupts which
+     * run on top of the thread have a different IRQL, so they never see the
+     * scope of the thread.
+     */
+    class ArenaContext {
+    public:
+        // The owner thread, or NULL for a free context
+        void* volatile m_thread;
+        // The IRQL of the owner
+        KIRQL m_irql;
+        // The current scope
+        cXdkArenaScope* m_scope;
+        // Set after the context is filled, and cleared before it's freed
+        volatile uint32 m_isActive;
+    };
+
+    /*
+     * Return the context of the current thread at the current IRQL, or NULL.
+     */
+    static ArenaContext* findArenaContext();
+    #endif
+
+    //////////////////////////////////////////////////////////////////////////
+    // The dtor queue-item.
+    #ifndef XDK_TEST
+
+    /*
+     * Free all objects which destructed at interrupt time.
+     * Called in IRQL PASSIVE_LEVEL to DISPATCH_LEVEL and free memory that dtor
+     * at higher IRQL than DISPATCH_LEVEL. Called periodically by the expandor
+     * thread, and when the driver is unloaded.
      */
-    static void pollList(DtorWorkItem& output);
+    static void clearDtorQueue();
     #endif
 
     //////////////////////////////////////////////////////////////////////////
@@ -189,11 +470,6 @@ private:
      */
     static void checkValid();
 
-    #ifdef _DEBUG
-    // Internal API for debuging bugs inside the memory manager
-    static cOSDef::threadHandle m_debugThread;
-    #endif
-
     //////////////////////////////////////////////////////////////////////////
     // Members
 
@@ -262,7 +538,10 @@ private:
     protected:
         /*
          * The thread main routine. Sleep 'm_refreshRateInMilliseconds' and
-         * expand the memory
+         * manage the memory. Expansions which are requested by the
+         * allocations, and the memory which was deleted at interrupt time,
+         * are served every REFERSH_UNIT_IN_MILLISECONDS.
+         * See SuperiorMemoryManager::isExpansionRequested and clearDtorQueue
          */
         virtual void run();
 
@@ -294,6 +573,9 @@ private:
         // The number of bytes for each superblock. Must be bigger than
         // SuperiorMemoryManager::INITIALIZE_SIZE_MINIMUM_SIZE
         enum { XDM_SUPERBLOCK_LENGTH = 16*1024*1024 };  // 8-mb
+        // Interrupt-time bursts should never find the superblocks full. See
+        // SuperiorMemoryManager::setLowWatermark
+        enum { XDM_LOW_WATERMARK = XDM_SUPERBLOCK_LENGTH / 4 };
 
         /*
          * Constructor.
@@ -317,6 +599,21 @@ private:
         // The memory manager
         SuperiorMemoryManager* m_memManager;
 
+        // The heap profiler of operator new
+        MemoryProfiler m_profiler;
+
+        // The length of the trace ring. 65536 records.
+        enum { TRACE_BUFFER_LENGTH = 2*1024*1024 };
+        // The allocation trace recorder of operator new
+        MemoryTraceRecorder m_tracer;
+        // The ring of 'm_tracer', or NULL before the first 'startTrace()'
+        void* m_traceBuffer;
+        // Protects the allocation of the ring
+        MemoryLockableObject m_traceLock;
+
+        // The slots of the pools of cXdkPooledObject. See createPool
+        XdkPoolSlot* volatile m_poolSlots;
+
         // Every 1 minute the memory should be refreshed
         enum { DEFAULT_REFRESH_RATE = 60*1000 };
         // The expandor thread
@@ -324,18 +621,18 @@ private:
 
         #ifndef XDK_TEST
         //////////////////////////////////////////////////////////////////
-        // The dtor-queue is a protected list of all normal-memory which
-        // is deallocated during an interrupt. After the interrupt will
-        // be free, the operating-system free() method will be called
-
-        // The dtor queue mutable
-        LOCKABLE_OBJECT m_dtorQueueLock;
-        // The dtor queue
-        DtorWorkItem* m_dtorQueue;
-        // Protect against 'm_isOperationInProgress' corruptions.
-        LOCKABLE_OBJECT m_dtorClearingAcquire;
-        // Set to true to indicate that queue clearing is in progress
-        bool m_isOperationInProgress;
+        // The dtor-queue holds all normal-memory which is deallocated
+        // during an interrupt. The expandor thread calls the operating-
+        // system free() method for them later on.
+        DeferredFreeQueue m_dtorQueue;
+
+        // The maximum number of threads which route operator new into an
+        // arena at the same time
+        enum { MAX_ARENA_CONTEXTS = 64 };
+        // The current scopes. See setCurrentScope
+        ArenaContext m_arenaContexts[MAX_ARENA_CONTEXTS];
+        // The number of used contexts. Routing is skipped when it's 0.
+        volatile uint32 m_activeArenaContexts;
         #endif // XDK_TEST
 
     private:
@@ -350,4 +647,49 @@ private:
     static bool m_aboutToTerminate;
 };
 
+/*
+ * Base class for hot objects of a fixed size, such as list nodes and
+ * reference counters. Each class gets a pool of it's own, so allocation and
+ * free never search the heap and the objects don't fragment it. See
+ * MemorySlabPool. Usage:
+ *
+ *     class cNode : public cXdkPooledObject<cNode> {
+ *         ...
+ *     };
+ *
+ * The objects are allocated from cXdkDriverMemoryManager in any IRQL.
+ * Objects of derived classes with a different size are allocated like
+ * cXdkSizedObject.
+ *
+ * NOTE: Classes which are deleted through a base pointer must have a virtual
+ *       destructor, so the operator delete gets the real size.
+ */
+template <class T>
+class cXdkPooledObject {
+public:
+    /*
+     * Allocate the object. Throws exception if there isn't enough memory.
+     */
+    static void* operator new(unsigned int cbSize)
+    {
+        return cXdkDriverMemoryManager::allocatePooled(m_slot, sizeof(T),
+                                                       cbSize);
+    }
+
+    /*
+     * Return the object to the pool
+     */
+    static void operator delete(void* memory, unsigned int cbSize)
+    {
+        cXdkDriverMemoryManager::freePooled(m_slot, memory, sizeof(T), cbSize);
+    }
+
+private:
+    // The pool of 'T'
+    static XdkPoolSlot m_slot;
+};
+
+template <class T>
+XdkPoolSlot cXdkPooledObject<T>::m_slot = { NULL, NULL };
+
 #endif // __TBA_XDK_MEMORY_H
@@ -0,0 +1,218 @@
+/*
+ * Copyright (c) 2008-2016, Integrity Project Ltd. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * Neither the name of the Integrity Project nor the names of its contributors
+ * may be used to endorse or promote products derived from this software
+ * without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE
+ */
+
+#ifndef __TBA_XDK_MEMORY_BITMAPMEMORYHEAPMANAGER_H
+#define __TBA_XDK_MEMORY_BITMAPMEMORYHEAPMANAGER_H
+
+/*
+ * BitmapMemoryHeapManager.h
+ *
+ * An implementation of MemorySuperblockHeapManager which tracks the free
+ * blocks inside a bitmap.
+ */
+#include "xStl/types.h"
+#include "xdk/memory/MemorySuperblockHeapManager.h"
+
+/*
+ * The superblock is divided into blocks of 'allocationUnit' bytes, exactly
+ * like the SmallMemoryHeapManager. The state of the blocks is not kept inside
+ * the blocks but inside a bitmap which is stored at the end of the
+ * superblock:
+ *
+ *   /-------------------------------------------------------------\
+ *   | Block | Block | Block | Block | Block | ... | Block | Bitmap |
+ *   \-------------------------------------------------------------/
+ *
+ * Each bit of the bitmap represents a block. A set bit marks a free block.
+ * Finding N contiguous free blocks is done by scanning the bitmap a word at
+ * a time: full words count as 32 free blocks, empty words are skipped
+ * (16 bytes at a time when SSE2 is available in the XDK_TEST build) and only
+ * mixed words are inspected bit by bit.
+ *
+ * Allocated blocks start with the same 4 bytes allocation-descriptor as the
+ * SmallMemoryHeapManager, so both engines share the same allocation unit
+ * overhead and can be replaced by each other. See ALLOCATED_UNIT_OVERHEAD.
+ *
+ * The allocation policy is address-ordered first-fit. The free blocks are
+ * always merged since the bitmap doesn't have any notion of chunks.
+ *
+ * Some more information about this kind of allocation:
+ *    - The overhead is a single bit per block (on top of the descriptor).
+ *    - Multiple blocks allocation is not depended on the number of free
+ *      blocks but on the length of the bitmap.
+ *
+ * NOTE: This class is thread-safe. See MemorySuperblockHeapManager::m_lock
+ */
+class BitmapMemoryHeapManager : public MemorySuperblockHeapManager {
+public:
+    // The size in bytes of the allocation-descriptor
+    enum { ALLOCATED_UNIT_OVERHEAD = 4 };
+
+    /*
+     * Constructor.
+     * See MemorySuperblockHeapManager::MemorySuperblockHeapManager
+     *
+     * superBlock       - The super block memory
+     * superBlockLength - The length of the super-block. The bitmap is
+     *                    allocated from the end of the superblock.
+     * allocationUnit   - The allocation unit. Including 4 bytes of the
+     *                    allocation header. See ALLOCATED_UNIT_OVERHEAD
+     */
+    BitmapMemoryHeapManager(void* superBlock,
+                            uint superBlockLength,
+                            uint allocationUnit);
+
+    /*
+     * See MemorySuperblockHeapManager::allocate
+     */
+    virtual void* allocate(uint length);
+
+    /*
+     * See MemorySuperblockHeapManager::free
+     */
+    virtual bool free(void* buffer);
+
+    /*
+     * See MemorySuperblockHeapManager::allocateBlocks
+     */
+    virtual uint allocateBlocks(uint length, void** blocks, uint count);
+
+    /*
+     * See MemorySuperblockHeapManager::freeBlocks
+     */
+    virtual void freeBlocks(void** blocks, uint count);
+
+    /*
+     * See MemorySuperblockHeapManager::getBlockLength
+     */
+    virtual uint getBlockLength(void* buffer);
+
+
+    /*
+     * See MemorySuperblockHeapManager::getMaximumAllocationUnit.
+     */
+    virtual uint getMaximumAllocationUnit() const;
+
+    /*
+     * See MemorySuperblockHeapManager::getMinimumAllocationUnit.
+     *
+     * Return the allocationUnit pass in the constructor
+     */
+    virtual uint getMinimumAllocationUnit() const;
+
+private:
+    // Deny copy-constructor and operator =
+    BitmapMemoryHeapManager(const BitmapMemoryHeapManager& other);
+    BitmapMemoryHeapManager& operator = (const BitmapMemoryHeapManager& other);
+
+    // The minimum allocation unit is 4 bytes
+    enum { MINIMUM_ALLOCATION_UNIT = 4 };
+    // The magic for the allocated descriptor block
+    enum { ALLOCATED_DESCRIPTOR_MAGIC = 0xBEEF };
+    // The number of bits inside a bitmap word
+    enum { WORD_BITS = 32 };
+    // The maximum number of blocks a single allocation may use
+    enum { MAX_ALLOCATION_BLOCKS = 0xFFFF };
+
+    #pragma pack(push)
+    #pragma pack(1)
+    /*
+     * An allocated descriptor block. Same as the one of the
+     * SmallMemoryHeapManager.
+     * Size: 4 bytes.
+     */
+    struct AllocatedDescriptorBlock {
+        // See ALLOCATED_DESCRIPTOR_MAGIC
+        uint16 m_magic;
+        // The number of allocated blocks, including this one
+        uint16 m_numberOfBlocks;
+    };
+    #pragma pack(pop)
+
+    /*
+     * Return the number of blocks (including the allocated-descriptor) which
+     * are needed for 'length' bytes. Return 0 if the length cannot be
+     * allocated by this manager.
+     */
+    uint getNumberOfBlocks(uint length) const;
+
+    /*
+     * Find and allocate 'numberOfBlocks' contiguous blocks.
+     * Return NULL if there isn't enough room.
+     *
+     * NOTE: m_lock must be acquired.
+     */
+    void* allocateUnsafe(uint numberOfBlocks);
+
+    /*
+     * Return the allocated-descriptor of 'buffer' and fill 'blockID' with it's
+     * block index. Return NULL if 'buffer' is not a valid allocated block.
+     *
+     * NOTE: m_lock must be acquired, unless the caller owns 'buffer'. See
+     *       getBlockLength
+     */
+    AllocatedDescriptorBlock* getValidDescriptor(void* buffer,
+                                                 uint& blockID);
+
+    /*
+     * Return the index of the first word, starting from 'word', which has at
+     * least a single free block. Return m_bitmapWords if there isn't any.
+     */
+    uint findNonEmptyWord(uint word) const;
+
+    /*
+     * Return the index of the first block of 'count' contiguous free blocks.
+     * Return m_totalNumberOfBlocks if there isn't any.
+     */
+    uint findFreeRun(uint count) const;
+
+    /*
+     * Set (free) or clear (allocate) the bits of 'count' blocks starting at
+     * 'blockID'.
+     */
+    void markBlocks(uint blockID, uint count, bool isFree);
+
+    //////////////////////////////////////////////////////////////////////////
+    // Members
+
+    // The bitmap. Stored at the end of the superblock
+    uint32* m_bitmap;
+    // The number of words inside the bitmap
+    uint m_bitmapWords;
+    // All words before this one are known to be empty
+    uint m_firstNonEmptyWord;
+    // The total number of blocks
+    uint m_totalNumberOfBlocks;
+    // The allocation unit
+    uint m_allocationUnit;
+};
+
+#endif // __TBA_XDK_MEMORY_BITMAPMEMORYHEAPMANAGER_H
@@ -0,0 +1,112 @@
+/*
+ * Copyright (c) 2008-2016, Integrity Project Ltd. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * Neither the name of the Integrity Project nor the names of its contributors
+ * may be used to endorse or promote products derived from this software
+ * without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE
+ */
+
+
+
+#ifndef __TBA_XDK_MEMORY_DEFERREDFREEQUEUE_H
+#define __TBA_XDK_MEMORY_DEFERREDFREEQUEUE_H
+
+/*
+ * DeferredFreeQueue.h
+ *
+ * A queue of memory blocks which cannot be freed in the current context, and
+ * are freed later on in batches.
+ */
+#include "xStl/types.h"
+
+/*
+ * Intrusive lock-free queue of memory blocks. The queue link is written into
+ * the first bytes of the queued block, so pushing a block never allocates
+ * memory and never waits for a lock. This makes the queue safe for interrupt
+ * time, when the operating system pool cannot be used.
+ *
+ * Any number of producers can push blocks concurrently. The consumer detaches
+ * all the pending blocks at once with popAll() and walks the batch using
+ * getNext(). Since blocks are never removed one by one the queue doesn't
+ * suffer from the ABA problem, and concurrent consumers are safe as well, each
+ * of them receives a different batch.
+ *
+ * NOTE: A queued block must be at least sizeof(void*) bytes long, and must not
+ *       be accessed by the producer after it's pushed.
+ */
+class DeferredFreeQueue {
+public:
+    /*
+     * Constructor. Creates an empty queue
+     */
+    DeferredFreeQueue();
+
+    /*
+     * Queue 'block'. Overwrites the first pointer of the block.
+     */
+    void push(void* block);
+
+    /*
+     * Detach all the queued blocks.
+     *
+     * Return the first block of the batch, in the order they were pushed, or
+     * NULL if the queue is empty. The blocks are owned by the caller.
+     */
+    void* popAll();
+
+    /*
+     * Return the block which follows 'block' in a batch returned by popAll(),
+     * or NULL if 'block' is the last one. Must be called before 'block' is
+     * freed.
+     */
+    static void* getNext(void* block);
+
+    /*
+     * Return the number of queued blocks. Might be a little bigger than the
+     * real number while blocks are pushed.
+     */
+    uint getNumberOfBlocks() const;
+
+private:
+    // Deny copy-constructor and operator =
+    DeferredFreeQueue(const DeferredFreeQueue& other);
+    DeferredFreeQueue& operator = (const DeferredFreeQueue& other);
+
+    /*
+     * The header of a queued block
+     */
+    struct Link {
+        // The previous pushed block
+        Link* m_next;
+    };
+
+    // The last pushed block
+    void* volatile m_head;
+    // The number of queued blocks
+    volatile uint32 m_numberOfBlocks;
+};
+
+#endif // __TBA_XDK_MEMORY_DEFERREDFREEQUEUE_H
@@ -0,0 +1,246 @@
+/*
+ * Copyright (c) 2008-2016, Integrity Project Ltd. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * Neither the name of the Integrity Project nor the names of its contributors
+ * may be used to endorse or promote products derived from this software
+ * without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE
+ */
+
+
+#ifndef __TBA_XDK_MEMORY_LARGEMEMORYHEAPMANAGER_H
+#define __TBA_XDK_MEMORY_LARGEMEMORYHEAPMANAGER_H
+
+/*
+ * LargeMemoryHeapManager.h
+ *
+ * An implementation of MemorySuperblockHeapManager for large blocks. The
+ * superblock is divided into page-granular extents.
+ */
+#include "xStl/types.h"
+#include "xdk/memory/MemorySuperblockHeapManager.h"
+
+/*
+ * The superblock is divided into extents. Each extent is a run of pages
+ * which starts with an extent header:
+ *
+ *   /----------------------------------------------------------------\
+ *   | Header | Data ... | Header | Data ......... | Header | Free ... |
+ *   \----------------------------------------------------------------/
+ *
+ * The header holds the number of pages of the extent and the number of pages
+ * of the extent before it (A boundary tag), so a freed extent is merged with
+ * both of its neighbours in O(1).
+ *
+ * The free extents are kept inside a tree (A treap) which is ordered by the
+ * number of pages and then by the address. The allocation policy is
+ * address-ordered best-fit: The smallest extent which fits, and the lowest
+ * one among the extents of the same size. The tail of the chosen extent is
+ * returned to the tree.
+ *
+ * Some more information about this kind of allocation:
+ *    - The overhead is a single header (16 bytes) per block, and the rest of
+ *      the last page.
+ *    - Allocation and free are O(log n) in the number of free extents.
+ *    - The blocks are aligned to 16 bytes.
+ *
+ * NOTE: This class is thread-safe. See MemorySuperblockHeapManager::m_lock
+ */
+class LargeMemoryHeapManager : public MemorySuperblockHeapManager {
+public:
+    // The size in bytes of the extent header
+    enum { ALLOCATED_UNIT_OVERHEAD = 16 };
+    // The granularity of the extents
+    enum { PAGE_SHIFT = 12 };
+    enum { PAGE_SIZE = 1 << PAGE_SHIFT };
+
+    /*
+     * Constructor.
+     * See MemorySuperblockHeapManager::MemorySuperblockHeapManager
+     *
+     * superBlock       - The super block memory
+     * superBlockLength - The length of the super-block. Must contain at least
+     *                    a single page after the alignment of 'superBlock'.
+     */
+    LargeMemoryHeapManager(void* superBlock,
+                           uint superBlockLength);
+
+    /*
+     * Return the length of a superblock which can serve a single block of
+     * 'length' bytes. Return 0 if 'length' is too big.
+     */
+    static uint getSuperblockLength(uint length);
+
+    /*
+     * See MemorySuperblockHeapManager::allocate
+     */
+    virtual void* allocate(uint length);
+
+    /*
+     * See MemorySuperblockHeapManager::free
+     */
+    virtual bool free(void* buffer);
+
+    /*
+     * See MemorySuperblockHeapManager::getBlockLength
+     */
+    virtual uint getBlockLength(void* buffer);
+
+
+    /*
+     * See MemorySuperblockHeapManager::getMaximumAllocationUnit.
+     *
+     * Return the length of the largest free extent
+     */
+    virtual uint getMaximumAllocationUnit() const;
+
+    /*
+     * See MemorySuperblockHeapManager::getMinimumAllocationUnit.
+     *
+     * Return PAGE_SIZE
+     */
+    virtual uint getMinimumAllocationUnit() const;
+
+private:
+    // Deny copy-constructor and operator =
+    LargeMemoryHeapManager(const LargeMemoryHeapManager& other);
+    LargeMemoryHeapManager& operator = (const LargeMemoryHeapManager& other);
+
+    // The magic for the allocated extent header
+    enum { ALLOCATED_EXTENT_MAGIC = 0x7A11BEEF };
+    // The magic for the free extent header
+    enum { FREE_EXTENT_MAGIC = 0x0F4EBEEF };
+    // The alignment of the first extent
+    enum { EXTENT_ALIGNMENT = 16 };
+
+    /*
+     * The header of each extent.
+     * Size: 16 bytes.
+     */
+    struct ExtentHeader {
+        // See ALLOCATED_EXTENT_MAGIC and FREE_EXTENT_MAGIC
+        uint32 m_magic;
+        // The number of pages of the extent, including this header
+        uint32 m_pages;
+        // The number of pages of the previous extent. 0 for the first one
+        uint32 m_previousPages;
+        // Keeps the data aligned to 16 bytes. Always 0 for allocated
+        // extents, since the word before a block must not look like an
+        // aligned block tag (See SuperiorMemoryManager::allocateAligned)
+        uint32 m_reserved;
+    };
+
+    /*
+     * A free extent. The tree links are stored after the header, inside the
+     * free pages.
+     */
+    struct FreeExtent {
+        ExtentHeader m_header;
+        // The extents which are smaller and bigger than this one
+        FreeExtent* m_left;
+        FreeExtent* m_right;
+    };
+
+    /*
+     * Return the number of pages (including the header) which are needed for
+     * 'length' bytes. Return 0 if the length cannot be allocated by this
+     * manager.
+     */
+    uint getNumberOfPages(uint length) const;
+
+    /*
+     * Return the extent which starts 'pages' pages after 'extent'
+     */
+    static ExtentHeader* getExtent(ExtentHeader* extent, uint pages);
+
+    /*
+     * Return the extent which follows 'extent', or NULL if 'extent' is the
+     * last one.
+     */
+    ExtentHeader* getNextExtent(ExtentHeader* extent) const;
+
+    /*
+     * Return the header of 'buffer'. Return NULL if 'buffer' is not a valid
+     * allocated block.
+     *
+     * NOTE: m_lock must be acquired.
+     */
+    ExtentHeader* getValidHeader(void* buffer) const;
+
+    /*
+     * Return true if 'a' is ordered before 'b' inside the tree
+     */
+    static bool isLess(const FreeExtent* a, const FreeExtent* b);
+
+    /*
+     * Return the tree priority of 'extent'. A hash of its address.
+     */
+    static uint32 getPriority(const FreeExtent* extent);
+
+    /*
+     * Rotate the sub-tree 'root' to the right (The left child becomes the
+     * root) or to the left (The right child becomes the root).
+     */
+    static void rotateRight(FreeExtent*& root);
+    static void rotateLeft(FreeExtent*& root);
+
+    /*
+     * Add 'extent' to the sub-tree 'root'
+     */
+    static void insertExtent(FreeExtent*& root, FreeExtent* extent);
+
+    /*
+     * Remove 'extent' from the sub-tree 'root'. The extent must be inside the
+     * sub-tree.
+     */
+    static void removeExtent(FreeExtent*& root, FreeExtent* extent);
+
+    /*
+     * Return the smallest free extent of at least 'pages' pages, or NULL if
+     * there isn't any.
+     *
+     * NOTE: m_lock must be acquired.
+     */
+    FreeExtent* findBestFit(uint pages) const;
+
+    /*
+     * Mark 'extent' as free and add it to m_freeExtents.
+     *
+     * NOTE: m_lock must be acquired.
+     */
+    void addFreeExtent(ExtentHeader* extent);
+
+    //////////////////////////////////////////////////////////////////////////
+    // Members
+
+    // The first extent. Aligned to EXTENT_ALIGNMENT
+    ExtentHeader* m_firstExtent;
+    // The total number of pages
+    uint m_totalPages;
+    // The root of the free extents tree
+    FreeExtent* m_freeExtents;
+};
+
+#endif // __TBA_XDK_MEMORY_LARGEMEMORYHEAPMANAGER_H
@@ -0,0 +1,177 @@
+/*
+ * Copyright (c) 2008-2016, Integrity Project Ltd. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * Neither the name of the Integrity Project nor the names of its contributors
+ * may be used to endorse or promote products derived from this software
+ * without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE
+ */
+
+
+
+
+#ifndef __TBA_XDK_MEMORY_MEMORYARENA_H
+#define __TBA_XDK_MEMORY_MEMORYARENA_H
+
+/*
+ * MemoryArena.h
+ *
+ * A region allocator for objects which share the same lifetime, such as the
+ * temporary objects of a single request.
+ */
+#include "xStl/types.h"
+#include "xdk/memory/MemorySuperblockHeapManager.h"
+
+/*
+ * The arena hands out blocks by bumping a pointer inside large chunks, which
+ * are allocated from a heap (Usually the SuperiorMemoryManager). The blocks
+ * are never freed one by one. All of them are released at once by 'release()'
+ * (Or by the destructor), which returns the chunks to the heap.
+ *
+ * Many small allocations cost a single heap allocation per chunk, and the
+ * whole set is freed in a single operation:
+ *
+ *     MemoryArena arena(heap);
+ *     for (...)
+ *         buildTemporaryObject(arena.allocate(length));
+ *     arena.release();
+ *
+ * Blocks which are larger than half a chunk get a chunk of their own, so they
+ * don't waste the rest of the current chunk.
+ *
+ * The first blocks can be served from a buffer of the caller (For example a
+ * buffer on the stack), so a short-lived arena might not touch the heap at
+ * all. This buffer is not freed by the arena.
+ *
+ * NOTE: This class is not thread-safe. An arena is owned by a single request
+ *       or a single interrupt.
+ */
+class MemoryArena {
+public:
+    // The default length of a chunk
+    enum { DEFAULT_CHUNK_LENGTH = 16*1024 };
+    // The default alignment of the blocks
+    enum { DEFAULT_ALIGNMENT = 8 };
+
+    /*
+     * Constructor. Nothing is allocated until the first block.
+     *
+     * heap                - The heap of the chunks. Must be valid until the
+     *                       arena is released.
+     * chunkLength         - The length in bytes of each chunk
+     * initialBuffer       - Optional. A buffer which serves the first blocks
+     * initialBufferLength - The length in bytes of 'initialBuffer'
+     */
+    MemoryArena(MemorySuperblockHeapManager& heap,
+                uint chunkLength = DEFAULT_CHUNK_LENGTH,
+                void* initialBuffer = NULL,
+                uint initialBufferLength = 0);
+
+    /*
+     * Destructor. Release all blocks
+     */
+    ~MemoryArena();
+
+    /*
+     * Allocate 'length' bytes which start at a multiple of 'alignment'.
+     *
+     * alignment - A power of 2
+     *
+     * Return NULL if the heap cannot allocate a new chunk, or if 'length' is
+     * 0 or 'alignment' is invalid.
+     */
+    void* allocate(uint length, uint alignment = DEFAULT_ALIGNMENT);
+
+    /*
+     * Release all the blocks of the arena. The chunks are returned to the
+     * heap, and the arena can be used again.
+     */
+    void release();
+
+    /*
+     * Return true if 'buffer' is inside one of the blocks of the arena.
+     *
+     * NOTE: The chunks are scanned, so the time depends on their number.
+     */
+    bool isOwner(void* buffer) const;
+
+    /*
+     * Return the number of bytes which were handed out since the last
+     * release.
+     */
+    uint getNumberOfAllocatedBytes() const;
+
+    /*
+     * Return the number of chunks which were allocated from the heap since
+     * the last release.
+     */
+    uint getNumberOfChunks() const;
+
+private:
+    // Deny copy-constructor and operator =
+    MemoryArena(const MemoryArena& other);
+    MemoryArena& operator = (const MemoryArena& other);
+
+    /*
+     * The header of each chunk
+     */
+    struct ChunkHeader {
+        // The previously allocated chunk
+        ChunkHeader* m_next;
+        // The length of the chunk, including the header
+        uint m_length;
+    };
+
+    /*
+     * Allocate a chunk of 'length' bytes from the heap and link it.
+     * Return NULL if the heap is full.
+     */
+    ChunkHeader* allocateChunk(uint length);
+
+    /*
+     * Return true if 'buffer' is inside the 'length' bytes at 'start'
+     */
+    static bool isInRange(void* buffer, void* start, uint length);
+
+    // The heap of the chunks
+    MemorySuperblockHeapManager& m_heap;
+    // The length of a new chunk
+    uint m_chunkLength;
+    // The buffer of the caller
+    void* m_initialBuffer;
+    uint m_initialBufferLength;
+
+    // The chunks, the last allocated first
+    ChunkHeader* m_chunks;
+    // The free bytes of the current chunk
+    addressNumericValue m_position;
+    addressNumericValue m_end;
+
+    // The statistics. See getNumberOfAllocatedBytes and getNumberOfChunks
+    uint m_allocatedBytes;
+    uint m_numberOfChunks;
+};
+
+#endif // __TBA_XDK_MEMORY_MEMORYARENA_H
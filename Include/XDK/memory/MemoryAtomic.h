@@ -0,0 +1,188 @@
+/*
+ * Copyright (c) 2008-2016, Integrity Project Ltd. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * Neither the name of the Integrity Project nor the names of its contributors
+ * may be used to endorse or promote products derived from this software
+ * without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE
+ */
+
+#ifndef __TBA_XDK_MEMORY_MEMORYATOMIC_H
+#define __TBA_XDK_MEMORY_MEMORYATOMIC_H
+
+/*
+ * MemoryAtomic.h
+ *
+ * Interlocked operations which are used by the memory managers lock-free
+ * paths. Implemented for the kernel and for the user-mode testing utilities.
+ */
+#include "xStl/types.h"
+
+#ifndef XDK_TEST
+    // Kernel mode
+    #include "xdk/kernel.h"
+#elif defined(XSTL_LINUX)
+    // User mode testing under Linux. Uses the GCC builtins.
+    // Thread local storage used to emulate the processor number.
+    #define XDK_MEMORY_THREAD_LOCAL __thread
+#else
+    // User mode testing under Windows
+    #include "xStl/os/os.h"
+    #define XDK_MEMORY_THREAD_LOCAL __declspec(thread)
+#endif
+
+/*
+ * All functions are full memory barriers.
+ */
+class MemoryAtomic {
+public:
+    /*
+     * Set '*target' to 'value'. Return the previous value of '*target'.
+     */
+    static uint32 exchange(volatile uint32* target, uint32 value)
+    {
+        #if defined(XDK_TEST) && defined(XSTL_LINUX)
+            return __sync_lock_test_and_set(target, value);
+        #else
+            return (uint32)InterlockedExchange((volatile LONG*)target,
+                                               (LONG)value);
+        #endif
+    }
+
+    /*
+     * Set '*target' to 'value' only if '*target' equals to 'comparand'.
+     * Return the previous value of '*target'.
+     */
+    static uint32 compareExchange(volatile uint32* target,
+                                  uint32 value,
+                                  uint32 comparand)
+    {
+        #if defined(XDK_TEST) && defined(XSTL_LINUX)
+            return __sync_val_compare_and_swap(target, comparand, value);
+        #else
+            return (uint32)InterlockedCompareExchange((volatile LONG*)target,
+                                                      (LONG)value,
+                                                      (LONG)comparand);
+        #endif
+    }
+
+    /*
+     * Increase '*target' by one. Return the new value.
+     */
+    static uint32 increment(volatile uint32* target)
+    {
+        #if defined(XDK_TEST) && defined(XSTL_LINUX)
+            return __sync_add_and_fetch(target, 1);
+        #else
+            return (uint32)InterlockedIncrement((volatile LONG*)target);
+        #endif
+    }
+
+    /*
+     * Increase '*target' by 'value'. Return the new value.
+     */
+    static uint32 add(volatile uint32* target, uint32 value)
+    {
+        #if defined(XDK_TEST) && defined(XSTL_LINUX)
+            return __sync_add_and_fetch(target, value);
+        #else
+            return (uint32)InterlockedExchangeAdd((volatile LONG*)target,
+                                                  (LONG)value) + value;
+        #endif
+    }
+
+    /*
+     * Decrease '*target' by one. Return the new value.
+     */
+    static uint32 decrement(volatile uint32* target)
+    {
+        #if defined(XDK_TEST) && defined(XSTL_LINUX)
+            return __sync_sub_and_fetch(target, 1);
+        #else
+            return (uint32)InterlockedDecrement((volatile LONG*)target);
+        #endif
+    }
+
+    /*
+     * Set '*target' to 'value'. Return the previous value of '*target'.
+     */
+    static void* exchangePointer(void* volatile* target, void* value)
+    {
+        #if defined(XDK_TEST) && defined(XSTL_LINUX)
+            return __sync_lock_test_and_set(target, value);
+        #else
+            return InterlockedExchangePointer((PVOID volatile*)target, value);
+        #endif
+    }
+
+    /*
+     * Set '*target' to 'value' only if '*target' equals to 'comparand'.
+     * Return the previous value of '*target'.
+     */
+    static void* compareExchangePointer(void* volatile* target,
+                                        void* value,
+                                        void* comparand)
+    {
+        #if defined(XDK_TEST) && defined(XSTL_LINUX)
+            return __sync_val_compare_and_swap(target, comparand, value);
+        #else
+            return InterlockedCompareExchangePointer((PVOID volatile*)target,
+                                                     value,
+                                                     comparand);
+        #endif
+    }
+
+    /*
+     * Set '*target' to 'value' only if '*target' equals to 'comparand'.
+     * Return the previous value of '*target'.
+     *
+     * NOTE: 'target' must be aligned to 8 bytes.
+     */
+    static uint64 compareExchange64(volatile uint64* target,
+                                    uint64 value,
+                                    uint64 comparand)
+    {
+        #if defined(XDK_TEST) && defined(XSTL_LINUX)
+            return __sync_val_compare_and_swap(target, comparand, value);
+        #else
+            return (uint64)InterlockedCompareExchange64(
+                                            (volatile LONGLONG*)target,
+                                            (LONGLONG)value,
+                                            (LONGLONG)comparand);
+        #endif
+    }
+
+    /*
+     * Return the value of '*target' as a single access, also for 32 bit
+     * processors.
+     */
+    static uint64 read64(volatile uint64* target)
+    {
+        // Replaces 0 with 0. Otherwise nothing is written.
+        return compareExchange64(target, 0, 0);
+    }
+};
+
+#endif // __TBA_XDK_MEMORY_MEMORYATOMIC_H
@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2008-2016, Integrity Project Ltd. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * Neither the name of the Integrity Project nor the names of its contributors
+ * may be used to endorse or promote products derived from this software
+ * without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE
+ */
+
+#ifndef __TBA_XDK_MEMORY_MEMORYBITSCAN_H
+#define __TBA_XDK_MEMORY_MEMORYBITSCAN_H
+
+/*
+ * MemoryBitScan.h
+ *
+ * Bit-scan operations which are used by the memory managers in order to
+ * search bitmaps and to calculate size classes.
+ */
+#include "xStl/types.h"
+
+#ifdef _MSC_VER
+    #include <intrin.h>
+#endif
+
+class MemoryBitScan {
+public:
+    /*
+     * Return the index of the lowest set bit of 'value'.
+     * NOTE: 'value' must not be 0.
+     */
+    static uint lowestSetBit(uint32 value)
+    {
+        #ifdef _MSC_VER
+            unsigned long index;
+            _BitScanForward(&index, value);
+            return index;
+        #else
+            return __builtin_ctz(value);
+        #endif
+    }
+
+    /*
+     * Return the index of the highest set bit of 'value'. This is the
+     * integer part of log2(value).
+     * NOTE: 'value' must not be 0.
+     */
+    static uint highestSetBit(uint32 value)
+    {
+        #ifdef _MSC_VER
+            unsigned long index;
+            _BitScanReverse(&index, value);
+            return index;
+        #else
+            return 31 - __builtin_clz(value);
+        #endif
+    }
+};
+
+#endif // __TBA_XDK_MEMORY_MEMORYBITSCAN_H
@@ -0,0 +1,160 @@
+/*
+ * Copyright (c) 2008-2016, Integrity Project Ltd. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * Neither the name of the Integrity Project nor the names of its contributors
+ * may be used to endorse or promote products derived from this software
+ * without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE
+ */
+
+
+
+
+#ifndef __TBA_XDK_MEMORY_MEMORYLARGEPAGEALLOCATOR_H
+#define __TBA_XDK_MEMORY_MEMORYLARGEPAGEALLOCATOR_H
+
+/*
+ * MemoryLargePageAllocator.h
+ *
+ * An operating system interface for the SuperiorMemoryManager which backs the
+ * superblocks with large pages.
+ */
+#include "xStl/types.h"
+#include "xdk/memory/MemoryLockableObject.h"
+#include "xdk/memory/SuperiorMemoryManagerInterface.h"
+
+/*
+ * A superblock of small pages takes a TLB entry for each 4kb which is touched,
+ * so a heap of a few megabytes is enough in order to miss the TLB on most of
+ * the random accesses. A large page covers 2mb (4mb on x86 without PAE) with
+ * a single entry.
+ *
+ * Superblocks whose length is a multiple of the large page size are
+ * allocated from:
+ *     Kernel       - Contiguous memory which is aligned to the large page
+ *                    size (MmAllocateContiguousMemorySpecifyCache). This is
+ *                    best-effort: No documented kernel API guarantees a
+ *                    large page mapping, the memory manager maps such memory
+ *                    with large pages when it can. Must be called in IRQL
+ *                    DISPATCH_LEVEL or below.
+ *     Linux host   - The huge pages pool (MAP_HUGETLB), or an aligned region
+ *                    which is advised for transparent huge pages
+ *                    (MADV_HUGEPAGE)
+ *     Windows host - VirtualAlloc with MEM_LARGE_PAGES. Requires the "Lock
+ *                    pages in memory" privilege.
+ *
+ * Any other length, a failure of the large pages allocation or a system
+ * without large pages are forwarded to the 'fallback' interface. The
+ * alignment which is reported to the SuperiorMemoryManager is the large page
+ * size, so the lengths of the expansions of the heap are large page
+ * multiples. The counters (See getNumberOfLargePageBytes) include the kernel
+ * blocks which weren't mapped by large pages after all.
+ *
+ * Usage:
+ *     SuperiorMemoryManager manager(
+ *         SuperiorOSMemePtr(new MemoryLargePageAllocator(smallPagesOSMem)),
+ *         ...);
+ */
+class MemoryLargePageAllocator : public SuperiorMemoryManagerInterface {
+public:
+    // The maximum number of superblocks which are backed by large pages. The
+    // next superblocks are allocated from the fallback interface.
+    enum { MAX_LARGE_BLOCKS = 256 };
+
+    /*
+     * Constructor. Query the large page size of the system.
+     *
+     * fallback - The interface of the superblocks which cannot be backed by
+     *            large pages.
+     */
+    MemoryLargePageAllocator(const SuperiorOSMemePtr& fallback);
+
+    /*
+     * See SuperiorMemoryManagerInterface::getSuperblockPageAlignment
+     * Return the large page size, or the alignment of the fallback interface
+     * if the system doesn't have large pages.
+     */
+    virtual uint getSuperblockPageAlignment();
+
+    /*
+     * See SuperiorMemoryManagerInterface::allocateNewSuperblock
+     */
+    virtual void* allocateNewSuperblock(uint length);
+
+    /*
+     * See SuperiorMemoryManagerInterface::freeSuperblock
+     */
+    virtual void freeSuperblock(void* pointer);
+
+    /*
+     * Return the large page size, or 0 if the system doesn't have large pages
+     */
+    uint getLargePageSize() const;
+
+    /*
+     * Return the number of bytes which are currently backed by large pages
+     */
+    uint getNumberOfLargePageBytes() const;
+
+private:
+    // Deny copy-constructor and operator =
+    MemoryLargePageAllocator(const MemoryLargePageAllocator& other);
+    MemoryLargePageAllocator& operator = (const MemoryLargePageAllocator& other);
+
+    /*
+     * Return the large page size of the system, or 0 if large pages cannot be
+     * allocated
+     */
+    static uint queryLargePageSize();
+
+    /*
+     * Allocate/Free 'length' bytes of large pages. 'length' is a multiple of
+     * 'm_largePageSize'. Return NULL if there aren't enough large pages.
+     */
+    void* allocateLargePages(uint length);
+    void freeLargePages(void* pointer, uint length);
+
+    // A superblock which is backed by large pages
+    struct LargeBlock {
+        void* m_pointer;
+        uint m_length;
+    };
+
+    // The interface of the other superblocks
+    SuperiorOSMemePtr m_fallback;
+    // See getLargePageSize
+    uint m_largePageSize;
+
+    // Protects the blocks table
+    MemoryLockableObject m_lock;
+    // The superblocks which are backed by large pages. The free needs their
+    // length.
+    LargeBlock m_blocks[MAX_LARGE_BLOCKS];
+    uint m_numberOfBlocks;
+    // See getNumberOfLargePageBytes
+    uint m_largePageBytes;
+};
+
+#endif // __TBA_XDK_MEMORY_MEMORYLARGEPAGEALLOCATOR_H
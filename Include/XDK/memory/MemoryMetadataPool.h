@@ -0,0 +1,189 @@
+/*
+ * Copyright (c) 2008-2016, Integrity Project Ltd. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * Neither the name of the Integrity Project nor the names of its contributors
+ * may be used to endorse or promote products derived from this software
+ * without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE
+ */
+
+
+#ifndef __TBA_XDK_MEMORY_MEMORYMETADATAPOOL_H
+#define __TBA_XDK_MEMORY_MEMORYMETADATAPOOL_H
+
+/*
+ * MemoryMetadataPool.h
+ *
+ * A pool of fixed size descriptors which grows by chunks of memory given by
+ * the owner. Used by the SuperiorMemoryManager in order to store it's
+ * buckets and superblock descriptors.
+ */
+#include "xStl/types.h"
+
+/*
+ * The pool starts with a single chunk (The private memory of the owner) and
+ * never allocates memory by itself. When all descriptors are used the owner
+ * adds another chunk (See 'addChunk'), and takes it back once all of it's
+ * descriptors are freed (See 'removeEmptyChunk').
+ *
+ * Each chunk starts with a header and is divided into descriptors of the same
+ * length. The free descriptors of each chunk are kept in a list. Allocations
+ * prefer the older chunks, so the newer chunks are the first to be emptied.
+ *
+ *     chunk: | Chunk header | object | object | ... | object | unused |
+ *
+ * NOTE: The chunk of the constructor is never removed.
+ * NOTE: This class is not thread-safe. The owner must serialize all calls.
+ */
+class MemoryMetadataPool {
+public:
+    /*
+     * Constructor. Use 'buffer' as the first chunk.
+     *
+     * buffer - The first chunk. Might be NULL.
+     * length - The length in bytes of 'buffer'. A buffer which cannot hold a
+     *          single descriptor is ignored.
+     * objectLength - The length in bytes of each descriptor
+     *
+     * NOTE: The pointer is allocated and free by outside module.
+     */
+    MemoryMetadataPool(void* buffer, uint length, uint objectLength);
+
+    /*
+     * Allocate a single descriptor. Return NULL if all descriptors are used.
+     */
+    void* allocate();
+
+    /*
+     * Free a descriptor which was returned by 'allocate'.
+     * Return false if 'object' doesn't belong to any chunk.
+     */
+    bool free(void* object);
+
+    /*
+     * Return true if the next 'allocate' will fail
+     */
+    bool isExhausted() const;
+
+    /*
+     * Add 'length' bytes of 'chunk' into the pool. The chunk must be at least
+     * 'getMinimumChunkLength()' bytes long.
+     */
+    void addChunk(void* chunk, uint length);
+
+    /*
+     * Remove a chunk which has no allocated descriptor from the pool.
+     * The chunk of the constructor is never removed.
+     *
+     * length - Will be filled with the length which was given to 'addChunk'
+     *
+     * Return the pointer which was given to 'addChunk', or NULL if there
+     * isn't any empty chunk.
+     */
+    void* removeEmptyChunk(uint& length);
+
+    /*
+     * Return the minimum length of a chunk which holds a single descriptor
+     */
+    uint getMinimumChunkLength() const;
+
+    /*
+     * Return the length of each descriptor, including it's alignment
+     */
+    uint getObjectLength() const;
+
+    /*
+     * Return the number of chunks, including the chunk of the constructor
+     */
+    uint getNumberOfChunks() const;
+
+    /*
+     * Return the number of descriptors which can be allocated without any new
+     * chunk
+     */
+    uint getNumberOfFreeObjects() const;
+
+private:
+    // Deny copy-constructor and operator =
+    MemoryMetadataPool(const MemoryMetadataPool& other);
+    MemoryMetadataPool& operator = (const MemoryMetadataPool& other);
+
+    // The descriptors and the headers are aligned to 8 bytes
+    enum { ALIGNMENT = 8 };
+
+    /*
+     * A free descriptor, stored at the beginning of the descriptor itself
+     */
+    struct FreeObject {
+        FreeObject* m_next;
+    };
+
+    /*
+     * The header of a chunk, stored at the beginning of the chunk (After the
+     * alignment)
+     */
+    struct Chunk {
+        // The next chunk. Newer chunks are linked after older ones
+        Chunk* m_next;
+        // The pointer and the length which were given to 'addChunk'
+        void* m_buffer;
+        uint m_length;
+        // The free descriptors of the chunk
+        FreeObject* m_freeList;
+        // The number of descriptors inside the chunk
+        uint m_numberOfObjects;
+        // The number of allocated descriptors
+        uint m_usedObjects;
+    };
+
+    /*
+     * Return the header size, including the alignment of the first descriptor
+     */
+    static uint getHeaderLength();
+
+    /*
+     * Format 'buffer' as a new chunk. Return NULL if the buffer cannot hold a
+     * single descriptor.
+     */
+    Chunk* formatChunk(void* buffer, uint length);
+
+    /*
+     * Return true if 'object' is a descriptor of 'chunk'
+     */
+    bool isInside(const Chunk* chunk, void* object) const;
+
+    // The list of chunks, the oldest first
+    Chunk* m_chunks;
+    // The chunk of the constructor. Never removed. Might be NULL.
+    Chunk* m_initialChunk;
+    // The length of each descriptor
+    uint m_objectLength;
+    // The number of chunks
+    uint m_numberOfChunks;
+    // The number of free descriptors of all chunks
+    uint m_freeObjects;
+};
+
+#endif // __TBA_XDK_MEMORY_MEMORYMETADATAPOOL_H
@@ -0,0 +1,195 @@
+/*
+ * Copyright (c) 2008-2016, Integrity Project Ltd. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * Neither the name of the Integrity Project nor the names of its contributors
+ * may be used to endorse or promote products derived from this software
+ * without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE
+ */
+
+#ifndef __TBA_XDK_MEMORY_MEMORYOWNERMAP_H
+#define __TBA_XDK_MEMORY_MEMORYOWNERMAP_H
+
+/*
+ * MemoryOwnerMap.h
+ *
+ * A radix table which maps addresses into the object which owns them. Used by
+ * the SuperiorMemoryManager in order to find the bucket of a pointer in a
+ * constant number of memory loads.
+ */
+#include "xStl/types.h"
+#include "xdk/memory/SuperiorMemoryManagerInterface.h"
+
+/*
+ * The address space is divided into granules of GRANULARITY bytes. Each granule
+ * is described by a single entry which is located by a three level radix
+ * lookup of the granule number:
+ *
+ *     address: | root index | middle index | leaf index | granule offset |
+ *
+ * The root table is part of the object, the middle and the leaf nodes are
+ * allocated from the operating system interface (See 'reserve').
+ *
+ * Owners are registered over contiguous ranges which must be at least
+ * GRANULARITY bytes long. Therefore a single granule can be shared by at most
+ * two owners: one which covers the beginning of the granule (the low owner)
+ * and one which starts inside the granule (the high owner).
+ *
+ * NOTE: 'lookup' is lock-free and can be called at any time. 'reserve' must
+ *       be serialized by the caller. 'insert' and 'remove' must be serialized
+ *       by the caller as well, but they can run together with 'reserve'.
+ */
+class MemoryOwnerMap {
+public:
+    // Each granule is 16kb. This is also the minimum length of a range
+    enum { GRANULARITY_SHIFT = 14 };
+    enum { GRANULARITY = 1 << GRANULARITY_SHIFT };
+
+    /*
+     * Constructor. Creates an empty map.
+     *
+     * osmem - The operating system interface. Used in order to allocate the
+     *         radix nodes.
+     */
+    MemoryOwnerMap(const SuperiorOSMemePtr& osmem);
+
+    /*
+     * Destructor. Free all radix nodes back to the operating system.
+     */
+    ~MemoryOwnerMap();
+
+    /*
+     * Allocate all the radix nodes which are needed in order to describe the
+     * range [start, start + length).
+     *
+     * Return false if the operating system cannot allocate more nodes.
+     *
+     * NOTE: Calls the operating system interface. Must not be called while
+     *       holding a lock which is used by the memory manager.
+     */
+    bool reserve(void* start, uint length);
+
+    /*
+     * Register 'owner' as the owner of [start, start + length).
+     *
+     * NOTE: The range must be reserved first (See 'reserve'), must not
+     *       overlap any other registered range and must be at least
+     *       GRANULARITY bytes long.
+     */
+    void insert(void* start, uint length, void* owner);
+
+    /*
+     * Unregister the owner of [start, start + length). The range must be
+     * registered by 'insert'.
+     */
+    void remove(void* start, uint length);
+
+    /*
+     * Return the only owner which might contain 'address'.
+     * Return NULL if no owner covers the granule of 'address'.
+     *
+     * NOTE: When the granule is shared with unused memory the owner is
+     *       returned even if 'address' is outside the owner range. The caller
+     *       must validate the pointer against the owner.
+     */
+    void* lookup(void* address) const;
+
+private:
+    // Deny copy-constructor and operator =
+    MemoryOwnerMap(const MemoryOwnerMap& other);
+    MemoryOwnerMap& operator = (const MemoryOwnerMap& other);
+
+    // The number of meaningful bits inside an address. 64 bit processors uses
+    // only 48 bits of virtual address.
+    enum { ADDRESS_BITS = (sizeof(addressNumericValue) > 4) ? 48 : 32 };
+    // The number of bits of a granule number
+    enum { INDEX_BITS = ADDRESS_BITS - GRANULARITY_SHIFT };
+    // Each leaf describes 1024 granules (16mb)
+    enum { LEAF_BITS = 10 };
+    enum { MIDDLE_BITS = (INDEX_BITS - LEAF_BITS) / 2 };
+    enum { ROOT_BITS = INDEX_BITS - LEAF_BITS - MIDDLE_BITS };
+
+    enum { LEAF_ENTRIES = 1 << LEAF_BITS };
+    enum { MIDDLE_ENTRIES = 1 << MIDDLE_BITS };
+    enum { ROOT_ENTRIES = 1 << ROOT_BITS };
+
+    // The radix nodes are allocated from the operating system in chunks of
+    // 64kb.
+    enum { NODES_CHUNK_SIZE = 64*1024 };
+
+    /*
+     * A single granule descriptor
+     */
+    struct Entry {
+        // The owner which covers the first byte of the granule, or NULL
+        void* m_lowOwner;
+        // The owner which starts inside the granule, or NULL
+        void* m_highOwner;
+        // The first address of 'm_highOwner'
+        addressNumericValue m_highStart;
+    };
+
+    /*
+     * The radix nodes
+     */
+    struct LeafNode {
+        Entry m_entries[LEAF_ENTRIES];
+    };
+    struct MiddleNode {
+        LeafNode* volatile m_leaves[MIDDLE_ENTRIES];
+    };
+
+    /*
+     * Return the granule number of an address
+     */
+    static addressNumericValue getGranule(addressNumericValue address);
+
+    /*
+     * Return the entry of a granule. The granule must be reserved.
+     */
+    Entry& getEntry(addressNumericValue granule);
+
+    /*
+     * Allocate a zeroed memory for a radix node.
+     * Return NULL if the operating system is out of memory.
+     */
+    void* allocateNode(uint length);
+
+    // The operating system memory allocation interface
+    SuperiorOSMemePtr m_osmem;
+
+    // The root of the radix table
+    MiddleNode* volatile m_root[ROOT_ENTRIES];
+
+    // The current chunk of nodes. The first pointer of each chunk points to
+    // the previous allocated chunk.
+    void* m_nodesChunk;
+    // The length of the current chunk
+    uint m_nodesChunkLength;
+    // The number of bytes already used inside the current chunk
+    uint m_nodesChunkPosition;
+};
+
+#endif // __TBA_XDK_MEMORY_MEMORYOWNERMAP_H
@@ -0,0 +1,146 @@
+/*
+ * Copyright (c) 2008-2016, Integrity Project Ltd. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * Neither the name of the Integrity Project nor the names of its contributors
+ * may be used to endorse or promote products derived from this software
+ * without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE
+ */
+
+
+
+
+#ifndef __TBA_XDK_MEMORY_MEMORYPROCESSORSLOT_H
+#define __TBA_XDK_MEMORY_MEMORYPROCESSORSLOT_H
+
+/*
+ * MemoryProcessorSlot.h
+ *
+ * Selects the per-processor state of the memory managers.
+ */
+#include "xStl/types.h"
+#include "xdk/memory/MemoryAtomic.h"
+
+#ifndef XDK_TEST
+    #include "xdk/utils/processorUtil.h"
+    #include "xdk/utils/processorLock.h"
+#endif
+
+/*
+ * In the kernel each processor has a slot of it's own, which is the number of
+ * the processor. In the XDK_TEST build a thread-local number emulates the
+ * processor number: Each thread is numbered the first time it asks for a
+ * slot, and more threads than SLOTS share the slots.
+ */
+class MemoryProcessorSlot {
+public:
+    // The number of slots
+    #ifndef XDK_TEST
+    enum { SLOTS = cProcessorUtil::MAX_PROCESSORS_SUPPORT };
+    #else
+    enum { SLOTS = 32 };
+    #endif
+
+    /*
+     * Return the number of the current processor. In the XDK_TEST build
+     * return the number of the current thread, which is not bounded by SLOTS.
+     *
+     * NOTE: The thread might move to another processor meanwhile. Use
+     *       MemoryProcessorCacheGuard in order to pin it.
+     */
+    static uint32 getCurrentProcessor();
+
+    /*
+     * Return the slot of the current processor, below SLOTS
+     */
+    static uint getCurrentSlot()
+    {
+        return getCurrentProcessor() % SLOTS;
+    }
+};
+
+/*
+ * Pins the current processor and returns it's entry of a per-processor array
+ * of SLOTS caches.
+ *
+ * In the kernel the processor is locked (See cProcessorLock) until the guard
+ * is destructed. In the XDK_TEST build the slot is acquired by the 'm_busy'
+ * member of the cache ('volatile uint32'), if the slot is used by another
+ * thread, then no cache is returned.
+ */
+template <class T>
+class MemoryProcessorCacheGuard {
+public:
+    // Constructor. Acquire the cache of the current processor
+    MemoryProcessorCacheGuard(T* caches) :
+        m_cache(NULL)
+    {
+        #ifndef XDK_TEST
+            // From now on the processor number cannot be changed
+            m_processorLock.lock();
+            m_cache = &caches[MemoryProcessorSlot::getCurrentSlot()];
+        #else
+            T* cache = &caches[MemoryProcessorSlot::getCurrentSlot()];
+            // More threads than slots share the slot. Never wait for it.
+            if (MemoryAtomic::exchange(&cache->m_busy, 1) == 0)
+                m_cache = cache;
+        #endif
+    }
+
+    // Destructor. Release the cache
+    ~MemoryProcessorCacheGuard()
+    {
+        #ifndef XDK_TEST
+            m_processorLock.unlock();
+        #else
+            if (m_cache != NULL)
+                MemoryAtomic::exchange(&m_cache->m_busy, 0);
+        #endif
+    }
+
+    /*
+     * Return the cache of the current processor. Return NULL if the cache
+     * cannot be used.
+     */
+    T* getCache()
+    {
+        return m_cache;
+    }
+
+private:
+    // Deny copy-constructor and operator =
+    MemoryProcessorCacheGuard(const MemoryProcessorCacheGuard& other);
+    MemoryProcessorCacheGuard& operator = (
+        const MemoryProcessorCacheGuard& other);
+
+    #ifndef XDK_TEST
+    // Prevent context-switch while the cache is used
+    cProcessorLock m_processorLock;
+    #endif
+    // The acquired cache
+    T* m_cache;
+};
+
+#endif // __TBA_XDK_MEMORY_MEMORYPROCESSORSLOT_H
@@ -0,0 +1,106 @@
+/*
+ * Copyright (c) 2008-2016, Integrity Project Ltd. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * Neither the name of the Integrity Project nor the names of its contributors
+ * may be used to endorse or promote products derived from this software
+ * without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE
+ */
+
+
+#ifndef __TBA_XDK_MEMORY_MEMORYPROFILE_H
+#define __TBA_XDK_MEMORY_MEMORYPROFILE_H
+
+/*
+ * MemoryProfile.h
+ *
+ * The dump format of the sampling heap profiler (See MemoryProfiler).
+ * Note: This file is compile for both ring3 application and ring0 applications.
+ *       The dump is passed as is from the driver to the ring3 reporting tool
+ *       (See cConsoleDeviceIoctl and cMemoryProfileReport), and might be
+ *       saved into a file, so only fixed size types are used.
+ */
+#include "xStl/types.h"
+
+/*
+ * A single sampled block which is still allocated
+ */
+struct MemoryProfileSample {
+    // The number of return addresses of each sample
+    enum { MAX_FRAMES = 8 };
+
+    // The address of the block
+    uint64 m_block;
+    // The return addresses of the allocation, starting at the caller of the
+    // allocator. Only the first 'm_numberOfFrames' addresses are valid.
+    uint64 m_frames[MAX_FRAMES];
+    // The requested length of the block
+    uint32 m_length;
+    // The time of the allocation, in milliseconds since the profiler started
+    uint32 m_time;
+    // The number of valid return addresses
+    uint32 m_numberOfFrames;
+    // Padding
+    uint32 m_reserved;
+};
+
+/*
+ * The dump of all the live samples of a profiler
+ */
+struct MemoryProfileDump {
+    enum {
+        // 'MPRF'
+        MAGIC = 0x4652504D,
+        VERSION = 1,
+        // The maximum number of samples in a dump
+        MAX_SAMPLES = 1024
+    };
+
+    // MAGIC and VERSION
+    uint32 m_magic;
+    uint32 m_version;
+    // The average number of allocated bytes between two samples. A block of
+    // 'length' bytes is sampled in a probability of
+    // 1 - exp(-length / m_sampleRate). 0 when the profiler is disabled.
+    uint32 m_sampleRate;
+    // The number of valid entries of 'm_samples'
+    uint32 m_numberOfSamples;
+    // The number of samples which were dropped since the profiler started,
+    // because the table was full
+    uint32 m_droppedSamples;
+    // The time of the dump, in milliseconds since the profiler started
+    uint32 m_time;
+    // The load address and the size of the module which holds the profiler.
+    // Used in order to translate the return addresses into the symbols of the
+    // module. 0 if unknown.
+    uint64 m_imageBase;
+    uint32 m_imageSize;
+    // Padding
+    uint32 m_reserved;
+    // The live samples
+    MemoryProfileSample m_samples[MAX_SAMPLES];
+};
+
+#endif // __TBA_XDK_MEMORY_MEMORYPROFILE_H
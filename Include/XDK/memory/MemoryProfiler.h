@@ -0,0 +1,216 @@
+/*
+ * Copyright (c) 2008-2016, Integrity Project Ltd. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * Neither the name of the Integrity Project nor the names of its contributors
+ * may be used to endorse or promote products derived from this software
+ * without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE
+ */
+
+
+#ifndef __TBA_XDK_MEMORY_MEMORYPROFILER_H
+#define __TBA_XDK_MEMORY_MEMORYPROFILER_H
+
+/*
+ * MemoryProfiler.h
+ *
+ * A sampling heap profiler. Attributes the allocated memory to the code paths
+ * which allocated it.
+ */
+#include "xStl/types.h"
+#include "xStl/os/os.h"
+#include "xdk/memory/MemoryLockableObject.h"
+#include "xdk/memory/MemoryProfile.h"
+#include "xdk/memory/MemoryProcessorSlot.h"
+
+/*
+ * Samples about one allocation per 'sampleRate' allocated bytes. The gap
+ * between two samples is drawn from an exponential distribution (Poisson
+ * sampling), so each allocated byte has the same chance to be sampled and a
+ * block of 'length' bytes is sampled in a probability of
+ * 1 - exp(-length / sampleRate). Large blocks are almost always sampled, small
+ * blocks are rarely sampled, and the total allocated memory of a call site
+ * can be estimated from it's samples. See cMemoryProfileReport.
+ *
+ * A sample holds the return addresses, the length and the time of the
+ * allocation. The samples are kept in a fixed table, which is allocated with
+ * the profiler, until their block is freed.
+ *
+ * The cost of an allocation which is not sampled is a subtraction from a
+ * per-processor counter. The cost of a free is a single probe of the table
+ * when no sample hashes into the same place. Only sampled blocks are locked.
+ *
+ * NOTE: This class doesn't allocate any memory and can be used by the global
+ *       operator new/delete, at any IRQL.
+ * NOTE: The allocations and the frees of the same block must be reported in
+ *       their order. The profiler doesn't detect double-frees.
+ */
+class MemoryProfiler {
+public:
+    // The default average number of bytes between two samples
+    enum { DEFAULT_SAMPLE_RATE = 512*1024 };
+    // The number of samples which can be kept in the table. A full table
+    // drops new samples.
+    enum { MAX_LIVE_SAMPLES = MemoryProfileDump::MAX_SAMPLES * 3 / 4 };
+
+    /*
+     * Constructor. Start sampling.
+     *
+     * sampleRate - The average number of bytes between two samples. Set to 0
+     *              in order to construct a disabled profiler.
+     */
+    MemoryProfiler(uint sampleRate = DEFAULT_SAMPLE_RATE);
+
+    /*
+     * Change the average number of bytes between two samples. Set to 0 in
+     * order to stop sampling. The samples which were already taken are kept
+     * until their blocks are freed.
+     */
+    void setSampleRate(uint sampleRate);
+
+    /*
+     * Return the average number of bytes between two samples, or 0 if the
+     * profiler is disabled.
+     */
+    uint getSampleRate() const;
+
+    /*
+     * Called after a block was allocated. Sample the block if the sampling
+     * interval is over.
+     *
+     * block      - The allocated block
+     * length     - The requested length of the block
+     * skipFrames - The number of return addresses to skip, besides the
+     *              profiler itself. Used in order to skip the allocator
+     *              functions.
+     */
+    void recordAllocation(void* block, uint length, uint skipFrames = 0);
+
+    /*
+     * Called before a block is freed. Forget the sample of the block, if it
+     * was sampled.
+     */
+    void recordFree(void* block);
+
+    /*
+     * Return the number of live samples
+     */
+    uint getNumberOfSamples() const;
+
+    /*
+     * Copy all the live samples into 'dump'. The image base and size of the
+     * dump are set to 0.
+     */
+    void dump(MemoryProfileDump& dump);
+
+private:
+    // Deny copy-constructor and operator =
+    MemoryProfiler(const MemoryProfiler& other);
+    MemoryProfiler& operator = (const MemoryProfiler& other);
+
+    // The keys of the table. A key is either the address of a sampled block,
+    // or one of the following values.
+    enum {
+        // The end of a probing sequence
+        KEY_EMPTY = 0,
+        // A removed sample. The probing sequence continues
+        KEY_REMOVED = 1
+    };
+    // The table has 2^TABLE_SHIFT entries. See MemoryProfileDump::MAX_SAMPLES
+    enum { TABLE_SHIFT = 10 };
+    // The maximum number of return addresses which can be skipped
+    enum { MAX_SKIPPED_FRAMES = 8 };
+
+    // See MemoryProcessorSlot
+    enum { PROFILER_SLOTS = MemoryProcessorSlot::SLOTS };
+
+    /*
+     * The sampling state of a single processor. Updated without any lock, in
+     * the kernel the processor might be switched in the middle of an update,
+     * which only changes the sampling intervals a little.
+     */
+    struct Slot {
+        // The number of bytes which are left until the next sample
+        uint32 m_bytesUntilSample;
+        // The state of the random numbers generator of the slot
+        uint32 m_seed;
+        // Keeps each slot in it's own cache-line
+        uint8 m_padding[56];
+    };
+
+    /*
+     * Return the slot of the current processor
+     */
+    Slot& getSlot();
+
+    /*
+     * Return a random interval from an exponential distribution whose mean is
+     * 'm_sampleRate'.
+     */
+    uint32 getNextInterval(Slot& slot);
+
+    /*
+     * Add a sample into the table. Return false if the table is full.
+     */
+    bool insertSample(void* block, uint length, uint skipFrames);
+
+    /*
+     * Return the position of 'block' in the table, or MAX_SAMPLES if the
+     * block isn't sampled. Doesn't lock the table.
+     */
+    uint findSample(addressNumericValue block) const;
+
+    /*
+     * Return the first position of the probing sequence of 'block'
+     */
+    static uint getHashPosition(addressNumericValue block);
+
+    /*
+     * Fill 'frames' with the return addresses of the current thread. Return
+     * the number of addresses.
+     */
+    static uint captureStackTrace(uint64* frames, uint count, uint skipFrames);
+
+    // See setSampleRate
+    volatile uint32 m_sampleRate;
+    // The number of live samples
+    volatile uint32 m_numberOfSamples;
+    // The number of dropped samples
+    volatile uint32 m_droppedSamples;
+    // The time of the construction
+    cOSDef::systemTime m_startTime;
+    // The sampling state of each processor
+    Slot m_slots[PROFILER_SLOTS];
+
+    // Protects the table modifications. The keys are read without the lock.
+    MemoryLockableObject m_lock;
+    // The addresses of the sampled blocks. Open addressing table with linear
+    // probing. See KEY_EMPTY and KEY_REMOVED
+    volatile addressNumericValue m_keys[MemoryProfileDump::MAX_SAMPLES];
+    // The samples. Valid when the matching key holds an address
+    MemoryProfileSample m_samples[MemoryProfileDump::MAX_SAMPLES];
+};
+
+#endif // __TBA_XDK_MEMORY_MEMORYPROFILER_H
@@ -0,0 +1,139 @@
+/*
+ * Copyright (c) 2008-2016, Integrity Project Ltd. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * Neither the name of the Integrity Project nor the names of its contributors
+ * may be used to endorse or promote products derived from this software
+ * without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE
+ */
+
+#ifndef __TBA_XDK_MEMORY_MEMORYSIZECLASS_H
+#define __TBA_XDK_MEMORY_MEMORYSIZECLASS_H
+
+/*
+ * MemorySizeClass.h
+ *
+ * The size classes of the SuperiorMemoryManager buckets.
+ */
+#include "xStl/types.h"
+#include "xdk/memory/MemoryBitScan.h"
+
+/*
+ * The allocation units of the size classes are calculated at compile time:
+ *
+ *   Class 0      - 4 bytes
+ *   Class 1..4   - 8, 16, 24, 32 bytes. (Quantum spacing)
+ *   Class 5..    - 4 classes per doubling. The classes between 2^k and
+ *                  2^(k+1) are spaced by 2^(k-2):
+ *                  40, 48, 56, 64, 80, 96, 112, 128, 160, ...
+ *   Last class   - 256kb
+ *
+ * The memory loss of a class is up to a quarter of the unit size (Instead of
+ * a half when the classes are powers of 2).
+ *
+ * See MemorySizeClassUnit for the compile-time calculation of each class
+ * See MemorySizeClass::getSizeClass for the size to class translation
+ */
+class MemorySizeClass {
+public:
+    enum {
+        // The classes which are spaced by QUANTUM
+        QUANTUM_CLASSES = 5,
+        QUANTUM = 8,
+        // The last quantum class is 2^FIRST_DOUBLING_SHIFT
+        FIRST_DOUBLING_SHIFT = 5,
+        // The number of classes per doubling is 2^CLASSES_PER_DOUBLING_SHIFT
+        CLASSES_PER_DOUBLING_SHIFT = 2,
+        CLASSES_PER_DOUBLING = 1 << CLASSES_PER_DOUBLING_SHIFT,
+        // The largest class is 2^LAST_DOUBLING_SHIFT
+        LAST_DOUBLING_SHIFT = 18,
+        MAXIMUM_UNIT_SIZE = 1 << LAST_DOUBLING_SHIFT,
+        // The number of classes
+        NUMBER_OF_CLASSES = QUANTUM_CLASSES +
+                            (LAST_DOUBLING_SHIFT - FIRST_DOUBLING_SHIFT) *
+                            CLASSES_PER_DOUBLING,
+        // The preferred size of the first bucket of each class
+        DEFAULT_BUCKET_SIZE = 256*1024,
+        // The minimum number of units of the first bucket
+        MINIMUM_BUCKET_ELEMENTS = 2
+    };
+
+    /*
+     * Return the smallest class which can hold 'length' bytes, in constant
+     * time. Return NUMBER_OF_CLASSES if 'length' is larger than
+     * MAXIMUM_UNIT_SIZE.
+     */
+    static uint getSizeClass(uint length)
+    {
+        if (length <= QUANTUM)
+            return (length <= 4) ? 0 : 1;
+        if (length <= (1 << FIRST_DOUBLING_SHIFT))
+            return (length + QUANTUM - 1) / QUANTUM;
+        if (length > MAXIMUM_UNIT_SIZE)
+            return NUMBER_OF_CLASSES;
+
+        // 2^k < length <= 2^(k+1)
+        uint k = MemoryBitScan::highestSetBit(length - 1);
+        uint step = (length - 1) >> (k - CLASSES_PER_DOUBLING_SHIFT);
+        return QUANTUM_CLASSES +
+               ((k - FIRST_DOUBLING_SHIFT) << CLASSES_PER_DOUBLING_SHIFT) +
+               step - CLASSES_PER_DOUBLING;
+    }
+};
+
+/*
+ * The allocation unit of the class INDEX, calculated at compile time:
+ *     UNIT_SIZE        - The largest length of the class
+ *     DEFAULT_ELEMENTS - The number of units of the first bucket
+ */
+template <uint INDEX,
+          bool IS_QUANTUM = (INDEX < MemorySizeClass::QUANTUM_CLASSES)>
+struct MemorySizeClassUnit {
+    enum {
+        DOUBLING = (INDEX - MemorySizeClass::QUANTUM_CLASSES) >>
+                   MemorySizeClass::CLASSES_PER_DOUBLING_SHIFT,
+        STEP = (INDEX - MemorySizeClass::QUANTUM_CLASSES) &
+               (MemorySizeClass::CLASSES_PER_DOUBLING - 1),
+        SHIFT = MemorySizeClass::FIRST_DOUBLING_SHIFT + DOUBLING,
+        UNIT_SIZE = (1 << SHIFT) +
+                    ((STEP + 1) << (SHIFT -
+                        MemorySizeClass::CLASSES_PER_DOUBLING_SHIFT)),
+        FIT_ELEMENTS = MemorySizeClass::DEFAULT_BUCKET_SIZE / UNIT_SIZE,
+        DEFAULT_ELEMENTS =
+            (FIT_ELEMENTS < MemorySizeClass::MINIMUM_BUCKET_ELEMENTS) ?
+            (int)MemorySizeClass::MINIMUM_BUCKET_ELEMENTS :
+            (int)FIT_ELEMENTS
+    };
+};
+
+template <uint INDEX>
+struct MemorySizeClassUnit<INDEX, true> {
+    enum {
+        UNIT_SIZE = (INDEX == 0) ? 4 : (INDEX * MemorySizeClass::QUANTUM),
+        DEFAULT_ELEMENTS = MemorySizeClass::DEFAULT_BUCKET_SIZE / UNIT_SIZE
+    };
+};
+
+#endif // __TBA_XDK_MEMORY_MEMORYSIZECLASS_H
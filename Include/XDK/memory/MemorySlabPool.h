@@ -0,0 +1,255 @@
+/*
+ * Copyright (c) 2008-2016, Integrity Project Ltd. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * Neither the name of the Integrity Project nor the names of its contributors
+ * may be used to endorse or promote products derived from this software
+ * without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE
+ */
+
+
+
+
+#ifndef __TBA_XDK_MEMORY_MEMORYSLABPOOL_H
+#define __TBA_XDK_MEMORY_MEMORYSLABPOOL_H
+
+/*
+ * MemorySlabPool.h
+ *
+ * A pool of fixed-length objects, which are carved out of slabs.
+ */
+#include "xStl/types.h"
+#include "xdk/memory/MemoryLockableObject.h"
+#include "xdk/memory/MemorySuperblockHeapManager.h"
+#include "xdk/memory/MemoryProcessorSlot.h"
+
+/*
+ * The pool allocates slabs (Blocks of many objects) from a heap and divides
+ * them into objects of a single length. The free objects are linked into an
+ * intrusive free list, the link is written into the first bytes of each free
+ * object, so the objects have no overhead at all.
+ *
+ * Each processor keeps a small cache of free objects. Allocation and free
+ * are served by the cache of the current processor without any lock or
+ * interlocked operation. Objects are moved between the caches and the free
+ * list in batches of CACHE_BATCH objects, under the lock of the pool.
+ *
+ * The slabs are returned to the heap only by the destructor, so the objects
+ * of a pool never fragment the heap.
+ *
+ * See ObjectPool for the typed interface.
+ *
+ * NOTE: This class is thread-safe and processor safe
+ */
+class MemorySlabPool {
+public:
+    // The default length in bytes of a slab
+    enum { DEFAULT_SLAB_LENGTH = 4096 };
+    // The minimum number of objects in each slab
+    enum { MINIMUM_SLAB_OBJECTS = 8 };
+    // The objects are aligned to 8 bytes
+    enum { OBJECT_ALIGNMENT = 8 };
+    // The number of free objects each processor cache can hold
+    enum { CACHE_SIZE = 16 };
+    // The number of objects which are moved between a cache and the free list
+    enum { CACHE_BATCH = CACHE_SIZE / 2 };
+
+    /*
+     * Constructor. Nothing is allocated until the first object.
+     *
+     * heap           - The heap of the slabs. Must be valid until the pool
+     *                  is destructed.
+     * objectLength   - The length in bytes of each object
+     * objectsPerSlab - The number of objects in each slab. For 0 the slabs
+     *                  are about DEFAULT_SLAB_LENGTH bytes long.
+     */
+    MemorySlabPool(MemorySuperblockHeapManager& heap,
+                   uint objectLength,
+                   uint objectsPerSlab = 0);
+
+    /*
+     * Destructor. Return all slabs to the heap. A trace is invoked if there
+     * are still allocated objects.
+     */
+    ~MemorySlabPool();
+
+    /*
+     * Allocate an object. Return NULL if the heap cannot allocate a new
+     * slab.
+     */
+    void* allocate();
+
+    /*
+     * Free an object which was allocated by this pool.
+     *
+     * NOTE: The object is not validated (Only in debug builds), so 'object'
+     *       must be a pointer which was returned by 'allocate()'.
+     */
+    void free(void* object);
+
+    /*
+     * Return true if 'object' is an object of this pool. Scans the slabs.
+     */
+    bool isOwner(void* object) const;
+
+    /*
+     * Return the length of the objects. Might be longer than the requested
+     * length due to the alignment.
+     */
+    uint getObjectLength() const;
+
+    /*
+     * Return the number of slabs which were allocated from the heap
+     */
+    uint getNumberOfSlabs() const;
+
+    /*
+     * Return the number of allocated objects. The processor caches are read
+     * without locking, so the number is accurate only when the pool isn't
+     * used.
+     */
+    uint getNumberOfObjects() const;
+
+    /*
+     * The pools of an owner can be linked into a list.
+     */
+    MemorySlabPool* getNextPool() const;
+    void setNextPool(MemorySlabPool* next);
+
+    /*
+     * Placement operator new. Allows the construction of a pool inside
+     * memory which is owned by another object.
+     */
+    void* operator new(uint cbSize, void* place);
+
+    /*
+     * Matching operator delete for the placement operator new. Nothing to
+     * free.
+     */
+    void operator delete(void* ptr, void* place);
+
+    /*
+     * The normal operator new and delete are forwarded to the global
+     * operators. (Otherwise they are hidden by the placement operators)
+     */
+    void* operator new(uint cbSize);
+    void operator delete(void* ptr);
+
+private:
+    // Deny copy-constructor and operator =
+    MemorySlabPool(const MemorySlabPool& other);
+    MemorySlabPool& operator = (const MemorySlabPool& other);
+
+    // See MemoryProcessorSlot
+    enum { PROCESSOR_CACHES = MemoryProcessorSlot::SLOTS };
+
+    /*
+     * A free object. The link is written into the object itself.
+     */
+    struct FreeObject {
+        FreeObject* m_next;
+    };
+
+    /*
+     * The header of each slab. The header is aligned to OBJECT_ALIGNMENT
+     * inside the heap block, and the objects follow it.
+     */
+    struct SlabHeader {
+        // The previously allocated slab
+        SlabHeader* m_next;
+        // The heap block of the slab
+        void* m_block;
+    };
+
+    /*
+     * The free objects of a single processor
+     */
+    struct ProcessorCache {
+        #ifdef XDK_TEST
+        // Set to 1 while a thread uses the slot
+        volatile uint32 m_busy;
+        #endif
+        // The number of objects inside the cache
+        uint m_count;
+        // The free objects
+        void* m_objects[CACHE_SIZE];
+    };
+
+    // Pins the current processor and returns it's cache. See
+    // MemoryProcessorCacheGuard
+    typedef MemoryProcessorCacheGuard<ProcessorCache> ProcessorCacheGuard;
+
+    /*
+     * Move up to 'count' objects from the free list into 'objects'. A new
+     * slab is allocated if the free list is empty.
+     *
+     * Return the number of objects which were moved. 0 if the heap is full.
+     */
+    uint takeObjects(void** objects, uint count);
+
+    /*
+     * Move 'count' objects into the free list
+     */
+    void returnObjects(void** objects, uint count);
+
+    /*
+     * Allocate a new slab from the heap, and add it's objects into the free
+     * list. Return false if the heap is full.
+     *
+     * NOTE: m_lock must not be acquired. The heap is called without it.
+     */
+    bool addSlab();
+
+    /*
+     * Return the first object of 'slab'
+     */
+    uint8* getFirstObject(SlabHeader* slab) const;
+
+    // The heap of the slabs
+    MemorySuperblockHeapManager& m_heap;
+    // The length of each object
+    uint m_objectLength;
+    // The number of objects in each slab
+    uint m_objectsPerSlab;
+    // The length of the heap block of each slab
+    uint m_slabLength;
+
+    // Protects the free list and the slabs list
+    mutable MemoryLockableObject m_lock;
+    // The free objects which are not cached
+    FreeObject* m_freeList;
+    uint m_freeObjects;
+    // The slabs, the last allocated first
+    SlabHeader* m_slabs;
+    uint m_numberOfSlabs;
+
+    // The processor caches
+    ProcessorCache m_caches[PROCESSOR_CACHES];
+
+    // See getNextPool
+    MemorySlabPool* m_nextPool;
+};
+
+#endif // __TBA_XDK_MEMORY_MEMORYSLABPOOL_H
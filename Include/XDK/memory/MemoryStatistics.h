@@ -0,0 +1,104 @@
+/*
+ * Copyright (c) 2008-2016, Integrity Project Ltd. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * Neither the name of the Integrity Project nor the names of its contributors
+ * may be used to endorse or promote products derived from this software
+ * without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE
+ */
+
+
+#ifndef __TBA_XDK_MEMORY_MEMORYSTATISTICS_H
+#define __TBA_XDK_MEMORY_MEMORYSTATISTICS_H
+
+/*
+ * MemoryStatistics.h
+ *
+ * The telemetry snapshot of the SuperiorMemoryManager.
+ * Note: This file is compile for both ring3 application and ring0 applications.
+ *       The snapshot is passed as is from the driver to the ring3 monitoring
+ *       application (See cConsoleDeviceIoctl), so only fixed size types are
+ *       used.
+ */
+#include "xStl/types.h"
+#include "xdk/memory/MemorySizeClass.h"
+
+/*
+ * The counters of a single size class.
+ *
+ * The counters are never reset. The counts wrap around at 4g, so a monitoring
+ * application should use the difference between two snapshots.
+ */
+struct MemorySizeClassStatistics {
+    // The allocation unit of the size class. 0 for the default bucket group
+    uint32 m_unitSize;
+    // The number of blocks which were allocated from the buckets of the
+    // size class. A request might be served by another size class when it's
+    // own buckets are full.
+    uint32 m_allocations;
+    // The number of blocks which were returned into the buckets of the size
+    // class (Or into the processor caches)
+    uint32 m_frees;
+    // The number of requests of the size class which couldn't be served
+    uint32 m_failures;
+    // The number of buckets in the bucket chain of the size class
+    uint32 m_buckets;
+    // Padding
+    uint32 m_reserved;
+    // The total length of the buckets
+    uint64 m_bucketBytes;
+    // The bytes of the blocks which are allocated by the application
+    uint64 m_bytesInUse;
+    // The highest 'm_bytesInUse' which was sampled. The value is sampled by
+    // each snapshot and by each managing period of the memory manager.
+    uint64 m_peakBytesInUse;
+    // The bytes of 'm_bytesInUse' which were not requested by the
+    // application. Estimated from the rounding of all requests so far.
+    uint64 m_internalFragmentation;
+};
+
+/*
+ * The snapshot of the whole memory manager.
+ * See SuperiorMemoryManager::getStatistics
+ */
+struct MemoryStatistics {
+    // The size classes and the default bucket group
+    enum { NUMBER_OF_CLASSES = MemorySizeClass::NUMBER_OF_CLASSES + 1 };
+
+    // The memory which is allocated from the operating system
+    uint64 m_osMemorySize;
+    // The memory which is used by the buckets
+    uint64 m_allocatedOsMemorySize;
+    // The memory of the blocks which are mapped directly from the operating
+    // system. See SuperiorMemoryManager::setDirectMappingThreshold
+    uint64 m_directMemorySize;
+    // The sum of all size classes
+    uint64 m_bytesInUse;
+    uint64 m_peakBytesInUse;
+    // The counters of each size class
+    MemorySizeClassStatistics m_classes[NUMBER_OF_CLASSES];
+};
+
+#endif // __TBA_XDK_MEMORY_MEMORYSTATISTICS_H
@@ -44,6 +44,13 @@
 #include "xStl/types.h"
 #include "xdk/memory/MemoryLockableObject.h"
 
+/*
+ * The type of heap totals (Allocated bytes, free bytes, OS memory). A single
+ * superblock is limited to 4GB but a heap which is made of many superblocks
+ * may exceed it on 64 bit platforms, so the totals are pointer wide.
+ */
+typedef addressNumericValue memorySize;
+
 /*
  * The interface for superblock manager.
  */
@@ -94,6 +101,67 @@ public:
      */
     virtual bool free(void* buffer) = 0;
 
+    /*
+     * Allocate up to 'count' blocks of 'length' bytes each, and store them
+     * inside 'blocks'. Used in order to fill caches with a single lock
+     * acquisition.
+     *
+     * Return the number of blocks which were allocated.
+     *
+     * The default implementation calls 'allocate' for each block.
+     */
+    virtual uint allocateBlocks(uint length, void** blocks, uint count);
+
+    /*
+     * Free 'count' blocks which were allocated by this superblock.
+     * Used in order to flush caches with a single lock acquisition.
+     *
+     * The default implementation calls 'free' for each block.
+     */
+    virtual void freeBlocks(void** blocks, uint count);
+
+    /*
+     * Return the number of bytes which can be used by the allocated block
+     * 'buffer'. The number might be bigger than the requested length since
+     * the blocks are aligned to the allocation unit.
+     *
+     * Return 0 if 'buffer' is not a valid block of this superblock, or if the
+     * implementation doesn't track the blocks length (The default
+     * implementation).
+     */
+    virtual uint getBlockLength(void* buffer);
+
+    /*
+     * Try to grow the allocated block 'buffer' so it can hold 'newLength'
+     * bytes without moving it. The content of the block is kept.
+     *
+     * Return true if the block can hold 'newLength' bytes now.
+     * Return false if the memory after the block is in use, or if 'buffer' is
+     * not a valid block of this superblock. The block is left untouched.
+     *
+     * The default implementation only tests the current length of the block
+     * (See getBlockLength).
+     */
+    virtual bool tryExpandInPlace(void* buffer, uint newLength);
+
+    /*
+     * Change the length of the allocated block 'buffer' to 'newLength' bytes.
+     * The block is expanded in place when possible (See tryExpandInPlace).
+     * Otherwise a new block is allocated, the content is copied and 'buffer'
+     * is freed.
+     *
+     * For a NULL 'buffer' a new block is allocated. For a 'newLength' of 0 the
+     * block is freed and NULL is returned.
+     *
+     * Return the new block, or NULL if there isn't enough memory or if
+     * 'buffer' is not a valid block. In that case 'buffer' is still
+     * allocated.
+     *
+     * NOTE: Blocks of implementations which don't track the blocks length
+     *       cannot be reallocated.
+     */
+    virtual void* reallocate(void* buffer, uint newLength);
+
 
     /*
      * Return the maximum number of bytes this superblock allows to
@@ -110,12 +178,31 @@ public:
     /*
      * Return 'm_allocatedBytes'
      */
-    virtual uint getNumberOfAllocatedBytes() const;
+    virtual memorySize getNumberOfAllocatedBytes() const;
 
     /*
      * Return 'm_superBlockLength' - 'm_allocatedBytes'
      */
-    virtual uint getNumberOfFreeBytes() const;
+    virtual memorySize getNumberOfFreeBytes() const;
+
+    /*
+     * Placement operator new. Allows the construction of a manager inside
+     * memory which is owned by another object.
+     */
+    void* operator new(uint cbSize, void* place);
+
+    /*
+     * Matching operator delete for the placement operator new. Nothing to
+     * free.
+     */
+    void operator delete(void* ptr, void* place);
+
+    /*
+     * The normal operator new and delete are forwarded to the global
+     * operators. (Otherwise they are hidden by the placement operators)
+     */
+    void* operator new(uint cbSize);
+    void operator delete(void* ptr);
 
 protected:
     /*
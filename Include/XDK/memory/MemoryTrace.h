@@ -0,0 +1,111 @@
+/*
+ * Copyright (c) 2008-2016, Integrity Project Ltd. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * Neither the name of the Integrity Project nor the names of its contributors
+ * may be used to endorse or promote products derived from this software
+ * without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE
+ */
+
+
+
+#ifndef __TBA_XDK_MEMORY_MEMORYTRACE_H
+#define __TBA_XDK_MEMORY_MEMORYTRACE_H
+
+/*
+ * MemoryTrace.h
+ *
+ * The record format of the allocation trace recorder (See
+ * MemoryTraceRecorder).
+ * Note: This file is compile for both ring3 application and ring0 applications.
+ *       The records are passed as is from the driver to the ring3 tools (See
+ *       cConsoleDeviceIoctl), saved into trace files and replayed on other
+ *       machines, so only fixed size types are used.
+ */
+#include "xStl/types.h"
+
+/*
+ * A single allocation or free
+ */
+struct MemoryTraceRecord {
+    enum {
+        OPERATION_ALLOCATE = 1,
+        OPERATION_FREE = 2
+    };
+
+    // The identifier of the block: The address of the block divided by 8.
+    // Only the lower 32 bits are kept, which is unique for the live blocks
+    // of a heap smaller than 32gb.
+    uint32 m_blockId;
+    // The requested length of an allocation. 0 for a free.
+    uint32 m_length;
+    // The time of the operation, in milliseconds since the recorder started
+    uint32 m_time;
+    // The processor which executed the operation
+    uint16 m_processor;
+    // OPERATION_ALLOCATE or OPERATION_FREE
+    uint8 m_operation;
+    // Padding
+    uint8 m_reserved;
+};
+
+/*
+ * The header of a batch of records. A trace file is a sequence of batches,
+ * each one is a header followed by 'm_numberOfRecords' records. The records
+ * are ordered by the time they were recorded.
+ */
+struct MemoryTraceHeader {
+    enum {
+        // 'MTRC'
+        MAGIC = 0x4352544D,
+        VERSION = 1
+    };
+
+    // MAGIC and VERSION
+    uint32 m_magic;
+    uint32 m_version;
+    // The number of records which follow the header
+    uint32 m_numberOfRecords;
+    // The number of records which were dropped since the recorder started,
+    // because the ring was full. The frees of blocks whose allocation was
+    // dropped are ignored by the replay.
+    uint32 m_droppedRecords;
+};
+
+/*
+ * A batch of records which is drained from the driver
+ */
+struct MemoryTraceDump {
+    // The maximum number of records of a single batch
+    enum { MAX_RECORDS = 4096 };
+
+    // The header. Only the first 'm_header.m_numberOfRecords' records are
+    // valid.
+    MemoryTraceHeader m_header;
+    // The records
+    MemoryTraceRecord m_records[MAX_RECORDS];
+};
+
+#endif // __TBA_XDK_MEMORY_MEMORYTRACE_H
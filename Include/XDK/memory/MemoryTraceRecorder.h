@@ -0,0 +1,163 @@
+/*
+ * Copyright (c) 2008-2016, Integrity Project Ltd. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * Neither the name of the Integrity Project nor the names of its contributors
+ * may be used to endorse or promote products derived from this software
+ * without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE
+ */
+
+
+
+#ifndef __TBA_XDK_MEMORY_MEMORYTRACERECORDER_H
+#define __TBA_XDK_MEMORY_MEMORYTRACERECORDER_H
+
+/*
+ * MemoryTraceRecorder.h
+ *
+ * Records the allocations and the frees of a heap, so the workload can be
+ * replayed against another allocator.
+ */
+#include "xStl/types.h"
+#include "xStl/os/os.h"
+#include "xdk/memory/MemoryLockableObject.h"
+#include "xdk/memory/MemoryTrace.h"
+#include "xdk/memory/MemoryProcessorSlot.h"
+
+/*
+ * The records are written into a ring which is given to the recorder once
+ * (See setBuffer), and drained in batches by a single consumer (See drain).
+ * The ring is a bounded multi-producer queue: A producer claims a position
+ * with a single interlocked operation, writes the record and publishes it by
+ * the sequence number of the position. When the consumer is slower than the
+ * producers the ring is full, and the new records are dropped and counted.
+ *
+ * The records are ordered by their position, which is claimed after the
+ * allocation and before the free. So the free of a block is always ordered
+ * before the next allocation of the same address.
+ *
+ * The cost of a disabled recorder is a single read of a flag.
+ *
+ * NOTE: This class doesn't allocate any memory and can be used by the global
+ *       operator new/delete, at any IRQL.
+ */
+class MemoryTraceRecorder {
+public:
+    // The number of bytes each record takes from the buffer
+    enum { BYTES_PER_RECORD = sizeof(MemoryTraceRecord) + sizeof(uint32) };
+
+    /*
+     * Constructor. The recorder is stopped and doesn't have a buffer.
+     */
+    MemoryTraceRecorder();
+
+    /*
+     * Set the ring of the recorder. The number of records is the largest
+     * power of 2 which fits into 'length' bytes (See BYTES_PER_RECORD). The
+     * buffer is not freed by the recorder.
+     *
+     * NOTE: Can be called only once, before the first 'start()'.
+     */
+    void setBuffer(void* buffer, uint length);
+
+    /*
+     * Start/Stop recording. The records which are already in the ring are
+     * kept until they are drained.
+     *
+     * Return false if there isn't a buffer.
+     */
+    bool start();
+    void stop();
+
+    /*
+     * Return true if the operations are recorded
+     */
+    bool isEnabled() const;
+
+    /*
+     * Called after a block was allocated
+     */
+    void recordAllocation(void* block, uint length);
+
+    /*
+     * Called before a block is freed
+     */
+    void recordFree(void* block);
+
+    /*
+     * Move up to MemoryTraceDump::MAX_RECORDS records from the ring into
+     * 'dump', and fill it's header. Return the number of records.
+     */
+    uint drain(MemoryTraceDump& dump);
+
+    /*
+     * Return the number of records the ring can hold
+     */
+    uint getCapacity() const;
+
+    /*
+     * Return the number of records which were dropped because the ring was
+     * full
+     */
+    uint getDroppedRecords() const;
+
+private:
+    // Deny copy-constructor and operator =
+    MemoryTraceRecorder(const MemoryTraceRecorder& other);
+    MemoryTraceRecorder& operator = (const MemoryTraceRecorder& other);
+
+    /*
+     * Add a record into the ring. The time and the processor are filled.
+     */
+    void push(uint8 operation, void* block, uint length);
+
+    /*
+     * Return the number of the current processor
+     */
+    static uint16 getProcessor();
+
+    // Set while recording
+    volatile uint32 m_isEnabled;
+    // The records of the ring
+    MemoryTraceRecord* m_records;
+    // The sequence number of each position of the ring. A position which is
+    // ready for the producer of 'position' holds 'position', a record which is
+    // ready for the consumer holds 'position' + 1.
+    volatile uint32* m_sequences;
+    // The number of records in the ring minus 1
+    uint32 m_mask;
+    // The next position to be claimed by a producer
+    volatile uint32 m_head;
+    // The next position to be drained
+    uint32 m_tail;
+    // See getDroppedRecords
+    volatile uint32 m_droppedRecords;
+    // The time of the construction
+    cOSDef::systemTime m_startTime;
+    // Allows a single consumer at a time
+    MemoryLockableObject m_drainLock;
+};
+
+#endif // __TBA_XDK_MEMORY_MEMORYTRACERECORDER_H
@@ -0,0 +1,88 @@
+/*
+ * Copyright (c) 2008-2016, Integrity Project Ltd. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * Neither the name of the Integrity Project nor the names of its contributors
+ * may be used to endorse or promote products derived from this software
+ * without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE
+ */
+
+
+
+
+#ifndef __TBA_XDK_MEMORY_OBJECTPOOL_H
+#define __TBA_XDK_MEMORY_OBJECTPOOL_H
+
+/*
+ * ObjectPool.h
+ *
+ * A typed pool of objects.
+ */
+#include "xStl/types.h"
+#include "xdk/memory/MemorySlabPool.h"
+
+/*
+ * A MemorySlabPool which hands out storage for objects of type 'T'. The
+ * storage is not constructed. Usage:
+ *
+ *     ObjectPool<Descriptor> pool(heap);
+ *     Descriptor* descriptor = pool.allocate();
+ *     ...
+ *     pool.free(descriptor);
+ *
+ * Classes which are allocated by operator new should inherit
+ * cXdkPooledObject instead (See xdk/memory.h).
+ *
+ * NOTE: This class is thread-safe and processor safe
+ */
+template <class T>
+class ObjectPool : public MemorySlabPool {
+public:
+    /*
+     * Constructor. See MemorySlabPool::MemorySlabPool
+     */
+    ObjectPool(MemorySuperblockHeapManager& heap, uint objectsPerSlab = 0) :
+        MemorySlabPool(heap, sizeof(T), objectsPerSlab)
+    {
+    }
+
+    /*
+     * Allocate storage for an object. Return NULL if the heap is full.
+     */
+    T* allocate()
+    {
+        return (T*)MemorySlabPool::allocate();
+    }
+
+    /*
+     * Free storage which was allocated by 'allocate()'
+     */
+    void free(T* object)
+    {
+        MemorySlabPool::free(object);
+    }
+};
+
+#endif // __TBA_XDK_MEMORY_OBJECTPOOL_H
@@ -41,39 +41,76 @@
  * Author: Elad Raz <e@eladraz.com>
  */
 #include "xStl/types.h"
+#include "xdk/memory/MemoryAtomic.h"
 #include "xdk/memory/MemorySuperblockHeapManager.h"
 
 /*
  * Allocation of small memory blocks (from 1 byte to 32 bytes) can be
  * effectively manage by small overhead packets. This done by dividing
- * the block into 4 bytes sub-blocks. Each sub-block can be either free
- * allocated or allocate-descriptor block.
+ * the block into 8 bytes (or larger) sub-blocks. Contiguous sub-blocks are
+ * grouped into runs. Each run is either allocated or free, and starts with a
+ * descriptor.
  *
- * Here is a small chart of empty superblock memory:
+ * Here is a small chart of a superblock memory:
  *
  *   /---------------------------------------------------------------------\
- *   | Free  | Free  |  Free  |  Free  |  Free  |  Free  |  Free  |  Free  |
- *   \-N-------N---------N--------N-------N---------N-------N--------N-----/
- *     \-----/  \-----/  \-----/  \-----/  \-----/  \-----/  \-----/ \-||
+ *   | A |  data  | F |  ...  |T| A | data | A |  data  |    Untouched     |
+ *   \---------------------------------------------------------------------/
+ *     Allocated    Free run     Allocated    Allocated  ^
+ *                                                       m_untouchedBlock
  *
- * As you can see each free block points in the beginning to the next free
- * block.
+ * An allocated run starts with an allocation-descriptor block. This special
+ * block contains the information about the allocated block: Number of blocks
+ * and a magic number. The magic also tells whether the previous run is free.
  *
- * When a memory is allocated a pool of 1 or more contiguous blocks are united
- * for the allocated block and the one block previous for the contiguous block
- * will be used for the allocation-descriptor block. This special block contains
- * the information about the allocated block: Number of blocks and a magic
- * number.
+ * A free run starts with a free-run descriptor (Length, links to the other
+ * free runs of the same size class) and ends with a tail tag which holds the
+ * length of the run again. The tail tag allows to find the beginning of the
+ * previous free run when a block is freed, and the descriptor of the next
+ * run tells whether the next run is free. Neighbour free runs are always
+ * merged upon free, so two free runs are never adjacent.
  *
- * See 'FreeBlock' for the free block descriptor
+ * The free runs are kept in lists by their size class (log2 of the number of
+ * blocks) and a bitmap tells which lists are not empty. Allocation looks for
+ * a list whose runs are surely long enough, so finding a run doesn't depend
+ * on the number of free runs. Only when there isn't any it scans the list of
+ * the requested size class.
+ *
+ * The superblock is formatted lazily: The blocks which were never used are
+ * not part of any run. They are handed out from a bump pointer
+ * (m_untouchedBlock) when the free runs cannot satisfy the allocation. A free
+ * run which reaches the untouched blocks is returned to them. This way the
+ * construction of a manager doesn't depend on the size of the superblock.
+ *
+ * Single blocks are the common case. Freeing a single block doesn't acquire
+ * the lock: The block is pushed into a lock-free stack (The quick list),
+ * keeping it's allocation-descriptor untouched. Allocations of single blocks
+ * pop from this stack. The stack head is a block index (Up to 32 bits)
+ * together with a 32 bit tag which is changed on every operation (A 64 bit
+ * compare-exchange), which protects from the ABA problem. The link to the
+ * next block is kept in the first bytes of the block data, see
+ * QuickBlockLink. The quick list is drained into the free runs when a larger
+ * allocation cannot be satisfied.
+ *
+ * An allocated run can grow in place (See tryExpandInPlace): The free run
+ * which follows it is split, or the untouched blocks are taken if it's the
+ * last run. Growing buffers are not copied as long as their neighbours are
+ * free.
+ *
+ * See 'FreeRunBlock' and 'FreeRunTail' for the free run descriptors
  * See 'AllocatedDescriptorBlock' for the allocation-descriptor block
  *
  * The block are index by thier position in the chain. Block number 5 start
- * after 20 bytes from the beginning of the superblock.
+ * after 40 bytes from the beginning of the superblock (For 8 bytes units).
  *
- * In order to reduce the over-head blocks, the number of blocks are limited
- * to 2^16, which limit the super-block size to 2^18 - 256kb of data.
- * Also, the maximum allocating unit is 1kb of data.
+ * All descriptors are made of block indices, whose type is the template
+ * argument 'BlockIndex'. The number of blocks is limited by the width of the
+ * index, the blocks after the limit are not used (See MAX_BLOCKS):
+ *    - SmallMemoryHeapManager uses 16 bit indices. The overhead of each
+ *      allocation is 4 bytes, up to 2^16-1 blocks.
+ *    - WideMemoryHeapManager uses 32 bit indices. The overhead of each
+ *      allocation is 8 bytes, and the whole superblock is used.
+ * Only superblocks with more than 2^16-1 units need the wide descriptors.
  *
  * Some more information about this kind of allocation:
  *    - The overhead for each packet is very small.
@@ -86,27 +123,33 @@
  *
  * NOTE: This class is thread-safe. See MemorySuperblockHeapManager::m_lock
  */
-class SmallMemoryHeapManager : public MemorySuperblockHeapManager {
+template <class BlockIndex>
+class FreeListMemoryHeapManager : public MemorySuperblockHeapManager {
 public:
-    // The size in bytes of the
-    enum { ALLOCATED_UNIT_OVERHEAD = 4 };
+    // The size in bytes of the allocation-descriptor
+    enum { ALLOCATED_UNIT_OVERHEAD = 2 * sizeof(BlockIndex) };
+    // The maximum number of blocks inside a superblock
+    enum { MAX_BLOCKS = (BlockIndex)(~0) };
 
     /*
      * Constructor.
      * See MemorySuperblockHeapManager::MemorySuperblockHeapManager
      *
      * superBlock       - The super block memory
-     * superBlockLength - The length of the super-block. Limited to
-     *                    MAX_SUPERBLOCK_SIZE. Also the superBlockLength must
+     * superBlockLength - The length of the super-block. Only MAX_BLOCKS
+     *                    blocks are used. Also the superBlockLength must
      *                    be bigger than 2 blocks
-     * allocationUnit   - The allocation unit. Including 4 bytes of the
-     *                    allocation header. See ALLOCATED_UNIT_OVERHEAD
+     * allocationUnit   - The allocation unit. Including the allocation
+     *                    header. See ALLOCATED_UNIT_OVERHEAD
+     * isLazyFormat     - Set to false in order to put all blocks into a
+     *                    single free run during the construction.
      *
      * It's recommended to allocate (N_ELEMENTS*ELEMENT_SIZE) + BLOCK_SIZE.
      */
-    SmallMemoryHeapManager(void* superBlock,
-                           uint superBlockLength,
-                           uint allocationUnit);
+    FreeListMemoryHeapManager(void* superBlock,
+                              uint superBlockLength,
+                              uint allocationUnit,
+                              bool isLazyFormat = true);
 
     /*
      * See MemorySuperblockHeapManager::allocate
@@ -118,6 +161,29 @@ public:
      */
     virtual bool free(void* buffer);
 
+    /*
+     * See MemorySuperblockHeapManager::allocateBlocks
+     */
+    virtual uint allocateBlocks(uint length, void** blocks, uint count);
+
+    /*
+     * See MemorySuperblockHeapManager::freeBlocks
+     */
+    virtual void freeBlocks(void** blocks, uint count);
+
+    /*
+     * See MemorySuperblockHeapManager::getBlockLength
+     */
+    virtual uint getBlockLength(void* buffer);
+
+    /*
+     * See MemorySuperblockHeapManager::tryExpandInPlace
+     *
+     * The run grows into the free run which follows it, or into the
+     * untouched blocks if it's the last run.
+     */
+    virtual bool tryExpandInPlace(void* buffer, uint newLength);
+
 
     /*
      * See MemorySuperblockHeapManager::getMaximumAllocationUnit.
@@ -134,16 +200,37 @@ public:
      */
     virtual uint getMinimumAllocationUnit() const;
 
+    /*
+     * See MemorySuperblockHeapManager::getNumberOfAllocatedBytes.
+     *
+     * The blocks inside the quick list are free.
+     */
+    virtual memorySize getNumberOfAllocatedBytes() const;
+
+    /*
+     * See MemorySuperblockHeapManager::getNumberOfFreeBytes.
+     */
+    virtual memorySize getNumberOfFreeBytes() const;
+
 private:
     // Deny copy-constructor and operator =
-    SmallMemoryHeapManager(const SmallMemoryHeapManager& other);
-    SmallMemoryHeapManager& operator = (const SmallMemoryHeapManager& other);
+    FreeListMemoryHeapManager(const FreeListMemoryHeapManager& other);
+    FreeListMemoryHeapManager& operator = (
+                                    const FreeListMemoryHeapManager& other);
 
-    // The minimum allocation unit is 4 bytes
-    enum { MINIMUM_ALLOCATION_UNIT = 4 };
+    // The minimum allocation unit is the size of the FreeRunBlock
+    enum { MINIMUM_ALLOCATION_UNIT = 4 * sizeof(BlockIndex) };
+    // The end of a free runs list
+    enum { NIL_BLOCK = MAX_BLOCKS };
+    // The number of free runs lists. Each list holds the runs of
+    // 2^i to 2^(i+1)-1 blocks.
+    enum { SIZE_CLASSES = 8 * sizeof(BlockIndex) };
 
-    // Convert index into FreeBlock*
-    #define getFreeBlock(index) ((FreeBlock*)getPtr( \
+    // Convert index into FreeRunBlock*
+    #define getFreeRun(index) ((FreeRunBlock*)getPtr( \
+        getNumeric(m_superBlock) + ((index) * m_allocationUnit)))
+    // Convert index into FreeRunTail*
+    #define getFreeRunTail(index) ((FreeRunTail*)getPtr( \
         getNumeric(m_superBlock) + ((index) * m_allocationUnit)))
     // Convert index into AllocatedDescriptorBlock*
     #define getAllocatedBlock(index) ((AllocatedDescriptorBlock*)getPtr( \
@@ -154,8 +241,22 @@ private:
         ((AllocatedDescriptorBlock*)(base) - 1)
 
 
-    // The magic for the allocated descriptor block
-    enum { ALLOCATED_DESCRIPTOR_MAGIC = 0xBEEF };
+    // The magics of the runs descriptors. The first index of each run.
+    enum {
+        // An allocated run. The previous run is allocated (or there isn't)
+        ALLOCATED_DESCRIPTOR_MAGIC = 0xBEEF,
+        // An allocated run. The previous run is free
+        ALLOCATED_PREVIOUS_FREE_MAGIC = 0xBEE7,
+        // A free run
+        FREE_RUN_MAGIC = 0xF4EE,
+        // The last block of a free run
+        FREE_RUN_TAIL_MAGIC = 0xF7A1,
+        // A descriptor of a released run
+        RELEASED_MAGIC = 0,
+        // Written inside the data of a block which is in the quick list.
+        // Used in order to detect double free.
+        QUICK_BLOCK_COOKIE = 0xC0DE
+    };
 
     //////////////////////////////////////////////////////////////////////////
     // Private structs
@@ -164,47 +265,208 @@ private:
     #pragma pack(1)
     /*
      * An allocated descriptor block
-     * Size: 4 bytes.
+     * Size: 2 indices (4 bytes for 16 bit indices).
      */
     class AllocatedDescriptorBlock {
     public:
         // Default constructor
-        AllocatedDescriptorBlock(uint16 blocksCount);
+        AllocatedDescriptorBlock(BlockIndex blocksCount,
+                                 bool isPreviousFree = false);
 
         // The magic. Used for test overrun by the previous block
-        // See ALLOCATED_DESCRIPTOR_MAGIC
-        uint16 m_magic;
+        // See ALLOCATED_DESCRIPTOR_MAGIC and ALLOCATED_PREVIOUS_FREE_MAGIC
+        BlockIndex m_magic;
         // The number of allocated blocks (Each block is m_allocationUnit bytes),
         // NOTE: including this one!
-        uint16 m_numberOfBlocks;
+        BlockIndex m_numberOfBlocks;
     };
 
     /*
-     * A free block
-     * Packed size: 4 bytes.
+     * The first block of a free run
+     * Packed size: 4 indices (8 bytes for 16 bit indices).
      */
-    class FreeBlock {
+    class FreeRunBlock {
     public:
-        // Default constructor
-        FreeBlock(uint16 nextFreeBlock = 0);
+        // See FREE_RUN_MAGIC
+        BlockIndex m_magic;
+        // The number of blocks of the run
+        BlockIndex m_numberOfBlocks;
+        // The next and previous runs of the same size class
+        BlockIndex m_nextRun;
+        BlockIndex m_previousRun;
+    };
+
+    /*
+     * The last block of a free run, which is longer than a single block.
+     * Packed size: 2 indices.
+     */
+    class FreeRunTail {
+    public:
+        // See FREE_RUN_TAIL_MAGIC
+        BlockIndex m_magic;
+        // The number of blocks of the run. Same as for the FreeRunBlock
+        BlockIndex m_numberOfBlocks;
+    };
 
-        // Pointer to the next free. (Each block is 4 bytes)
-        uint32 m_nextFreeBlock;
+    /*
+     * The data of a single block inside the quick list. Follows the
+     * allocation-descriptor.
+     * Packed size: 2 indices.
+     */
+    class QuickBlockLink {
+    public:
+        // See QUICK_BLOCK_COOKIE
+        BlockIndex m_cookie;
+        // The next block inside the quick list
+        BlockIndex m_nextBlock;
     };
     #pragma pack(pop)
 
+    /*
+     * Return the number of blocks (including the allocated-descriptor) which
+     * are needed for 'length' bytes. Return 0 if the length cannot be
+     * allocated by this manager.
+     */
+    BlockIndex getNumberOfBlocks(uint length) const;
+
+    /*
+     * Find and allocate 'numberOfBlocks' contiguous blocks.
+     * Return NULL if there isn't enough room.
+     *
+     * NOTE: m_lock must be acquired.
+     */
+    void* allocateUnsafe(BlockIndex numberOfBlocks);
+
+    /*
+     * Allocate 'numberOfBlocks' blocks from the untouched blocks.
+     * Return NULL if there isn't enough room.
+     *
+     * NOTE: m_lock must be acquired.
+     */
+    void* allocateUntouched(BlockIndex numberOfBlocks);
+
+    /*
+     * Return the first block of a free run which has at least
+     * 'numberOfBlocks' blocks. Return NIL_BLOCK if there isn't any.
+     *
+     * NOTE: m_lock must be acquired.
+     */
+    BlockIndex findFreeRun(BlockIndex numberOfBlocks) const;
+
+    /*
+     * Return the allocated-descriptor of 'buffer' and fill 'blockID' with it's
+     * block index. Return NULL if 'buffer' is not a valid allocated block.
+     */
+    AllocatedDescriptorBlock* getValidDescriptor(void* buffer,
+                                                 uint32& blockID);
+
+    /*
+     * Release 'count' blocks starting at 'thisBlockID'. Merge them with the
+     * neighbour free runs.
+     *
+     * NOTE: m_lock must be acquired.
+     */
+    void freeUnsafe(uint32 thisBlockID, BlockIndex count);
+
+    /*
+     * Grow the allocated run which starts at 'thisBlockID' into
+     * 'numberOfBlocks' blocks. Return false if the blocks after the run
+     * cannot complete it.
+     *
+     * NOTE: m_lock must be acquired.
+     */
+    bool expandUnsafe(uint32 thisBlockID, BlockIndex numberOfBlocks);
+
+    /*
+     * Return the size class of a run of 'numberOfBlocks' blocks
+     */
+    static uint getSizeClass(BlockIndex numberOfBlocks);
+
+    /*
+     * Format 'count' blocks starting at 'blockID' as a free run, and add it
+     * into the lists. The run must not have free neighbours.
+     *
+     * NOTE: m_lock must be acquired.
+     */
+    void insertFreeRun(BlockIndex blockID, BlockIndex count);
+
+    /*
+     * Remove the free run which starts at 'blockID' from the lists.
+     *
+     * NOTE: m_lock must be acquired.
+     */
+    void removeFreeRun(BlockIndex blockID);
+
+    /*
+     * Update the descriptor of the run which starts at 'blockID' (if it's
+     * allocated) about the state of the previous run.
+     *
+     * NOTE: m_lock must be acquired.
+     */
+    void setPreviousFree(uint32 blockID, bool isPreviousFree);
+
+    /*
+     * Pop a single block out of the quick list. Return NULL if the list is
+     * empty.
+     *
+     * NOTE: Lock-free
+     */
+    void* popQuickBlock();
+
+    /*
+     * Push an allocated single block into the quick list.
+     *
+     * NOTE: Lock-free
+     */
+    void pushQuickBlock(uint32 blockID);
+
+    /*
+     * Move all the blocks of the quick list into the free runs. Return false
+     * if the quick list was empty.
+     *
+     * NOTE: m_lock must be acquired.
+     */
+    bool drainQuickBlocks();
+
+    // Build the quick list head out of a block and a tag
+    #define makeQuickHead(block, tag) \
+        ((uint64)(block) | ((uint64)(tag) << 32))
+    #define getQuickHeadBlock(head) ((BlockIndex)((head) & 0xFFFFFFFF))
+    #define getQuickHeadTag(head) ((uint32)((head) >> 32))
+
     //////////////////////////////////////////////////////////////////////////
     // Members
 
-    // The first free block pointer
-    uint32 m_firstFreeBlock;
+    // The head of the quick list. See makeQuickHead
+    volatile uint64 m_quickHead;
+    // The number of blocks inside the quick list
+    volatile uint32 m_quickBlocks;
+    // The first free run of each size class
+    BlockIndex m_freeRuns[SIZE_CLASSES];
+    // Bit i is set when m_freeRuns[i] isn't empty
+    uint32 m_freeRunsMask;
+    // The first block which was never used. All the blocks from this one
+    // until the end of the superblock are free and not part of any run.
+    uint32 m_untouchedBlock;
     // The total number of blocks
     uint m_totalNumberOfBlocks;
     // The allocation unit
     uint m_allocationUnit;
     // The maximum number of bytes which can be allocated.
-    // Calculated as the 16bit * m_allocationUnit
+    // Calculated as the MAX_BLOCKS * m_allocationUnit
     uint64 m_maxAllocationUnit;
 };
 
+/*
+ * The free-list engine with 4 bytes of allocation overhead, for superblocks
+ * of up to 2^16-1 units.
+ */
+typedef FreeListMemoryHeapManager<uint16> SmallMemoryHeapManager;
+
+/*
+ * The free-list engine with 8 bytes of allocation overhead, for superblocks
+ * of any number of units.
+ */
+typedef FreeListMemoryHeapManager<uint32> WideMemoryHeapManager;
+
 #endif // __TBA_XDK_MEMORY_SMALLMEMORYHEAPMANAGER_H
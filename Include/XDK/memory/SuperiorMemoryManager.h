@@ -41,10 +41,19 @@
  * Author: Elad Raz <e@eladraz.com>
  */
 #include "xStl/types.h"
+#include "xStl/os/os.h"
 #include "xStl/stream/stringerStream.h"
+#include "xdk/memory/MemoryAtomic.h"
 #include "xdk/memory/MemoryLockableObject.h"
+#include "xdk/memory/MemorySizeClass.h"
 #include "xdk/memory/SmallMemoryHeapManager.h"
+#include "xdk/memory/BitmapMemoryHeapManager.h"
+#include "xdk/memory/LargeMemoryHeapManager.h"
+#include "xdk/memory/MemoryOwnerMap.h"
+#include "xdk/memory/MemoryMetadataPool.h"
+#include "xdk/memory/MemoryStatistics.h"
 #include "xdk/memory/SuperiorMemoryManagerInterface.h"
+#include "xdk/memory/MemoryProcessorSlot.h"
 
 /*
  * When this macro is defined the code is compiled with statistics information
@@ -63,28 +72,112 @@
  * When the class is constructed a small memory is given and used to allocate
  * buckets. Bucket is an internal use in order to decrease the number of
  * fragmentation. See SuperiorMemoryManager::Bucket for more information
+ * Once the given memory is used, more descriptors are carved out of the
+ * superblocks (See MemoryMetadataPool), and returned to them by
+ * 'manageMemory()' when they are no longer in use.
+ *
+ * Each bucket is registered inside an address radix table (See MemoryOwnerMap)
+ * so freeing a block, or rejecting a pointer which doesn't belong to the heap,
+ * costs a constant number of memory loads regardless of the number of buckets.
+ *
+ * Small blocks are cached per processor (See ProcessorCache). Each processor
+ * keeps a magazine of free blocks for each small size class, which serves
+ * allocations and frees without any shared lock. Empty magazines are refilled
+ * from the buckets in batches, full magazines are flushed back in batches.
+ * In the kernel the cache is selected by the current processor number, in the
+ * XDK_TEST build a thread-local slot emulates the processor number.
+ *
+ * Larger blocks are freed into their buckets. Each bucket remembers the
+ * processor which allocated from it first (It's owner). A block of several
+ * units which is freed on another processor is pushed into a lock-free list
+ * of the bucket instead (See freeRemote), and the list is returned into the
+ * bucket under a single lock the next time the bucket is allocated from. So
+ * blocks which are passed between processors don't bounce the lock of their
+ * bucket. Single-unit blocks are freed by the engine without a lock anyway.
+ *
+ * The manager counts the requests of each size class. Each time the
+ * 'manageMemory()' function is called with enough new requests, the number of
+ * units of new buckets is tuned according to the requests of the last period.
+ * Hot size classes get larger buckets and rare size classes get smaller ones.
+ *
+ * The 'manageMemory()' function also returns memory after bursts. Buckets
+ * which stay empty for a few periods are detached and their memory is
+ * recycled by their superblock. Superblocks without any bucket are returned
+ * to the operating system after a few more idle periods, as long as the heap
+ * keeps it's initialize size and stays far from the expansion threshold. See
+ * setReclaimIdlePeriods.
+ *
+ * The heap is expanded ahead of the demand. When the free memory of the
+ * superblocks drops below a low watermark, or when a new bucket cannot be
+ * allocated, the allocation posts a lock-free request (See
+ * isExpansionRequested) which the managing unit serves by calling
+ * 'expandMemory()'. The size of the new superblock is predicted from the
+ * recent rate of new buckets.
+ *
+ * Blocks above the last size class are served by the default bucket group.
+ * It's buckets are large regions which are divided into page-granular
+ * extents (See LargeMemoryHeapManager), so freed large blocks are merged and
+ * reused by the next large allocations. Each new region is as large as the
+ * whole group. Blocks above an optional threshold are mapped directly from
+ * the operating system instead, see setDirectMappingThreshold.
+ *
+ * Aligned blocks are carved out of a larger block (See allocateAligned). The
+ * aligned pointer is preceded by a tag which leads back to the real block, so
+ * 'free' and 'getBlockLength' accept both kinds of pointers.
+ *
+ * Growing blocks are expanded inside their bucket when the memory after them
+ * is free (See tryExpandInPlace), so 'reallocate' copies a block only when
+ * it's neighbours are in use.
+ *
+ * When SUPERIOR_MEMORY_MANAGER_STATISTICS is defined, each allocation, free
+ * and failure is counted by it's size class in the slot of the current
+ * processor, next to the processor cache, so the counters never share a lock
+ * or a cache-line between processors. See getStatistics for the aggregated
+ * snapshot.
  *
  * NOTE: No global operator new/delete is called during the construction of this
  *       class. This is done in order to prevent recursive calls.
  *
  * NOTE: This interface allows allocating blocks without any fragmentation
- *       (but with memory loss up to half of size) for allocation units 1 bytes
- *       until 256kb. In order to increase the maximum allocation unit, please
- *       change the table m_bucketSizes and append your statistics best-fit
- *       blocks.
+ *       (but with memory loss up to a quarter of size) for allocation units 1
+ *       bytes until 256kb. The size classes are generated at compile time,
+ *       see MemorySizeClass. In order to increase the maximum allocation
+ *       unit, please change MemorySizeClass::LAST_DOUBLING_SHIFT.
  *
  * NOTE: This class is thread-safe and processor safe
  */
 class SuperiorMemoryManager : public MemorySuperblockHeapManager {
 public:
-    // The default maximum allocation size if 4gb of memory
-    enum { DEFAULT_MAXIMUM_SIZE = 0xFFFFFFFF };
+    // The default maximum size of the heap. 0 means no limit but the address
+    // space, so the heap may exceed 4gb on 64 bit platforms
+    enum { DEFAULT_MAXIMUM_SIZE = 0 };
+    // A single superblock is limited to 4gb. New superblocks are smaller so
+    // large heaps are made of several superblocks
+    enum { MAXIMUM_SUPERBLOCK_SIZE = 1024*1024*1024 };
 
     // The memory which the superior memory manager is allocating for itself
-    // is 16kb which will be used to store about XXX of SmallMemoryHeapManagers
+    // is 16kb which will be used to store the first buckets descriptors
     enum { DEFAULT_SUPRIOR_MEMORY_PRIVATE_MEM = 16*1024 };
+    // When the private memory is full, the descriptors are allocated from
+    // chunks of the superblocks of this size
+    enum { METADATA_CHUNK_SIZE = 16*1024 };
     // The default allocation is 4mb memory
     enum { INITIALIZE_SIZE_MINIMUM_SIZE = 4*1024*1024 };
+    // The default number of idle 'manageMemory()' periods before memory is
+    // returned. See setReclaimIdlePeriods
+    enum { DEFAULT_RECLAIM_IDLE_PERIODS = 4 };
+    // The minimum and the maximum size of a new region of the default bucket
+    // group. Larger blocks get a region of their own.
+    enum { LARGE_REGION_MINIMUM_SIZE = 1024*1024 };
+    enum { LARGE_REGION_MAXIMUM_SIZE = 32*1024*1024 };
+    // The default low watermark. See setLowWatermark
+    enum { DEFAULT_LOW_WATERMARK = 1024*1024 };
+    // A new superblock should serve the predicted demand of this period
+    enum { EXPANSION_HORIZON_MILLISECONDS = 1000 };
+    // The minimum size of a new superblock
+    enum { EXPANSION_MINIMUM_SIZE = 1024*1024 };
+    // The largest alignment of allocateAligned
+    enum { MAXIMUM_ALIGNMENT = 64*1024 };
 
     /*
      * Constructor. Allocate 'initializeSize' of memory from the os interface
@@ -94,9 +187,13 @@ public:
      * initializeSize - The initialize allocated size
      * privateMemPool - The memory pool which is in used by the
      *                  SuperiorMemoryManager. Used for new buckets allocation
+     *                  until it's full. Might be NULL.
      * privateMemPoolLength - The length in bytes of 'privateMemPool'
      * maximumSize    - The maximum size in bytes of which the manager can be
-     *                  expand
+     *                  expand. See DEFAULT_MAXIMUM_SIZE
+     * isAdaptive     - Set to false in order to keep the default number of
+     *                  units of new buckets (See m_bucketSizes) instead of
+     *                  tuning it from the requests histogram.
      *
      * Throw exception if 'initializeSize' is less than the table buckets
      * initial requested memory. See INITIALIZE_SIZE_MINIMUM_SIZE
@@ -108,7 +205,8 @@ public:
                           uint initializeSize,
                           void* privateMemPool,
                           uint privateMemPoolLength,
-                          uint maximumSize = DEFAULT_MAXIMUM_SIZE);
+                          memorySize maximumSize = DEFAULT_MAXIMUM_SIZE,
+                          bool isAdaptive = true);
 
     /*
      * Free all allocated operating-system memory.
@@ -130,6 +228,52 @@ public:
      */
     virtual bool free(void* buffer);
 
+    /*
+     * Allocate 'length' bytes which start at a multiple of 'alignment'. The
+     * block is freed by 'free(buffer)' like any other block.
+     *
+     * alignment - A power of 2, up to MAXIMUM_ALIGNMENT.
+     *
+     * Return NULL if there isn't enough memory or if 'alignment' is invalid.
+     *
+     * NOTE: The block is carved out of a block of 'length + alignment + 7'
+     *       bytes, which is the length the statistics see.
+     */
+    void* allocateAligned(uint length, uint alignment);
+
+    /*
+     * Free a block which was allocated by 'allocate(length)'. The length
+     * tells the size class of the block, so a small block is returned into
+     * the processor cache at once. The block is still validated by it's
+     * bucket, blocks which cannot be cached are freed by 'free(buffer)'.
+     *
+     * Return false if 'buffer' is not a valid pointer.
+     *
+     * NOTE: Blocks of 'allocateAligned' must be freed by 'free(buffer)'.
+     */
+    bool free(void* buffer, uint length);
+
+
+    /*
+     * See MemorySuperblockHeapManager::getBlockLength
+     */
+    virtual uint getBlockLength(void* buffer);
+
+    /*
+     * See MemorySuperblockHeapManager::tryExpandInPlace
+     *
+     * The block grows inside it's bucket. Only buckets of the free-list
+     * engine (See SmallMemoryHeapManager) grow blocks beyond their length.
+     */
+    virtual bool tryExpandInPlace(void* buffer, uint newLength);
+
+    /*
+     * See MemorySuperblockHeapManager::reallocate
+     *
+     * A moved aligned block (See allocateAligned) keeps the alignment of
+     * 'buffer'.
+     */
+    virtual void* reallocate(void* buffer, uint newLength);
 
     /*
      * See MemorySuperblockHeapManager::getMaximumAllocationUnit
@@ -144,12 +288,12 @@ public:
     /*
      * See MemorySuperblockHeapManager::getNumberOfAllocatedBytes
      */
-    virtual uint getNumberOfAllocatedBytes() const;
+    virtual memorySize getNumberOfAllocatedBytes() const;
 
     /*
      * See MemorySuperblockHeapManager::getNumberOfFreeBytes()
      */
-    virtual uint getNumberOfFreeBytes() const;
+    virtual memorySize getNumberOfFreeBytes() const;
 
 
     /*
@@ -159,9 +303,86 @@ public:
      * NOTE: It's gurentee that no mutable are kept lock by the
      *       SuperiorMemoryManager when the 'osmem' API interfaces is being
      *       called.
+     * NOTE: Empty buckets are detached only by this function. Other functions
+     *       which scan the buckets without locking (See 'traceMemory') must
+     *       be called from the same thread.
      */
     void manageMemory();
 
+    /*
+     * Return true if an allocation asked for more memory since the last call
+     * to 'expandMemory()'. Doesn't lock anything, so it can be polled by the
+     * managing unit at any rate.
+     */
+    bool isExpansionRequested() const;
+
+    /*
+     * Allocate a new superblock if the superblocks are half full, if their
+     * free memory is below the low watermark or if a new bucket couldn't be
+     * allocated since the last expansion. The new superblock covers the
+     * demand of the next EXPANSION_HORIZON_MILLISECONDS, as predicted from
+     * the rate of new buckets, above the low watermark.
+     *
+     * Called by 'manageMemory()' as well.
+     *
+     * NOTE: The same as 'manageMemory()', no lock is held while the 'osmem'
+     *       interface is called.
+     */
+    void expandMemory();
+
+    /*
+     * Set the number of free bytes inside the superblocks below which an
+     * expansion is requested. Set to 0 in order to request expansions only
+     * when a new bucket cannot be allocated.
+     */
+    void setLowWatermark(uint bytes);
+
+    /*
+     * Set the number of consecutive 'manageMemory()' periods which an empty
+     * bucket must stay empty before it's detached. An unused superblock is
+     * returned to the operating system after the same number of periods.
+     * Set to 0 in order to keep all memory until the destructor.
+     */
+    void setReclaimIdlePeriods(uint periods);
+
+    /*
+     * Blocks of the default bucket group (Above the last size class) of at
+     * least 'length' bytes will be mapped directly from the operating system,
+     * and returned to it as soon as they are freed. Such blocks never
+     * fragment the regions of the default bucket group.
+     * Set to 0 in order to serve all blocks from the regions (The default).
+     *
+     * NOTE: The 'osmem' interface is called without any lock, during the
+     *       'allocate' and 'free' of these blocks. When another thread is
+     *       expanding the heap at the same time, the block is allocated from
+     *       the regions.
+     */
+    void setDirectMappingThreshold(uint length);
+
+    /*
+     * Add 'count' requests of 'length' bytes into the requests histogram.
+     * Used in order to feed a recorded size distribution, which will be used
+     * by the next call to 'manageMemory()'.
+     */
+    void recordSizeHistogram(uint length, uint count);
+
+    /*
+     * Return the number of units which a new bucket for allocations of
+     * 'length' bytes will contain. Return 0 for the default bucket.
+     */
+    uint getBucketElements(uint length) const;
+
+    #ifdef SUPERIOR_MEMORY_MANAGER_STATISTICS
+    /*
+     * Fill 'statistics' with a snapshot of the counters of all size classes.
+     * The counters of each processor are read while no allocation of that
+     * processor updates them. The bucket chains and the peaks are read under
+     * the manager lock. The function doesn't stop the allocations of other
+     * processors, so the snapshot is consistent per processor.
+     */
+    void getStatistics(MemoryStatistics& statistics);
+    #endif
+
     #ifdef XDK_TRACE_MEMORY
     /*
      * Output general information in a human readable way to the user
@@ -186,40 +407,74 @@ private:
          * buffer   - The mini-superblock buffer.
          * length   - The length of the mini-superblock
          * unitSize - The max-allocation unit
+         * sizeClass - The index of the bucket group inside m_bucketSizes
+         * engine   - The superblock manager implementation to use
          * nextHandler - The previous block handler
          */
         Bucket(void* buffer,
                uint length,
                uint unitSize,
+               uint sizeClass,
+               uint engine,
                Bucket* nextHandler = NULL);
 
+        /*
+         * Destructor. Destruct the memory manager unit
+         */
+        ~Bucket();
+
         /*
          * Overloading operator new. The bucket memory must be allocated from
          * the private stash.
          *
-         * See SuperiorMemoryManager::m_privatePool
+         * See SuperiorMemoryManager::m_metadataPool
          */
         void* operator new(uint cbSize,
-                           SmallMemoryHeapManager& privateStash);
+                           MemoryMetadataPool& privateStash);
 
         /*
          * Overloading operator delete. In order to free the resource
          * allocated by the private stash
          */
         void operator delete (void* ptr,
-                              SmallMemoryHeapManager& privateStash);
+                              MemoryMetadataPool& privateStash);
 
         /*
          * Return the memory manager unit
          */
-        SmallMemoryHeapManager& getManager();
+        MemorySuperblockHeapManager& getManager();
+
+        /*
+         * Return the mini-superblock buffer and it's length
+         */
+        void* getBuffer() const;
+        uint getLength() const;
+
+        /*
+         * Return true if no block is allocated from the bucket
+         */
+        bool isEmpty();
 
         /*
          * Return the next bucket in the list
          */
         Bucket* getNextBucket();
 
+        /*
+         * Return the index of the bucket group (See m_bucketSizes)
+         */
+        uint getSizeClass() const;
+
+        /*
+         * Return true if the bucket is in the full set of it's bucket group.
+         * See SuperiorMemoryManager::m_partialBuckets
+         */
+        bool isFull() const;
+
     private:
+        // The partial set is managed by the SuperiorMemoryManager
+        friend class SuperiorMemoryManager;
+
         // Deny normal operator new and delete
         void* operator new (uint cbSize);
         void operator delete (void* ptr);
@@ -227,10 +482,56 @@ private:
         Bucket(const Bucket& other);
         Bucket& operator = (const Bucket& other);
 
-        // The manager for the current block
-        SmallMemoryHeapManager m_manager;
+        // The storage of the manager for the current block. The engine is
+        // selected by the bucket group. See BucketEngine
+        union ManagerStorage {
+            uint8 m_freeList[sizeof(SmallMemoryHeapManager)];
+            uint8 m_wideFreeList[sizeof(WideMemoryHeapManager)];
+            uint8 m_bitmap[sizeof(BitmapMemoryHeapManager)];
+            uint8 m_large[sizeof(LargeMemoryHeapManager)];
+            // Force the alignment
+            uint64 m_alignment;
+            void* m_pointerAlignment;
+        };
+        ManagerStorage m_managerStorage;
+        // The manager for the current block, constructed inside
+        // m_managerStorage
+        MemorySuperblockHeapManager* m_manager;
         // The next handler
         Bucket* m_nextHandler;
+        // The bucket group
+        uint m_sizeClass;
+        // Set to 1 when the bucket is in the full set, 0 when it's in the
+        // partial set. Changed under SuperiorMemoryManager::m_lock. A bucket
+        // which is found partial under the partial lock is linked
+        volatile uint32 m_isFull;
+        // The links of the partial set. Protected by
+        // SuperiorMemoryManager::m_partialLocks
+        Bucket* m_nextPartial;
+        Bucket* m_previousPartial;
+        // The mini-superblock
+        void* m_buffer;
+        uint m_length;
+        // The number of threads which are allocating from, or freeing into,
+        // the bucket. Allocating users are only added under
+        // SuperiorMemoryManager::m_partialLocks. A bucket with users is never
+        // detached. See acquireNextPartialBucket and free
+        volatile uint32 m_users;
+        // The number of 'manageMemory()' periods which the bucket was empty
+        uint m_idlePeriods;
+        // Set to true when the mini-superblock was mapped directly from the
+        // operating system for a single block. Such buckets are always in
+        // the full set. See setDirectMappingThreshold
+        bool m_isDirect;
+        // The processor slot which allocated from the bucket first, plus
+        // one. Zero until the first allocation. Only a hint, see freeRemote
+        volatile uint32 m_owner;
+        // The blocks which were freed by other processors, linked by
+        // RemoteFreeLink. See freeRemote and reclaimRemoteFrees
+        void* volatile m_remoteFrees;
+        // The length of the blocks inside m_remoteFrees. They are counted
+        // as free bytes. See getBucketSize
+        volatile uint32 m_remoteBytes;
     };
 
     /*
@@ -276,23 +577,56 @@ private:
         void* minimumAllocation(uint allocationUnit,
                                 uint& realAllocatedBlockSize);
 
+        /*
+         * Return a mini-superblock into this superblock. The memory will be
+         * used again by the next allocations.
+         *
+         * NOTE: This function is not thread-safe!
+         */
+        void release(void* buffer, uint length);
+
+        /*
+         * Return true if 'buffer' is inside this superblock
+         */
+        bool isInside(void* buffer) const;
+
+        /*
+         * Return the length of the allocated OS buffer
+         */
+        uint getLength() const;
+
+        /*
+         * Count another 'manageMemory()' period. Return the number of
+         * consecutive periods which the superblock had no mini-superblock.
+         */
+        uint countIdlePeriod();
+
+        /*
+         * Change the next repository. Used in order to remove a repository
+         * from the list.
+         */
+        void setNextRepository(SuperblockRepository* nextRepository);
+
         /*
          * Overloading operator new. The repository memory must be allocated
          * from the private stash.
          *
-         * See SuperiorMemoryManager::m_privatePool
+         * See SuperiorMemoryManager::m_metadataPool
          */
         void* operator new(uint cbSize,
-            SmallMemoryHeapManager& privateStash);
+            MemoryMetadataPool& privateStash);
 
         /*
          * Overloading operator delete. In order to free the resource
          * allocated by the private stash
          */
         void operator delete (void* ptr,
-            SmallMemoryHeapManager& privateStash);
+            MemoryMetadataPool& privateStash);
 
     private:
+        // The metadata chunks are taken by the SuperiorMemoryManager
+        friend class SuperiorMemoryManager;
+
         // Deny normal operator new and delete
         void* operator new (uint cbSize);
         void operator delete (void* ptr);
@@ -310,22 +644,184 @@ private:
          */
         void* privateMalloc(uint length);
 
+        /*
+         * Try to allocate a mini-superblock from the released memory. See
+         * 'allocate' for the arguments.
+         */
+        void* allocateReleased(uint requestedLength,
+                               uint minimumLength,
+                               uint allocationUnit,
+                               uint& realAllocatedBlockSize);
+
+        /*
+         * The descriptor of released memory, stored at the beginning of the
+         * released memory itself. The released ranges are sorted by their
+         * address and never touch each other.
+         */
+        struct ReleasedRange {
+            // The length of the range
+            uint m_length;
+            // The next range
+            ReleasedRange* m_next;
+        };
+
         // The allocated OS buffer
         void* m_buffer;
         // The length of the allocated OS buffer
         uint m_bufferLength;
         // The current non-allocated buffer
         void* m_position;
+        // The released memory below m_position
+        ReleasedRange* m_releasedRanges;
+        // The number of bytes of the mini-superblocks inside the superblock
+        uint m_usedBytes;
+        // The number of 'manageMemory()' periods without mini-superblocks
+        uint m_idlePeriods;
 
         // Pointer to the next repository
         SuperblockRepository* m_nextRepository;
     };
 
     /*
-     * Return the first handler for a bucket
+     * Return the first handler for a bucket. The handler is read without
+     * the lock, so it might be detached meanwhile. It can only be compared
+     * with other handlers (The bucket group has grown when it's changed) or
+     * be dereferenced under m_lock.
      */
     Bucket* safeGetFirstBucket(uint bucket) const;
 
+    /*
+     * Return the bucket which follows 'current' in the partial set of the
+     * bucket group 'bucket'. Return the first partial bucket if 'current' is
+     * NULL or if it was moved into the full set meanwhile. Return NULL at
+     * the end of the set.
+     *
+     * The returned bucket cannot be detached until it's released, either by
+     * the next call or by 'releaseBucket'. 'current' is released.
+     *
+     * Only the partial lock of the bucket group is acquired, so the
+     * allocations of different bucket groups don't contend on m_lock.
+     */
+    Bucket* acquireNextPartialBucket(uint bucket, Bucket* current);
+
+    /*
+     * Release a bucket which was returned by 'acquireNextPartialBucket'
+     */
+    void releaseBucket(Bucket* bucket);
+
+    /*
+     * Return true if 'bucket' failed to allocate 'length' bytes because all
+     * it's units are used. Requests of a few units might fail because of
+     * fragmentation (See the wrap-around of 'allocate'), and so might the
+     * requests of the default bucket group, as long as it has a free extent.
+     */
+    bool isBucketExhausted(Bucket* bucket, uint length) const;
+
+    /*
+     * Move an exhausted bucket into the full set. A block which was freed
+     * meanwhile is allocated and returned instead, and the bucket stays in
+     * the partial set. Otherwise return NULL.
+     *
+     * length - The length of the failed allocation
+     */
+    void* markBucketFull(Bucket* bucket, uint length);
+
+    /*
+     * Called after a block of a full 'bucket' was freed. Move the bucket back
+     * into the partial set of it's bucket group.
+     *
+     * NOTE: The full mark must be read before the block is freed. Once the
+     *       bucket is empty, it might be detached.
+     */
+    void markBucketPartial(Bucket* bucket);
+
+    /*
+     * Make sure the next descriptor can be allocated from m_metadataPool. When
+     * the pool is full, a new chunk is carved out of the superblocks.
+     * Return false if the superblocks are full. The caller must hold m_lock
+     */
+    bool reserveMetadata();
+
+    /*
+     * Return the metadata chunks which have no descriptor into their
+     * superblocks. The caller must hold m_lock
+     */
+    void releaseMetadataChunks();
+
+    /*
+     * Create the repository of a new superblock. The repository is linked
+     * before m_superBlockRepository, which should be replaced by the caller.
+     * When no descriptor can be allocated, the descriptor is
+     * stored inside a metadata chunk at the beginning of the superblock
+     * itself. The caller must hold m_lock
+     */
+    SuperblockRepository* newSuperblockRepository(void* buffer, uint length);
+
+    /*
+     * Return a mini-superblock into the superblock which contains it. The
+     * caller must hold m_lock
+     */
+    void releaseSuperblockMemory(void* buffer, uint length);
+
+    /*
+     * Detach the buckets which were empty for m_reclaimIdlePeriods periods.
+     * The caller must hold m_lock
+     */
+    void reclaimBuckets();
+
+    /*
+     * Remove 'bucket' from all lists, return it's memory to the superblock
+     * and destroy it. The bucket must be unlinked from the partial set by
+     * the caller. The caller must hold m_lock
+     *
+     * previous - The bucket before 'bucket' in the bucket chain, or NULL
+     */
+    void detachBucket(Bucket* bucket, Bucket* previous);
+
+    /*
+     * Remove a superblock which was idle for m_reclaimIdlePeriods periods
+     * from the repositories list and return it. The superblock memory should
+     * be returned to the operating system by the caller.
+     * Return NULL if no superblock should be returned. The caller must hold
+     * m_lock
+     */
+    SuperblockRepository* detachIdleSuperblock();
+
+    /*
+     * Add/Remove 'bucket' from the partial set. The caller must hold m_lock
+     * and the partial lock of the bucket group. See m_partialLocks
+     */
+    void linkPartialBucket(Bucket* bucket);
+    void unlinkPartialBucket(Bucket* bucket);
+
+    /*
+     * Map a block of 'length' bytes directly from the operating system.
+     * Return NULL if the block should be allocated from the regions.
+     */
+    void* allocateDirect(uint length);
+
+    /*
+     * Return the memory of an empty direct bucket to the operating system.
+     */
+    void freeDirect(Bucket* bucket);
+
+    /*
+     * Called after a new bucket was allocated (Or failed to be allocated)
+     * from the superblocks. Count the bucket into the allocation rate and
+     * post an expansion request if needed. The caller must hold m_lock
+     *
+     * minimumLength - The minimum length of the requested bucket
+     */
+    void countSuperblockAllocation(void* buffer,
+                                   uint length,
+                                   uint minimumLength);
+
+    /*
+     * Return the length of the next superblock. Return 0 if the heap reached
+     * it's maximum size. The caller must hold m_lock
+     */
+    uint getExpansionSize();
+
     /*
      * Return the bucket index for a certain length
      */
@@ -345,8 +841,8 @@ private:
         // Return both free and allocated count
         SIZE_ALLOCATE_AND_FREE = SIZE_ALLOCATE | SIZE_FREE,
     };
-    uint getBucketSize(uint bucket,
-                       uint type) const;
+    memorySize getBucketSize(uint bucket,
+                             uint type) const;
 
     /*
      * Return the prefered size of a new memory bucket
@@ -386,49 +882,376 @@ private:
     // The operating system memory allocation interface
     SuperiorOSMemePtr m_osmem;
 
-    // The private pool is used to allocate '' units so
-    enum { PRIVATE_POOL_SIZE = sizeof(Bucket) +
-                               SmallMemoryHeapManager::ALLOCATED_UNIT_OVERHEAD };
+    // Maps each bucket memory range into it's Bucket object.
+    // Modified under the parent m_lock lockable, read without locks.
+    MemoryOwnerMap m_ownerMap;
+
+    // The buckets and the repositories descriptors share the same pool
+    enum { METADATA_OBJECT_SIZE =
+                (sizeof(Bucket) > sizeof(SuperblockRepository)) ?
+                    sizeof(Bucket) : sizeof(SuperblockRepository) };
 
-    // The private pool memory
-    SmallMemoryHeapManager m_privatePool;
+    // The descriptors memory. Starts with the private memory of the
+    // constructor and grows by chunks of the superblocks. Protected by the
+    // parent m_lock lockable
+    MemoryMetadataPool m_metadataPool;
 
     // The maximum allocation size is allowed
-    uint m_osMaximumSize;
+    memorySize m_osMaximumSize;
     // The os allocate size so far
-    uint m_osMemorySize;
+    memorySize m_osMemorySize;
     // The internal superblocks size allocated so far
-    uint m_allocatedOsMemorySize;
+    memorySize m_allocatedOsMemorySize;
+    // The os memory is never returned below the initialize size
+    memorySize m_osMinimumSize;
+    // See setReclaimIdlePeriods
+    uint m_reclaimIdlePeriods;
+    // See setLowWatermark
+    uint m_lowWatermark;
+    // Set to 1 when an expansion is requested. See isExpansionRequested
+    volatile uint32 m_isExpansionRequested;
+    // The minimum length of the largest bucket which couldn't be allocated
+    // since the last expansion
+    uint m_failedBucketLength;
+    // The bytes of the new buckets since the last rate sample, and the time
+    // of the first one.
+    uint m_rateBytes;
+    cOSDef::systemTime m_rateStartTime;
+    // The rate of new buckets in bytes per second. See 'expandMemory()'
+    uint m_allocationRate;
+    // See setDirectMappingThreshold
+    uint m_directMappingThreshold;
+    // The os memory which is mapped for direct buckets
+    memorySize m_directMemorySize;
 
+    // The size classes and the default bucket. See MemorySizeClass
     // The maximum allocation unit is 4gb.
-    enum { MAX_BUCKETS = 18 };
+    enum { MAX_BUCKETS = MemorySizeClass::NUMBER_OF_CLASSES + 1 };
     // For all other allocation types
     enum { BUCKET_DEFAULT_CACHE_SIZE = 0xFFFFFFFF};
 
     // The first handler chain. Protected by the parent m_lock lockable
     Bucket* m_firstBucketHandler[MAX_BUCKETS];
+    // The buckets of each group which have free units (The partial set).
+    // The other buckets of the group are full (The full set), and are never
+    // scanned by the allocation. Buckets move between the sets during the
+    // allocate/free transitions. Protected by m_partialLocks
+    Bucket* m_partialBuckets[MAX_BUCKETS];
+    // The lock of the partial set of each bucket group. The set is changed
+    // under both m_lock and the partial lock, and it's scanned only under
+    // the partial lock. Always acquired after m_lock.
+    MemoryLockableObject m_partialLocks[MAX_BUCKETS];
 
 
+    // The superblock manager of the bucket groups
+    enum BucketEngine {
+        // SmallMemoryHeapManager. The free blocks are kept in a list.
+        // Buckets of more than 2^16-1 units use WideMemoryHeapManager
+        ENGINE_FREE_LIST,
+        // BitmapMemoryHeapManager. The free blocks are kept in a bitmap
+        ENGINE_BITMAP,
+        // LargeMemoryHeapManager. Page-granular extents of any length
+        ENGINE_LARGE
+    };
+
     // The bucket sizes
     struct BucketSizeAndStatistics {
         // The allocation-unit of the bucket
         uint m_bucketUnitSize;
         // The default number of element for the bucket
         uint m_defaultElementsForBucket;
+        // The superblock manager of the bucket. See BucketEngine
+        uint m_engine;
     };
     // The different sizes
     static const BucketSizeAndStatistics m_bucketSizes[MAX_BUCKETS];
 
+    //////////////////////////////////////////////////////////////////////////
+    // Adaptive size classes
+
+    // The minimum number of new requests between two tunings
+    enum { TUNING_MINIMUM_REQUESTS = 4096 };
+    // The largest first bucket which the tuning can select
+    enum { TUNING_MAXIMUM_BUCKET_SIZE = 2*1024*1024 };
+    // New buckets get 1/2^TUNING_HEADROOM_SHIFT more units than requested
+    enum { TUNING_HEADROOM_SHIFT = 3 };
+
+    /*
+     * Update m_bucketElements from the requests of the last period.
+     * Called by 'manageMemory()' while m_lock is held.
+     */
+    void tuneSizeClasses();
+
+    // Set to false in order to keep the default elements of m_bucketSizes
+    bool m_isAdaptive;
+    // The number of requests for each bucket group. The small bucket groups
+    // are counted in the processor caches as well. See ProcessorCache
+    volatile uint32 m_requestsHistogram[MAX_BUCKETS];
+    // The number of requests which were already used by the tuning
+    uint32 m_tunedRequests[MAX_BUCKETS];
+    // The number of units of new buckets. Protected by the parent m_lock
+    uint m_bucketElements[MAX_BUCKETS];
+
     // The superblocks repository
     // Protected by the parent m_lock lockable
     SuperblockRepository* m_superBlockRepository;
 
+    //////////////////////////////////////////////////////////////////////////
+    // Processor caches
+
+    // Only buckets 0 to 24 (Units up to 1kb) are cached. See m_bucketSizes
+    enum { MAGAZINE_BUCKETS = 25 };
+    // The number of free blocks each magazine can hold
+    enum { MAGAZINE_SIZE = 32 };
+    // The number of blocks which are moved between a magazine and the buckets
+    enum { MAGAZINE_BATCH = MAGAZINE_SIZE / 2 };
+    // Written into the first bytes of a cached block. Used in order to
+    // detect double-free of cached blocks.
+    enum { MAGAZINE_COOKIE = 0xCACEB10C };
+
+    // See MemoryProcessorSlot
+    enum { PROCESSOR_CACHES = MemoryProcessorSlot::SLOTS };
+
+    #ifdef SUPERIOR_MEMORY_MANAGER_STATISTICS
+    /*
+     * The counters of a single size class inside a processor slot. Blocks
+     * are freed on other processors, so only the sum of all slots is
+     * meaningful. See getStatistics
+     */
+    struct SizeClassCounters {
+        uint32 m_allocations;
+        uint32 m_frees;
+        uint32 m_failures;
+        // The bytes which were requested by the allocations
+        uint64 m_requestedBytes;
+        // The length of the allocated blocks
+        uint64 m_allocatedBytes;
+        // The length of the freed blocks
+        uint64 m_freedBytes;
+    };
+
+    /*
+     * The counters of all size classes of a single processor. Only the owner
+     * of the slot writes into it.
+     */
+    struct StatisticsSlot {
+        // Increased before and after the counters are updated. Readers retry
+        // while it's odd or changed. See readStatistics
+        volatile uint32 m_sequence;
+        // The counters of each bucket group
+        SizeClassCounters m_counters[MAX_BUCKETS];
+    };
+    #endif
+
+    /*
+     * A stack of free blocks of a single bucket group
+     */
+    struct Magazine {
+        // The number of blocks inside the magazine
+        uint m_count;
+        // The free blocks
+        void* m_blocks[MAGAZINE_SIZE];
+    };
+
+    /*
+     * All the magazines of a single processor
+     */
+    struct ProcessorCache {
+        #ifdef XDK_TEST
+        // Set to 1 while a thread uses the slot
+        volatile uint32 m_busy;
+        #endif
+        // A magazine for each cached bucket group
+        Magazine m_magazines[MAGAZINE_BUCKETS];
+        // The number of requests for each cached bucket group
+        uint32 m_requests[MAGAZINE_BUCKETS];
+        #ifdef SUPERIOR_MEMORY_MANAGER_STATISTICS
+        // The counters of the processor
+        StatisticsSlot m_statistics;
+        #endif
+    };
+
+    // Pins the current processor and returns it's cache. See
+    // MemoryProcessorCacheGuard
+    typedef MemoryProcessorCacheGuard<ProcessorCache> ProcessorCacheGuard;
+
+    /*
+     * Try to allocate a block of the bucket group 'bucket' from the current
+     * processor cache. Return NULL if the cache cannot serve the request.
+     * The request is counted in the requests histogram in any case.
+     *
+     * length - The requested length. Used by the statistics
+     */
+    void* allocateFromProcessorCache(uint bucket, uint length);
+
+    // The results of freeToProcessorCache
+    enum CacheFreeResult {
+        // The block was cached
+        CACHE_FREE_CACHED,
+        // The block should be freed by it's bucket
+        CACHE_FREE_NOT_CACHEABLE,
+        // The block is already inside a processor cache (Double free)
+        CACHE_FREE_REJECTED
+    };
+
+    /*
+     * Try to return a block into the current processor cache. The block is
+     * validated by the bucket.
+     */
+    CacheFreeResult freeToProcessorCache(Bucket* bucket, void* buffer);
+
+    /*
+     * Return true if 'buffer' is inside a magazine of the bucket group
+     * 'sizeClass', of any processor. The magazines of the other processors
+     * are read without their guard, so a block which is moved meanwhile
+     * might be missed.
+     */
+    bool isBlockCached(uint sizeClass, void* buffer) const;
+
+    /*
+     * Return the processor cache slot of the current processor, plus one.
+     * In the XDK_TEST build the slot of the thread is assigned by the first
+     * call.
+     */
+    static uint32 getProcessorSlot();
+
+    //////////////////////////////////////////////////////////////////////////
+    // Remote frees
+
+    // The number of remote blocks which are returned into a bucket under a
+    // single lock. See reclaimRemoteFrees
+    enum { REMOTE_FREE_BATCH = 32 };
+    // Written into a block inside a remote list. Used in order to detect
+    // double-free of remote blocks.
+    enum { REMOTE_FREE_COOKIE = 0xF2EEB10C };
+
+    /*
+     * The header of a block inside the remote list of it's bucket. Stored at
+     * the beginning of the block data.
+     */
+    struct RemoteFreeLink {
+        // The next block of the list
+        void* m_next;
+        // See REMOTE_FREE_COOKIE
+        uint32 m_cookie;
+        // The length of the block, including it's allocation-descriptor
+        uint32 m_length;
+    };
+
+    /*
+     * Try to push 'buffer' into the remote list of 'bucket'. Only blocks of
+     * several units of free-list buckets which are owned by another
+     * processor are pushed.
+     * The free-list engine validates blocks without a lock.
+     *
+     * Return true if the block was pushed.
+     * Return false if the block should be freed by it's bucket.
+     */
+    bool freeRemote(Bucket* bucket, void* buffer);
+
+    /*
+     * Take the remote list of 'bucket' and free it's blocks into the bucket,
+     * REMOTE_FREE_BATCH blocks under each lock. The caller must keep the
+     * bucket alive (Hold m_lock, a user of the bucket or a block of it).
+     */
+    void reclaimRemoteFrees(Bucket* bucket);
+
+    /*
+     * The tag which precedes an aligned block which doesn't start at the
+     * beginning of it's real block. The magic takes the place of the
+     * allocation-descriptor of the engines and never matches any of them.
+     * See allocateAligned
+     */
+    struct AlignedBlockTag {
+        // The number of bytes from the real block to the aligned block
+        uint32 m_offset;
+        // See ALIGNED_BLOCK_MAGIC
+        uint32 m_magic;
+    };
+    enum { ALIGNED_BLOCK_MAGIC = 0xA11C0DED };
+
+    /*
+     * Return the real block of 'buffer', which is inside 'bucket'. Return
+     * 'buffer' if it isn't an aligned block.
+     */
+    void* getRealBlock(Bucket* bucket, void* buffer) const;
+
+    /*
+     * Fill an empty magazine with MAGAZINE_BATCH blocks from the buckets of
+     * the bucket group 'bucket'.
+     */
+    void refillMagazine(uint bucket, Magazine& magazine);
+
+    /*
+     * Free the first 'count' blocks of a magazine back into their buckets.
+     */
+    void flushMagazine(Magazine& magazine, uint count);
+
+    // The processor caches
+    ProcessorCache m_processorCaches[PROCESSOR_CACHES];
+
     // Set to true when the 'manage' function is in a middle of processing.
     volatile bool m_manageInProgress;
 
     // The statistics API
     #ifdef SUPERIOR_MEMORY_MANAGER_STATISTICS
-    // Count the number of fragmentation
+    // The events which are counted. See countStatistics
+    enum StatisticsEvent {
+        // A block was allocated. 'length' is the requested length and
+        // 'blockLength' is the length of the block
+        EVENT_ALLOCATE,
+        // A block of 'blockLength' bytes was freed
+        EVENT_FREE,
+        // A request of 'length' bytes couldn't be served
+        EVENT_FAILURE
+    };
+
+    /*
+     * Count an event of the bucket group 'bucket' in the slot of the current
+     * processor.
+     *
+     * cache - The processor cache, if it's already acquired by the caller.
+     *         Otherwise NULL.
+     */
+    void countStatistics(ProcessorCache* cache,
+                         uint bucket,
+                         StatisticsEvent event,
+                         uint length,
+                         uint blockLength);
+
+    /*
+     * Count an event into 'slot'. The caller must own the slot.
+     */
+    static void updateStatistics(StatisticsSlot& slot,
+                                 uint bucket,
+                                 StatisticsEvent event,
+                                 uint length,
+                                 uint blockLength);
+
+    /*
+     * Add the counters of the bucket group 'bucket' from all the slots into
+     * 'total'. Each slot is read while it's owner doesn't update it.
+     */
+    void readStatistics(uint bucket, SizeClassCounters& total) const;
+
+    /*
+     * Update the sampled peaks from the current counters. The caller must
+     * hold m_lock
+     */
+    void samplePeaks();
+
+    #ifdef XDK_TEST
+    // Threads which share their slot with another thread (See
+    // ProcessorCacheGuard) count into this slot. Protected by
+    // m_sharedStatisticsBusy
+    StatisticsSlot m_sharedStatistics;
+    volatile uint32 m_sharedStatisticsBusy;
+    #endif
+
+    // The highest number of bytes in use which was sampled for each bucket
+    // group, and for the whole heap. Protected by the parent m_lock lockable
+    uint64 m_peakBytesInUse[MAX_BUCKETS];
+    uint64 m_peakTotalBytesInUse;
     #endif
 };
 
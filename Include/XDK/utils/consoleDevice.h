@@ -126,10 +126,42 @@ public:
                         uint8*       outputBuffer,
                         uint         outputBufferLength);
 
+    // See cConsoleDeviceControls::queryMemoryStatistics()
+    uint handleMemoryStatisticsIoctl(uint    ioctlCode,
+                                const uint8* inputBuffer,
+                                uint         inputBufferLength,
+                                uint8*       outputBuffer,
+                                uint         outputBufferLength);
+
+    // See cConsoleDeviceControls::queryMemoryProfile()
+    uint handleMemoryProfileIoctl(uint    ioctlCode,
+                             const uint8* inputBuffer,
+                             uint         inputBufferLength,
+                             uint8*       outputBuffer,
+                             uint         outputBufferLength);
+
+    // See cConsoleDeviceControls::controlMemoryTrace()
+    uint handleMemoryTraceControlIoctl(uint    ioctlCode,
+                                  const uint8* inputBuffer,
+                                  uint         inputBufferLength,
+                                  uint8*       outputBuffer,
+                                  uint         outputBufferLength);
+
+    // See cConsoleDeviceControls::drainMemoryTrace()
+    uint handleMemoryTraceIoctl(uint    ioctlCode,
+                           const uint8* inputBuffer,
+                           uint         inputBufferLength,
+                           uint8*       outputBuffer,
+                           uint         outputBufferLength);
+
     // Create the thunks
     IOCTL_CALLBACK(cConsoleDevice, handleGetVersionIoctl);
     IOCTL_CALLBACK(cConsoleDevice, handleGetNextLineIoctl);
     IOCTL_CALLBACK(cConsoleDevice, handlePoolLineIoctl);
+    IOCTL_CALLBACK(cConsoleDevice, handleMemoryStatisticsIoctl);
+    IOCTL_CALLBACK(cConsoleDevice, handleMemoryProfileIoctl);
+    IOCTL_CALLBACK(cConsoleDevice, handleMemoryTraceControlIoctl);
+    IOCTL_CALLBACK(cConsoleDevice, handleMemoryTraceIoctl);
 
 protected:
 	// The dispatcher module for the IOCTLs
@@ -59,6 +59,10 @@ public:
     virtual uint getVersion();
     virtual uint getNextLineSize();
     virtual bool poolLine(uint8* outputLine, uint outputLineLength);
+    virtual bool queryMemoryStatistics(MemoryStatistics& statistics);
+    virtual bool queryMemoryProfile(MemoryProfileDump& dump);
+    virtual bool controlMemoryTrace(bool shouldRecord);
+    virtual bool drainMemoryTrace(MemoryTraceDump& dump);
 };
 
 #endif // __TBA_XDK_UTILS_CONSOLE_DEVICECONTROL_H
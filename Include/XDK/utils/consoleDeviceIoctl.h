@@ -43,6 +43,9 @@
  * Author: Elad Raz <e@eladraz.com>
  */
 #include "xStl/types.h"
+#include "XDK/memory/MemoryStatistics.h"
+#include "XDK/memory/MemoryProfile.h"
+#include "XDK/memory/MemoryTrace.h"
 
 // Ring3 applications include files
 #ifdef XSTL_WINDOWS
@@ -108,6 +111,43 @@ protected:
          */
         IOCTL_CONSOLE_POOL_LINE =
             CTL_CODE(FILE_DEVICE_UNKNOWN, BASE + 0xB2, METHOD_BUFFERED, FILE_WRITE_ACCESS),
+
+        /*
+         * See queryMemoryStatistics().
+         *
+         * Input buffer: (NULL,0)
+         * Output buffer: (MemoryStatistics*, sizeof(MemoryStatistics))
+         */
+        IOCTL_CONSOLE_MEMORY_STATISTICS =
+            CTL_CODE(FILE_DEVICE_UNKNOWN, BASE + 0xB3, METHOD_BUFFERED, FILE_WRITE_ACCESS),
+
+        /*
+         * See queryMemoryProfile().
+         *
+         * Input buffer: (NULL,0)
+         * Output buffer: (MemoryProfileDump*, sizeof(MemoryProfileDump))
+         */
+        IOCTL_CONSOLE_MEMORY_PROFILE =
+            CTL_CODE(FILE_DEVICE_UNKNOWN, BASE + 0xB4, METHOD_BUFFERED, FILE_WRITE_ACCESS),
+
+        /*
+         * See controlMemoryTrace().
+         *
+         * Input buffer: (uint32*, 4) - 1 in order to start the recording, 0
+         *               in order to stop it.
+         * Output buffer: (NULL,0)
+         */
+        IOCTL_CONSOLE_MEMORY_TRACE_CONTROL =
+            CTL_CODE(FILE_DEVICE_UNKNOWN, BASE + 0xB5, METHOD_BUFFERED, FILE_WRITE_ACCESS),
+
+        /*
+         * See drainMemoryTrace().
+         *
+         * Input buffer: (NULL,0)
+         * Output buffer: (MemoryTraceDump*, sizeof(MemoryTraceDump))
+         */
+        IOCTL_CONSOLE_MEMORY_TRACE =
+            CTL_CODE(FILE_DEVICE_UNKNOWN, BASE + 0xB6, METHOD_BUFFERED, FILE_WRITE_ACCESS),
     };
 
     // The different implementation of this protocol
@@ -139,6 +179,51 @@ protected:
      * Return true if the line is polled or false if an error occuered.
      */
     virtual bool poolLine(uint8* outputLine, uint outputLineLength) = 0;
+
+    /*
+     * Filles 'statistics' with a snapshot of the driver memory manager. The
+     * driver keeps running while the snapshot is taken, so monitoring
+     * applications can poll it periodically.
+     * See SuperiorMemoryManager::getStatistics.
+     *
+     * Return true if the snapshot is filled or false if the driver memory
+     * manager isn't available.
+     */
+    virtual bool queryMemoryStatistics(MemoryStatistics& statistics) = 0;
+
+    /*
+     * Filles 'dump' with the live samples of the driver heap profiler. The
+     * image base and size of the dump describe the driver module, so the
+     * return addresses can be translated into the driver symbols.
+     * See cXdkDriverMemoryManager::getProfile and cMemoryProfileReport.
+     *
+     * Return true if the dump is filled or false if the driver memory manager
+     * isn't available.
+     */
+    virtual bool queryMemoryProfile(MemoryProfileDump& dump) = 0;
+
+    /*
+     * Starts or stops the recording of the driver allocation trace. The trace
+     * buffer is allocated by the first start and kept until the driver is
+     * unloaded.
+     * See cXdkDriverMemoryManager::startTrace.
+     *
+     * Return true if the recording state was changed or false if the driver
+     * memory manager isn't available.
+     */
+    virtual bool controlMemoryTrace(bool shouldRecord) = 0;
+
+    /*
+     * Moves the pending records of the allocation trace into 'dump'. The
+     * recording continues while the trace is drained, so the monitoring
+     * application should drain it periodically and append the dumps to a
+     * trace file.
+     * See cXdkDriverMemoryManager::drainTrace and MemoryTrace.h.
+     *
+     * Return true if the dump is filled or false if the driver memory manager
+     * isn't available.
+     */
+    virtual bool drainMemoryTrace(MemoryTraceDump& dump) = 0;
 };
 
 #endif // __CONSOLE_DEVICE_IOCTLS_H
@@ -153,3 +153,48 @@ bool cConsolePooler::poolLine(uint8* outputLine, uint outputLineLength)
     return true;
 }
 
+bool cConsolePooler::queryMemoryStatistics(MemoryStatistics& statistics)
+{
+    // Execute
+    CHECK(m_command->invoke(IOCTL_CONSOLE_MEMORY_STATISTICS,
+                        NULL, 0,
+                        (uint8*)&statistics,
+                        sizeof(statistics)) == sizeof(statistics));
+
+    return true;
+}
+
+bool cConsolePooler::queryMemoryProfile(MemoryProfileDump& dump)
+{
+    // Execute
+    CHECK(m_command->invoke(IOCTL_CONSOLE_MEMORY_PROFILE,
+                        NULL, 0,
+                        (uint8*)&dump,
+                        sizeof(dump)) == sizeof(dump));
+
+    return true;
+}
+
+bool cConsolePooler::controlMemoryTrace(bool shouldRecord)
+{
+    uint32 shouldRecordValue = shouldRecord ? 1 : 0;
+
+    // Execute
+    CHECK(m_command->invoke(IOCTL_CONSOLE_MEMORY_TRACE_CONTROL,
+                        (const uint8*)&shouldRecordValue,
+                        sizeof(shouldRecordValue),
+                        NULL, 0) == 0);
+
+    return true;
+}
+
+bool cConsolePooler::drainMemoryTrace(MemoryTraceDump& dump)
+{
+    // Execute
+    CHECK(m_command->invoke(IOCTL_CONSOLE_MEMORY_TRACE,
+                        NULL, 0,
+                        (uint8*)&dump,
+                        sizeof(dump)) == sizeof(dump));
+
+    return true;
+}
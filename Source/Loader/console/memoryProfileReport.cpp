@@ -0,0 +1,300 @@
+/*
+ * Copyright (c) 2008-2016, Integrity Project Ltd. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * Neither the name of the Integrity Project nor the names of its contributors
+ * may be used to endorse or promote products derived from this software
+ * without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE
+ */
+
+
+/*
+ * memoryProfileReport.cpp
+ *
+ * Implementation file for NT operation system.
+ */
+#include "xStl/types.h"
+#include "xStl/except/trace.h"
+#include "xStl/except/exception.h"
+#include "xStl/data/string.h"
+#include "xStl/os/os.h"
+#include "xStl/utils/algorithm.h"
+#include "XDK/memory/MemoryProfile.h"
+#include "loader/console/memoryProfileReport.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <tchar.h>
+// Use the TCHAR version of the symbols engine, like cString
+#define DBGHELP_TRANSLATE_TCHAR
+#include <dbghelp.h>
+
+cMemoryProfileReport::cMemoryProfileReport(const MemoryProfileDump& dump) :
+    m_dump(dump),
+    m_numberOfCallSites(0),
+    m_symbolsHandle(NULL)
+{
+    if ((dump.m_magic != MemoryProfileDump::MAGIC) ||
+        (dump.m_version != MemoryProfileDump::VERSION) ||
+        (dump.m_numberOfSamples > MemoryProfileDump::MAX_SAMPLES))
+    {
+        TRACE(TRACE_VERY_HIGH, "MemoryProfileReport: Invalid dump!");
+        XSTL_THROW(cException, EXCEPTION_FAILED);
+    }
+
+    // Aggregate the samples. The dump is small, so the call-sites are
+    // searched linearly.
+    for (uint i = 0; i < dump.m_numberOfSamples; i++)
+    {
+        const MemoryProfileSample& sample = dump.m_samples[i];
+        if (sample.m_numberOfFrames > MemoryProfileSample::MAX_FRAMES)
+        {
+            TRACE(TRACE_VERY_HIGH, "MemoryProfileReport: Invalid sample!");
+            XSTL_THROW(cException, EXCEPTION_FAILED);
+        }
+
+        uint j = 0;
+        while ((j < m_numberOfCallSites) &&
+               (!isSameCallSite(*m_callSites[j].m_sample, sample)))
+        {
+            j++;
+        }
+
+        CallSite& callSite = m_callSites[j];
+        if (j == m_numberOfCallSites)
+        {
+            callSite.m_sample = &sample;
+            callSite.m_numberOfSamples = 0;
+            callSite.m_sampledBytes = 0;
+            callSite.m_estimatedBytes = 0;
+            callSite.m_oldestTime = sample.m_time;
+            m_numberOfCallSites++;
+        }
+
+        callSite.m_numberOfSamples++;
+        callSite.m_sampledBytes+= sample.m_length;
+        callSite.m_estimatedBytes+= estimateBytes(sample.m_length);
+        if (sample.m_time < callSite.m_oldestTime)
+            callSite.m_oldestTime = sample.m_time;
+    }
+
+    qsort(m_callSites, m_numberOfCallSites, sizeof(CallSite),
+          compareCallSites);
+}
+
+cMemoryProfileReport::~cMemoryProfileReport()
+{
+    if (m_symbolsHandle != NULL)
+        SymCleanup((HANDLE)m_symbolsHandle);
+}
+
+bool cMemoryProfileReport::symbolize(const cString& moduleFilename)
+{
+    if (m_dump.m_imageBase == 0)
+        return false;
+
+    // The symbols engine doesn't need a real process for a module which is
+    // loaded at a known address, any unique value is good enough.
+    HANDLE handle = (HANDLE)this;
+    if (m_symbolsHandle == NULL)
+    {
+        SymSetOptions(SymGetOptions() | SYMOPT_UNDNAME | SYMOPT_DEFERRED_LOADS |
+                      SYMOPT_LOAD_LINES);
+        if (!SymInitialize(handle, NULL, FALSE))
+            return false;
+        m_symbolsHandle = handle;
+    }
+
+    return SymLoadModuleEx(handle,
+                           NULL,
+                           moduleFilename.getBuffer(),
+                           NULL,
+                           m_dump.m_imageBase,
+                           m_dump.m_imageSize,
+                           NULL,
+                           0) != 0;
+}
+
+void cMemoryProfileReport::print(uint maxCallSites) const
+{
+    uint64 sampledBytes = 0;
+    for (uint i = 0; i < m_numberOfCallSites; i++)
+        sampledBytes+= m_callSites[i].m_sampledBytes;
+
+    printf("Memory profile at %u.%03u seconds\n",
+           m_dump.m_time / 1000, m_dump.m_time % 1000);
+    if (m_dump.m_sampleRate == 0)
+        printf("  The profiler is disabled\n");
+    else
+        printf("  Sample rate:      %u bytes\n", m_dump.m_sampleRate);
+    printf("  Live samples:     %u (%I64u bytes)\n",
+           m_dump.m_numberOfSamples, sampledBytes);
+    printf("  Dropped samples:  %u\n", m_dump.m_droppedSamples);
+    printf("  Call sites:       %u\n", m_numberOfCallSites);
+    printf("  Estimated bytes:  %I64u\n\n", getEstimatedBytes());
+
+    uint count = t_min(maxCallSites, m_numberOfCallSites);
+    for (uint i = 0; i < count; i++)
+    {
+        const CallSite& callSite = m_callSites[i];
+        printf("#%u: %I64u estimated bytes in %u samples (%I64u bytes), "
+               "oldest at %u.%03u seconds\n",
+               i + 1,
+               (uint64)callSite.m_estimatedBytes,
+               callSite.m_numberOfSamples,
+               callSite.m_sampledBytes,
+               callSite.m_oldestTime / 1000, callSite.m_oldestTime % 1000);
+
+        const MemoryProfileSample& sample = *callSite.m_sample;
+        for (uint j = 0; j < sample.m_numberOfFrames; j++)
+            printFrame(sample.m_frames[j]);
+        printf("\n");
+    }
+
+    if (count < m_numberOfCallSites)
+        printf("... %u more call sites\n", m_numberOfCallSites - count);
+}
+
+uint cMemoryProfileReport::getNumberOfCallSites() const
+{
+    return m_numberOfCallSites;
+}
+
+uint64 cMemoryProfileReport::getEstimatedBytes() const
+{
+    double ret = 0;
+    for (uint i = 0; i < m_numberOfCallSites; i++)
+        ret+= m_callSites[i].m_estimatedBytes;
+    return (uint64)ret;
+}
+
+void cMemoryProfileReport::saveDump(const MemoryProfileDump& dump,
+                                    const cString& filename)
+{
+    HANDLE file = CreateFile(filename.getBuffer(), GENERIC_WRITE, 0, NULL,
+                             CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        XSTL_THROW(cException, EXCEPTION_FAILED);
+    }
+
+    DWORD written = 0;
+    BOOL ret = WriteFile(file, &dump, sizeof(dump), &written, NULL);
+    CloseHandle(file);
+    if ((!ret) || (written != sizeof(dump)))
+    {
+        XSTL_THROW(cException, EXCEPTION_FAILED);
+    }
+}
+
+void cMemoryProfileReport::loadDump(MemoryProfileDump& dump,
+                                    const cString& filename)
+{
+    HANDLE file = CreateFile(filename.getBuffer(), GENERIC_READ,
+                             FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                             FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        XSTL_THROW(cException, EXCEPTION_FAILED);
+    }
+
+    DWORD read = 0;
+    BOOL ret = ReadFile(file, &dump, sizeof(dump), &read, NULL);
+    CloseHandle(file);
+    if ((!ret) || (read != sizeof(dump)) ||
+        (dump.m_magic != MemoryProfileDump::MAGIC) ||
+        (dump.m_version != MemoryProfileDump::VERSION))
+    {
+        XSTL_THROW(cException, EXCEPTION_FAILED);
+    }
+}
+
+bool cMemoryProfileReport::isSameCallSite(const MemoryProfileSample& a,
+                                          const MemoryProfileSample& b)
+{
+    if (a.m_numberOfFrames != b.m_numberOfFrames)
+        return false;
+    for (uint i = 0; i < a.m_numberOfFrames; i++)
+        if (a.m_frames[i] != b.m_frames[i])
+            return false;
+    return true;
+}
+
+int __cdecl cMemoryProfileReport::compareCallSites(const void* a,
+                                                   const void* b)
+{
+    double aBytes = ((const CallSite*)a)->m_estimatedBytes;
+    double bBytes = ((const CallSite*)b)->m_estimatedBytes;
+    if (aBytes > bBytes)
+        return -1;
+    if (aBytes < bBytes)
+        return 1;
+    return 0;
+}
+
+double cMemoryProfileReport::estimateBytes(uint32 length) const
+{
+    // Every block is sampled when the profiler samples every byte
+    if ((m_dump.m_sampleRate <= 1) || (length == 0))
+        return length;
+
+    double probability = 1.0 - exp(-(double)length / m_dump.m_sampleRate);
+    return length / probability;
+}
+
+void cMemoryProfileReport::printFrame(uint64 address) const
+{
+    // Try the symbols first
+    if (m_symbolsHandle != NULL)
+    {
+        uint8 buffer[sizeof(SYMBOL_INFO) + MAX_SYM_NAME * sizeof(TCHAR)];
+        PSYMBOL_INFO symbol = (PSYMBOL_INFO)buffer;
+        memset(buffer, 0, sizeof(buffer));
+        symbol->SizeOfStruct = sizeof(SYMBOL_INFO);
+        symbol->MaxNameLen = MAX_SYM_NAME;
+
+        DWORD64 displacement = 0;
+        if (SymFromAddr((HANDLE)m_symbolsHandle, address, &displacement,
+                        symbol))
+        {
+            _tprintf(_T("    %016I64X %s+0x%I64X\n"), address, symbol->Name,
+                     displacement);
+            return;
+        }
+    }
+
+    // Module offset
+    if ((m_dump.m_imageBase != 0) &&
+        (address >= m_dump.m_imageBase) &&
+        (address < m_dump.m_imageBase + m_dump.m_imageSize))
+    {
+        printf("    %016I64X module+0x%I64X\n", address,
+               address - m_dump.m_imageBase);
+        return;
+    }
+
+    printf("    %016I64X\n", address);
+}
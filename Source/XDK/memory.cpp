@@ -43,14 +43,11 @@
 #include "xStl/except/trace.h"
 #include "xStl/stream/traceStream.h"
 #include "xdk/memory.h"
+#include "xdk/memory/MemoryAtomic.h"
+#include "xdk/memory/MemoryLargePageAllocator.h"
 #include "xdk/utils/processorUtil.h"
 #include "xdk/utils/bugcheck.h"
 
-#ifdef _DEBUG
-cOSDef::threadHandle cXdkDriverMemoryManager::m_debugThread
-    = INVALID_THREAD_HANDLE;
-#endif
-
 // The singleton object
 cXdkDriverMemoryManager::Members*
     cXdkDriverMemoryManager::m_members = NULL;
@@ -58,6 +55,11 @@ cXdkDriverMemoryManager::Members*
 // The termination flag
 bool cXdkDriverMemoryManager::m_aboutToTerminate = false;
 
+#ifdef XDK_TEST
+// The current scope of the thread. See cXdkDriverMemoryManager::setCurrentScope
+static XDK_MEMORY_THREAD_LOCAL cXdkArenaScope* gCurrentScope = NULL;
+#endif
+
 
 //////////////////////////////////////////////////////////////////////////
 
@@ -95,14 +97,25 @@ cXdkDriverMemoryManager::Members::Members(uint initializeSize,
                                           uint maxSize) :
     m_isValid(false),
     m_memManager(NULL),
+    m_traceBuffer(NULL),
+    m_poolSlots(NULL),
     m_expandor(NULL)
+{
     #ifndef XDK_TEST
-        , m_isOperationInProgress(false),
-        m_dtorQueue(NULL)
+    memset(m_arenaContexts, 0, sizeof(m_arenaContexts));
+    m_activeArenaContexts = 0;
     #endif
-{
+
+    #ifdef XDK_MEMORY_LARGE_PAGES
+    // Superblocks of large pages, or of the non-paged pool
+    SuperiorOSMemePtr osmem(new MemoryLargePageAllocator(
+        SuperiorOSMemePtr(new cXdkDriverMemoryManager::XdkMemoryAllocator())));
+    #else
+    SuperiorOSMemePtr osmem(new cXdkDriverMemoryManager::XdkMemoryAllocator());
+    #endif
+
     m_memManager = new SuperiorMemoryManager(
-        SuperiorOSMemePtr(new cXdkDriverMemoryManager::XdkMemoryAllocator()),
+        osmem,
         initializeSize,
         m_privatePoolMemory,
         SuperiorMemoryManager::DEFAULT_SUPRIOR_MEMORY_PRIVATE_MEM,
@@ -110,6 +123,7 @@ cXdkDriverMemoryManager::Members::Members(uint initializeSize,
 
     // Test that operating system have enough resources
     CHECK(m_memManager != NULL);
+    m_memManager->setLowWatermark(XDM_LOW_WATERMARK);
 
     // Start the expander thread
     m_expandor = new cXdkDriverMemoryManager::XdkMemoryExpandor(*m_memManager,
@@ -129,6 +143,13 @@ cXdkDriverMemoryManager::Members::~Members()
     }
     delete m_expandor;
     delete m_memManager;
+
+    if (m_traceBuffer != NULL)
+    {
+        m_tracer.stop();
+        cXdkDriverMemoryManager::XdkMemoryAllocator osmem;
+        osmem.freeSuperblock(m_traceBuffer);
+    }
 }
 
 //////////////////////////////////////////////////////////////////////////
@@ -144,13 +165,6 @@ void cXdkDriverMemoryManager::initialize()
 
     // Allocate and initialize memory
     m_members = new Members();
-
-    #ifndef XDK_TEST
-        // Only ring0 have a dtor queue
-        // The dtor queue item is now belongs to XDM memory
-        cLock lock(m_members->m_dtorQueueLock);
-        m_members->m_dtorQueue = new DtorWorkItem();
-    #endif // XDK_TEST
 }
 
 void cXdkDriverMemoryManager::terminate()
@@ -162,9 +176,25 @@ void cXdkDriverMemoryManager::terminate()
     m_aboutToTerminate = true;
 
     #ifndef XDK_TEST
-        delete m_members->m_dtorQueue;
+        // Operator delete cannot queue anymore
+        clearDtorQueue();
     #endif // XDK_TEST
 
+    // The pools return their slabs before the heap is destroyed. Objects which
+    // are deleted from now on are lost.
+    XdkPoolSlot* slot = m_members->m_poolSlots;
+    m_members->m_poolSlots = NULL;
+    while (slot != NULL)
+    {
+        MemorySlabPool* pool = slot->m_pool;
+        XdkPoolSlot* next = slot->m_next;
+        slot->m_pool = NULL;
+        slot->m_next = NULL;
+        pool->~MemorySlabPool();
+        m_members->m_memManager->free(pool);
+        slot = next;
+    }
+
     // Remove the member list
     Members* member = m_members;
     member->m_isValid = false;
@@ -195,133 +225,391 @@ bool cXdkDriverMemoryManager::free(void* address)
     return m_members->m_memManager->free(address);
 }
 
-//////////////////////////////////////////////////////////////////////////
-// Ring0 operator new/delete implementation
+bool cXdkDriverMemoryManager::getStatistics(MemoryStatistics& statistics)
+{
+    if (m_members == NULL)
+        return false;
+    if (!m_members->m_isValid)
+        return false;
 
-#ifndef XDK_TEST
+    #ifdef SUPERIOR_MEMORY_MANAGER_STATISTICS
+    m_members->m_memManager->getStatistics(statistics);
+    return true;
+    #else
+    return false;
+    #endif
+}
 
-bool cXdkDriverMemoryManager::acquireClearing()
+bool cXdkDriverMemoryManager::getProfile(MemoryProfileDump& dump)
 {
-    cLock lock(m_members->m_dtorClearingAcquire);
-    if (m_members->m_isOperationInProgress)
+    if (m_members == NULL)
         return false;
-    // Acquire clearing.
-    m_members->m_isOperationInProgress = true;
+    if (!m_members->m_isValid)
+        return false;
+
+    m_members->m_profiler.dump(dump);
     return true;
 }
 
-void cXdkDriverMemoryManager::releaseClearing()
+void cXdkDriverMemoryManager::setProfilerSampleRate(uint sampleRate)
 {
-    cLock lock(m_members->m_dtorClearingAcquire);
-    m_members->m_isOperationInProgress = false;
+    checkValid();
+
+    m_members->m_profiler.setSampleRate(sampleRate);
 }
 
-void cXdkDriverMemoryManager::clearingProcess()
+bool cXdkDriverMemoryManager::startTrace()
 {
-    XSTL_TRY
+    if ((m_members == NULL) || (!m_members->m_isValid))
+        return false;
+
+    if (m_members->m_traceBuffer == NULL)
     {
-        // Called in IRQL PASSIVE_LEVEL to DISPATCH_LEVEL
-        #ifdef _DEBUG
-        if (cProcessorUtil::getCurrentIrql() > DISPATCH_LEVEL)
-            cBugCheck::bugCheck(0xDEAD0EEE, 1,1,1,1);
-        #endif // _DEBUG
+        // The ring is taken from the operating system, not from the heap
+        // which it records
+        XdkMemoryAllocator osmem;
+        void* buffer = osmem.allocateNewSuperblock(
+            Members::TRACE_BUFFER_LENGTH);
+        if (buffer == NULL)
+            return false;
+
+        bool isInstalled = false;
+        {
+            cLock lock(m_members->m_traceLock);
+            if (m_members->m_traceBuffer == NULL)
+            {
+                m_members->m_tracer.setBuffer(buffer,
+                                              Members::TRACE_BUFFER_LENGTH);
+                m_members->m_traceBuffer = buffer;
+                isInstalled = true;
+            }
+        }
+
+        // Another thread started the trace first
+        if (!isInstalled)
+            osmem.freeSuperblock(buffer);
+    }
 
-        DtorWorkItem listCopy;
-        pollList(listCopy);
+    return m_members->m_tracer.start();
+}
 
-        // Must be the same as here
-        #ifdef _DEBUG
-        if (cProcessorUtil::getCurrentIrql() > DISPATCH_LEVEL)
-            cBugCheck::bugCheck(0xDEAD0EEE, 2,2,2,2);
-        #endif // _DEBUG
+void cXdkDriverMemoryManager::stopTrace()
+{
+    if ((m_members == NULL) || (!m_members->m_isValid))
+        return;
 
-        for (DtorWorkItem::iterator i = listCopy.begin();
-            i != listCopy.end();
-            ++i)
-        {
-            ExFreePool(getPtr(*i));
-        }
+    m_members->m_tracer.stop();
+}
 
-        // Must be the same as here
-        #ifdef _DEBUG
-        if (cProcessorUtil::getCurrentIrql() > DISPATCH_LEVEL)
-            cBugCheck::bugCheck(0xDEAD0EEE, 3,3,3,3);
-        #endif // _DEBUG
+bool cXdkDriverMemoryManager::drainTrace(MemoryTraceDump& dump)
+{
+    if ((m_members == NULL) || (!m_members->m_isValid))
+        return false;
+
+    m_members->m_tracer.drain(dump);
+    return true;
+}
+
+void* cXdkDriverMemoryManager::allocateObject(uint length, uint alignment)
+{
+    checkValid();
+
+    if (length == 0)
+        // When allocating 0 bytes memory than a valid pointer must return
+        length = 1;
+
+    void* ret = m_members->m_memManager->allocateAligned(length, alignment);
+    if (ret == NULL)
+    {
+        TRACE(TRACE_VERY_HIGH, "Out of memory exception. Allocating ");
+        TRACE(TRACE_VERY_HIGH, cString(length));
+        TRACE(TRACE_VERY_HIGH, " aligned bytes.");
+        XSTL_THROW(cException, EXCEPTION_OUT_OF_MEM);
     }
-    XSTL_CATCH_ALL
+
+    // Skip this function and the operator new
+    m_members->m_profiler.recordAllocation(ret, length, 2);
+    m_members->m_tracer.recordAllocation(ret, length);
+    return ret;
+}
+
+void cXdkDriverMemoryManager::freeObject(void* address, uint length)
+{
+    if (address == NULL)
+        return;
+
+    if (length == 0)
+        length = 1;
+
+    // The objects are always allocated by allocateObject
+    recordFree(address);
+    if (!m_members->m_memManager->free(address, length))
     {
-        traceHigh("XDM: FATAL! Unknown exception while clearing memory!" << endl);
+        traceHigh("XDM: Invalid sized free " << HEXDWORD(getNumeric(address))
+                  << endl);
     }
 }
 
-void cXdkDriverMemoryManager::clearDtorQueue()
+void* cXdkDriverMemoryManager::allocatePooled(XdkPoolSlot& slot,
+                                              uint objectLength,
+                                              uint length)
 {
-    // This function can be called by operator new before class initialized
-    if (m_members == NULL)
+    checkValid();
+
+    // Derived classes are not pooled
+    if (length != objectLength)
+        return allocateObject(length, 1);
+
+    MemorySlabPool* pool = slot.m_pool;
+    if (pool == NULL)
+        pool = createPool(slot, objectLength);
+
+    void* ret = NULL;
+    if (pool != NULL)
+        ret = pool->allocate();
+    if (ret == NULL)
+    {
+        TRACE(TRACE_VERY_HIGH, "Out of memory exception. Allocating ");
+        TRACE(TRACE_VERY_HIGH, cString(length));
+        TRACE(TRACE_VERY_HIGH, " pooled bytes.");
+        XSTL_THROW(cException, EXCEPTION_OUT_OF_MEM);
+    }
+
+    // Skip this function and the operator new
+    m_members->m_profiler.recordAllocation(ret, length, 2);
+    m_members->m_tracer.recordAllocation(ret, length);
+    return ret;
+}
+
+void cXdkDriverMemoryManager::freePooled(XdkPoolSlot& slot,
+                                         void* address,
+                                         uint objectLength,
+                                         uint length)
+{
+    if (address == NULL)
         return;
 
-    if (m_members->m_isValid == false)
+    if (length != objectLength)
+    {
+        freeObject(address, length);
         return;
+    }
 
-    // Prevent recursing behavior in operator new.
-    if (!acquireClearing())
+    // The pool is destroyed by 'terminate()'
+    MemorySlabPool* pool = slot.m_pool;
+    if (pool == NULL)
+    {
+        traceHigh("XDM: Pooled object freed without a pool " <<
+                  HEXDWORD(getNumeric(address)) << endl);
         return;
+    }
+
+    recordFree(address);
+    pool->free(address);
+}
+
+MemorySlabPool* cXdkDriverMemoryManager::createPool(XdkPoolSlot& slot,
+                                                    uint objectLength)
+{
+    void* buffer = m_members->m_memManager->allocate(sizeof(MemorySlabPool));
+    if (buffer == NULL)
+        return NULL;
+    MemorySlabPool* pool = new(buffer) MemorySlabPool(*m_members->m_memManager,
+                                                      objectLength);
+
+    MemorySlabPool* other = (MemorySlabPool*)MemoryAtomic::
+        compareExchangePointer((void* volatile*)&slot.m_pool, pool, NULL);
+    if (other != NULL)
+    {
+        // Another thread created the pool first
+        pool->~MemorySlabPool();
+        m_members->m_memManager->free(buffer);
+        return other;
+    }
 
-    clearingProcess();
+    // Register the slot. Only the winner reaches here, once per slot.
+    while (true)
+    {
+        XdkPoolSlot* head = m_members->m_poolSlots;
+        slot.m_next = head;
+        if (MemoryAtomic::compareExchangePointer(
+                (void* volatile*)&m_members->m_poolSlots, &slot, head) == head)
+        {
+            break;
+        }
+    }
 
-    releaseClearing();
+    return pool;
 }
 
-void cXdkDriverMemoryManager::pollList(DtorWorkItem& output)
+void cXdkDriverMemoryManager::recordAllocation(void* address, uint length)
 {
-    #ifdef _DEBUG
-    KIRQL oldIrql = cProcessorUtil::getCurrentIrql();
-    #endif //_DEBUG
+    if ((m_members == NULL) || (!m_members->m_isValid))
+        return;
 
-    // The next element to free
-    cLock lock(m_members->m_dtorQueueLock);
+    // Skip this function and operator new
+    m_members->m_profiler.recordAllocation(address, length, 2);
+    m_members->m_tracer.recordAllocation(address, length);
+}
 
-    // Release the pool type.
-    #ifdef _DEBUG
-    cXdkDriverMemoryManager::m_debugThread = cThread::getCurrentThreadHandle();
+void cXdkDriverMemoryManager::recordFree(void* address)
+{
+    if ((m_members == NULL) || (!m_members->m_isValid))
+        return;
+
+    m_members->m_profiler.recordFree(address);
+    m_members->m_tracer.recordFree(address);
+}
+
+SuperiorMemoryManager& cXdkDriverMemoryManager::getHeap()
+{
+    checkValid();
+
+    return *m_members->m_memManager;
+}
+
+MemoryArena* cXdkDriverMemoryManager::getCurrentArena()
+{
+    cXdkArenaScope* scope = getCurrentScope();
+    if (scope == NULL)
+        return NULL;
+    return &scope->m_arena;
+}
+
+bool cXdkDriverMemoryManager::isArenaBlock(void* address)
+{
+    for (cXdkArenaScope* scope = getCurrentScope();
+         scope != NULL;
+         scope = scope->m_previousScope)
+    {
+        if (scope->m_arena.isOwner(address))
+            return true;
+    }
+    return false;
+}
+
+cXdkArenaScope* cXdkDriverMemoryManager::getCurrentScope()
+{
+    if ((m_members == NULL) || (!m_members->m_isValid))
+        return NULL;
+
+    #ifndef XDK_TEST
+    // The common case. Nobody routes.
+    if (m_members->m_activeArenaContexts == 0)
+        return NULL;
+
+    ArenaContext* context = findArenaContext();
+    if (context == NULL)
+        return NULL;
+    return context->m_scope;
+    #else
+    return gCurrentScope;
     #endif
+}
 
-    DtorWorkItem::iterator i = m_members->m_dtorQueue->begin();
-    bool shouldFreeList = false;
+bool cXdkDriverMemoryManager::setCurrentScope(cXdkArenaScope* scope)
+{
+    checkValid();
 
-    for (; i != m_members->m_dtorQueue->end(); ++i)
+    #ifndef XDK_TEST
+    // Only the owner of a context changes it
+    ArenaContext* context = findArenaContext();
+    if (context != NULL)
     {
-        // The list memory is cXdkDriverMemoryManager so there aren't any
-        // recursions
-        output.append(*i);
-        shouldFreeList = true;
+        if (scope != NULL)
+        {
+            context->m_scope = scope;
+            return true;
+        }
+
+        // Free the context
+        MemoryAtomic::exchange(&context->m_isActive, 0);
+        MemoryAtomic::decrement(&m_members->m_activeArenaContexts);
+        context->m_scope = NULL;
+        MemoryAtomic::exchangePointer(&context->m_thread, NULL);
+        return true;
     }
 
-    // All elements of m_dtorQueue where allocated from cXdkDriverMemoryManager
-    // so the operator delete can be operate normally, including the constructor
-    if (shouldFreeList)
+    if (scope == NULL)
+        return true;
+
+    void* thread = PsGetCurrentThread();
+    for (uint i = 0; i < Members::MAX_ARENA_CONTEXTS; i++)
     {
-        #ifdef _DEBUG
-        if (cProcessorUtil::getCurrentIrql() != TBA_INTERRUPT_IRQL)
-            cBugCheck::bugCheck(0xDEAD10C6, cProcessorUtil::getCurrentIrql(),
-                                            oldIrql, 0x4E4004E4, 3);
-        #endif
-        // TODO!!!!TODO!!!!TODO!!!!TODO!!!!TODO!!!!TODO!!!!TODO!!!!TODO!!!!
-        //
-        // Me and sergei detected that there can be still some cases in which
-        // multiprocessors might enter dead-lock due to the following delete
-        // PLEASE CHECK IT OUT.
-        //
-        // TODO!!!!TODO!!!!TODO!!!!TODO!!!!TODO!!!!TODO!!!!TODO!!!!TODO!!!!
-        m_members->m_dtorQueue->removeAll();
+        context = &m_members->m_arenaContexts[i];
+        if ((context->m_thread == NULL) &&
+            (MemoryAtomic::compareExchangePointer(&context->m_thread,
+                                                  thread,
+                                                  NULL) == NULL))
+        {
+            context->m_irql = cProcessorUtil::getCurrentIrql();
+            context->m_scope = scope;
+            MemoryAtomic::increment(&m_members->m_activeArenaContexts);
+            MemoryAtomic::exchange(&context->m_isActive, 1);
+            return true;
+        }
     }
 
-    // Release the pool type.
-    #ifdef _DEBUG
-    cXdkDriverMemoryManager::m_debugThread = INVALID_THREAD_HANDLE;
+    // All contexts are used
+    return false;
+    #else
+    gCurrentScope = scope;
+    return true;
     #endif
 }
 
+#ifndef XDK_TEST
+cXdkDriverMemoryManager::ArenaContext*
+    cXdkDriverMemoryManager::findArenaContext()
+{
+    void* thread = PsGetCurrentThread();
+    KIRQL irql = cProcessorUtil::getCurrentIrql();
+    for (uint i = 0; i < Members::MAX_ARENA_CONTEXTS; i++)
+    {
+        ArenaContext* context = &m_members->m_arenaContexts[i];
+        if ((context->m_isActive != 0) &&
+            (context->m_thread == thread) &&
+            (context->m_irql == irql))
+        {
+            return context;
+        }
+    }
+    return NULL;
+}
+#endif
+
+//////////////////////////////////////////////////////////////////////////
+// Ring0 operator new/delete implementation
+
+#ifndef XDK_TEST
+
+void cXdkDriverMemoryManager::clearDtorQueue()
+{
+    // This function can be called before class initialized
+    if (m_members == NULL)
+        return;
+
+    if (m_members->m_isValid == false)
+        return;
+
+    // Called in IRQL PASSIVE_LEVEL to DISPATCH_LEVEL
+    #ifdef _DEBUG
+    if (cProcessorUtil::getCurrentIrql() > DISPATCH_LEVEL)
+        cBugCheck::bugCheck(0xDEAD0EEE, 1,1,1,1);
+    #endif // _DEBUG
+
+    // The whole batch is detached at once. Blocks which are deleted in the
+    // meantime wait for the next call.
+    void* block = m_members->m_dtorQueue.popAll();
+    while (block != NULL)
+    {
+        // The link is stored inside the block
+        void* next = DeferredFreeQueue::getNext(block);
+        ExFreePool(block);
+        block = next;
+    }
+}
+
 //////////////////////////////////////////////////////////////////////////
 
 cXdkDriverMemoryManager::XdkMemoryExpandor::XdkMemoryExpandor(
@@ -346,6 +634,16 @@ void cXdkDriverMemoryManager::XdkMemoryExpandor::run()
         cOS::sleepMillisecond(REFERSH_UNIT_IN_MILLISECONDS);
         units++;
 
+        // Expand ahead of the demand. The request is posted by the
+        // allocations, which might run at interrupt time.
+        if (m_manager.isExpansionRequested())
+            m_manager.expandMemory();
+
+        #ifndef XDK_TEST
+        // Free the memory which was deleted at interrupt time
+        cXdkDriverMemoryManager::clearDtorQueue();
+        #endif
+
         if (units >= m_refreshRateInUnits)
         {
             // Reset the counter
@@ -370,6 +668,15 @@ void * __cdecl operator new(unsigned int cbSize)
         // When allocating 0 bytes memory than a valid pointer must return
         cbSize = 1;
 
+    // Request-scoped objects are bump-allocated from the current arena. See
+    // cXdkArenaScope
+    MemoryArena* arena = cXdkDriverMemoryManager::getCurrentArena();
+    if (arena != NULL)
+    {
+        void* arenaBlock = arena->allocate(cbSize);
+        if (arenaBlock != NULL)
+            return arenaBlock;
+    }
 
     void* ret;
 
@@ -381,20 +688,6 @@ void * __cdecl operator new(unsigned int cbSize)
 
     if (cProcessorUtil::getCurrentIrql() <= DISPATCH_LEVEL)
     {
-        //////////////////////////////////////////////////////////////////
-        // Test whether known HIGH_LEVEL IRQL trying to commit illegal
-        // operation.
-        #ifdef _DEBUG
-        if ((cXdkDriverMemoryManager::m_debugThread != INVALID_THREAD_HANDLE) &&
-            (cThread::getCurrentThreadHandle() ==
-                cXdkDriverMemoryManager::m_debugThread))
-            cBugCheck::bugCheck(0xDEAD10C6, 0xDEAD0EEE,
-                                cProcessorUtil::getCurrentIrql(), cbSize, 1);
-        #endif
-        //////////////////////////////////////////////////////////////////
-
-        // This seems to cause a lot of slowness issues
-        cXdkDriverMemoryManager::clearDtorQueue();
         ret = ExAllocatePool(NonPagedPool, cbSize);
     } else
     {
@@ -424,6 +717,7 @@ void * __cdecl operator new(unsigned int cbSize)
         XSTL_THROW(cException, EXCEPTION_OUT_OF_MEM);
     }
 
+    cXdkDriverMemoryManager::recordAllocation(ret, cbSize);
     return ret;
 }
 
@@ -431,6 +725,13 @@ void __cdecl operator delete(void *memory)
 {
     if (memory != NULL)
     {
+        // Arena blocks are released together with their arena
+        if (cXdkDriverMemoryManager::isArenaBlock(memory))
+            return;
+
+        // Forget the sample before the memory can be reused
+        cXdkDriverMemoryManager::recordFree(memory);
+
         // No matter what IRQL we are in
         if (cXdkDriverMemoryManager::free(memory))
         {
@@ -440,22 +741,6 @@ void __cdecl operator delete(void *memory)
 
         if (cProcessorUtil::getCurrentIrql() <= DISPATCH_LEVEL)
         {
-            //////////////////////////////////////////////////////////////////
-            // Test whether known HIGH_LEVEL IRQL trying to commit illegal
-            // operation.
-            #ifdef _DEBUG
-            if ((cXdkDriverMemoryManager::m_debugThread != INVALID_THREAD_HANDLE) &&
-                (cThread::getCurrentThreadHandle() ==
-                    cXdkDriverMemoryManager::m_debugThread))
-                    cBugCheck::bugCheck(0xDEAD10C6, 0xDEAD0EEE,
-                                         cProcessorUtil::getCurrentIrql(),
-                                         getNumeric(memory), 2);
-            #endif
-            //////////////////////////////////////////////////////////////////
-
-            if (!cXdkDriverMemoryManager::m_aboutToTerminate)
-                cXdkDriverMemoryManager::clearDtorQueue();
-
             ExFreePool(memory);
         } else
         {
@@ -463,29 +748,11 @@ void __cdecl operator delete(void *memory)
             if (cXdkDriverMemoryManager::m_aboutToTerminate)
                 cBugCheck::bugCheck(0xDEAD10C7, 2,0,0,0);
 
-            // Interrupt time cannot free normal.
-            cLock lock(cXdkDriverMemoryManager::m_members->m_dtorQueueLock);
-
-            #ifdef _DEBUG
-            // Stack eye-catcher. This way the memory block can be located.
-            addressNumericValue eyeCatcher[3];
-            eyeCatcher[0] = 0xDEADFACE;
-            eyeCatcher[1] = getNumeric(memory);
-            eyeCatcher[2] = 0xDEADFACE;
-            // Now the IRQL should be HIGH_LEVEL and operator new should be
-            // allocating memory only from our memory-pool
-            cXdkDriverMemoryManager::m_debugThread =
-                cThread::getCurrentThreadHandle();
-            #endif
-
-            // Append the memory into a queue of dtors.
-            cXdkDriverMemoryManager::m_members->m_dtorQueue->append(
-                getNumeric(memory));
-
-            #ifdef _DEBUG
-            // Release the pool type.
-            cXdkDriverMemoryManager::m_debugThread = INVALID_THREAD_HANDLE;
-            #endif
+            // Interrupt time cannot free normal. Queue the memory for the
+            // expandor thread. The queue link is written into the block
+            // itself (Pool blocks are always big enough), so nothing is
+            // allocated and no lock is taken here.
+            cXdkDriverMemoryManager::m_members->m_dtorQueue.push(memory);
         }
     }
 }
@@ -508,7 +775,18 @@ void __cdecl operator delete(void *memory)
             isInit = true;
         }
 
-        return cXdkDriverMemoryManager::allocate(cbSize);
+        MemoryArena* arena = cXdkDriverMemoryManager::getCurrentArena();
+        if (arena != NULL)
+        {
+            void* arenaBlock = arena->allocate(cbSize);
+            if (arenaBlock != NULL)
+                return arenaBlock;
+        }
+
+        void* ret = cXdkDriverMemoryManager::allocate(cbSize);
+        if (ret != NULL)
+            cXdkDriverMemoryManager::recordAllocation(ret, cbSize);
+        return ret;
     }
 
     void __cdecl operator delete(void *memory)
@@ -517,8 +795,70 @@ void __cdecl operator delete(void *memory)
         if (memory == NULL)
             return;
 
+        if (cXdkDriverMemoryManager::isArenaBlock(memory))
+            return;
+
+        cXdkDriverMemoryManager::recordFree(memory);
+
         if (!cXdkDriverMemoryManager::free(memory))
             ::free(memory);
     }
 #endif // XDK_TEST
 
+//////////////////////////////////////////////////////////////////////////
+// Aligned and sized objects. Always allocated by cXdkDriverMemoryManager
+
+void * __cdecl operator new(unsigned int cbSize, const XdkAlignment& alignment)
+{
+    return cXdkDriverMemoryManager::allocateObject(cbSize,
+                                                   alignment.m_alignment);
+}
+
+void __cdecl operator delete(void* memory, const XdkAlignment& alignment)
+{
+    ::operator delete(memory);
+}
+
+void* cXdkSizedObject::operator new(unsigned int cbSize)
+{
+    return cXdkDriverMemoryManager::allocateObject(cbSize, 1);
+}
+
+void cXdkSizedObject::operator delete(void* memory, unsigned int cbSize)
+{
+    cXdkDriverMemoryManager::freeObject(memory, cbSize);
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Request-scoped arenas
+
+cXdkArenaScope::cXdkArenaScope(uint chunkLength,
+                               void* initialBuffer,
+                               uint initialBufferLength) :
+    m_arena(cXdkDriverMemoryManager::getHeap(),
+            chunkLength,
+            initialBuffer,
+            initialBufferLength),
+    m_previousScope(cXdkDriverMemoryManager::getCurrentScope()),
+    m_isRouted(false)
+{
+    m_isRouted = cXdkDriverMemoryManager::setCurrentScope(this);
+}
+
+cXdkArenaScope::~cXdkArenaScope()
+{
+    // The arena itself is released by it's destructor, after it stops being
+    // the current one
+    if (m_isRouted)
+        cXdkDriverMemoryManager::setCurrentScope(m_previousScope);
+}
+
+MemoryArena& cXdkArenaScope::getArena()
+{
+    return m_arena;
+}
+
+bool cXdkArenaScope::isRouted() const
+{
+    return m_isRouted;
+}
@@ -0,0 +1,376 @@
+/*
+ * Copyright (c) 2008-2016, Integrity Project Ltd. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * Neither the name of the Integrity Project nor the names of its contributors
+ * may be used to endorse or promote products derived from this software
+ * without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE
+ */
+
+/*
+ * BitmapMemoryHeapManager.cpp
+ *
+ * Implementation file
+ */
+#include "xStl/types.h"
+#include "xStl/os/lock.h"
+#include "xStl/except/assert.h"
+#include "xStl/except/trace.h"
+#include "xdk/memory/MemoryBitScan.h"
+#include "xdk/memory/BitmapMemoryHeapManager.h"
+
+// Empty words are skipped using SSE2 only in user-mode. The kernel doesn't
+// save the XMM registers for us.
+#if defined(XDK_TEST) && (defined(__SSE2__) || defined(_M_X64))
+    #define XDK_MEMORY_BITMAP_SSE2
+    #include <emmintrin.h>
+#endif
+
+BitmapMemoryHeapManager::BitmapMemoryHeapManager(void* superBlock,
+                                                 uint superBlockLength,
+                                                 uint allocationUnit) :
+    MemorySuperblockHeapManager(superBlock,
+                                superBlockLength),
+    m_firstNonEmptyWord(0),
+    m_allocationUnit(allocationUnit)
+{
+    ASSERT(sizeof(AllocatedDescriptorBlock) == ALLOCATED_UNIT_OVERHEAD);
+
+    // Test the allocation unit
+    CHECK(m_allocationUnit >= MINIMUM_ALLOCATION_UNIT);
+
+    // Each block costs 'm_allocationUnit' bytes and a single bit. Start from
+    // the estimation and shrink until both the blocks and the aligned bitmap
+    // fit into the superblock.
+    m_totalNumberOfBlocks = (uint)(((uint64)superBlockLength * 8) /
+                                   ((uint64)m_allocationUnit * 8 + 1));
+    addressNumericValue bitmapOffset;
+    while (true)
+    {
+        m_bitmapWords = (m_totalNumberOfBlocks + WORD_BITS - 1) / WORD_BITS;
+        bitmapOffset = m_totalNumberOfBlocks * m_allocationUnit;
+        bitmapOffset = (bitmapOffset + sizeof(uint32) - 1) &
+                       ~(addressNumericValue)(sizeof(uint32) - 1);
+        if ((bitmapOffset + m_bitmapWords * sizeof(uint32)) <=
+            superBlockLength)
+            break;
+        CHECK(m_totalNumberOfBlocks > 0);
+        m_totalNumberOfBlocks--;
+    }
+    m_bitmap = (uint32*)getPtr(getNumeric(m_superBlock) + bitmapOffset);
+
+    // All blocks are free. The bits after the last block are never free.
+    uint i;
+    for (i = 0; i < m_bitmapWords; i++)
+        m_bitmap[i] = 0;
+    markBlocks(0, m_totalNumberOfBlocks, true);
+}
+
+void* BitmapMemoryHeapManager::allocate(uint length)
+{
+    uint numberOfBlocks = getNumberOfBlocks(length);
+    if (numberOfBlocks == 0)
+        return NULL;
+
+    cLock lock(m_lock);
+    return allocateUnsafe(numberOfBlocks);
+}
+
+uint BitmapMemoryHeapManager::allocateBlocks(uint length,
+                                             void** blocks,
+                                             uint count)
+{
+    uint numberOfBlocks = getNumberOfBlocks(length);
+    if (numberOfBlocks == 0)
+        return 0;
+
+    cLock lock(m_lock);
+    uint i = 0;
+    for (; i < count; i++)
+    {
+        blocks[i] = allocateUnsafe(numberOfBlocks);
+        if (blocks[i] == NULL)
+            break;
+    }
+    return i;
+}
+
+uint BitmapMemoryHeapManager::getNumberOfBlocks(uint length) const
+{
+    if ((length == 0) || (length >= m_superBlockLength))
+        return 0;
+
+    uint numberOfBlocks = (length + ALLOCATED_UNIT_OVERHEAD +
+                           m_allocationUnit - 1) / m_allocationUnit;
+    if ((numberOfBlocks > MAX_ALLOCATION_BLOCKS) ||
+        (numberOfBlocks > m_totalNumberOfBlocks))
+        return 0;
+
+    return numberOfBlocks;
+}
+
+void* BitmapMemoryHeapManager::allocateUnsafe(uint numberOfBlocks)
+{
+    uint blockID = findFreeRun(numberOfBlocks);
+    if (blockID == m_totalNumberOfBlocks)
+        return NULL;
+
+    markBlocks(blockID, numberOfBlocks, false);
+    if ((m_firstNonEmptyWord < m_bitmapWords) &&
+        (m_bitmap[m_firstNonEmptyWord] == 0))
+    {
+        m_firstNonEmptyWord = findNonEmptyWord(m_firstNonEmptyWord);
+    }
+
+    AllocatedDescriptorBlock* ac = (AllocatedDescriptorBlock*)getPtr(
+        getNumeric(m_superBlock) + blockID * m_allocationUnit);
+    ac->m_magic = ALLOCATED_DESCRIPTOR_MAGIC;
+    ac->m_numberOfBlocks = (uint16)numberOfBlocks;
+
+    m_allocatedBytes+= numberOfBlocks * m_allocationUnit;
+    return (void*)(ac + 1);
+}
+
+bool BitmapMemoryHeapManager::free(void* buffer)
+{
+    cLock lock(m_lock);
+    uint blockID;
+    AllocatedDescriptorBlock* block = getValidDescriptor(buffer, blockID);
+    if (block == NULL)
+        return false;
+
+    markBlocks(blockID, block->m_numberOfBlocks, true);
+    if ((blockID / WORD_BITS) < m_firstNonEmptyWord)
+        m_firstNonEmptyWord = blockID / WORD_BITS;
+    m_allocatedBytes-= block->m_numberOfBlocks * m_allocationUnit;
+    return true;
+}
+
+void BitmapMemoryHeapManager::freeBlocks(void** blocks, uint count)
+{
+    cLock lock(m_lock);
+    for (uint i = 0; i < count; i++)
+    {
+        uint blockID;
+        AllocatedDescriptorBlock* block = getValidDescriptor(blocks[i],
+                                                             blockID);
+        // The caller must pass only valid blocks
+        CHECK(block != NULL);
+        markBlocks(blockID, block->m_numberOfBlocks, true);
+        if ((blockID / WORD_BITS) < m_firstNonEmptyWord)
+            m_firstNonEmptyWord = blockID / WORD_BITS;
+        m_allocatedBytes-= block->m_numberOfBlocks * m_allocationUnit;
+    }
+}
+
+uint BitmapMemoryHeapManager::getBlockLength(void* buffer)
+{
+    // No locking. The block is owned by the caller, so it's descriptor and
+    // it's bit are not changed meanwhile. Other bits of the same word might
+    // change, but the word is read at once.
+    uint blockID;
+    AllocatedDescriptorBlock* block = getValidDescriptor(buffer, blockID);
+    if (block == NULL)
+        return 0;
+
+    return (block->m_numberOfBlocks * m_allocationUnit) -
+           ALLOCATED_UNIT_OVERHEAD;
+}
+
+BitmapMemoryHeapManager::AllocatedDescriptorBlock*
+    BitmapMemoryHeapManager::getValidDescriptor(void* buffer, uint& blockID)
+{
+    // First check the boundries of the buffer
+    if (!isInBoundries(buffer, ALLOCATED_UNIT_OVERHEAD,
+                               m_allocationUnit - ALLOCATED_UNIT_OVERHEAD))
+    {
+        return NULL;
+    }
+
+    AllocatedDescriptorBlock* block = (AllocatedDescriptorBlock*)buffer - 1;
+    addressNumericValue offset = getNumeric(block) - getNumeric(m_superBlock);
+    blockID = (uint)(offset / m_allocationUnit);
+
+    // The descriptor must start at the beginning of an allocated block
+    if ((offset != (blockID * m_allocationUnit)) ||
+        (blockID >= m_totalNumberOfBlocks))
+    {
+        return NULL;
+    }
+    if ((m_bitmap[blockID / WORD_BITS] &
+         ((uint32)1 << (blockID % WORD_BITS))) != 0)
+    {
+        // The block is free
+        return NULL;
+    }
+
+    // Test the descriptor
+    if ((block->m_magic != ALLOCATED_DESCRIPTOR_MAGIC) ||
+        (block->m_numberOfBlocks == 0) ||
+        ((blockID + block->m_numberOfBlocks) > m_totalNumberOfBlocks))
+    {
+        return NULL;
+    }
+
+    return block;
+}
+
+uint BitmapMemoryHeapManager::findNonEmptyWord(uint word) const
+{
+    #ifdef XDK_MEMORY_BITMAP_SSE2
+    // Skip 4 empty words at a time
+    __m128i zero = _mm_setzero_si128();
+    while ((word + 4) <= m_bitmapWords)
+    {
+        __m128i value = _mm_loadu_si128((const __m128i*)(m_bitmap + word));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(value, zero)) != 0xFFFF)
+            break;
+        word+= 4;
+    }
+    #endif
+
+    while ((word < m_bitmapWords) && (m_bitmap[word] == 0))
+        word++;
+    return word;
+}
+
+uint BitmapMemoryHeapManager::findFreeRun(uint count) const
+{
+    uint word = findNonEmptyWord(m_firstNonEmptyWord);
+
+    // The common case: A single block
+    if (count == 1)
+    {
+        if (word == m_bitmapWords)
+            return m_totalNumberOfBlocks;
+        return word * WORD_BITS +
+               MemoryBitScan::lowestSetBit(m_bitmap[word]);
+    }
+
+    // The length and the start of the free run which ends at the top of the
+    // previous word
+    uint run = 0;
+    uint runStart = 0;
+    while (word < m_bitmapWords)
+    {
+        uint32 bits = m_bitmap[word];
+        if (bits == 0xFFFFFFFF)
+        {
+            // The whole word is free
+            if (run == 0)
+                runStart = word * WORD_BITS;
+            run+= WORD_BITS;
+            if (run >= count)
+                return runStart;
+            word++;
+            continue;
+        }
+
+        if (bits == 0)
+        {
+            // The whole word is allocated
+            run = 0;
+            word = findNonEmptyWord(word + 1);
+            continue;
+        }
+
+        // Try to complete the previous run with the low free blocks
+        if ((run > 0) &&
+            ((run + MemoryBitScan::lowestSetBit(~bits)) >= count))
+            return runStart;
+
+        // Try to find the run inside the word. Each set bit of 'starts' marks
+        // 'covered' free blocks.
+        if (count < WORD_BITS)
+        {
+            uint32 starts = bits;
+            uint covered = 1;
+            while ((covered < count) && (starts != 0))
+            {
+                uint shift = covered;
+                if (shift > (count - covered))
+                    shift = count - covered;
+                starts&= starts >> shift;
+                covered+= shift;
+            }
+            if (starts != 0)
+                return word * WORD_BITS + MemoryBitScan::lowestSetBit(starts);
+        }
+
+        // Start a new run from the high free blocks
+        if ((bits & 0x80000000) != 0)
+        {
+            run = WORD_BITS - 1 - MemoryBitScan::highestSetBit(~bits);
+            runStart = (word + 1) * WORD_BITS - run;
+        } else
+        {
+            run = 0;
+        }
+        word++;
+    }
+
+    return m_totalNumberOfBlocks;
+}
+
+void BitmapMemoryHeapManager::markBlocks(uint blockID, uint count, bool isFree)
+{
+    while (count > 0)
+    {
+        uint word = blockID / WORD_BITS;
+        uint bit = blockID % WORD_BITS;
+        uint bits = WORD_BITS - bit;
+        if (bits > count)
+            bits = count;
+
+        uint32 mask = (bits == WORD_BITS) ? 0xFFFFFFFF :
+                      ((((uint32)1 << bits) - 1) << bit);
+        if (isFree)
+        {
+            ASSERT((m_bitmap[word] & mask) == 0);
+            m_bitmap[word]|= mask;
+        } else
+        {
+            ASSERT((m_bitmap[word] & mask) == mask);
+            m_bitmap[word]&= ~mask;
+        }
+
+        blockID+= bits;
+        count-= bits;
+    }
+}
+
+uint BitmapMemoryHeapManager::getMaximumAllocationUnit() const
+{
+    uint64 ret = (uint64)m_allocationUnit * MAX_ALLOCATION_BLOCKS;
+    if (ret > 0xFFFFFFFF)
+        return 0xFFFFFFFF;
+
+    return (uint32)ret;
+}
+
+uint BitmapMemoryHeapManager::getMinimumAllocationUnit() const
+{
+    return m_allocationUnit;
+}
@@ -0,0 +1,99 @@
+/*
+ * Copyright (c) 2008-2016, Integrity Project Ltd. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * Neither the name of the Integrity Project nor the names of its contributors
+ * may be used to endorse or promote products derived from this software
+ * without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE
+ */
+
+
+
+/*
+ * DeferredFreeQueue.cpp
+ *
+ * Implementation file
+ */
+#include "xStl/types.h"
+#include "xdk/memory/MemoryAtomic.h"
+#include "xdk/memory/DeferredFreeQueue.h"
+
+DeferredFreeQueue::DeferredFreeQueue() :
+    m_head(NULL),
+    m_numberOfBlocks(0)
+{
+}
+
+void DeferredFreeQueue::push(void* block)
+{
+    // Counted first, so the counter never drops below the real number
+    MemoryAtomic::increment(&m_numberOfBlocks);
+
+    Link* link = (Link*)block;
+    void* head;
+    do
+    {
+        head = m_head;
+        link->m_next = (Link*)head;
+    } while (MemoryAtomic::compareExchangePointer(&m_head, link, head) !=
+             head);
+}
+
+void* DeferredFreeQueue::popAll()
+{
+    // Fast path, nothing to detach
+    if (m_head == NULL)
+        return NULL;
+
+    Link* link = (Link*)MemoryAtomic::exchangePointer(&m_head, NULL);
+
+    // The blocks are linked from the last pushed one. Reverse the batch so
+    // the blocks are freed by their order.
+    Link* batch = NULL;
+    uint32 count = 0;
+    while (link != NULL)
+    {
+        Link* next = link->m_next;
+        link->m_next = batch;
+        batch = link;
+        link = next;
+        count++;
+    }
+
+    if (count != 0)
+        MemoryAtomic::add(&m_numberOfBlocks, (uint32)(0 - count));
+
+    return batch;
+}
+
+void* DeferredFreeQueue::getNext(void* block)
+{
+    return ((Link*)block)->m_next;
+}
+
+uint DeferredFreeQueue::getNumberOfBlocks() const
+{
+    return m_numberOfBlocks;
+}
@@ -0,0 +1,348 @@
+/*
+ * Copyright (c) 2008-2016, Integrity Project Ltd. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * Neither the name of the Integrity Project nor the names of its contributors
+ * may be used to endorse or promote products derived from this software
+ * without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE
+ */
+
+
+/*
+ * LargeMemoryHeapManager.cpp
+ *
+ * Implementation file
+ */
+#include "xStl/types.h"
+#include "xStl/os/lock.h"
+#include "xStl/except/assert.h"
+#include "xStl/except/trace.h"
+#include "xdk/memory/LargeMemoryHeapManager.h"
+
+LargeMemoryHeapManager::LargeMemoryHeapManager(void* superBlock,
+                                               uint superBlockLength) :
+    MemorySuperblockHeapManager(superBlock,
+                                superBlockLength),
+    m_freeExtents(NULL)
+{
+    ASSERT(sizeof(ExtentHeader) == ALLOCATED_UNIT_OVERHEAD);
+    ASSERT(sizeof(FreeExtent) <= PAGE_SIZE);
+
+    // Align the first extent. The slack at the end of the superblock, which
+    // is shorter than a page, is never used.
+    addressNumericValue start = getNumeric(superBlock);
+    addressNumericValue first = (start + EXTENT_ALIGNMENT - 1) &
+                                ~(addressNumericValue)(EXTENT_ALIGNMENT - 1);
+    CHECK((first - start) < superBlockLength);
+    m_firstExtent = (ExtentHeader*)getPtr(first);
+    m_totalPages = (superBlockLength - (uint)(first - start)) >> PAGE_SHIFT;
+    CHECK(m_totalPages > 0);
+
+    // A single free extent
+    m_firstExtent->m_pages = m_totalPages;
+    m_firstExtent->m_previousPages = 0;
+    addFreeExtent(m_firstExtent);
+}
+
+uint LargeMemoryHeapManager::getSuperblockLength(uint length)
+{
+    uint64 ret = (uint64)length + ALLOCATED_UNIT_OVERHEAD + PAGE_SIZE - 1;
+    ret = (ret & ~(uint64)(PAGE_SIZE - 1)) + EXTENT_ALIGNMENT - 1;
+    if ((length == 0) || (ret > 0xFFFFFFFF))
+        return 0;
+
+    return (uint)ret;
+}
+
+uint LargeMemoryHeapManager::getNumberOfPages(uint length) const
+{
+    if ((length == 0) || (length >= m_superBlockLength))
+        return 0;
+
+    uint pages = (uint)(((uint64)length + ALLOCATED_UNIT_OVERHEAD +
+                         PAGE_SIZE - 1) >> PAGE_SHIFT);
+    if (pages > m_totalPages)
+        return 0;
+
+    return pages;
+}
+
+void* LargeMemoryHeapManager::allocate(uint length)
+{
+    uint pages = getNumberOfPages(length);
+    if (pages == 0)
+        return NULL;
+
+    cLock lock(m_lock);
+    FreeExtent* extent = findBestFit(pages);
+    if (extent == NULL)
+        return NULL;
+    removeExtent(m_freeExtents, extent);
+
+    ExtentHeader* header = &extent->m_header;
+    if (header->m_pages > pages)
+    {
+        // Return the tail to the tree
+        ExtentHeader* tail = getExtent(header, pages);
+        tail->m_pages = header->m_pages - pages;
+        tail->m_previousPages = pages;
+        ExtentHeader* next = getNextExtent(tail);
+        if (next != NULL)
+            next->m_previousPages = tail->m_pages;
+        addFreeExtent(tail);
+        header->m_pages = pages;
+    }
+
+    header->m_magic = ALLOCATED_EXTENT_MAGIC;
+    header->m_reserved = 0;
+    m_allocatedBytes+= pages << PAGE_SHIFT;
+    return (void*)(header + 1);
+}
+
+bool LargeMemoryHeapManager::free(void* buffer)
+{
+    cLock lock(m_lock);
+    ExtentHeader* header = getValidHeader(buffer);
+    if (header == NULL)
+        return false;
+
+    m_allocatedBytes-= header->m_pages << PAGE_SHIFT;
+    uint pages = header->m_pages;
+
+    // Merge with the next extent
+    ExtentHeader* next = getNextExtent(header);
+    if ((next != NULL) && (next->m_magic == FREE_EXTENT_MAGIC))
+    {
+        removeExtent(m_freeExtents, (FreeExtent*)next);
+        pages+= next->m_pages;
+        next->m_magic = 0;
+    }
+
+    // Merge with the previous extent
+    if (header->m_previousPages != 0)
+    {
+        ExtentHeader* previous = (ExtentHeader*)getPtr(getNumeric(header) -
+            ((addressNumericValue)header->m_previousPages << PAGE_SHIFT));
+        if (previous->m_magic == FREE_EXTENT_MAGIC)
+        {
+            removeExtent(m_freeExtents, (FreeExtent*)previous);
+            pages+= previous->m_pages;
+            header->m_magic = 0;
+            header = previous;
+        }
+    }
+
+    header->m_pages = pages;
+    next = getNextExtent(header);
+    if (next != NULL)
+        next->m_previousPages = pages;
+    addFreeExtent(header);
+    return true;
+}
+
+uint LargeMemoryHeapManager::getBlockLength(void* buffer)
+{
+    cLock lock(m_lock);
+    ExtentHeader* header = getValidHeader(buffer);
+    if (header == NULL)
+        return 0;
+
+    return (header->m_pages << PAGE_SHIFT) - ALLOCATED_UNIT_OVERHEAD;
+}
+
+LargeMemoryHeapManager::ExtentHeader* LargeMemoryHeapManager::getExtent(
+    ExtentHeader* extent,
+    uint pages)
+{
+    return (ExtentHeader*)getPtr(getNumeric(extent) +
+                                 ((addressNumericValue)pages << PAGE_SHIFT));
+}
+
+LargeMemoryHeapManager::ExtentHeader* LargeMemoryHeapManager::getNextExtent(
+    ExtentHeader* extent) const
+{
+    uint page = (uint)((getNumeric(extent) - getNumeric(m_firstExtent)) >>
+                       PAGE_SHIFT);
+    if ((page + extent->m_pages) >= m_totalPages)
+        return NULL;
+
+    return getExtent(extent, extent->m_pages);
+}
+
+LargeMemoryHeapManager::ExtentHeader* LargeMemoryHeapManager::getValidHeader(
+    void* buffer) const
+{
+    // The header must start at the beginning of a page
+    addressNumericValue address = getNumeric(buffer);
+    addressNumericValue first = getNumeric(m_firstExtent) +
+                                ALLOCATED_UNIT_OVERHEAD;
+    if (address < first)
+        return NULL;
+    addressNumericValue offset = address - first;
+    if ((offset & (PAGE_SIZE - 1)) != 0)
+        return NULL;
+    offset>>= PAGE_SHIFT;
+    if (offset >= m_totalPages)
+        return NULL;
+
+    // Test the header
+    ExtentHeader* header = (ExtentHeader*)buffer - 1;
+    if ((header->m_magic != ALLOCATED_EXTENT_MAGIC) ||
+        (header->m_pages == 0) ||
+        (header->m_pages > (m_totalPages - (uint)offset)))
+    {
+        return NULL;
+    }
+
+    return header;
+}
+
+bool LargeMemoryHeapManager::isLess(const FreeExtent* a, const FreeExtent* b)
+{
+    if (a->m_header.m_pages != b->m_header.m_pages)
+        return a->m_header.m_pages < b->m_header.m_pages;
+    return getNumeric(a) < getNumeric(b);
+}
+
+uint32 LargeMemoryHeapManager::getPriority(const FreeExtent* extent)
+{
+    // Fibonacci hashing of the page number
+    return (uint32)(getNumeric(extent) >> PAGE_SHIFT) * 2654435761U;
+}
+
+void LargeMemoryHeapManager::rotateRight(FreeExtent*& root)
+{
+    FreeExtent* left = root->m_left;
+    root->m_left = left->m_right;
+    left->m_right = root;
+    root = left;
+}
+
+void LargeMemoryHeapManager::rotateLeft(FreeExtent*& root)
+{
+    FreeExtent* right = root->m_right;
+    root->m_right = right->m_left;
+    right->m_left = root;
+    root = right;
+}
+
+void LargeMemoryHeapManager::insertExtent(FreeExtent*& root,
+                                          FreeExtent* extent)
+{
+    if (root == NULL)
+    {
+        extent->m_left = NULL;
+        extent->m_right = NULL;
+        root = extent;
+        return;
+    }
+
+    // Insert as a leaf and rotate up by the priority
+    if (isLess(extent, root))
+    {
+        insertExtent(root->m_left, extent);
+        if (getPriority(root->m_left) > getPriority(root))
+            rotateRight(root);
+    } else
+    {
+        insertExtent(root->m_right, extent);
+        if (getPriority(root->m_right) > getPriority(root))
+            rotateLeft(root);
+    }
+}
+
+void LargeMemoryHeapManager::removeExtent(FreeExtent*& root,
+                                          FreeExtent* extent)
+{
+    ASSERT(root != NULL);
+    if (root != extent)
+    {
+        if (isLess(extent, root))
+            removeExtent(root->m_left, extent);
+        else
+            removeExtent(root->m_right, extent);
+        return;
+    }
+
+    // Rotate the extent down until it has a single child
+    if (root->m_left == NULL)
+    {
+        root = root->m_right;
+    } else if (root->m_right == NULL)
+    {
+        root = root->m_left;
+    } else if (getPriority(root->m_left) > getPriority(root->m_right))
+    {
+        rotateRight(root);
+        removeExtent(root->m_right, extent);
+    } else
+    {
+        rotateLeft(root);
+        removeExtent(root->m_left, extent);
+    }
+}
+
+LargeMemoryHeapManager::FreeExtent* LargeMemoryHeapManager::findBestFit(
+    uint pages) const
+{
+    FreeExtent* ret = NULL;
+    FreeExtent* node = m_freeExtents;
+    while (node != NULL)
+    {
+        if (node->m_header.m_pages >= pages)
+        {
+            // Fits. Look for a smaller (or a lower) one.
+            ret = node;
+            node = node->m_left;
+        } else
+        {
+            node = node->m_right;
+        }
+    }
+    return ret;
+}
+
+void LargeMemoryHeapManager::addFreeExtent(ExtentHeader* extent)
+{
+    extent->m_magic = FREE_EXTENT_MAGIC;
+    insertExtent(m_freeExtents, (FreeExtent*)extent);
+}
+
+uint LargeMemoryHeapManager::getMaximumAllocationUnit() const
+{
+    cLock lock(m_lock);
+    FreeExtent* node = m_freeExtents;
+    if (node == NULL)
+        return 0;
+    while (node->m_right != NULL)
+        node = node->m_right;
+
+    return (node->m_header.m_pages << PAGE_SHIFT) - ALLOCATED_UNIT_OVERHEAD;
+}
+
+uint LargeMemoryHeapManager::getMinimumAllocationUnit() const
+{
+    return PAGE_SIZE;
+}
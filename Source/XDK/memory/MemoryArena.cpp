@@ -0,0 +1,175 @@
+/*
+ * Copyright (c) 2008-2016, Integrity Project Ltd. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * Neither the name of the Integrity Project nor the names of its contributors
+ * may be used to endorse or promote products derived from this software
+ * without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE
+ */
+
+
+
+
+/*
+ * MemoryArena.cpp
+ *
+ * Implementation file
+ */
+#include "xStl/types.h"
+#include "xStl/except/assert.h"
+#include "xdk/memory/MemoryArena.h"
+
+MemoryArena::MemoryArena(MemorySuperblockHeapManager& heap,
+                         uint chunkLength,
+                         void* initialBuffer,
+                         uint initialBufferLength) :
+    m_heap(heap),
+    m_chunkLength(chunkLength),
+    m_initialBuffer(initialBuffer),
+    m_initialBufferLength(initialBufferLength),
+    m_chunks(NULL),
+    m_position(0),
+    m_end(0),
+    m_allocatedBytes(0),
+    m_numberOfChunks(0)
+{
+    CHECK(m_chunkLength > sizeof(ChunkHeader));
+    release();
+}
+
+MemoryArena::~MemoryArena()
+{
+    release();
+}
+
+void* MemoryArena::allocate(uint length, uint alignment)
+{
+    if ((length == 0) || (alignment == 0) ||
+        ((alignment & (alignment - 1)) != 0))
+    {
+        return NULL;
+    }
+
+    // The common case. Bump the current chunk.
+    addressNumericValue mask = (addressNumericValue)alignment - 1;
+    addressNumericValue position = (m_position + mask) & ~mask;
+    if ((position >= m_position) && (position <= m_end) &&
+        ((m_end - position) >= length))
+    {
+        m_position = position + length;
+        m_allocatedBytes+= length;
+        return getPtr(position);
+    }
+
+    // Leave room for the header and for the worst misalignment
+    uint chunkLength = length + alignment - 1 + sizeof(ChunkHeader);
+    if (chunkLength < length)
+        return NULL;
+
+    // Large blocks get a chunk of their own. The current chunk stays.
+    bool isDedicated = (chunkLength > (m_chunkLength / 2));
+    if (!isDedicated)
+        chunkLength = m_chunkLength;
+
+    ChunkHeader* chunk = allocateChunk(chunkLength);
+    if (chunk == NULL)
+        return NULL;
+
+    addressNumericValue start = getNumeric(chunk + 1);
+    position = (start + mask) & ~mask;
+    if (!isDedicated)
+    {
+        m_position = position + length;
+        m_end = getNumeric(chunk) + chunkLength;
+    }
+
+    m_allocatedBytes+= length;
+    return getPtr(position);
+}
+
+MemoryArena::ChunkHeader* MemoryArena::allocateChunk(uint length)
+{
+    ChunkHeader* chunk = (ChunkHeader*)m_heap.allocate(length);
+    if (chunk == NULL)
+        return NULL;
+
+    chunk->m_next = m_chunks;
+    chunk->m_length = length;
+    m_chunks = chunk;
+    m_numberOfChunks++;
+    return chunk;
+}
+
+void MemoryArena::release()
+{
+    ChunkHeader* chunk = m_chunks;
+    while (chunk != NULL)
+    {
+        ChunkHeader* next = chunk->m_next;
+        m_heap.free(chunk);
+        chunk = next;
+    }
+    m_chunks = NULL;
+    m_numberOfChunks = 0;
+    m_allocatedBytes = 0;
+
+    // Start over with the buffer of the caller
+    m_position = getNumeric(m_initialBuffer);
+    m_end = m_position + m_initialBufferLength;
+}
+
+bool MemoryArena::isOwner(void* buffer) const
+{
+    if (isInRange(buffer, m_initialBuffer, m_initialBufferLength))
+        return true;
+
+    for (const ChunkHeader* chunk = m_chunks;
+         chunk != NULL;
+         chunk = chunk->m_next)
+    {
+        if (isInRange(buffer, (void*)(chunk + 1),
+                      chunk->m_length - sizeof(ChunkHeader)))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool MemoryArena::isInRange(void* buffer, void* start, uint length)
+{
+    return (getNumeric(buffer) >= getNumeric(start)) &&
+           ((getNumeric(buffer) - getNumeric(start)) < length);
+}
+
+uint MemoryArena::getNumberOfAllocatedBytes() const
+{
+    return m_allocatedBytes;
+}
+
+uint MemoryArena::getNumberOfChunks() const
+{
+    return m_numberOfChunks;
+}
@@ -0,0 +1,275 @@
+/*
+ * Copyright (c) 2008-2016, Integrity Project Ltd. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * Neither the name of the Integrity Project nor the names of its contributors
+ * may be used to endorse or promote products derived from this software
+ * without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE
+ */
+
+
+
+
+
+
+/*
+ * MemoryLargePageAllocator.cpp
+ *
+ * Implementation file
+ */
+#include "xStl/types.h"
+#include "xStl/os/os.h"
+#include "xStl/os/lock.h"
+#include "xStl/except/assert.h"
+#include "xdk/memory/MemoryLargePageAllocator.h"
+
+#ifndef XDK_TEST
+    #include "xdk/kernel.h"
+    #include "xdk/utils/processorUtil.h"
+#elif defined(XSTL_LINUX)
+    #include <stdio.h>
+    #include <string.h>
+    #include <sys/mman.h>
+#else
+    #include <windows.h>
+#endif
+
+#ifndef XDK_TEST
+// The large page size of x64 and x86 with PAE. (PDE of 512 PTEs)
+#define KERNEL_LARGE_PAGE_SIZE (2*1024*1024)
+#endif
+
+MemoryLargePageAllocator::MemoryLargePageAllocator(
+                                const SuperiorOSMemePtr& fallback) :
+    m_fallback(fallback),
+    m_largePageSize(0),
+    m_numberOfBlocks(0),
+    m_largePageBytes(0)
+{
+    m_largePageSize = queryLargePageSize();
+    // The superblocks are aligned to the large page size, which must be a
+    // multiple of the alignment of the fallback interface
+    if ((m_largePageSize != 0) &&
+        ((m_largePageSize % m_fallback->getSuperblockPageAlignment()) != 0))
+    {
+        m_largePageSize = 0;
+    }
+}
+
+uint MemoryLargePageAllocator::getSuperblockPageAlignment()
+{
+    if (m_largePageSize == 0)
+        return m_fallback->getSuperblockPageAlignment();
+    return m_largePageSize;
+}
+
+void* MemoryLargePageAllocator::allocateNewSuperblock(uint length)
+{
+    if ((m_largePageSize == 0) || (length == 0) ||
+        ((length % m_largePageSize) != 0))
+    {
+        return m_fallback->allocateNewSuperblock(length);
+    }
+
+    // Reserve an entry, so the table cannot be full after the allocation
+    {
+        cLock lock(m_lock);
+        if (m_numberOfBlocks == MAX_LARGE_BLOCKS)
+            return m_fallback->allocateNewSuperblock(length);
+        m_blocks[m_numberOfBlocks].m_pointer = NULL;
+        m_blocks[m_numberOfBlocks].m_length = 0;
+        m_numberOfBlocks++;
+    }
+
+    void* ret = allocateLargePages(length);
+
+    cLock lock(m_lock);
+    // Fill the reserved entry, or release it. Entries which were reserved by
+    // other threads are empty as well.
+    for (uint i = 0; i < m_numberOfBlocks; i++)
+    {
+        if (m_blocks[i].m_pointer != NULL)
+            continue;
+
+        if (ret != NULL)
+        {
+            m_blocks[i].m_pointer = ret;
+            m_blocks[i].m_length = length;
+            m_largePageBytes+= length;
+        } else
+        {
+            m_numberOfBlocks--;
+            m_blocks[i] = m_blocks[m_numberOfBlocks];
+        }
+        break;
+    }
+    lock.unlock();
+
+    if (ret == NULL)
+        return m_fallback->allocateNewSuperblock(length);
+    return ret;
+}
+
+void MemoryLargePageAllocator::freeSuperblock(void* pointer)
+{
+    uint length = 0;
+    {
+        cLock lock(m_lock);
+        for (uint i = 0; i < m_numberOfBlocks; i++)
+        {
+            if (m_blocks[i].m_pointer == pointer)
+            {
+                length = m_blocks[i].m_length;
+                m_largePageBytes-= length;
+                m_numberOfBlocks--;
+                m_blocks[i] = m_blocks[m_numberOfBlocks];
+                break;
+            }
+        }
+    }
+
+    if (length == 0)
+        m_fallback->freeSuperblock(pointer);
+    else
+        freeLargePages(pointer, length);
+}
+
+uint MemoryLargePageAllocator::getLargePageSize() const
+{
+    return m_largePageSize;
+}
+
+uint MemoryLargePageAllocator::getNumberOfLargePageBytes() const
+{
+    return m_largePageBytes;
+}
+
+uint MemoryLargePageAllocator::queryLargePageSize()
+{
+    #ifndef XDK_TEST
+        return KERNEL_LARGE_PAGE_SIZE;
+    #elif defined(XSTL_LINUX)
+        // Transparent huge pages are used when the huge pages pool is empty
+        bool isAvailable = false;
+        char line[128];
+        FILE* file = fopen("/sys/kernel/mm/transparent_hugepage/enabled", "r");
+        if (file != NULL)
+        {
+            if (fgets(line, sizeof(line), file) != NULL)
+                isAvailable = (strstr(line, "[never]") == NULL);
+            fclose(file);
+        }
+
+        uint size = 0;
+        file = fopen("/proc/meminfo", "r");
+        if (file != NULL)
+        {
+            while (fgets(line, sizeof(line), file) != NULL)
+            {
+                unsigned int value = 0;
+                if (sscanf(line, "Hugepagesize: %u kB", &value) == 1)
+                    size = value * 1024;
+                else if ((sscanf(line, "HugePages_Total: %u", &value) == 1) &&
+                         (value > 0))
+                    isAvailable = true;
+            }
+            fclose(file);
+        }
+
+        return isAvailable ? size : 0;
+    #else
+        return (uint)GetLargePageMinimum();
+    #endif
+}
+
+void* MemoryLargePageAllocator::allocateLargePages(uint length)
+{
+    #ifndef XDK_TEST
+        // Called in IRQL PASSIVE_LEVEL to DISPATCH_LEVEL
+        ASSERT(cProcessorUtil::getCurrentIrql() <= DISPATCH_LEVEL);
+
+        // NOTE: No documented kernel API guarantees a large page mapping.
+        //       The memory manager maps contiguous memory with large pages
+        //       only when the range allows it, so this is best-effort. A
+        //       block whose address isn't aligned to the large page size
+        //       cannot be mapped by large pages at all, and is returned.
+        PHYSICAL_ADDRESS lowest;
+        PHYSICAL_ADDRESS highest;
+        PHYSICAL_ADDRESS boundary;
+        lowest.QuadPart = 0;
+        highest.QuadPart = -1;
+        boundary.QuadPart = 0;
+        void* ret = MmAllocateContiguousMemorySpecifyCache(length, lowest,
+                                                           highest, boundary,
+                                                           MmCached);
+        if ((ret != NULL) &&
+            ((getNumeric(ret) & (m_largePageSize - 1)) != 0))
+        {
+            MmFreeContiguousMemorySpecifyCache(ret, length, MmCached);
+            ret = NULL;
+        }
+        return ret;
+    #elif defined(XSTL_LINUX)
+        void* ret = mmap(NULL, length, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (ret != MAP_FAILED)
+            return ret;
+
+        // Transparent huge pages. The region is aligned to the large page
+        // size, so it can be promoted.
+        uint8* region = (uint8*)mmap(NULL, length + m_largePageSize,
+                                     PROT_READ | PROT_WRITE,
+                                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (region == MAP_FAILED)
+            return NULL;
+        uint8* aligned = (uint8*)
+            ((getNumeric(region) + m_largePageSize - 1) &
+             ~((addressNumericValue)m_largePageSize - 1));
+        if (aligned != region)
+            munmap(region, aligned - region);
+        munmap(aligned + length, (region + m_largePageSize) - aligned);
+        if (madvise(aligned, length, MADV_HUGEPAGE) != 0)
+        {
+            munmap(aligned, length);
+            return NULL;
+        }
+        return aligned;
+    #else
+        return VirtualAlloc(NULL, length,
+                            MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES,
+                            PAGE_READWRITE);
+    #endif
+}
+
+void MemoryLargePageAllocator::freeLargePages(void* pointer, uint length)
+{
+    #ifndef XDK_TEST
+        MmFreeContiguousMemorySpecifyCache(pointer, length, MmCached);
+    #elif defined(XSTL_LINUX)
+        munmap(pointer, length);
+    #else
+        VirtualFree(pointer, 0, MEM_RELEASE);
+    #endif
+}
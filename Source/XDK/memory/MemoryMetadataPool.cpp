@@ -0,0 +1,217 @@
+/*
+ * Copyright (c) 2008-2016, Integrity Project Ltd. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * Neither the name of the Integrity Project nor the names of its contributors
+ * may be used to endorse or promote products derived from this software
+ * without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE
+ */
+
+
+/*
+ * MemoryMetadataPool.cpp
+ *
+ * Implementation file
+ */
+#include "xStl/types.h"
+#include "xStl/except/assert.h"
+#include "xdk/memory/MemoryMetadataPool.h"
+
+MemoryMetadataPool::MemoryMetadataPool(void* buffer,
+                                       uint length,
+                                       uint objectLength) :
+    m_chunks(NULL),
+    m_initialChunk(NULL),
+    m_objectLength((t_max(objectLength, (uint)sizeof(FreeObject)) +
+                    ALIGNMENT - 1) & ~((uint)ALIGNMENT - 1)),
+    m_numberOfChunks(0),
+    m_freeObjects(0)
+{
+    if (buffer == NULL)
+        return;
+
+    m_initialChunk = formatChunk(buffer, length);
+    m_chunks = m_initialChunk;
+}
+
+uint MemoryMetadataPool::getHeaderLength()
+{
+    return (sizeof(Chunk) + ALIGNMENT - 1) & ~((uint)ALIGNMENT - 1);
+}
+
+uint MemoryMetadataPool::getMinimumChunkLength() const
+{
+    // The worst alignment of the chunk is included
+    return ALIGNMENT - 1 + getHeaderLength() + m_objectLength;
+}
+
+uint MemoryMetadataPool::getObjectLength() const
+{
+    return m_objectLength;
+}
+
+uint MemoryMetadataPool::getNumberOfChunks() const
+{
+    return m_numberOfChunks;
+}
+
+uint MemoryMetadataPool::getNumberOfFreeObjects() const
+{
+    return m_freeObjects;
+}
+
+bool MemoryMetadataPool::isExhausted() const
+{
+    return m_freeObjects == 0;
+}
+
+MemoryMetadataPool::Chunk* MemoryMetadataPool::formatChunk(void* buffer,
+                                                           uint length)
+{
+    addressNumericValue start = getNumeric(buffer);
+    addressNumericValue end = start + length;
+    start = (start + ALIGNMENT - 1) & ~((addressNumericValue)ALIGNMENT - 1);
+    if ((end < start) || ((end - start) < (getHeaderLength() + m_objectLength)))
+        return NULL;
+
+    Chunk* chunk = (Chunk*)getPtr(start);
+    chunk->m_next = NULL;
+    chunk->m_buffer = buffer;
+    chunk->m_length = length;
+    chunk->m_numberOfObjects = (uint)((end - start - getHeaderLength()) /
+                                      m_objectLength);
+    chunk->m_usedObjects = 0;
+
+    // Link the descriptors by their address
+    FreeObject** link = &chunk->m_freeList;
+    addressNumericValue position = start + getHeaderLength();
+    for (uint i = 0; i < chunk->m_numberOfObjects; i++)
+    {
+        FreeObject* object = (FreeObject*)getPtr(position);
+        *link = object;
+        link = &object->m_next;
+        position+= m_objectLength;
+    }
+    *link = NULL;
+
+    m_numberOfChunks++;
+    m_freeObjects+= chunk->m_numberOfObjects;
+    return chunk;
+}
+
+bool MemoryMetadataPool::isInside(const Chunk* chunk, void* object) const
+{
+    addressNumericValue first = getNumeric(chunk) + getHeaderLength();
+    addressNumericValue address = getNumeric(object);
+    return (address >= first) &&
+           (address < (first + chunk->m_numberOfObjects * m_objectLength));
+}
+
+void* MemoryMetadataPool::allocate()
+{
+    if (m_freeObjects == 0)
+        return NULL;
+
+    // Prefer the older chunks
+    Chunk* chunk = m_chunks;
+    while (chunk->m_freeList == NULL)
+    {
+        chunk = chunk->m_next;
+        ASSERT(chunk != NULL);
+    }
+
+    FreeObject* ret = chunk->m_freeList;
+    chunk->m_freeList = ret->m_next;
+    chunk->m_usedObjects++;
+    m_freeObjects--;
+    return ret;
+}
+
+bool MemoryMetadataPool::free(void* object)
+{
+    if (object == NULL)
+        return false;
+
+    for (Chunk* chunk = m_chunks; chunk != NULL; chunk = chunk->m_next)
+    {
+        if (!isInside(chunk, object))
+            continue;
+
+        ASSERT(((getNumeric(object) - getNumeric(chunk) - getHeaderLength()) %
+                m_objectLength) == 0);
+        ASSERT(chunk->m_usedObjects > 0);
+        FreeObject* freeObject = (FreeObject*)object;
+        freeObject->m_next = chunk->m_freeList;
+        chunk->m_freeList = freeObject;
+        chunk->m_usedObjects--;
+        m_freeObjects++;
+        return true;
+    }
+
+    return false;
+}
+
+void MemoryMetadataPool::addChunk(void* chunk, uint length)
+{
+    Chunk* newChunk = formatChunk(chunk, length);
+    ASSERT(newChunk != NULL);
+    if (newChunk == NULL)
+        return;
+
+    // The newest chunk is the last one
+    Chunk** link = &m_chunks;
+    while (*link != NULL)
+        link = &(*link)->m_next;
+    *link = newChunk;
+}
+
+void* MemoryMetadataPool::removeEmptyChunk(uint& length)
+{
+    // Take the newest empty chunk. The list is short.
+    Chunk* found = NULL;
+    Chunk* foundPrevious = NULL;
+    Chunk* previous = NULL;
+    for (Chunk* chunk = m_chunks; chunk != NULL; chunk = chunk->m_next)
+    {
+        if ((chunk != m_initialChunk) && (chunk->m_usedObjects == 0))
+        {
+            found = chunk;
+            foundPrevious = previous;
+        }
+        previous = chunk;
+    }
+    if (found == NULL)
+        return NULL;
+
+    if (foundPrevious != NULL)
+        foundPrevious->m_next = found->m_next;
+    else
+        m_chunks = found->m_next;
+    m_numberOfChunks--;
+    m_freeObjects-= found->m_numberOfObjects;
+
+    length = found->m_length;
+    return found->m_buffer;
+}
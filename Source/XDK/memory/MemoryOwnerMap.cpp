@@ -0,0 +1,213 @@
+/*
+ * Copyright (c) 2008-2016, Integrity Project Ltd. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * Neither the name of the Integrity Project nor the names of its contributors
+ * may be used to endorse or promote products derived from this software
+ * without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE
+ */
+
+/*
+ * MemoryOwnerMap.cpp
+ *
+ * Implementation file
+ */
+#include "xStl/types.h"
+#include "xStl/except/assert.h"
+#include "xStl/except/trace.h"
+#include "xdk/memory/MemoryOwnerMap.h"
+
+MemoryOwnerMap::MemoryOwnerMap(const SuperiorOSMemePtr& osmem) :
+    m_osmem(osmem),
+    m_nodesChunk(NULL),
+    m_nodesChunkLength(0),
+    m_nodesChunkPosition(0)
+{
+    for (uint i = 0; i < ROOT_ENTRIES; i++)
+        m_root[i] = NULL;
+}
+
+MemoryOwnerMap::~MemoryOwnerMap()
+{
+    // All nodes are stored inside the chunks. Free the chunks chain.
+    while (m_nodesChunk != NULL)
+    {
+        void* previous = *((void**)m_nodesChunk);
+        m_osmem->freeSuperblock(m_nodesChunk);
+        m_nodesChunk = previous;
+    }
+}
+
+addressNumericValue MemoryOwnerMap::getGranule(addressNumericValue address)
+{
+    return (address >> GRANULARITY_SHIFT) &
+           ((((addressNumericValue)1) << INDEX_BITS) - 1);
+}
+
+MemoryOwnerMap::Entry& MemoryOwnerMap::getEntry(addressNumericValue granule)
+{
+    MiddleNode* middle = m_root[granule >> (LEAF_BITS + MIDDLE_BITS)];
+    ASSERT(middle != NULL);
+    LeafNode* leaf = middle->m_leaves[(granule >> LEAF_BITS) &
+                                      (MIDDLE_ENTRIES - 1)];
+    ASSERT(leaf != NULL);
+    return leaf->m_entries[granule & (LEAF_ENTRIES - 1)];
+}
+
+void* MemoryOwnerMap::allocateNode(uint length)
+{
+    // Align the position of the node to a pointer size
+    uint position = (m_nodesChunkPosition + sizeof(addressNumericValue) - 1) &
+                    ~(sizeof(addressNumericValue) - 1);
+
+    if ((m_nodesChunk == NULL) || ((position + length) > m_nodesChunkLength))
+    {
+        // Allocate a new chunk. The first pointer links the previous chunk
+        uint alignment = m_osmem->getSuperblockPageAlignment();
+        uint chunkLength = t_max((uint)NODES_CHUNK_SIZE,
+                                 (uint)(length + sizeof(addressNumericValue)));
+        chunkLength = ((chunkLength + alignment - 1) / alignment) * alignment;
+
+        void* chunk = m_osmem->allocateNewSuperblock(chunkLength);
+        if (chunk == NULL)
+            return NULL;
+
+        *((void**)chunk) = m_nodesChunk;
+        m_nodesChunk = chunk;
+        m_nodesChunkLength = chunkLength;
+        position = sizeof(addressNumericValue);
+    }
+
+    void* ret = getPtr(getNumeric(m_nodesChunk) + position);
+    m_nodesChunkPosition = position + length;
+
+    // Nodes must be empty before they are published
+    memset(ret, 0, length);
+    return ret;
+}
+
+bool MemoryOwnerMap::reserve(void* start, uint length)
+{
+    ASSERT(length > 0);
+
+    addressNumericValue first = getGranule(getNumeric(start));
+    addressNumericValue last = getGranule(getNumeric(start) + length - 1);
+
+    for (addressNumericValue granule = first; granule <= last; granule++)
+    {
+        uint rootIndex = (uint)(granule >> (LEAF_BITS + MIDDLE_BITS));
+        uint middleIndex = (uint)((granule >> LEAF_BITS) &
+                                  (MIDDLE_ENTRIES - 1));
+
+        if (m_root[rootIndex] == NULL)
+        {
+            MiddleNode* middle = (MiddleNode*)allocateNode(sizeof(MiddleNode));
+            if (middle == NULL)
+                return false;
+            // Publish the node only after it was cleared
+            m_root[rootIndex] = middle;
+        }
+
+        MiddleNode* middle = m_root[rootIndex];
+        if (middle->m_leaves[middleIndex] == NULL)
+        {
+            LeafNode* leaf = (LeafNode*)allocateNode(sizeof(LeafNode));
+            if (leaf == NULL)
+                return false;
+            middle->m_leaves[middleIndex] = leaf;
+        }
+
+        // Skip to the last granule of the leaf
+        granule|= (LEAF_ENTRIES - 1);
+    }
+
+    return true;
+}
+
+void MemoryOwnerMap::insert(void* start, uint length, void* owner)
+{
+    CHECK(length >= GRANULARITY);
+    ASSERT(owner != NULL);
+
+    addressNumericValue saddr = getNumeric(start);
+    addressNumericValue first = getGranule(saddr);
+    addressNumericValue last = getGranule(saddr + length - 1);
+
+    for (addressNumericValue granule = first; granule <= last; granule++)
+    {
+        Entry& entry = getEntry(granule);
+        if ((granule == first) && ((saddr & (GRANULARITY - 1)) != 0))
+        {
+            // The owner starts inside the granule.
+            ASSERT(entry.m_highOwner == NULL);
+            entry.m_highStart = saddr;
+            entry.m_highOwner = owner;
+        } else
+        {
+            ASSERT(entry.m_lowOwner == NULL);
+            entry.m_lowOwner = owner;
+        }
+    }
+}
+
+void MemoryOwnerMap::remove(void* start, uint length)
+{
+    addressNumericValue saddr = getNumeric(start);
+    addressNumericValue first = getGranule(saddr);
+    addressNumericValue last = getGranule(saddr + length - 1);
+
+    for (addressNumericValue granule = first; granule <= last; granule++)
+    {
+        Entry& entry = getEntry(granule);
+        if ((granule == first) && ((saddr & (GRANULARITY - 1)) != 0))
+        {
+            entry.m_highOwner = NULL;
+            entry.m_highStart = 0;
+        } else
+        {
+            entry.m_lowOwner = NULL;
+        }
+    }
+}
+
+void* MemoryOwnerMap::lookup(void* address) const
+{
+    addressNumericValue naddr = getNumeric(address);
+    addressNumericValue granule = getGranule(naddr);
+
+    MiddleNode* middle = m_root[granule >> (LEAF_BITS + MIDDLE_BITS)];
+    if (middle == NULL)
+        return NULL;
+    LeafNode* leaf = middle->m_leaves[(granule >> LEAF_BITS) &
+                                      (MIDDLE_ENTRIES - 1)];
+    if (leaf == NULL)
+        return NULL;
+
+    const Entry& entry = leaf->m_entries[granule & (LEAF_ENTRIES - 1)];
+    void* highOwner = entry.m_highOwner;
+    if ((highOwner != NULL) && (naddr >= entry.m_highStart))
+        return highOwner;
+    return entry.m_lowOwner;
+}
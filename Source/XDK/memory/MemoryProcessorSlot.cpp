@@ -0,0 +1,65 @@
+/*
+ * Copyright (c) 2008-2016, Integrity Project Ltd. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * Neither the name of the Integrity Project nor the names of its contributors
+ * may be used to endorse or promote products derived from this software
+ * without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE
+ */
+
+
+
+
+/*
+ * MemoryProcessorSlot.cpp
+ *
+ * Implementation file
+ */
+#include "xStl/types.h"
+#include "xdk/memory/MemoryAtomic.h"
+#include "xdk/memory/MemoryProcessorSlot.h"
+
+#ifdef XDK_TEST
+// The number of the current thread, plus one. Zero for threads which didn't
+// ask for a slot yet.
+static XDK_MEMORY_THREAD_LOCAL uint32 gProcessorSlotThread = 0;
+// The number of threads which were numbered
+static volatile uint32 gProcessorSlotThreadsCounter = 0;
+#endif
+
+uint32 MemoryProcessorSlot::getCurrentProcessor()
+{
+    #ifndef XDK_TEST
+        return cProcessorUtil::getCurrentProcessorNumber();
+    #else
+        uint32 thread = gProcessorSlotThread;
+        if (thread == 0)
+        {
+            thread = MemoryAtomic::increment(&gProcessorSlotThreadsCounter);
+            gProcessorSlotThread = thread;
+        }
+        return thread - 1;
+    #endif
+}
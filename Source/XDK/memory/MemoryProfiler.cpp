@@ -0,0 +1,298 @@
+/*
+ * Copyright (c) 2008-2016, Integrity Project Ltd. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * Neither the name of the Integrity Project nor the names of its contributors
+ * may be used to endorse or promote products derived from this software
+ * without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE
+ */
+
+
+/*
+ * MemoryProfiler.cpp
+ *
+ * Implementation file
+ */
+#include "xStl/types.h"
+#include "xStl/os/os.h"
+#include "xStl/except/assert.h"
+#include "xdk/memory/MemoryAtomic.h"
+#include "xdk/memory/MemoryBitScan.h"
+#include "xdk/memory/MemoryProfiler.h"
+
+#ifndef XDK_TEST
+    #include "xdk/kernel.h"
+#elif defined(XSTL_LINUX)
+    #include <execinfo.h>
+#else
+    #include <windows.h>
+#endif
+
+MemoryProfiler::MemoryProfiler(uint sampleRate) :
+    m_sampleRate(0),
+    m_numberOfSamples(0),
+    m_droppedSamples(0)
+{
+    ASSERT((1 << TABLE_SHIFT) == MemoryProfileDump::MAX_SAMPLES);
+
+    m_startTime = cOS::getSystemTime();
+
+    uint i;
+    for (i = 0; i < MemoryProfileDump::MAX_SAMPLES; i++)
+        m_keys[i] = KEY_EMPTY;
+
+    // Each slot gets a different sequence of intervals
+    for (i = 0; i < PROFILER_SLOTS; i++)
+    {
+        m_slots[i].m_seed = (i + 1) * 0x9E3779B9;
+        m_slots[i].m_bytesUntilSample = 0;
+    }
+
+    setSampleRate(sampleRate);
+}
+
+void MemoryProfiler::setSampleRate(uint sampleRate)
+{
+    m_sampleRate = sampleRate;
+    if (sampleRate == 0)
+        return;
+
+    // Restart the intervals with the new mean
+    for (uint i = 0; i < PROFILER_SLOTS; i++)
+        m_slots[i].m_bytesUntilSample = getNextInterval(m_slots[i]);
+}
+
+uint MemoryProfiler::getSampleRate() const
+{
+    return m_sampleRate;
+}
+
+uint MemoryProfiler::getNumberOfSamples() const
+{
+    return m_numberOfSamples;
+}
+
+void MemoryProfiler::recordAllocation(void* block,
+                                      uint length,
+                                      uint skipFrames)
+{
+    if (m_sampleRate == 0)
+        return;
+
+    Slot& slot = getSlot();
+    if (length < slot.m_bytesUntilSample)
+    {
+        slot.m_bytesUntilSample-= length;
+        return;
+    }
+
+    // The interval is over. The distribution is memoryless, so the next
+    // interval starts from scratch.
+    slot.m_bytesUntilSample = getNextInterval(slot);
+    if (!insertSample(block, length, skipFrames + 1))
+        MemoryAtomic::increment(&m_droppedSamples);
+}
+
+void MemoryProfiler::recordFree(void* block)
+{
+    // The common case. Nothing was sampled.
+    if (m_numberOfSamples == 0)
+        return;
+
+    addressNumericValue key = getNumeric(block);
+    if (findSample(key) == MemoryProfileDump::MAX_SAMPLES)
+        return;
+
+    cLock lock(m_lock);
+    uint position = findSample(key);
+    if (position == MemoryProfileDump::MAX_SAMPLES)
+        return;
+
+    m_keys[position] = KEY_REMOVED;
+    m_numberOfSamples--;
+
+    // Removed keys which are followed by an empty key are not part of any
+    // probing sequence. Empty them, so the sequences stay short.
+    uint mask = MemoryProfileDump::MAX_SAMPLES - 1;
+    if (m_keys[(position + 1) & mask] == KEY_EMPTY)
+    {
+        while (m_keys[position] == KEY_REMOVED)
+        {
+            m_keys[position] = KEY_EMPTY;
+            position = (position - 1) & mask;
+        }
+    }
+}
+
+void MemoryProfiler::dump(MemoryProfileDump& dump)
+{
+    dump.m_magic = MemoryProfileDump::MAGIC;
+    dump.m_version = MemoryProfileDump::VERSION;
+    dump.m_sampleRate = m_sampleRate;
+    dump.m_droppedSamples = m_droppedSamples;
+    dump.m_time = cOS::calculateTimesDiffMilli(cOS::getSystemTime(),
+                                               m_startTime);
+    dump.m_imageBase = 0;
+    dump.m_imageSize = 0;
+    dump.m_reserved = 0;
+
+    cLock lock(m_lock);
+    uint count = 0;
+    for (uint i = 0; i < MemoryProfileDump::MAX_SAMPLES; i++)
+    {
+        if (m_keys[i] > KEY_REMOVED)
+        {
+            dump.m_samples[count] = m_samples[i];
+            count++;
+        }
+    }
+    dump.m_numberOfSamples = count;
+}
+
+MemoryProfiler::Slot& MemoryProfiler::getSlot()
+{
+    return m_slots[MemoryProcessorSlot::getCurrentSlot()];
+}
+
+uint32 MemoryProfiler::getNextInterval(Slot& slot)
+{
+    // Xorshift random numbers. The seed is never 0.
+    uint32 random = slot.m_seed;
+    random^= random << 13;
+    random^= random >> 17;
+    random^= random << 5;
+    slot.m_seed = random;
+
+    // The interval is -ln(U) * m_sampleRate, where U = random / 2^32 is
+    // uniform in (0, 1). Since -ln(U) = (32 - log2(random)) * ln(2), only an
+    // integer log2 is needed. The fraction of log2 is interpolated linearly
+    // between the powers of 2, in 16 bits fixed point.
+    uint msb = MemoryBitScan::highestSetBit(random);
+    uint32 mantissa = random - ((uint32)1 << msb);
+    uint32 fraction = (msb >= 16) ? (mantissa >> (msb - 16)) :
+                                    (mantissa << (16 - msb));
+    uint32 minusLog2 = (32 << 16) - ((msb << 16) + fraction);
+
+    // The interpolation is below log2 by 0.0573 on average (3755 / 65536).
+    // Without the correction the mean interval is 4% too long.
+    minusLog2 = (minusLog2 > 3755) ? (minusLog2 - 3755) : 0;
+
+    // ln(2) = 45426 / 65536
+    uint64 minusLn = ((uint64)minusLog2 * 45426) >> 16;
+    uint64 interval = ((uint64)m_sampleRate * minusLn) >> 16;
+    if (interval > 0xFFFFFFFF)
+        return 0xFFFFFFFF;
+    return (uint32)interval;
+}
+
+bool MemoryProfiler::insertSample(void* block, uint length, uint skipFrames)
+{
+    // Prepare the sample without the lock
+    MemoryProfileSample sample;
+    sample.m_block = getNumeric(block);
+    sample.m_numberOfFrames = captureStackTrace(sample.m_frames,
+                                    MemoryProfileSample::MAX_FRAMES,
+                                    skipFrames + 1);
+    sample.m_length = length;
+    sample.m_time = cOS::calculateTimesDiffMilli(cOS::getSystemTime(),
+                                                 m_startTime);
+    sample.m_reserved = 0;
+
+    addressNumericValue key = getNumeric(block);
+    ASSERT(key > KEY_REMOVED);
+
+    cLock lock(m_lock);
+    if (m_numberOfSamples >= MAX_LIVE_SAMPLES)
+        return false;
+
+    // The table is never full, so an unused key is always found
+    uint mask = MemoryProfileDump::MAX_SAMPLES - 1;
+    uint position = getHashPosition(key);
+    while (m_keys[position] > KEY_REMOVED)
+        position = (position + 1) & mask;
+
+    // The sample is written before the key is published. The volatile key
+    // keeps the order.
+    m_samples[position] = sample;
+    m_keys[position] = key;
+    m_numberOfSamples++;
+    return true;
+}
+
+uint MemoryProfiler::findSample(addressNumericValue block) const
+{
+    uint mask = MemoryProfileDump::MAX_SAMPLES - 1;
+    uint position = getHashPosition(block);
+    for (uint i = 0; i < MemoryProfileDump::MAX_SAMPLES; i++)
+    {
+        addressNumericValue key = m_keys[position];
+        if (key == block)
+            return position;
+        if (key == KEY_EMPTY)
+            break;
+        position = (position + 1) & mask;
+    }
+    return MemoryProfileDump::MAX_SAMPLES;
+}
+
+uint MemoryProfiler::getHashPosition(addressNumericValue block)
+{
+    // Fibonacci hashing of the block address. The low bits are always 0.
+    uint32 value = (uint32)(block >> 4);
+    return (value * 0x9E3779B1) >> (32 - TABLE_SHIFT);
+}
+
+uint MemoryProfiler::captureStackTrace(uint64* frames,
+                                       uint count,
+                                       uint skipFrames)
+{
+    ASSERT(count <= MemoryProfileSample::MAX_FRAMES);
+    ASSERT(skipFrames <= MAX_SKIPPED_FRAMES);
+
+    // Skip this function as well
+    skipFrames++;
+
+    void* addresses[MemoryProfileSample::MAX_FRAMES + MAX_SKIPPED_FRAMES + 1];
+    uint captured = 0;
+    #ifndef XDK_TEST
+        captured = RtlCaptureStackBackTrace(skipFrames, count, addresses, NULL);
+    #elif defined(XSTL_LINUX)
+        int total = backtrace(addresses, count + skipFrames);
+        if (total > (int)skipFrames)
+        {
+            captured = total - skipFrames;
+            for (uint i = 0; i < captured; i++)
+                addresses[i] = addresses[i + skipFrames];
+        }
+    #else
+        captured = CaptureStackBackTrace(skipFrames, count, addresses, NULL);
+    #endif
+
+    for (uint i = 0; i < captured; i++)
+        frames[i] = getNumeric(addresses[i]);
+    for (uint i = captured; i < count; i++)
+        frames[i] = 0;
+    return captured;
+}
@@ -0,0 +1,293 @@
+/*
+ * Copyright (c) 2008-2016, Integrity Project Ltd. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * Neither the name of the Integrity Project nor the names of its contributors
+ * may be used to endorse or promote products derived from this software
+ * without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE
+ */
+
+
+
+
+/*
+ * MemorySlabPool.cpp
+ *
+ * Implementation file
+ */
+#include "xStl/types.h"
+#include "xStl/os/lock.h"
+#include "xStl/except/assert.h"
+#include "xStl/except/trace.h"
+#include "xdk/memory/MemorySlabPool.h"
+
+MemorySlabPool::MemorySlabPool(MemorySuperblockHeapManager& heap,
+                               uint objectLength,
+                               uint objectsPerSlab) :
+    m_heap(heap),
+    m_objectLength(objectLength),
+    m_objectsPerSlab(objectsPerSlab),
+    m_slabLength(0),
+    m_freeList(NULL),
+    m_freeObjects(0),
+    m_slabs(NULL),
+    m_numberOfSlabs(0),
+    m_nextPool(NULL)
+{
+    // Free objects hold the link of the free list
+    if (m_objectLength < sizeof(FreeObject))
+        m_objectLength = sizeof(FreeObject);
+    m_objectLength = (m_objectLength + OBJECT_ALIGNMENT - 1) &
+                     ~((uint)OBJECT_ALIGNMENT - 1);
+
+    if (m_objectsPerSlab == 0)
+        m_objectsPerSlab = DEFAULT_SLAB_LENGTH / m_objectLength;
+    if (m_objectsPerSlab < MINIMUM_SLAB_OBJECTS)
+        m_objectsPerSlab = MINIMUM_SLAB_OBJECTS;
+
+    // Leave room for the header and for the alignment of the heap block
+    m_slabLength = m_objectsPerSlab * m_objectLength + sizeof(SlabHeader) +
+                   OBJECT_ALIGNMENT - 1;
+    CHECK((m_slabLength / m_objectsPerSlab) >= m_objectLength);
+
+    for (uint i = 0; i < PROCESSOR_CACHES; i++)
+    {
+        #ifdef XDK_TEST
+        m_caches[i].m_busy = 0;
+        #endif
+        m_caches[i].m_count = 0;
+    }
+}
+
+MemorySlabPool::~MemorySlabPool()
+{
+    // Assume the pool is no longer used
+    #ifdef _DEBUG
+    if (getNumberOfObjects() != 0)
+    {
+        // We cannot call operator new
+        TRACE(TRACE_VERY_HIGH,
+            XSTL_STRING("MemorySlabPool dtor, memory-leak!!\n"));
+    }
+    #endif
+
+    while (m_slabs != NULL)
+    {
+        SlabHeader* slab = m_slabs;
+        m_slabs = slab->m_next;
+        m_heap.free(slab->m_block);
+    }
+}
+
+void* MemorySlabPool::allocate()
+{
+    {
+        ProcessorCacheGuard guard(m_caches);
+        ProcessorCache* cache = guard.getCache();
+        if (cache != NULL)
+        {
+            if (cache->m_count == 0)
+                cache->m_count = takeObjects(cache->m_objects, CACHE_BATCH);
+            if (cache->m_count == 0)
+                return NULL;
+            cache->m_count--;
+            return cache->m_objects[cache->m_count];
+        }
+    }
+
+    // The cache is in use by another thread
+    void* object = NULL;
+    if (takeObjects(&object, 1) == 0)
+        return NULL;
+    return object;
+}
+
+void MemorySlabPool::free(void* object)
+{
+    if (object == NULL)
+        return;
+
+    #ifdef _DEBUG
+    ASSERT(isOwner(object));
+    #endif
+
+    {
+        ProcessorCacheGuard guard(m_caches);
+        ProcessorCache* cache = guard.getCache();
+        if (cache != NULL)
+        {
+            // Make room by returning the oldest half of the cache
+            if (cache->m_count == CACHE_SIZE)
+            {
+                returnObjects(cache->m_objects, CACHE_BATCH);
+                cache->m_count-= CACHE_BATCH;
+                for (uint i = 0; i < cache->m_count; i++)
+                    cache->m_objects[i] = cache->m_objects[i + CACHE_BATCH];
+            }
+            cache->m_objects[cache->m_count] = object;
+            cache->m_count++;
+            return;
+        }
+    }
+
+    returnObjects(&object, 1);
+}
+
+bool MemorySlabPool::isOwner(void* object) const
+{
+    addressNumericValue address = getNumeric(object);
+    addressNumericValue slabObjectsLength = m_objectsPerSlab * m_objectLength;
+
+    cLock lock(m_lock);
+    for (SlabHeader* slab = m_slabs; slab != NULL; slab = slab->m_next)
+    {
+        addressNumericValue first = getNumeric(getFirstObject(slab));
+        if ((address >= first) && (address < (first + slabObjectsLength)))
+            return ((address - first) % m_objectLength) == 0;
+    }
+    return false;
+}
+
+uint MemorySlabPool::getObjectLength() const
+{
+    return m_objectLength;
+}
+
+uint MemorySlabPool::getNumberOfSlabs() const
+{
+    return m_numberOfSlabs;
+}
+
+uint MemorySlabPool::getNumberOfObjects() const
+{
+    uint ret;
+    {
+        cLock lock(m_lock);
+        ret = m_numberOfSlabs * m_objectsPerSlab - m_freeObjects;
+    }
+    for (uint i = 0; i < PROCESSOR_CACHES; i++)
+        ret-= m_caches[i].m_count;
+    return ret;
+}
+
+MemorySlabPool* MemorySlabPool::getNextPool() const
+{
+    return m_nextPool;
+}
+
+void MemorySlabPool::setNextPool(MemorySlabPool* next)
+{
+    m_nextPool = next;
+}
+
+void* MemorySlabPool::operator new(uint, void* place)
+{
+    return place;
+}
+
+void MemorySlabPool::operator delete(void*, void*)
+{
+}
+
+void* MemorySlabPool::operator new(uint cbSize)
+{
+    return ::operator new(cbSize);
+}
+
+void MemorySlabPool::operator delete(void* ptr)
+{
+    ::operator delete(ptr);
+}
+
+uint MemorySlabPool::takeObjects(void** objects, uint count)
+{
+    while (true)
+    {
+        {
+            cLock lock(m_lock);
+            uint taken = 0;
+            while ((taken < count) && (m_freeList != NULL))
+            {
+                objects[taken] = m_freeList;
+                m_freeList = m_freeList->m_next;
+                taken++;
+            }
+            m_freeObjects-= taken;
+            if (taken > 0)
+                return taken;
+        }
+
+        // Other threads might take the new objects. Try again.
+        if (!addSlab())
+            return 0;
+    }
+}
+
+void MemorySlabPool::returnObjects(void** objects, uint count)
+{
+    if (count == 0)
+        return;
+
+    // Link the objects before acquiring the lock
+    for (uint i = 0; i < (count - 1); i++)
+        ((FreeObject*)objects[i])->m_next = (FreeObject*)objects[i + 1];
+
+    cLock lock(m_lock);
+    ((FreeObject*)objects[count - 1])->m_next = m_freeList;
+    m_freeList = (FreeObject*)objects[0];
+    m_freeObjects+= count;
+}
+
+bool MemorySlabPool::addSlab()
+{
+    void* block = m_heap.allocate(m_slabLength);
+    if (block == NULL)
+        return false;
+
+    addressNumericValue mask = OBJECT_ALIGNMENT - 1;
+    SlabHeader* slab = (SlabHeader*)getPtr((getNumeric(block) + mask) & ~mask);
+    slab->m_block = block;
+
+    // Link the objects of the slab
+    uint8* first = getFirstObject(slab);
+    uint8* last = first + (m_objectsPerSlab - 1) * m_objectLength;
+    for (uint8* object = first; object != last; object+= m_objectLength)
+        ((FreeObject*)object)->m_next = (FreeObject*)(object + m_objectLength);
+
+    cLock lock(m_lock);
+    slab->m_next = m_slabs;
+    m_slabs = slab;
+    m_numberOfSlabs++;
+    ((FreeObject*)last)->m_next = m_freeList;
+    m_freeList = (FreeObject*)first;
+    m_freeObjects+= m_objectsPerSlab;
+    return true;
+}
+
+uint8* MemorySlabPool::getFirstObject(SlabHeader* slab) const
+{
+    return (uint8*)(slab + 1);
+}
+
@@ -37,6 +37,7 @@
  * Author: Elad Raz <e@eladraz.com>
  */
 #include "xStl/types.h"
+#include "xStl/os/os.h"
 #include "xdk/memory/MemorySuperblockHeapManager.h"
 
 MemorySuperblockHeapManager::MemorySuperblockHeapManager(void* superBlock,
@@ -51,16 +52,95 @@ MemorySuperblockHeapManager::~MemorySuperblockHeapManager()
 {
 }
 
-uint MemorySuperblockHeapManager::getNumberOfAllocatedBytes() const
+uint MemorySuperblockHeapManager::allocateBlocks(uint length,
+                                                 void** blocks,
+                                                 uint count)
+{
+    uint i = 0;
+    for (; i < count; i++)
+    {
+        blocks[i] = allocate(length);
+        if (blocks[i] == NULL)
+            break;
+    }
+    return i;
+}
+
+void MemorySuperblockHeapManager::freeBlocks(void** blocks, uint count)
+{
+    for (uint i = 0; i < count; i++)
+        free(blocks[i]);
+}
+
+uint MemorySuperblockHeapManager::getBlockLength(void*)
+{
+    return 0;
+}
+
+bool MemorySuperblockHeapManager::tryExpandInPlace(void* buffer,
+                                                   uint newLength)
+{
+    return (newLength > 0) && (getBlockLength(buffer) >= newLength);
+}
+
+void* MemorySuperblockHeapManager::reallocate(void* buffer, uint newLength)
+{
+    if (buffer == NULL)
+        return allocate(newLength);
+
+    if (newLength == 0)
+    {
+        free(buffer);
+        return NULL;
+    }
+
+    uint oldLength = getBlockLength(buffer);
+    if (oldLength == 0)
+        return NULL;
+
+    if (tryExpandInPlace(buffer, newLength))
+        return buffer;
+
+    // Move the block. The old block is longer than the new one only when
+    // it's shrunk, and shorter blocks always fit in place.
+    void* ret = allocate(newLength);
+    if (ret == NULL)
+        return NULL;
+
+    cOS::memcpy(ret, buffer, oldLength);
+    free(buffer);
+    return ret;
+}
+
+memorySize MemorySuperblockHeapManager::getNumberOfAllocatedBytes() const
 {
     return m_allocatedBytes;
 }
 
-uint MemorySuperblockHeapManager::getNumberOfFreeBytes() const
+memorySize MemorySuperblockHeapManager::getNumberOfFreeBytes() const
 {
     return m_superBlockLength - m_allocatedBytes;
 }
 
+void* MemorySuperblockHeapManager::operator new(uint, void* place)
+{
+    return place;
+}
+
+void MemorySuperblockHeapManager::operator delete(void*, void*)
+{
+}
+
+void* MemorySuperblockHeapManager::operator new(uint cbSize)
+{
+    return ::operator new(cbSize);
+}
+
+void MemorySuperblockHeapManager::operator delete(void* ptr)
+{
+    ::operator delete(ptr);
+}
+
 bool MemorySuperblockHeapManager::isInBoundries(void* addr,
                                                 uint prefixLength,
                                                 uint postfixLength)
@@ -0,0 +1,199 @@
+/*
+ * Copyright (c) 2008-2016, Integrity Project Ltd. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * Neither the name of the Integrity Project nor the names of its contributors
+ * may be used to endorse or promote products derived from this software
+ * without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE
+ */
+
+
+
+
+
+/*
+ * MemoryTraceRecorder.cpp
+ *
+ * Implementation file
+ */
+#include "xStl/types.h"
+#include "xStl/os/os.h"
+#include "xStl/os/lock.h"
+#include "xStl/except/assert.h"
+#include "xdk/memory/MemoryAtomic.h"
+#include "xdk/memory/MemoryTraceRecorder.h"
+
+MemoryTraceRecorder::MemoryTraceRecorder() :
+    m_isEnabled(0),
+    m_records(NULL),
+    m_sequences(NULL),
+    m_mask(0),
+    m_head(0),
+    m_tail(0),
+    m_droppedRecords(0)
+{
+    ASSERT(sizeof(MemoryTraceRecord) == 16);
+    m_startTime = cOS::getSystemTime();
+}
+
+void MemoryTraceRecorder::setBuffer(void* buffer, uint length)
+{
+    CHECK(m_records == NULL);
+
+    uint count = 1;
+    while ((count * 2) <= (length / BYTES_PER_RECORD))
+        count*= 2;
+    CHECK(count <= (length / BYTES_PER_RECORD));
+
+    m_records = (MemoryTraceRecord*)buffer;
+    m_sequences = (volatile uint32*)(m_records + count);
+    for (uint i = 0; i < count; i++)
+        m_sequences[i] = i;
+    m_mask = count - 1;
+}
+
+bool MemoryTraceRecorder::start()
+{
+    if (m_records == NULL)
+        return false;
+
+    MemoryAtomic::exchange(&m_isEnabled, 1);
+    return true;
+}
+
+void MemoryTraceRecorder::stop()
+{
+    MemoryAtomic::exchange(&m_isEnabled, 0);
+}
+
+bool MemoryTraceRecorder::isEnabled() const
+{
+    return m_isEnabled != 0;
+}
+
+void MemoryTraceRecorder::recordAllocation(void* block, uint length)
+{
+    if (m_isEnabled == 0)
+        return;
+
+    push(MemoryTraceRecord::OPERATION_ALLOCATE, block, length);
+}
+
+void MemoryTraceRecorder::recordFree(void* block)
+{
+    if (m_isEnabled == 0)
+        return;
+
+    push(MemoryTraceRecord::OPERATION_FREE, block, 0);
+}
+
+void MemoryTraceRecorder::push(uint8 operation, void* block, uint length)
+{
+    // Claim a position
+    uint32 position = m_head;
+    while (true)
+    {
+        int32 difference = (int32)(m_sequences[position & m_mask] - position);
+        if (difference == 0)
+        {
+            uint32 previous = MemoryAtomic::compareExchange(&m_head,
+                                                            position + 1,
+                                                            position);
+            if (previous == position)
+                break;
+            position = previous;
+        } else if (difference < 0)
+        {
+            // The record of the previous round wasn't drained yet
+            MemoryAtomic::increment(&m_droppedRecords);
+            return;
+        } else
+        {
+            // Another producer claimed the position
+            position = m_head;
+        }
+    }
+
+    MemoryTraceRecord& record = m_records[position & m_mask];
+    record.m_blockId = (uint32)(getNumeric(block) >> 3);
+    record.m_length = length;
+    record.m_time = cOS::calculateTimesDiffMilli(cOS::getSystemTime(),
+                                                 m_startTime);
+    record.m_processor = getProcessor();
+    record.m_operation = operation;
+    record.m_reserved = 0;
+
+    // Publish the record
+    MemoryAtomic::exchange(&m_sequences[position & m_mask], position + 1);
+}
+
+uint MemoryTraceRecorder::drain(MemoryTraceDump& dump)
+{
+    uint count = 0;
+    if (m_records != NULL)
+    {
+        cLock lock(m_drainLock);
+        while (count < MemoryTraceDump::MAX_RECORDS)
+        {
+            uint32 position = m_tail;
+            // Stop at the first record which is not published yet
+            if (m_sequences[position & m_mask] != (position + 1))
+                break;
+
+            dump.m_records[count] = m_records[position & m_mask];
+            count++;
+
+            // Free the position for the next round
+            MemoryAtomic::exchange(&m_sequences[position & m_mask],
+                                   position + m_mask + 1);
+            m_tail = position + 1;
+        }
+    }
+
+    dump.m_header.m_magic = MemoryTraceHeader::MAGIC;
+    dump.m_header.m_version = MemoryTraceHeader::VERSION;
+    dump.m_header.m_numberOfRecords = count;
+    dump.m_header.m_droppedRecords = m_droppedRecords;
+    return count;
+}
+
+uint MemoryTraceRecorder::getCapacity() const
+{
+    if (m_records == NULL)
+        return 0;
+    return m_mask + 1;
+}
+
+uint MemoryTraceRecorder::getDroppedRecords() const
+{
+    return m_droppedRecords;
+}
+
+uint16 MemoryTraceRecorder::getProcessor()
+{
+    // In the XDK_TEST build each thread is recorded as a processor of it's
+    // own
+    return (uint16)MemoryProcessorSlot::getCurrentProcessor();
+}
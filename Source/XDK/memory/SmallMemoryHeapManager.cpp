@@ -40,19 +40,30 @@
 #include "xStl/os/lock.h"
 #include "xStl/except/assert.h"
 #include "xStl/except/trace.h"
+#include "xdk/memory/MemoryBitScan.h"
 #include "xdk/memory/SmallMemoryHeapManager.h"
 
-SmallMemoryHeapManager::SmallMemoryHeapManager(void* superBlock,
-                                               uint superBlockLength,
-                                               uint allocationUnit) :
+template <class BlockIndex>
+FreeListMemoryHeapManager<BlockIndex>::FreeListMemoryHeapManager(
+                                                    void* superBlock,
+                                                    uint superBlockLength,
+                                                    uint allocationUnit,
+                                                    bool isLazyFormat) :
     MemorySuperblockHeapManager(superBlock,
                                 superBlockLength),
+    m_quickHead(makeQuickHead(NIL_BLOCK, 0)),
+    m_quickBlocks(0),
+    m_freeRunsMask(0),
+    m_untouchedBlock(0),
     m_allocationUnit(allocationUnit),
-    m_maxAllocationUnit((uint64)(allocationUnit) * 65535)
+    m_maxAllocationUnit((uint64)(allocationUnit) * (BlockIndex)MAX_BLOCKS)
 {
     // Some assertion for binary compatability
-    ASSERT(sizeof(AllocatedDescriptorBlock) == MINIMUM_ALLOCATION_UNIT);
-    ASSERT(sizeof(FreeBlock) == MINIMUM_ALLOCATION_UNIT);
+    ASSERT(sizeof(AllocatedDescriptorBlock) == ALLOCATED_UNIT_OVERHEAD);
+    ASSERT(sizeof(FreeRunBlock) == MINIMUM_ALLOCATION_UNIT);
+    ASSERT(sizeof(FreeRunTail) == ALLOCATED_UNIT_OVERHEAD);
+    ASSERT(sizeof(QuickBlockLink) + ALLOCATED_UNIT_OVERHEAD <=
+           MINIMUM_ALLOCATION_UNIT);
 
     // Test the allocation unit
     CHECK(m_allocationUnit >= MINIMUM_ALLOCATION_UNIT);
@@ -60,148 +71,582 @@ SmallMemoryHeapManager::SmallMemoryHeapManager(void* superBlock,
     // The total number of block is the lower-bound of blocks which can be
     // fit into 'superBlockLength'
     m_totalNumberOfBlocks = superBlockLength  / m_allocationUnit;
+    if (m_totalNumberOfBlocks > MAX_BLOCKS)
+        m_totalNumberOfBlocks = MAX_BLOCKS;
 
-    // Start by reset the memory. Set all memory to be free blocks
-    // The first block will point to the last block and vis versa
-    for (uint32 i = 0; i < m_totalNumberOfBlocks; i++)
-        *(getFreeBlock(i)) = FreeBlock(i + 1);
+    for (uint i = 0; i < SIZE_CLASSES; i++)
+        m_freeRuns[i] = NIL_BLOCK;
 
-    // The last block will be pointed out to 'm_totalNumberOfBlocks' which
-    // means, no more free blocks. end of list
+    // All blocks are untouched. Otherwise they are all a single free run
+    if ((!isLazyFormat) && (m_totalNumberOfBlocks > 0))
+    {
+        insertFreeRun(0, (BlockIndex)m_totalNumberOfBlocks);
+        m_untouchedBlock = (uint32)m_totalNumberOfBlocks;
+    }
+}
+
+template <class BlockIndex>
+void* FreeListMemoryHeapManager<BlockIndex>::allocate(uint length)
+{
+    BlockIndex numberOfBlocks = getNumberOfBlocks(length);
+    if (numberOfBlocks == 0)
+        return NULL;
+
+    // Single blocks are taken from the quick list without locking
+    if (numberOfBlocks == 1)
+    {
+        void* ret = popQuickBlock();
+        if (ret != NULL)
+            return ret;
+    }
+
+    cLock lock(m_lock);
+    return allocateUnsafe(numberOfBlocks);
+}
 
-    m_firstFreeBlock = 0;
+template <class BlockIndex>
+uint FreeListMemoryHeapManager<BlockIndex>::allocateBlocks(uint length,
+                                                     void** blocks,
+                                                     uint count)
+{
+    BlockIndex numberOfBlocks = getNumberOfBlocks(length);
+    if (numberOfBlocks == 0)
+        return 0;
+
+    uint i = 0;
+    if (numberOfBlocks == 1)
+    {
+        for (; i < count; i++)
+        {
+            blocks[i] = popQuickBlock();
+            if (blocks[i] == NULL)
+                break;
+        }
+        if (i == count)
+            return count;
+    }
+
+    cLock lock(m_lock);
+    for (; i < count; i++)
+    {
+        blocks[i] = allocateUnsafe(numberOfBlocks);
+        if (blocks[i] == NULL)
+            break;
+    }
+    return i;
 }
 
-void* SmallMemoryHeapManager::allocate(uint length)
+template <class BlockIndex>
+BlockIndex FreeListMemoryHeapManager<BlockIndex>::getNumberOfBlocks(
+                                                        uint length) const
 {
     // Cannot allocate more then MAX_ALLOCATED_MEMORY
     if ((length >= m_maxAllocationUnit) ||
         (length >= m_superBlockLength) ||
         // Should I return a valid pointer?!
         (length == 0))
-        return NULL;
+        return 0;
 
     // Align (truncate-up) the length to m_allocationUnit and append the
     // size of the AllocatedDescriptorBlock.
-    uint16 numberOfBlocks = (uint16)((length + sizeof(AllocatedDescriptorBlock) +
-                                     m_allocationUnit - 1) /
-                                     m_allocationUnit);
+    uint numberOfBlocks = (length + ALLOCATED_UNIT_OVERHEAD +
+                           m_allocationUnit - 1) / m_allocationUnit;
+    if (numberOfBlocks > m_totalNumberOfBlocks)
+        return 0;
 
-    cLock lock(m_lock);
+    return (BlockIndex)numberOfBlocks;
+}
+
+template <class BlockIndex>
+void* FreeListMemoryHeapManager<BlockIndex>::allocateUnsafe(
+                                                    BlockIndex numberOfBlocks)
+{
+    BlockIndex startBlockID = findFreeRun(numberOfBlocks);
+    if (startBlockID == NIL_BLOCK)
+    {
+        void* ret = allocateUntouched(numberOfBlocks);
+        if ((ret != NULL) || (!drainQuickBlocks()))
+            return ret;
+
+        // The blocks of the quick list might complete a run
+        startBlockID = findFreeRun(numberOfBlocks);
+        if (startBlockID == NIL_BLOCK)
+            return allocateUntouched(numberOfBlocks);
+    }
 
-    // Try to find 'numberOfBlocks' contiguous blocks of data
-    // NOTE: The search algorithm is very slow. We are depending that the
-    //       SuperiorMemoryManager will manager the allocation without
-    //       fragmentation so that the first-free block is actually a pointer
-    //       into a valid block
-    uint32 startBlockID = m_firstFreeBlock;
-    bool found = false;
+    // Found! Split the run. The rest of it stays free.
+    BlockIndex runLength = getFreeRun(startBlockID)->m_numberOfBlocks;
+    removeFreeRun(startBlockID);
+    if (runLength > numberOfBlocks)
+    {
+        insertFreeRun(startBlockID + numberOfBlocks,
+                      runLength - numberOfBlocks);
+    } else
+    {
+        setPreviousFree(startBlockID + numberOfBlocks, false);
+    }
 
-    // Check for no more memory
-    if (m_firstFreeBlock == m_totalNumberOfBlocks)
+    // Runs are always merged. The previous run must be allocated.
+    AllocatedDescriptorBlock* ac = getAllocatedBlock(startBlockID);
+    *ac = AllocatedDescriptorBlock(numberOfBlocks);
+
+    // There are numberOfBlocks allocation blocks
+    m_allocatedBytes+= numberOfBlocks * m_allocationUnit;
+
+    return (void*)(ac + 1);
+}
+
+template <class BlockIndex>
+void* FreeListMemoryHeapManager<BlockIndex>::allocateUntouched(
+                                                    BlockIndex numberOfBlocks)
+{
+    if ((m_totalNumberOfBlocks - m_untouchedBlock) < numberOfBlocks)
         return NULL;
 
-    // Try to discover the
-    uint32 previousFreeBlockID = startBlockID;
-    // Try to find a block
-    while (!found)
+    // Free runs never reach the untouched blocks. The previous run must be
+    // allocated.
+    AllocatedDescriptorBlock* ac = getAllocatedBlock(m_untouchedBlock);
+    *ac = AllocatedDescriptorBlock(numberOfBlocks);
+    m_untouchedBlock+= numberOfBlocks;
+
+    m_allocatedBytes+= numberOfBlocks * m_allocationUnit;
+    return (void*)(ac + 1);
+}
+
+template <class BlockIndex>
+BlockIndex FreeListMemoryHeapManager<BlockIndex>::findFreeRun(
+                                              BlockIndex numberOfBlocks) const
+{
+    // Runs of the next size classes are always long enough. For exact powers
+    // of 2 the runs of the same class are also long enough.
+    uint sizeClass = getSizeClass(numberOfBlocks);
+    uint firstClass = sizeClass;
+    if ((numberOfBlocks & (numberOfBlocks - 1)) != 0)
+        firstClass++;
+
+    uint32 mask = 0;
+    if (firstClass < SIZE_CLASSES)
+        mask = m_freeRunsMask & ~(((uint32)1 << firstClass) - 1);
+    if (mask != 0)
+        return m_freeRuns[MemoryBitScan::lowestSetBit(mask)];
+
+    // Scan the runs of the requested class
+    if ((m_freeRunsMask & ((uint32)1 << sizeClass)) == 0)
+        return NIL_BLOCK;
+
+    BlockIndex run = m_freeRuns[sizeClass];
+    while (run != NIL_BLOCK)
     {
-        // Assume OK
-        found = true;
+        const FreeRunBlock* freeRun = getFreeRun(run);
+        if (freeRun->m_numberOfBlocks >= numberOfBlocks)
+            return run;
+        run = freeRun->m_nextRun;
+    }
+    return NIL_BLOCK;
+}
 
-        // NOTE: We are trying to allocated 'numberOfBlocks' contiguous blocks,
-        //       that means that only numberOfBlocks blocks should have the
-        //       next pointer of them follow the previous one.
-        for (uint16 i = 0; i < (numberOfBlocks - 1); i++)
-        {
-            if (getFreeBlock(startBlockID + i)->m_nextFreeBlock !=
-                (startBlockID + i + 1))
-            {
-                previousFreeBlockID = startBlockID;
-                startBlockID = getFreeBlock(startBlockID)->m_nextFreeBlock;
-                found = false;
-
-                // Check for no more memory
-                if (startBlockID == m_totalNumberOfBlocks)
-                    return NULL;
-
-                // No more scanning needed
-                // TODO! Add statics, mismatch
-                break;
-            }
-        }
+template <class BlockIndex>
+bool FreeListMemoryHeapManager<BlockIndex>::free(void* buffer)
+{
+    uint32 thisBlockID;
+    AllocatedDescriptorBlock* block = getValidDescriptor(buffer, thisBlockID);
+    if (block == NULL)
+        return false;
+
+    // Single blocks are pushed into the quick list without locking. The
+    // cookie means that the block might already be there.
+    if ((block->m_numberOfBlocks == 1) &&
+        (((QuickBlockLink*)buffer)->m_cookie != QUICK_BLOCK_COOKIE))
+    {
+        pushQuickBlock(thisBlockID);
+        return true;
     }
 
-    // First cache this block
-    uint32 nextFreeBlockID =
-        getFreeBlock(startBlockID + numberOfBlocks - 1)->m_nextFreeBlock;
+    // All operation for now on require a protection
+    cLock lock(m_lock);
 
-    // Found! Allocate this block
-    AllocatedDescriptorBlock* ac = getAllocatedBlock(startBlockID);
-    *ac = AllocatedDescriptorBlock(numberOfBlocks);
+    // Return the quick list into the runs, so a block which is inside the
+    // quick list will not be a valid block anymore.
+    if (block->m_numberOfBlocks == 1)
+        drainQuickBlocks();
+
+    block = getValidDescriptor(buffer, thisBlockID);
+    if (block == NULL)
+        return false;
+
+    freeUnsafe(thisBlockID, block->m_numberOfBlocks);
+    return true;
+}
 
-    // Increase the first pointer was allocated.
-    if (previousFreeBlockID == startBlockID)
+template <class BlockIndex>
+void FreeListMemoryHeapManager<BlockIndex>::freeBlocks(void** blocks,
+                                                 uint count)
+{
+    cLock lock(m_lock);
+    for (uint i = 0; i < count; i++)
     {
-        ASSERT(previousFreeBlockID == m_firstFreeBlock);
-        m_firstFreeBlock = nextFreeBlockID;
-    } else
+        uint32 thisBlockID;
+        AllocatedDescriptorBlock* block = getValidDescriptor(blocks[i],
+                                                             thisBlockID);
+        // The caller must pass only valid blocks
+        CHECK(block != NULL);
+        freeUnsafe(thisBlockID, block->m_numberOfBlocks);
+    }
+}
+
+template <class BlockIndex>
+uint FreeListMemoryHeapManager<BlockIndex>::getBlockLength(void* buffer)
+{
+    uint32 thisBlockID;
+    AllocatedDescriptorBlock* block = getValidDescriptor(buffer, thisBlockID);
+    if (block == NULL)
+        return 0;
+
+    return (block->m_numberOfBlocks * m_allocationUnit) -
+           sizeof(AllocatedDescriptorBlock);
+}
+
+template <class BlockIndex>
+bool FreeListMemoryHeapManager<BlockIndex>::tryExpandInPlace(void* buffer,
+                                                       uint newLength)
+{
+    BlockIndex numberOfBlocks = getNumberOfBlocks(newLength);
+    if (numberOfBlocks == 0)
+        return false;
+
+    cLock lock(m_lock);
+    uint32 thisBlockID;
+    AllocatedDescriptorBlock* block = getValidDescriptor(buffer, thisBlockID);
+    if (block == NULL)
+        return false;
+
+    // A single block which might be inside the quick list. Return the quick
+    // list into the runs, so a free block will not be valid anymore.
+    if ((block->m_numberOfBlocks == 1) &&
+        (((QuickBlockLink*)buffer)->m_cookie == QUICK_BLOCK_COOKIE))
     {
-        getFreeBlock(previousFreeBlockID)->m_nextFreeBlock = nextFreeBlockID;
+        drainQuickBlocks();
+        block = getValidDescriptor(buffer, thisBlockID);
+        if (block == NULL)
+            return false;
     }
 
-    // There are numberOfBlocks allocation blocks
-    m_allocatedBytes+= numberOfBlocks * m_allocationUnit;
+    if (expandUnsafe(thisBlockID, numberOfBlocks))
+        return true;
 
-    return (void*)(ac + 1);
+    // The next blocks might be inside the quick list
+    if (!drainQuickBlocks())
+        return false;
+    return expandUnsafe(thisBlockID, numberOfBlocks);
 }
 
-bool SmallMemoryHeapManager::free(void* buffer)
+template <class BlockIndex>
+bool FreeListMemoryHeapManager<BlockIndex>::expandUnsafe(uint32 thisBlockID,
+                                                   BlockIndex numberOfBlocks)
+{
+    AllocatedDescriptorBlock* block = getAllocatedBlock(thisBlockID);
+    if (numberOfBlocks <= block->m_numberOfBlocks)
+        return true;
+
+    BlockIndex extraBlocks = numberOfBlocks - block->m_numberOfBlocks;
+    uint32 nextBlockID = thisBlockID + block->m_numberOfBlocks;
+
+    if (nextBlockID == m_untouchedBlock)
+    {
+        // The run is the last one. Take the blocks from the untouched blocks.
+        if ((m_totalNumberOfBlocks - m_untouchedBlock) < extraBlocks)
+            return false;
+        m_untouchedBlock+= extraBlocks;
+    } else
+    {
+        // Free runs never reach the untouched blocks, so the next free run
+        // must be long enough by itself.
+        FreeRunBlock* nextRun = getFreeRun(nextBlockID);
+        if (nextRun->m_magic != FREE_RUN_MAGIC)
+            return false;
+
+        BlockIndex runLength = nextRun->m_numberOfBlocks;
+        if (runLength < extraBlocks)
+            return false;
+
+        // Split the run. The rest of it stays free.
+        removeFreeRun((BlockIndex)nextBlockID);
+        nextRun->m_magic = RELEASED_MAGIC;
+        if (runLength > extraBlocks)
+        {
+            insertFreeRun((BlockIndex)(nextBlockID + extraBlocks),
+                          runLength - extraBlocks);
+        } else
+        {
+            setPreviousFree(nextBlockID + runLength, false);
+        }
+    }
+
+    block->m_numberOfBlocks = numberOfBlocks;
+    m_allocatedBytes+= extraBlocks * m_allocationUnit;
+    return true;
+}
+
+template <class BlockIndex>
+typename FreeListMemoryHeapManager<BlockIndex>::AllocatedDescriptorBlock*
+    FreeListMemoryHeapManager<BlockIndex>::getValidDescriptor(void* buffer,
+                                                      uint32& blockID)
 {
     // First check the boundries of the buffer
     if (!isInBoundries(buffer, sizeof(AllocatedDescriptorBlock),
                                m_allocationUnit - ALLOCATED_UNIT_OVERHEAD))
     {
-        return false;
+        return NULL;
     }
 
     // Get the allocation block
     AllocatedDescriptorBlock* block = getAllocatedDescriptorBlock(buffer);
-    uint32 thisBlockID = (getNumeric(block) - getNumeric(m_superBlock)) /
-                          m_allocationUnit;
-    uint16 count = block->m_numberOfBlocks;
+    blockID = (uint32)((getNumeric(block) - getNumeric(m_superBlock)) /
+                       m_allocationUnit);
+
+    // The descriptor must start at the beginning of a used block
+    if (((getNumeric(block) - getNumeric(m_superBlock)) !=
+         (blockID * m_allocationUnit)) ||
+        (blockID >= m_untouchedBlock))
+    {
+        return NULL;
+    }
 
     // Test that all blocks are fitted
-    if ((thisBlockID + count) > m_totalNumberOfBlocks)
+    if ((block->m_numberOfBlocks == 0) ||
+        ((blockID + block->m_numberOfBlocks) > m_untouchedBlock))
     {
-        return false;
+        return NULL;
     }
 
     // Test the magic
-    if (block->m_magic != ALLOCATED_DESCRIPTOR_MAGIC)
+    if ((block->m_magic != ALLOCATED_DESCRIPTOR_MAGIC) &&
+        (block->m_magic != ALLOCATED_PREVIOUS_FREE_MAGIC))
     {
-        return false;
+        return NULL;
     }
 
-    // All operation for now on require a protection
-    cLock lock(m_lock);
-
-    // Unchain the blocks
-    for (uint16 i = 0; i < (count - 1); i++)
-        *(getFreeBlock(thisBlockID + i)) = FreeBlock(thisBlockID + i + 1);
-    getFreeBlock(thisBlockID + count - 1)->m_nextFreeBlock = m_firstFreeBlock;
-    m_firstFreeBlock = thisBlockID;
-
-    // TODO! Defragment!
+    return block;
+}
 
+template <class BlockIndex>
+void FreeListMemoryHeapManager<BlockIndex>::freeUnsafe(uint32 thisBlockID,
+                                                 BlockIndex count)
+{
     // The number of free allocate blocks are the 'allocated-descriptor' and
     // the 'count' number of blocks
     m_allocatedBytes-= count * m_allocationUnit;
 
+    uint32 startBlockID = thisBlockID;
+    uint32 runLength = count;
+    AllocatedDescriptorBlock* block = getAllocatedBlock(thisBlockID);
+
+    // Merge with the previous free run. It's length is written at it's last
+    // block.
+    if (block->m_magic == ALLOCATED_PREVIOUS_FREE_MAGIC)
+    {
+        BlockIndex previousLength =
+            getFreeRunTail(thisBlockID - 1)->m_numberOfBlocks;
+        startBlockID = thisBlockID - previousLength;
+        ASSERT(getFreeRun(startBlockID)->m_magic == FREE_RUN_MAGIC);
+        removeFreeRun((BlockIndex)startBlockID);
+        runLength+= previousLength;
+    }
+    // The block is not a valid allocated block anymore
+    block->m_magic = RELEASED_MAGIC;
+
+    // Blocks which are followed by the untouched blocks become untouched
+    uint32 nextBlockID = thisBlockID + count;
+    if (nextBlockID == m_untouchedBlock)
+    {
+        m_untouchedBlock = startBlockID;
+        return;
+    }
+
+    // Merge with the next free run
+    FreeRunBlock* nextRun = getFreeRun(nextBlockID);
+    if (nextRun->m_magic == FREE_RUN_MAGIC)
+    {
+        runLength+= nextRun->m_numberOfBlocks;
+        removeFreeRun((BlockIndex)nextBlockID);
+        nextRun->m_magic = RELEASED_MAGIC;
+    }
+
+    insertFreeRun((BlockIndex)startBlockID, (BlockIndex)runLength);
+}
+
+template <class BlockIndex>
+uint FreeListMemoryHeapManager<BlockIndex>::getSizeClass(
+                                                    BlockIndex numberOfBlocks)
+{
+    ASSERT(numberOfBlocks > 0);
+    return MemoryBitScan::highestSetBit(numberOfBlocks);
+}
+
+template <class BlockIndex>
+void FreeListMemoryHeapManager<BlockIndex>::insertFreeRun(BlockIndex blockID,
+                                                    BlockIndex count)
+{
+    ASSERT(count > 0);
+    uint sizeClass = getSizeClass(count);
+
+    FreeRunBlock* run = getFreeRun(blockID);
+    run->m_magic = FREE_RUN_MAGIC;
+    run->m_numberOfBlocks = count;
+    run->m_previousRun = NIL_BLOCK;
+    run->m_nextRun = m_freeRuns[sizeClass];
+    if (run->m_nextRun != NIL_BLOCK)
+        getFreeRun(run->m_nextRun)->m_previousRun = blockID;
+    m_freeRuns[sizeClass] = blockID;
+    m_freeRunsMask|= ((uint32)1 << sizeClass);
+
+    // The tail tag. For a single block the run descriptor is the tail.
+    if (count > 1)
+    {
+        FreeRunTail* tail = getFreeRunTail(blockID + count - 1);
+        tail->m_magic = FREE_RUN_TAIL_MAGIC;
+        tail->m_numberOfBlocks = count;
+    }
+
+    setPreviousFree(blockID + count, true);
+}
+
+template <class BlockIndex>
+void FreeListMemoryHeapManager<BlockIndex>::removeFreeRun(BlockIndex blockID)
+{
+    FreeRunBlock* run = getFreeRun(blockID);
+    ASSERT(run->m_magic == FREE_RUN_MAGIC);
+
+    if (run->m_nextRun != NIL_BLOCK)
+        getFreeRun(run->m_nextRun)->m_previousRun = run->m_previousRun;
+
+    if (run->m_previousRun != NIL_BLOCK)
+    {
+        getFreeRun(run->m_previousRun)->m_nextRun = run->m_nextRun;
+    } else
+    {
+        uint sizeClass = getSizeClass(run->m_numberOfBlocks);
+        ASSERT(m_freeRuns[sizeClass] == blockID);
+        m_freeRuns[sizeClass] = run->m_nextRun;
+        if (run->m_nextRun == NIL_BLOCK)
+            m_freeRunsMask&= ~((uint32)1 << sizeClass);
+    }
+}
+
+template <class BlockIndex>
+void FreeListMemoryHeapManager<BlockIndex>::setPreviousFree(uint32 blockID,
+                                                      bool isPreviousFree)
+{
+    // The untouched blocks (and the end of the superblock) don't have
+    // descriptors
+    if (blockID >= m_untouchedBlock)
+        return;
+
+    AllocatedDescriptorBlock* block = getAllocatedBlock(blockID);
+    ASSERT((block->m_magic == ALLOCATED_DESCRIPTOR_MAGIC) ||
+           (block->m_magic == ALLOCATED_PREVIOUS_FREE_MAGIC));
+    block->m_magic = isPreviousFree ? ALLOCATED_PREVIOUS_FREE_MAGIC :
+                                      ALLOCATED_DESCRIPTOR_MAGIC;
+}
+
+template <class BlockIndex>
+void* FreeListMemoryHeapManager<BlockIndex>::popQuickBlock()
+{
+    while (true)
+    {
+        uint64 head = MemoryAtomic::read64(&m_quickHead);
+        BlockIndex blockID = getQuickHeadBlock(head);
+        if (blockID == NIL_BLOCK)
+            return NULL;
+
+        // The block might be taken by another thread right now, and the
+        // link might be garbage. The tag will fail the exchange.
+        AllocatedDescriptorBlock* block = getAllocatedBlock(blockID);
+        QuickBlockLink* link = (QuickBlockLink*)(block + 1);
+        uint64 newHead = makeQuickHead(link->m_nextBlock,
+                                       getQuickHeadTag(head) + 1);
+        if (MemoryAtomic::compareExchange64(&m_quickHead,
+                                            newHead,
+                                            head) == head)
+        {
+            MemoryAtomic::decrement(&m_quickBlocks);
+            link->m_cookie = 0;
+            return (void*)(block + 1);
+        }
+    }
+}
+
+template <class BlockIndex>
+void FreeListMemoryHeapManager<BlockIndex>::pushQuickBlock(uint32 blockID)
+{
+    QuickBlockLink* link = (QuickBlockLink*)(getAllocatedBlock(blockID) + 1);
+    link->m_cookie = QUICK_BLOCK_COOKIE;
+    MemoryAtomic::increment(&m_quickBlocks);
+
+    while (true)
+    {
+        uint64 head = MemoryAtomic::read64(&m_quickHead);
+        link->m_nextBlock = getQuickHeadBlock(head);
+        uint64 newHead = makeQuickHead(blockID, getQuickHeadTag(head) + 1);
+        if (MemoryAtomic::compareExchange64(&m_quickHead,
+                                            newHead,
+                                            head) == head)
+        {
+            return;
+        }
+    }
+}
+
+template <class BlockIndex>
+bool FreeListMemoryHeapManager<BlockIndex>::drainQuickBlocks()
+{
+    // Detach the whole list
+    uint64 head;
+    while (true)
+    {
+        head = MemoryAtomic::read64(&m_quickHead);
+        if (getQuickHeadBlock(head) == NIL_BLOCK)
+            return false;
+
+        uint64 newHead = makeQuickHead(NIL_BLOCK, getQuickHeadTag(head) + 1);
+        if (MemoryAtomic::compareExchange64(&m_quickHead,
+                                            newHead,
+                                            head) == head)
+        {
+            break;
+        }
+    }
+
+    // The blocks still have their allocation-descriptors
+    BlockIndex blockID = getQuickHeadBlock(head);
+    while (blockID != NIL_BLOCK)
+    {
+        QuickBlockLink* link =
+            (QuickBlockLink*)(getAllocatedBlock(blockID) + 1);
+        BlockIndex nextBlockID = link->m_nextBlock;
+        link->m_cookie = 0;
+        MemoryAtomic::decrement(&m_quickBlocks);
+        freeUnsafe(blockID, 1);
+        blockID = nextBlockID;
+    }
     return true;
 }
 
-uint SmallMemoryHeapManager::getMaximumAllocationUnit() const
+template <class BlockIndex>
+memorySize
+    FreeListMemoryHeapManager<BlockIndex>::getNumberOfAllocatedBytes() const
+{
+    return m_allocatedBytes - (m_quickBlocks * m_allocationUnit);
+}
+
+template <class BlockIndex>
+memorySize FreeListMemoryHeapManager<BlockIndex>::getNumberOfFreeBytes() const
+{
+    return m_superBlockLength - getNumberOfAllocatedBytes();
+}
+
+template <class BlockIndex>
+uint FreeListMemoryHeapManager<BlockIndex>::getMaximumAllocationUnit() const
 {
     if (m_maxAllocationUnit > 0xFFFFFFFF)
         return 0xFFFFFFFF;
@@ -209,20 +654,23 @@ uint SmallMemoryHeapManager::getMaximumAllocationUnit() const
     return (uint32)(m_maxAllocationUnit);
 }
 
-uint SmallMemoryHeapManager::getMinimumAllocationUnit() const
+template <class BlockIndex>
+uint FreeListMemoryHeapManager<BlockIndex>::getMinimumAllocationUnit() const
 {
     return m_allocationUnit;
 }
 
 //////////////////////////////////////////////////////////////////////////
-SmallMemoryHeapManager::AllocatedDescriptorBlock::AllocatedDescriptorBlock(
-        uint16 blocksCount) :
-    m_numberOfBlocks(blocksCount),
-    m_magic((uint16)ALLOCATED_DESCRIPTOR_MAGIC)
+template <class BlockIndex>
+FreeListMemoryHeapManager<BlockIndex>::AllocatedDescriptorBlock::
+    AllocatedDescriptorBlock(BlockIndex blocksCount,
+                             bool isPreviousFree) :
+    m_magic((BlockIndex)(isPreviousFree ? ALLOCATED_PREVIOUS_FREE_MAGIC :
+                                          ALLOCATED_DESCRIPTOR_MAGIC)),
+    m_numberOfBlocks(blocksCount)
 {
 }
 
-SmallMemoryHeapManager::FreeBlock::FreeBlock(uint16 nextFreeBlock) :
-    m_nextFreeBlock(nextFreeBlock)
-{
-}
+// The engines which are used by the memory managers
+template class FreeListMemoryHeapManager<uint16>;
+template class FreeListMemoryHeapManager<uint32>;
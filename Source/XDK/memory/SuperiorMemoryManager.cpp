@@ -41,48 +41,81 @@
 #include "xStl/data/datastream.h"
 #include "xStl/except/trace.h"
 #include "xStl/stream/traceStream.h"
+#include "xdk/memory/MemoryAtomic.h"
 #include "xdk/memory/SuperiorMemoryManager.h"
 
+// The bucket group of the size class 'index'. See MemorySizeClass
+#define BUCKET_SIZE_CLASS(index) \
+    { MemorySizeClassUnit<index>::UNIT_SIZE, \
+      MemorySizeClassUnit<index>::DEFAULT_ELEMENTS, \
+      ((index) < MAGAZINE_BUCKETS) ? ENGINE_BITMAP : ENGINE_FREE_LIST }
+
+// The four size classes of the doubling which starts at class 'index'
+#define BUCKET_SIZE_DOUBLING(index) \
+    BUCKET_SIZE_CLASS(index),     BUCKET_SIZE_CLASS(index + 1), \
+    BUCKET_SIZE_CLASS(index + 2), BUCKET_SIZE_CLASS(index + 3)
+
 // NOTE: The overhead size is taken care of inside the
 //       'getBucketAllocationUnit' function
+// NOTE: The small units are managed by bitmaps. Their buckets contain many
+//       blocks, which a free-list scans slowly.
+// NOTE: The table is generated at compile time from MemorySizeClass. The
+//       index of each bucket group is it's size class.
 const SuperiorMemoryManager::BucketSizeAndStatistics
     SuperiorMemoryManager::m_bucketSizes[MAX_BUCKETS] = {
-    { 4,          65536 }, //  1: Allocation 0 to 4 bytes.    64k units = 256kb
-    { 8,          32768 }, //  1: Allocation 5 to 8 bytes.    32k units = 256kb
-    { 16,         16386 }, //  2: Allocation 9 to 16 bytes    16k units = 256kb
-    { 32,          8192 }, //  3: Allocation 17 to 32 bytes    8k units = 256kb
-    { 64,          4196 }, //  4: Allocation 33 to 64 bytes    4k units = 256kb
-    { 128,         2048 }, //  5: Allocation 65 to 128 bytes   2k units = 256kb
-    { 256,         1024 }, //  6: Allocation 129 to 256 bytes  1k units = 256kb
-    { 512,          512 }, //  7: Allocation 257 to 512 bytes             256kb
-    { 1024,         256 }, //  8: Allocation 513 to 1024 bytes            256kb
-    { 2048,         128 }, //  9: Allocation 1024 to 2048 bytes           256kb
-    { 4*1024,        64 }, // 10:      2kb-4kb         256kb
-    { 8*1024,        32 }, // 11:      4kb-8kb         256kb
-    { 16*1024,       16 }, // 12:     8kb-16kb         256kb
-    { 32*1024,        8 }, // 13:    16kb-32kb         256kb
-    { 64*1024,        4 }, // 14:    32kb-64kb         256kb
-    { 128*1024,       2 }, // 15:   64kb-128kb         256kb
-    { 256*1024,       2 }, // 16:  128kb-256kb         512kb
+    BUCKET_SIZE_CLASS(0),        //     0 to 4 bytes
+    BUCKET_SIZE_CLASS(1),        //     5 to 8 bytes
+    BUCKET_SIZE_CLASS(2),        //     9 to 16 bytes
+    BUCKET_SIZE_CLASS(3),        //    17 to 24 bytes
+    BUCKET_SIZE_CLASS(4),        //    25 to 32 bytes
+    BUCKET_SIZE_DOUBLING(5),     //    33 to 64 bytes
+    BUCKET_SIZE_DOUBLING(9),     //    65 to 128 bytes
+    BUCKET_SIZE_DOUBLING(13),    //   129 to 256 bytes
+    BUCKET_SIZE_DOUBLING(17),    //   257 to 512 bytes
+    BUCKET_SIZE_DOUBLING(21),    //   513 to 1kb
+    BUCKET_SIZE_DOUBLING(25),    //    1kb to 2kb
+    BUCKET_SIZE_DOUBLING(29),    //    2kb to 4kb
+    BUCKET_SIZE_DOUBLING(33),    //    4kb to 8kb
+    BUCKET_SIZE_DOUBLING(37),    //    8kb to 16kb
+    BUCKET_SIZE_DOUBLING(41),    //   16kb to 32kb
+    BUCKET_SIZE_DOUBLING(45),    //   32kb to 64kb
+    BUCKET_SIZE_DOUBLING(49),    //   64kb to 128kb
+    BUCKET_SIZE_DOUBLING(53),    //  128kb to 256kb
     // All other allocation will be throw into this bucket
-    { BUCKET_DEFAULT_CACHE_SIZE, 0 }
+    { BUCKET_DEFAULT_CACHE_SIZE, 0, ENGINE_LARGE }
 };
 
+#undef BUCKET_SIZE_DOUBLING
+#undef BUCKET_SIZE_CLASS
+
 SuperiorMemoryManager::SuperiorMemoryManager(
             const SuperiorOSMemePtr& osmem,
             uint initializeSize,
             void* privateMemPool,
             uint privateMemPoolLength,
-            uint maximumSize) :
+            memorySize maximumSize,
+            bool isAdaptive) :
     // Initialize parent class, but first allocate the initialize memory
     MemorySuperblockHeapManager(NULL, 0),
     m_osmem(osmem),
-    m_osMaximumSize(maximumSize),
+    m_ownerMap(osmem),
+    m_metadataPool(privateMemPool, privateMemPoolLength, METADATA_OBJECT_SIZE),
+    m_osMaximumSize((maximumSize == DEFAULT_MAXIMUM_SIZE) ? ~(memorySize)0 :
+                                                           maximumSize),
     m_osMemorySize(initializeSize),
     m_allocatedOsMemorySize(0),
+    m_osMinimumSize(initializeSize),
+    m_reclaimIdlePeriods(DEFAULT_RECLAIM_IDLE_PERIODS),
+    m_lowWatermark(DEFAULT_LOW_WATERMARK),
+    m_isExpansionRequested(0),
+    m_failedBucketLength(0),
+    m_rateBytes(0),
+    m_allocationRate(0),
+    m_directMappingThreshold(0),
+    m_directMemorySize(0),
+    m_isAdaptive(isAdaptive),
     m_superBlockRepository(NULL),
-    m_manageInProgress(false),
-    m_privatePool(privateMemPool, privateMemPoolLength, PRIVATE_POOL_SIZE)
+    m_manageInProgress(false)
 {
     ASSERT(m_superBlock == NULL);
 
@@ -93,26 +126,90 @@ SuperiorMemoryManager::SuperiorMemoryManager(
     void* firstSuperblock = m_osmem->allocateNewSuperblock(initializeSize);
     // If the initialize allocate memory failed, throw an exception
     CHECK(firstSuperblock != NULL);
+    // Prepare the owner-map for the buckets of the first superblock
+    if (!m_ownerMap.reserve(firstSuperblock, initializeSize))
+    {
+        m_osmem->freeSuperblock(firstSuperblock);
+        CHECK_FAIL();
+    }
     // Initialize the repository for the first allocated superblock
-    m_superBlockRepository = new(m_privatePool)
-        SuperblockRepository(firstSuperblock, initializeSize, NULL);
+    m_superBlockRepository = newSuperblockRepository(firstSuperblock,
+                                                     initializeSize);
+
+    // No new buckets yet
+    m_rateStartTime = cOS::getSystemTime();
 
     // Start by creating empty buckets
     uint i;
     for (i = 0; i < MAX_BUCKETS; i++)
+    {
         m_firstBucketHandler[i] = NULL;
+        m_partialBuckets[i] = NULL;
+        m_requestsHistogram[i] = 0;
+        m_tunedRequests[i] = 0;
+        m_bucketElements[i] = m_bucketSizes[i].m_defaultElementsForBucket;
+    }
+
+    #ifdef _DEBUG
+    // Validate the size class translation against the table
+    for (i = 0; i < MemorySizeClass::NUMBER_OF_CLASSES; i++)
+    {
+        ASSERT(getBucketIndex(m_bucketSizes[i].m_bucketUnitSize) == i);
+        ASSERT(getBucketIndex(m_bucketSizes[i].m_bucketUnitSize + 1) == i + 1);
+    }
+    #endif
+
+    // And empty processor caches
+    for (i = 0; i < PROCESSOR_CACHES; i++)
+    {
+        #ifdef XDK_TEST
+        m_processorCaches[i].m_busy = 0;
+        #endif
+        for (uint j = 0; j < MAGAZINE_BUCKETS; j++)
+        {
+            m_processorCaches[i].m_magazines[j].m_count = 0;
+            m_processorCaches[i].m_requests[j] = 0;
+        }
+    }
+
+    #ifdef SUPERIOR_MEMORY_MANAGER_STATISTICS
+    // And zero counters
+    memset(m_peakBytesInUse, 0, sizeof(m_peakBytesInUse));
+    m_peakTotalBytesInUse = 0;
+    for (i = 0; i < PROCESSOR_CACHES; i++)
+    {
+        memset(&m_processorCaches[i].m_statistics, 0,
+               sizeof(StatisticsSlot));
+    }
+    #ifdef XDK_TEST
+    memset(&m_sharedStatistics, 0, sizeof(m_sharedStatistics));
+    m_sharedStatisticsBusy = 0;
+    #endif
+    #endif
 }
 
 SuperiorMemoryManager::~SuperiorMemoryManager()
 {
     // Assume no operator new/delete is called.
 
+    // Return all cached blocks to their buckets
+    for (uint j = 0; j < PROCESSOR_CACHES; j++)
+    {
+        for (uint k = 0; k < MAGAZINE_BUCKETS; k++)
+        {
+            Magazine& magazine = m_processorCaches[j].m_magazines[k];
+            flushMagazine(magazine, magazine.m_count);
+        }
+    }
+
     // Scan all buckets and test no memory is still allocated
     for (uint i = 0; i < MAX_BUCKETS; i++)
     {
         Bucket* bucket = m_firstBucketHandler[i];
         while (bucket != NULL)
         {
+            reclaimRemoteFrees(bucket);
+
             // Trace out information
             #ifdef _DEBUG
             uint left = bucket->getManager().getNumberOfAllocatedBytes();
@@ -131,20 +228,34 @@ SuperiorMemoryManager::~SuperiorMemoryManager()
             // coding.
             Bucket* temp = bucket;
             bucket = bucket->getNextBucket();
-            temp->operator delete(temp, m_privatePool);
+            if (temp->m_isDirect)
+                m_osmem->freeSuperblock(temp->getBuffer());
+            temp->operator delete(temp, m_metadataPool);
         }
     }
 
 
-    // Freeing all superblocks
+    // The repositories might be stored inside the superblocks (See
+    // m_metadataPool), so the superblocks are linked before any of them is
+    // freed. The first pointer of each superblock points to the next one.
+    // The beginning of a superblock is never a repository, it's either a
+    // mini-superblock or a metadata chunk header.
+    void* osBuffers = NULL;
     SuperblockRepository* superblock = m_superBlockRepository;
     while (superblock != NULL)
     {
-        m_osmem->freeSuperblock(superblock->getOSBuffer());
-
-        SuperblockRepository* temp = superblock;
+        void* buffer = superblock->getOSBuffer();
         superblock = superblock->getNextRepository();
-        temp->operator delete(temp, m_privatePool);
+        *((void**)buffer) = osBuffers;
+        osBuffers = buffer;
+    }
+
+    // Freeing all superblocks
+    while (osBuffers != NULL)
+    {
+        void* next = *((void**)osBuffers);
+        m_osmem->freeSuperblock(osBuffers);
+        osBuffers = next;
     }
 
     // The global private memory is allocate outside this class and must be
@@ -160,34 +271,94 @@ void* SuperiorMemoryManager::allocate(uint length)
     // Get the best bucket position
     uint originalBucket = getBucketIndex(length);
 
+    // Small blocks are served by the processor cache
+    if (originalBucket < MAGAZINE_BUCKETS)
+    {
+        void* ret = allocateFromProcessorCache(originalBucket, length);
+        if (ret != NULL)
+            return ret;
+    } else
+    {
+        MemoryAtomic::increment(&m_requestsHistogram[originalBucket]);
+
+        // Very large blocks might get their own mapping
+        if ((originalBucket == MemorySizeClass::NUMBER_OF_CLASSES) &&
+            (m_directMappingThreshold != 0) &&
+            (length >= m_directMappingThreshold))
+        {
+            void* ret = allocateDirect(length);
+            if (ret != NULL)
+            {
+                #ifdef SUPERIOR_MEMORY_MANAGER_STATISTICS
+                countStatistics(NULL, originalBucket, EVENT_ALLOCATE, length,
+                                getBlockLength(ret));
+                #endif
+                return ret;
+            }
+        }
+    }
+
     uint bucket = originalBucket;
     do {
-        // Try to allocate from the bucket.
-        // NOTE: There is no need to lock here since even if another pointer is
-        //       being added then still all pointers are valid.
-        Bucket* bucketPtr = safeGetFirstBucket(bucket);
-        Bucket* originalBucketPtr = bucketPtr;
+        // Try to allocate from the buckets which have free units. The full
+        // buckets are skipped.
+        Bucket* originalBucketPtr = safeGetFirstBucket(bucket);
+        Bucket* bucketPtr = acquireNextPartialBucket(bucket, NULL);
+        uint32 slot = getProcessorSlot();
         while (bucketPtr != NULL)
         {
+            // The first processor which allocates from the bucket owns it.
+            // The owner is kept, so the bucket isn't written by every
+            // allocation. The blocks which were freed by other processors
+            // are returned at once.
+            if (bucketPtr->m_owner == 0)
+                MemoryAtomic::compareExchange(&bucketPtr->m_owner, slot, 0);
+            reclaimRemoteFrees(bucketPtr);
+
             // Try to allocate from the new bucket
             void* ret = bucketPtr->getManager().allocate(length);
+            if ((ret == NULL) && (isBucketExhausted(bucketPtr, length)))
+                ret = markBucketFull(bucketPtr, length);
+
             if (ret != NULL)
+            {
+                #ifdef SUPERIOR_MEMORY_MANAGER_STATISTICS
+                countStatistics(NULL, bucket, EVENT_ALLOCATE, length,
+                    bucketPtr->getManager().getBlockLength(ret));
+                #endif
+                releaseBucket(bucketPtr);
                 return ret;
+            }
+
             // Get the next bucket from the same group
-            bucketPtr = bucketPtr->getNextBucket();
+            bucketPtr = acquireNextPartialBucket(bucket, bucketPtr);
         }
 
         // Performance and race-conditions simple prevent condition
         if (originalBucketPtr != safeGetFirstBucket(bucket))
             continue;
 
-        // This bucket group is full. Try to expand the bucket
+        // This bucket group is full. Try to expand the bucket, unless the
+        // new bucket might be too short for the block (See the wrap-around)
         uint allocatedSize;
         uint aunit = getBucketAllocationUnit(bucket, length);
-        void* newBuffer = allocateSuperblock(getNewBucketSize(bucket, length),
-                                             getMinimumBucketSize(bucket, length),
-                                             aunit,
-                                             allocatedSize);
+        uint minimumSize = getMinimumBucketSize(bucket, length);
+        void* newBuffer = NULL;
+        if (minimumSize > length)
+        {
+            newBuffer = allocateSuperblock(getNewBucketSize(bucket, length),
+                                           minimumSize,
+                                           aunit,
+                                           allocatedSize);
+        }
+        if ((newBuffer != NULL) && (allocatedSize <= length))
+        {
+            // The best fit for the remainding of the memory might be too
+            // short for a block of another bucket group (See the wrap-around)
+            cLock lock(m_lock);
+            releaseSuperblockMemory(newBuffer, allocatedSize);
+            newBuffer = NULL;
+        }
         if (newBuffer != NULL)
         {
             // Bucket can be expand
@@ -195,16 +366,35 @@ void* SuperiorMemoryManager::allocate(uint length)
 
             // Lock the bucket and expand
             cLock lock(m_lock);
-            Bucket* newBucket = new(m_privatePool) Bucket(newBuffer,
-                                        allocatedSize,
-                                        aunit,
-                                        m_firstBucketHandler[bucket]);
-            m_firstBucketHandler[bucket] = newBucket;
-
-            // Allocate and return
-            void* ret = newBucket->getManager().allocate(length);
-            ASSERT(ret != NULL);
-            return ret;
+            if (reserveMetadata())
+            {
+                Bucket* newBucket = new(m_metadataPool) Bucket(newBuffer,
+                                            allocatedSize,
+                                            aunit,
+                                            bucket,
+                                            m_bucketSizes[bucket].m_engine,
+                                            m_firstBucketHandler[bucket]);
+                m_ownerMap.insert(newBuffer, allocatedSize, newBucket);
+                m_firstBucketHandler[bucket] = newBucket;
+                {
+                    cLock partialLock(m_partialLocks[bucket]);
+                    linkPartialBucket(newBucket);
+                }
+
+                // Allocate and return
+                void* ret = newBucket->getManager().allocate(length);
+                ASSERT(ret != NULL);
+                #ifdef SUPERIOR_MEMORY_MANAGER_STATISTICS
+                countStatistics(NULL, bucket, EVENT_ALLOCATE, length,
+                                newBucket->getManager().getBlockLength(ret));
+                #endif
+                return ret;
+            }
+
+            // No room for the descriptor of the bucket. Return the memory
+            // and ask for a new superblock.
+            releaseSuperblockMemory(newBuffer, allocatedSize);
+            MemoryAtomic::exchange(&m_isExpansionRequested, 1);
         }
 
         // Performance and race-conditions simple prevent condition
@@ -224,33 +414,495 @@ void* SuperiorMemoryManager::allocate(uint length)
     traceHigh("SuperiorMemoryManager: Try allocating " << length << " bytes." << endl);
     // Raise the debugger. Wait a minute, we are the debugger, aren't we?!
     // When this case happens, trace out the statistics...
+    #ifdef SUPERIOR_MEMORY_MANAGER_STATISTICS
+    countStatistics(NULL, originalBucket, EVENT_FAILURE, length, 0);
+    #endif
     return NULL;
 }
 
+void* SuperiorMemoryManager::allocateAligned(uint length, uint alignment)
+{
+    // The alignment must be a power of 2
+    if ((alignment == 0) || (alignment > MAXIMUM_ALIGNMENT) ||
+        ((alignment & (alignment - 1)) != 0))
+    {
+        return NULL;
+    }
+
+    // The blocks are aligned to the descriptors
+    if (alignment < sizeof(AlignedBlockTag))
+        return allocate(length);
+
+    // Leave room for the tag and for the worst misalignment
+    uint paddedLength = length + alignment + sizeof(AlignedBlockTag) - 1;
+    if (paddedLength < length)
+        return NULL;
+
+    void* block = allocate(paddedLength);
+    if (block == NULL)
+        return NULL;
+
+    addressNumericValue position = getNumeric(block);
+    if ((position & (alignment - 1)) == 0)
+        return block;
+
+    position = (position + sizeof(AlignedBlockTag) + alignment - 1) &
+               ~((addressNumericValue)alignment - 1);
+    AlignedBlockTag* tag = (AlignedBlockTag*)getPtr(position) - 1;
+    tag->m_offset = (uint32)(position - getNumeric(block));
+    tag->m_magic = ALIGNED_BLOCK_MAGIC;
+    return getPtr(position);
+}
+
+void* SuperiorMemoryManager::getRealBlock(Bucket* bucket, void* buffer) const
+{
+    // Blocks always have a descriptor before them
+    addressNumericValue position = getNumeric(buffer);
+    if (position < getNumeric(bucket->getBuffer()) + sizeof(AlignedBlockTag))
+        return buffer;
+
+    AlignedBlockTag* tag = (AlignedBlockTag*)buffer - 1;
+    if (tag->m_magic != ALIGNED_BLOCK_MAGIC)
+        return buffer;
+
+    // The offset is validated, so a corrupted tag cannot lead outside the
+    // bucket. The real block is validated by the bucket.
+    uint offset = tag->m_offset;
+    if ((offset < sizeof(AlignedBlockTag)) ||
+        (offset >= MAXIMUM_ALIGNMENT + sizeof(AlignedBlockTag)) ||
+        (position - offset < getNumeric(bucket->getBuffer())))
+    {
+        return buffer;
+    }
+    return getPtr(position - offset);
+}
+
 bool SuperiorMemoryManager::free(void* buffer)
 {
-    // Try to free the block from all buckets.
-    // This is the right thing to do since the allocate buffer might be in a
-    // different bucket group depending on memory fragmentation.
-    for (uint i = 0; i < MAX_BUCKETS; i++)
+    // The allocate buffer might be in a different bucket group depending on
+    // memory fragmentation, so the bucket is located by it's address.
+    // NOTE: There is no need to lock here since buckets are registered before
+    //       any of their blocks can be allocated.
+    Bucket* bucket = (Bucket*)m_ownerMap.lookup(buffer);
+    if (bucket == NULL)
     {
-        // NOTE: There is no need to lock here since even if another pointer is
-        //       being added then still all pointers are valid.
-        Bucket* bucket = safeGetFirstBucket(i);
-        while (bucket != NULL)
+        // The buffer is not one of buckets
+        return false;
+    }
+
+    // Aligned blocks are freed by their real block, which is inside the same
+    // bucket
+    buffer = getRealBlock(bucket, buffer);
+
+    // Small blocks are kept in the processor cache
+    CacheFreeResult cached = freeToProcessorCache(bucket, buffer);
+    if (cached == CACHE_FREE_CACHED)
+        return true;
+    if (cached == CACHE_FREE_REJECTED)
+        return false;
+
+    // Blocks of buckets which are owned by another processor are batched
+    if (freeRemote(bucket, buffer))
+        return true;
+
+    #ifdef SUPERIOR_MEMORY_MANAGER_STATISTICS
+    uint blockLength = bucket->getManager().getBlockLength(buffer);
+    #endif
+
+    // Once the block is freed the bucket might be empty. It cannot be
+    // detached while it has users, see 'reclaimBuckets'
+    MemoryAtomic::increment(&bucket->m_users);
+    bool wasFull = bucket->isFull();
+    bool isDirect = bucket->m_isDirect;
+
+    // The bucket validates that the buffer is really inside it
+    if (!bucket->getManager().free(buffer))
+    {
+        releaseBucket(bucket);
+        return false;
+    }
+
+    #ifdef SUPERIOR_MEMORY_MANAGER_STATISTICS
+    countStatistics(NULL, bucket->getSizeClass(), EVENT_FREE, 0, blockLength);
+    #endif
+
+    // A direct bucket holds a single block. It's never reclaimed.
+    if (isDirect)
+    {
+        releaseBucket(bucket);
+        freeDirect(bucket);
+        return true;
+    }
+
+    // The bucket has a free unit now
+    if (wasFull)
+        markBucketPartial(bucket);
+    releaseBucket(bucket);
+    return true;
+}
+
+bool SuperiorMemoryManager::free(void* buffer, uint length)
+{
+    Bucket* bucket = (Bucket*)m_ownerMap.lookup(buffer);
+    if (bucket == NULL)
+        return false;
+
+    // A block of it's own size class is a single unit. Blocks which were
+    // allocated from another bucket group (See the wrap-around of 'allocate')
+    // take the normal path.
+    uint sizeClass = getBucketIndex(length);
+    if ((length != 0) &&
+        (sizeClass < MAGAZINE_BUCKETS) &&
+        (bucket->getSizeClass() == sizeClass))
+    {
+        // The bucket still validates the block. A stale or an interior
+        // pointer is not cacheable.
+        CacheFreeResult cached = freeToProcessorCache(bucket, buffer);
+        if (cached != CACHE_FREE_NOT_CACHEABLE)
+            return (cached == CACHE_FREE_CACHED);
+    }
+
+    return free(buffer);
+}
+
+uint SuperiorMemoryManager::getBlockLength(void* buffer)
+{
+    Bucket* bucket = (Bucket*)m_ownerMap.lookup(buffer);
+    if (bucket == NULL)
+        return 0;
+
+    // The aligned block ends with it's real block
+    void* block = getRealBlock(bucket, buffer);
+    uint offset = (uint)(getNumeric(buffer) - getNumeric(block));
+    uint length = bucket->getManager().getBlockLength(block);
+    if (length <= offset)
+        return 0;
+    return length - offset;
+}
+
+bool SuperiorMemoryManager::tryExpandInPlace(void* buffer, uint newLength)
+{
+    Bucket* bucket = (Bucket*)m_ownerMap.lookup(buffer);
+    if ((bucket == NULL) || (newLength == 0))
+        return false;
+
+    // The aligned block ends with it's real block
+    void* block = getRealBlock(bucket, buffer);
+    uint offset = (uint)(getNumeric(buffer) - getNumeric(block));
+    uint blockLength = newLength + offset;
+    if (blockLength < newLength)
+        return false;
+
+    uint oldLength = bucket->getManager().getBlockLength(block);
+    if (oldLength == 0)
+        return false;
+    if (oldLength >= blockLength)
+        return true;
+
+    if (!bucket->getManager().tryExpandInPlace(block, blockLength))
+        return false;
+
+    // Counted the same as a moved block, so the allocated bytes of the size
+    // class stay balanced
+    #ifdef SUPERIOR_MEMORY_MANAGER_STATISTICS
+    countStatistics(NULL, bucket->getSizeClass(), EVENT_FREE, 0, oldLength);
+    countStatistics(NULL, bucket->getSizeClass(), EVENT_ALLOCATE, blockLength,
+                    bucket->getManager().getBlockLength(block));
+    #endif
+    return true;
+}
+
+void* SuperiorMemoryManager::reallocate(void* buffer, uint newLength)
+{
+    if ((buffer == NULL) || (newLength == 0))
+        return MemorySuperblockHeapManager::reallocate(buffer, newLength);
+
+    Bucket* bucket = (Bucket*)m_ownerMap.lookup(buffer);
+    if (bucket == NULL)
+        return NULL;
+
+    if (getRealBlock(bucket, buffer) == buffer)
+        return MemorySuperblockHeapManager::reallocate(buffer, newLength);
+
+    // The requested alignment isn't recorded, but the alignment of the pointer
+    // itself is at least the requested one.
+    uint oldLength = getBlockLength(buffer);
+    if (oldLength == 0)
+        return NULL;
+    if (tryExpandInPlace(buffer, newLength))
+        return buffer;
+
+    uint alignment = MAXIMUM_ALIGNMENT;
+    while ((getNumeric(buffer) & (alignment - 1)) != 0)
+        alignment>>= 1;
+
+    void* ret = allocateAligned(newLength, alignment);
+    if (ret == NULL)
+        return NULL;
+
+    cOS::memcpy(ret, buffer, oldLength);
+    free(buffer);
+    return ret;
+}
+
+//
+// Processor caches
+//
+void* SuperiorMemoryManager::allocateFromProcessorCache(uint bucket,
+                                                        uint length)
+{
+    ASSERT(bucket < MAGAZINE_BUCKETS);
+
+    ProcessorCacheGuard guard(m_processorCaches);
+    ProcessorCache* cache = guard.getCache();
+    if (cache == NULL)
+    {
+        MemoryAtomic::increment(&m_requestsHistogram[bucket]);
+        return NULL;
+    }
+
+    // The cache is owned by the current processor
+    cache->m_requests[bucket]++;
+
+    Magazine& magazine = cache->m_magazines[bucket];
+    if (magazine.m_count == 0)
+    {
+        refillMagazine(bucket, magazine);
+        if (magazine.m_count == 0)
         {
-            // If the buffer is not one of buckets then false will be returned.
-            if (bucket->getManager().free(buffer))
-                return true;
-            // Get the next bucket from the same group
-            bucket = bucket->getNextBucket();
+            // All buckets are full. The bucket group should be expanded
+            return NULL;
         }
     }
 
-    // Cannot free the block
+    #ifdef SUPERIOR_MEMORY_MANAGER_STATISTICS
+    countStatistics(cache, bucket, EVENT_ALLOCATE, length,
+                    m_bucketSizes[bucket].m_bucketUnitSize);
+    #endif
+
+    // The cookie of a freed block marks it as cached. See
+    // freeToProcessorCache
+    magazine.m_count--;
+    void* ret = magazine.m_blocks[magazine.m_count];
+    *((uint32*)ret) = 0;
+    return ret;
+}
+
+SuperiorMemoryManager::CacheFreeResult
+    SuperiorMemoryManager::freeToProcessorCache(Bucket* bucket,
+                                                void* buffer)
+{
+    uint sizeClass = bucket->getSizeClass();
+    if (sizeClass >= MAGAZINE_BUCKETS)
+        return CACHE_FREE_NOT_CACHEABLE;
+
+    // Only single-unit blocks of the bucket group can be cached. Other blocks
+    // (and invalid pointers) are handled by the bucket itself. So are the
+    // blocks which were flushed from the cache, which are free inside the
+    // bucket.
+    if (bucket->getManager().getBlockLength(buffer) !=
+        m_bucketSizes[sizeClass].m_bucketUnitSize)
+    {
+        return CACHE_FREE_NOT_CACHEABLE;
+    }
+
+    // Double free of a cached block will corrupt the cache, and the bucket
+    // still counts it as allocated. The cookie hints that the block might
+    // already be cached, by any processor.
+    uint32* cookie = (uint32*)buffer;
+    if ((*cookie == MAGAZINE_COOKIE) && (isBlockCached(sizeClass, buffer)))
+        return CACHE_FREE_REJECTED;
+
+    ProcessorCacheGuard guard(m_processorCaches);
+    ProcessorCache* cache = guard.getCache();
+    if (cache == NULL)
+        return CACHE_FREE_NOT_CACHEABLE;
+
+    Magazine& magazine = cache->m_magazines[sizeClass];
+    if (magazine.m_count == MAGAZINE_SIZE)
+        flushMagazine(magazine, MAGAZINE_BATCH);
+
+    *cookie = MAGAZINE_COOKIE;
+    magazine.m_blocks[magazine.m_count] = buffer;
+    magazine.m_count++;
+
+    #ifdef SUPERIOR_MEMORY_MANAGER_STATISTICS
+    countStatistics(cache, sizeClass, EVENT_FREE, 0,
+                    m_bucketSizes[sizeClass].m_bucketUnitSize);
+    #endif
+    return CACHE_FREE_CACHED;
+}
+
+bool SuperiorMemoryManager::isBlockCached(uint sizeClass, void* buffer) const
+{
+    for (uint i = 0; i < PROCESSOR_CACHES; i++)
+    {
+        const Magazine& magazine =
+            m_processorCaches[i].m_magazines[sizeClass];
+        uint count = t_min(magazine.m_count, (uint)MAGAZINE_SIZE);
+        for (uint j = 0; j < count; j++)
+        {
+            if (magazine.m_blocks[j] == buffer)
+                return true;
+        }
+    }
     return false;
 }
 
+void SuperiorMemoryManager::refillMagazine(uint bucket, Magazine& magazine)
+{
+    uint length = m_bucketSizes[bucket].m_bucketUnitSize;
+
+    // Each bucket fills the magazine under a single lock
+    Bucket* bucketPtr = acquireNextPartialBucket(bucket, NULL);
+    while (bucketPtr != NULL)
+    {
+        magazine.m_count+= bucketPtr->getManager().allocateBlocks(length,
+                                     magazine.m_blocks + magazine.m_count,
+                                     MAGAZINE_BATCH - magazine.m_count);
+        if (magazine.m_count == MAGAZINE_BATCH)
+        {
+            releaseBucket(bucketPtr);
+            break;
+        }
+
+        // A bucket which cannot fill the magazine is exhausted
+        void* ret = markBucketFull(bucketPtr, length);
+        if (ret != NULL)
+        {
+            magazine.m_blocks[magazine.m_count] = ret;
+            magazine.m_count++;
+        }
+
+        bucketPtr = acquireNextPartialBucket(bucket, bucketPtr);
+    }
+}
+
+void SuperiorMemoryManager::flushMagazine(Magazine& magazine, uint count)
+{
+    ASSERT(count <= magazine.m_count);
+
+    // Free runs of blocks which belong to the same bucket together
+    uint i = 0;
+    while (i < count)
+    {
+        Bucket* bucket = (Bucket*)m_ownerMap.lookup(magazine.m_blocks[i]);
+        ASSERT(bucket != NULL);
+
+        uint j = i + 1;
+        while ((j < count) &&
+               (m_ownerMap.lookup(magazine.m_blocks[j]) == bucket))
+            j++;
+
+        bool wasFull = bucket->isFull();
+        bucket->getManager().freeBlocks(magazine.m_blocks + i, j - i);
+        if (wasFull)
+            markBucketPartial(bucket);
+        i = j;
+    }
+
+    // Keep the rest of the blocks
+    for (i = count; i < magazine.m_count; i++)
+        magazine.m_blocks[i - count] = magazine.m_blocks[i];
+    magazine.m_count-= count;
+}
+
+bool SuperiorMemoryManager::freeRemote(Bucket* bucket, void* buffer)
+{
+    uint sizeClass = bucket->getSizeClass();
+    if (m_bucketSizes[sizeClass].m_engine != ENGINE_FREE_LIST)
+        return false;
+    uint32 owner = bucket->m_owner;
+    if ((owner == 0) || (owner == getProcessorSlot()))
+        return false;
+
+    // Invalid pointers are rejected by the bucket. Single-unit blocks are
+    // freed by the engine without a lock (See it's quick list), so the remote
+    // list would only add atomics on the bucket.
+    uint unit = bucket->getManager().getMinimumAllocationUnit();
+    uint length = bucket->getManager().getBlockLength(buffer);
+    if ((length < unit) || (length < sizeof(RemoteFreeLink)))
+        return false;
+
+    // Double free of a remote block will corrupt the list. The cookie hints
+    // that the block might already be inside it, so the list is returned
+    // into the bucket, which rejects the second free.
+    RemoteFreeLink* link = (RemoteFreeLink*)buffer;
+    if (link->m_cookie == REMOTE_FREE_COOKIE)
+    {
+        reclaimRemoteFrees(bucket);
+        return false;
+    }
+
+    #ifdef SUPERIOR_MEMORY_MANAGER_STATISTICS
+    countStatistics(NULL, sizeClass, EVENT_FREE, 0, length);
+    #endif
+
+    // The bytes are counted like the allocated bytes of the bucket: Whole
+    // units, including the allocation-descriptor
+    link->m_cookie = REMOTE_FREE_COOKIE;
+    link->m_length = ((length + unit - 1) / unit) * unit;
+    MemoryAtomic::add(&bucket->m_remoteBytes, link->m_length);
+
+    // Once the block is published it might be reclaimed by the owner, and the
+    // bucket might become empty. It cannot be detached while it has users.
+    MemoryAtomic::increment(&bucket->m_users);
+
+    // Only the whole list is taken, so the push is safe from the ABA problem
+    void* head;
+    do {
+        head = bucket->m_remoteFrees;
+        link->m_next = head;
+    } while (MemoryAtomic::compareExchangePointer(&bucket->m_remoteFrees,
+                                                  buffer,
+                                                  head) != head);
+
+    // Full buckets are not allocated from. The first block of the list moves
+    // the bucket back into the partial set. The full mark is set before the
+    // list is reclaimed, see 'markBucketFull'.
+    if ((head == NULL) && (bucket->isFull()))
+        markBucketPartial(bucket);
+    releaseBucket(bucket);
+    return true;
+}
+
+void SuperiorMemoryManager::reclaimRemoteFrees(Bucket* bucket)
+{
+    if (bucket->m_remoteFrees == NULL)
+        return;
+
+    void* block = MemoryAtomic::exchangePointer(&bucket->m_remoteFrees, NULL);
+    void* blocks[REMOTE_FREE_BATCH];
+    uint count = 0;
+    uint32 bytes = 0;
+    while (block != NULL)
+    {
+        RemoteFreeLink* link = (RemoteFreeLink*)block;
+        block = link->m_next;
+        link->m_cookie = 0;
+        bytes+= link->m_length;
+        blocks[count] = link;
+        count++;
+
+        if ((count == REMOTE_FREE_BATCH) || (block == NULL))
+        {
+            // The bytes stop being free before the blocks are freed. See
+            // getBucketSize
+            MemoryAtomic::add(&bucket->m_remoteBytes, (uint32)0 - bytes);
+            bucket->getManager().freeBlocks(blocks, count);
+            count = 0;
+            bytes = 0;
+        }
+    }
+}
+
+uint32 SuperiorMemoryManager::getProcessorSlot()
+{
+    // NOTE: The thread might move to another processor meanwhile. The callers
+    //       use the slot only as a hint.
+    return MemoryProcessorSlot::getCurrentSlot() + 1;
+}
+
 uint SuperiorMemoryManager::getMaximumAllocationUnit() const
 {
     return BUCKET_DEFAULT_CACHE_SIZE;
@@ -261,9 +913,9 @@ uint SuperiorMemoryManager::getMinimumAllocationUnit() const
     return 0;
 }
 
-uint SuperiorMemoryManager::getNumberOfAllocatedBytes() const
+memorySize SuperiorMemoryManager::getNumberOfAllocatedBytes() const
 {
-    uint ret = 0;
+    memorySize ret = 0;
     for (uint i = 0; i < MAX_BUCKETS; i++)
     {
         ret+= getBucketSize(i, SIZE_ALLOCATE);
@@ -271,9 +923,9 @@ uint SuperiorMemoryManager::getNumberOfAllocatedBytes() const
     return ret;
 }
 
-uint SuperiorMemoryManager::getNumberOfFreeBytes() const
+memorySize SuperiorMemoryManager::getNumberOfFreeBytes() const
 {
-    uint ret = 0;
+    memorySize ret = 0;
     for (uint i = 0; i < MAX_BUCKETS; i++)
     {
         ret+= getBucketSize(i, SIZE_FREE);
@@ -287,37 +939,144 @@ SuperiorMemoryManager::Bucket* SuperiorMemoryManager::safeGetFirstBucket(
 {
     ASSERT(bucket < MAX_BUCKETS);
 
-    cLock lock(m_lock);
+    // A pointer is read at once. See the header
     return m_firstBucketHandler[bucket];
 }
 
-uint SuperiorMemoryManager::getBucketIndex(uint length) const
+SuperiorMemoryManager::Bucket*
+    SuperiorMemoryManager::acquireNextPartialBucket(uint bucket,
+                                                    Bucket* current)
 {
-    for (uint i = 0; i < MAX_BUCKETS; i++)
-        // NOTE: The overhead size is taken care of inside the
-        //       'getBucketAllocationUnit' function
-        if (length <= m_bucketSizes[i].m_bucketUnitSize)
-            return i;
+    ASSERT(bucket < MAX_BUCKETS);
+
+    cLock lock(m_partialLocks[bucket]);
+    Bucket* ret;
+    // The links of a full bucket are no longer valid
+    if ((current == NULL) || (current->isFull()))
+        ret = m_partialBuckets[bucket];
+    else
+        ret = current->m_nextPartial;
+
+    if (ret != NULL)
+        MemoryAtomic::increment(&ret->m_users);
+    if (current != NULL)
+        releaseBucket(current);
+    return ret;
+}
+
+void SuperiorMemoryManager::releaseBucket(Bucket* bucket)
+{
+    ASSERT(bucket->m_users > 0);
+    MemoryAtomic::decrement(&bucket->m_users);
+}
+
+bool SuperiorMemoryManager::isBucketExhausted(Bucket* bucket,
+                                              uint length) const
+{
+    uint sizeClass = bucket->getSizeClass();
+    if (sizeClass != MemorySizeClass::NUMBER_OF_CLASSES)
+    {
+        // A single unit cannot be allocated
+        return length <= m_bucketSizes[sizeClass].m_bucketUnitSize;
+    }
+    // No free extent at all
+    return bucket->getManager().getMaximumAllocationUnit() == 0;
+}
+
+void* SuperiorMemoryManager::markBucketFull(Bucket* bucket, uint length)
+{
+    cLock lock(m_lock);
+    if (bucket->isFull())
+        return NULL;
+
+    // A concurrent free which reads the full mark after this point will
+    // wait for the lock in order to move the bucket back. A free which read
+    // it before, might leave a free unit inside a full bucket. Such buckets
+    // are moved back once they are empty. See 'reclaimBuckets'
+    MemoryAtomic::exchange(&bucket->m_isFull, 1);
+    // The remote blocks are free units as well. A block which is pushed from
+    // now on finds the full mark. See 'freeRemote'
+    reclaimRemoteFrees(bucket);
+    void* ret = bucket->getManager().allocate(length);
+    if (ret != NULL)
+    {
+        // A unit was freed before the mark
+        MemoryAtomic::exchange(&bucket->m_isFull, 0);
+        return ret;
+    }
+
+    cLock partialLock(m_partialLocks[bucket->getSizeClass()]);
+    unlinkPartialBucket(bucket);
+    return NULL;
+}
+
+void SuperiorMemoryManager::markBucketPartial(Bucket* bucket)
+{
+    cLock lock(m_lock);
+    if (!bucket->isFull())
+        return;
+
+    // A scan of the set which finds the bucket partial, finds it linked
+    cLock partialLock(m_partialLocks[bucket->getSizeClass()]);
+    MemoryAtomic::exchange(&bucket->m_isFull, 0);
+    linkPartialBucket(bucket);
+}
 
-    // Something went wrong with the table
-    ASSERT_FAIL(XSTL_STRING("Invalid terminate bucket"));
-    // Return the default bucket
-    return MAX_BUCKETS - 1;
+void SuperiorMemoryManager::linkPartialBucket(Bucket* bucket)
+{
+    uint sizeClass = bucket->getSizeClass();
+    bucket->m_previousPartial = NULL;
+    bucket->m_nextPartial = m_partialBuckets[sizeClass];
+    if (bucket->m_nextPartial != NULL)
+        bucket->m_nextPartial->m_previousPartial = bucket;
+    m_partialBuckets[sizeClass] = bucket;
+}
+
+void SuperiorMemoryManager::unlinkPartialBucket(Bucket* bucket)
+{
+    if (bucket->m_previousPartial != NULL)
+        bucket->m_previousPartial->m_nextPartial = bucket->m_nextPartial;
+    else
+        m_partialBuckets[bucket->getSizeClass()] = bucket->m_nextPartial;
+
+    if (bucket->m_nextPartial != NULL)
+        bucket->m_nextPartial->m_previousPartial = bucket->m_previousPartial;
+
+    bucket->m_nextPartial = NULL;
+    bucket->m_previousPartial = NULL;
+}
+
+uint SuperiorMemoryManager::getBucketIndex(uint length) const
+{
+    // NOTE: The overhead size is taken care of inside the
+    //       'getBucketAllocationUnit' function
+    // NOTE: Lengths above the last size class are mapped into the default
+    //       bucket (MemorySizeClass::NUMBER_OF_CLASSES)
+    return MemorySizeClass::getSizeClass(length);
 }
 
-uint SuperiorMemoryManager::getBucketSize(uint bucket,
-                                          uint type) const
+memorySize SuperiorMemoryManager::getBucketSize(uint bucket,
+                                                uint type) const
 {
     ASSERT(bucket < MAX_BUCKETS);
 
-    uint ret = 0;
-    Bucket* bucketPtr = safeGetFirstBucket(bucket);
+    memorySize ret = 0;
+    // The buckets cannot be detached while they are scanned
+    cLock lock(m_lock);
+    Bucket* bucketPtr = m_firstBucketHandler[bucket];
     while (bucketPtr != NULL)
     {
+        // The blocks of the remote list are free. They are counted before
+        // they are freed, so they never exceed the allocated bytes. (Unless
+        // the list was reclaimed between the two reads)
+        memorySize remoteBytes = bucketPtr->m_remoteBytes;
+        memorySize allocatedBytes =
+            bucketPtr->getManager().getNumberOfAllocatedBytes();
+        remoteBytes = t_min(remoteBytes, allocatedBytes);
         if ((type & SIZE_ALLOCATE) != 0)
-            ret+= bucketPtr->getManager().getNumberOfAllocatedBytes();
+            ret+= allocatedBytes - remoteBytes;
         if ((type & SIZE_FREE) != 0)
-            ret+= bucketPtr->getManager().getNumberOfFreeBytes();
+            ret+= bucketPtr->getManager().getNumberOfFreeBytes() + remoteBytes;
 
         // Get the next bucket from the same group
         bucketPtr = bucketPtr->getNextBucket();
@@ -333,15 +1092,25 @@ uint SuperiorMemoryManager::getNewBucketSize(uint bucket,
     // For the nil bucket
     if (m_bucketSizes[bucket].m_bucketUnitSize == BUCKET_DEFAULT_CACHE_SIZE)
     {
-        return requestedMem + SmallMemoryHeapManager::ALLOCATED_UNIT_OVERHEAD;
+        // Each new region doubles the group, so the group is made of a few
+        // regions. Larger blocks get a region of their own.
+        memorySize groupSize = getBucketSize(bucket, SIZE_ALLOCATE_AND_FREE);
+        groupSize = t_max(groupSize, (memorySize)LARGE_REGION_MINIMUM_SIZE);
+        uint initSize = (uint)t_min(groupSize,
+                                    (memorySize)LARGE_REGION_MAXIMUM_SIZE);
+        return t_max(initSize, getMinimumBucketSize(bucket, requestedMem));
     }
 
-    uint initSize = getBucketSize(bucket, SIZE_ALLOCATE_AND_FREE);
-    if (initSize == 0)
-    {
-        // There is not bucket allocated yet
-        return getMinimumBucketSize(bucket, requestedMem);
-    }
+    // Grow by the size of the bucket group, or start with the minimum size
+    // (The minimum might be tuned above the current size of the group)
+    // NOTE: Groups of the size classes are bounded by the buckets count, so
+    //       the group size is truncated only on absurdly large heaps.
+    uint initSize = (uint)t_min(getBucketSize(bucket, SIZE_ALLOCATE_AND_FREE),
+                                (memorySize)0xFFFFFFFF);
+    initSize = t_max(initSize, getMinimumBucketSize(bucket, requestedMem));
+
+    // NOTE: Buckets of the free-list engine with more than MAX_BLOCKS units
+    //       use the wide descriptors. See Bucket::Bucket
 
     // Allocate x0.7 of the enitre old allocated size
     return initSize;
@@ -355,10 +1124,17 @@ uint SuperiorMemoryManager::getMinimumBucketSize(uint bucket,
     // For the nil bucket
     if (m_bucketSizes[bucket].m_bucketUnitSize == BUCKET_DEFAULT_CACHE_SIZE)
     {
-        return requestedMem + SmallMemoryHeapManager::ALLOCATED_UNIT_OVERHEAD;
+        // A single extent of the requested length. Buckets must not be
+        // smaller than the owner-map granularity. Small requests reach the
+        // nil bucket by the wrap-around of 'allocate'.
+        uint minimumSize =
+            LargeMemoryHeapManager::getSuperblockLength(requestedMem);
+        if (minimumSize == 0)
+            return 0xFFFFFFFF;
+        return t_max(minimumSize, (uint)MemoryOwnerMap::GRANULARITY);
     }
 
-    return m_bucketSizes[bucket].m_defaultElementsForBucket *
+    return m_bucketElements[bucket] *
             getBucketAllocationUnit(bucket, requestedMem);
 }
 
@@ -370,7 +1146,9 @@ uint SuperiorMemoryManager::getBucketAllocationUnit(uint bucket,
     // For the nil bucket
     if (m_bucketSizes[bucket].m_bucketUnitSize == BUCKET_DEFAULT_CACHE_SIZE)
     {
-        return requestedMem + SmallMemoryHeapManager::ALLOCATED_UNIT_OVERHEAD;
+        // A region which cannot hold the requested block is useless. See the
+        // minimum allocation of 'allocateSuperblock'
+        return getMinimumBucketSize(bucket, requestedMem);
     }
 
     // Don't forget to include the over-head as well!
@@ -400,24 +1178,52 @@ void* SuperiorMemoryManager::allocateSuperblock(uint requestedLength,
 
     if (ret == NULL)
     {
-        // Try to allocate the best fit for the remainding of the memory
-        for (uint j = ((minimumLength / allocationUnit) >> 1); j > 0; j>>= 1)
+        // Try to allocate the best fit for the remainding of the memory.
+        // Buckets must not be smaller than the owner-map granularity.
+        for (uint j = ((minimumLength / allocationUnit) >> 1);
+             (j > 0) && ((j * allocationUnit) >= MemoryOwnerMap::GRANULARITY);
+             j>>= 1)
         {
             ret = m_superBlockRepository->minimumAllocation(
                                                        j * allocationUnit,
                                                        realAllocatedBlockSize);
             if (ret != NULL)
-            {
-                m_allocatedOsMemorySize+= realAllocatedBlockSize;
-                return ret;
-            }
+                break;
         }
     }
 
     m_allocatedOsMemorySize+= realAllocatedBlockSize;
+    countSuperblockAllocation(ret, realAllocatedBlockSize, minimumLength);
     return ret;
 }
 
+void SuperiorMemoryManager::countSuperblockAllocation(void* buffer,
+                                                      uint length,
+                                                      uint minimumLength)
+{
+    if (buffer != NULL)
+    {
+        // The rate is measured from the first bucket after the last sample,
+        // so idle periods don't hide a burst
+        if (m_rateBytes == 0)
+            m_rateStartTime = cOS::getSystemTime();
+        m_rateBytes+= length;
+    } else if ((minimumLength > m_failedBucketLength) &&
+               (minimumLength <= (m_osMaximumSize - m_osMemorySize)))
+    {
+        m_failedBucketLength = minimumLength;
+    }
+
+    // Post the request only once
+    if (m_isExpansionRequested != 0)
+        return;
+    if ((buffer == NULL) ||
+        ((m_osMemorySize - m_allocatedOsMemorySize) < m_lowWatermark))
+    {
+        MemoryAtomic::exchange(&m_isExpansionRequested, 1);
+    }
+}
+
 void SuperiorMemoryManager::manageMemory()
 {
     // Lock all superblock activities. This section is critical
@@ -429,61 +1235,731 @@ void SuperiorMemoryManager::manageMemory()
     if (m_manageInProgress)
         return;
 
-    // Test whether the total number of allocated memory is close to the
-    // number of superblock size
-    if ((m_allocatedOsMemorySize * 2) > m_osMemorySize)
-    {
-        // Need to allocate more superblock
-        uint newSuperblockSize = m_osMaximumSize - m_osMemorySize;
-        newSuperblockSize = t_min(newSuperblockSize, m_osMemorySize / 2);
+    #ifdef SUPERIOR_MEMORY_MANAGER_STATISTICS
+    samplePeaks();
+    #endif
 
-        // Align superblock
-        newSuperblockSize = (newSuperblockSize /
-                             m_osmem->getSuperblockPageAlignment());
-        newSuperblockSize*= m_osmem->getSuperblockPageAlignment();
+    // Follow the requests of the last period
+    if (m_isAdaptive)
+        tuneSizeClasses();
 
+    // Return the memory of the last burst
+    if (m_reclaimIdlePeriods != 0)
+    {
+        reclaimBuckets();
+        releaseMetadataChunks();
 
-        // This code should be executed without any guards.
-        m_manageInProgress = true;
-        m_lock.unlock();
-        // {
-        void* ptr = m_osmem->allocateNewSuperblock(newSuperblockSize);
-        // }
-        m_lock.lock();
-        m_manageInProgress = false;
-
-        if (ptr == NULL)
+        SuperblockRepository* idleSuperblock = detachIdleSuperblock();
+        if (idleSuperblock != NULL)
         {
+            uint idleLength = idleSuperblock->getLength();
+
+            // This code should be executed without any guards.
+            m_manageInProgress = true;
+            m_lock.unlock();
+            // {
+            m_osmem->freeSuperblock(idleSuperblock->getOSBuffer());
+            // }
+            m_lock.lock();
+            m_manageInProgress = false;
+
+            idleSuperblock->operator delete(idleSuperblock, m_metadataPool);
+
             // Free the lockable
             lock.unlock();
-            traceHigh("SuperiorMemoryManager: No more operating system memory..." << endl);
-            cOS::debuggerBreak();
+            traceHigh("SuperiorMemoryManager: --- Returning superblock: " <<
+                      HEXDWORD(idleLength) << endl);
             return;
         }
+    }
+
+    // Free the lockable
+    lock.unlock();
+    expandMemory();
+}
+
+bool SuperiorMemoryManager::isExpansionRequested() const
+{
+    return m_isExpansionRequested != 0;
+}
+
+void SuperiorMemoryManager::setLowWatermark(uint bytes)
+{
+    cLock lock(m_lock);
+    m_lowWatermark = bytes;
+}
 
-        // And expand
-        m_osMemorySize+= newSuperblockSize;
-        SuperblockRepository* newBlock = new(m_privatePool)
-            SuperblockRepository(ptr,
-                                 newSuperblockSize,
-                                 m_superBlockRepository);
-        m_superBlockRepository = newBlock;
+void SuperiorMemoryManager::expandMemory()
+{
+    // Lock all superblock activities. This section is critical
+    cLock lock(m_lock);
+
+    // Test previous manage code. The request is kept for the next call.
+    if (m_manageInProgress)
+        return;
+    MemoryAtomic::exchange(&m_isExpansionRequested, 0);
+
+    // Sample the rate of new buckets. Grow at once, decay slowly.
+    uint rate = 0;
+    if (m_rateBytes != 0)
+    {
+        uint elapsed = cOS::calculateTimesDiffMilli(cOS::getSystemTime(),
+                                                    m_rateStartTime);
+        elapsed = t_max(elapsed, (uint)1);
+        uint64 bytesPerSecond = (uint64)m_rateBytes * 1000 / elapsed;
+        rate = (uint)t_min(bytesPerSecond, (uint64)0xFFFFFFFF);
+        m_rateBytes = 0;
+    }
+    m_allocationRate = t_max(rate, (m_allocationRate / 2) + (rate / 2));
+
+    // Test whether the total number of allocated memory is close to the
+    // number of superblock size
+    memorySize freeSize = m_osMemorySize - m_allocatedOsMemorySize;
+    if (((m_allocatedOsMemorySize * 2) <= m_osMemorySize) &&
+        (freeSize >= m_lowWatermark) &&
+        (m_failedBucketLength == 0))
+    {
+        return;
+    }
+
+    // Need to allocate more superblock
+    uint newSuperblockSize = getExpansionSize();
+    if (newSuperblockSize == 0)
+    {
+        // Free the lockable
+        lock.unlock();
+        traceHigh("SuperiorMemoryManager: Maximum size reached..." << endl);
+        return;
+    }
+
+    // This code should be executed without any guards.
+    m_manageInProgress = true;
+    m_lock.unlock();
+    // {
+    void* ptr = m_osmem->allocateNewSuperblock(newSuperblockSize);
+    if ((ptr != NULL) && (!m_ownerMap.reserve(ptr, newSuperblockSize)))
+    {
+        // Not enough memory for the owner-map
+        m_osmem->freeSuperblock(ptr);
+        ptr = NULL;
+    }
+    // }
+    m_lock.lock();
+    m_manageInProgress = false;
 
+    if (ptr == NULL)
+    {
         // Free the lockable
         lock.unlock();
-        traceHigh("SuperiorMemoryManager: +++ Expanding superblock: " <<
-                  HEXDWORD(newSuperblockSize) << endl);
+        traceHigh("SuperiorMemoryManager: No more operating system memory..." << endl);
+        cOS::debuggerBreak();
+        return;
+    }
+
+    // And expand
+    m_osMemorySize+= newSuperblockSize;
+    m_failedBucketLength = 0;
+    m_superBlockRepository = newSuperblockRepository(ptr, newSuperblockSize);
+
+    // Free the lockable
+    lock.unlock();
+    traceHigh("SuperiorMemoryManager: +++ Expanding superblock: " <<
+              HEXDWORD(newSuperblockSize) << endl);
+}
+
+uint SuperiorMemoryManager::getExpansionSize()
+{
+    if (m_osMemorySize >= m_osMaximumSize)
+        return 0;
+    // Each superblock length must fit 32 bits
+    uint64 maximumSize = t_min((uint64)(m_osMaximumSize - m_osMemorySize),
+                               (uint64)0xFFFFFFFF);
+
+    // The predicted demand above the low watermark, minus the free memory
+    uint64 freeSize = m_osMemorySize - m_allocatedOsMemorySize;
+    uint64 demand = (uint64)m_allocationRate * EXPANSION_HORIZON_MILLISECONDS /
+                    1000 + m_lowWatermark;
+    uint64 size = (demand > freeSize) ? (demand - freeSize) : 0;
+    size = t_max(size, (uint64)EXPANSION_MINIMUM_SIZE);
+    // Never more than double the heap at once, unless a bucket requires it
+    size = t_min(size, (uint64)m_osMemorySize);
+    size = t_min(size, (uint64)MAXIMUM_SUPERBLOCK_SIZE);
+    size = t_max(size, (uint64)m_failedBucketLength);
+
+    // Align superblock
+    uint64 alignment = m_osmem->getSuperblockPageAlignment();
+    size = ((size + alignment - 1) / alignment) * alignment;
+    if (size > maximumSize)
+        size = (maximumSize / alignment) * alignment;
+    return (uint)size;
+}
+
+void SuperiorMemoryManager::tuneSizeClasses()
+{
+    // Collect the requests since the last tuning
+    uint32 requests[MAX_BUCKETS];
+    uint32 totalRequests = 0;
+    uint i;
+    for (i = 0; i < MemorySizeClass::NUMBER_OF_CLASSES; i++)
+    {
+        uint32 count = m_requestsHistogram[i];
+        if (i < MAGAZINE_BUCKETS)
+        {
+            // NOTE: The counters of the other processors might be changed
+            //       meanwhile. The next period will count the difference.
+            for (uint j = 0; j < PROCESSOR_CACHES; j++)
+                count+= m_processorCaches[j].m_requests[i];
+        }
+        requests[i] = count - m_tunedRequests[i];
+        totalRequests+= requests[i];
+    }
+
+    // Wait for a representative period
+    if (totalRequests < TUNING_MINIMUM_REQUESTS)
+        return;
+
+    for (i = 0; i < MemorySizeClass::NUMBER_OF_CLASSES; i++)
+    {
+        m_tunedRequests[i]+= requests[i];
+
+        // A new bucket should hold the units which were requested during the
+        // last period, but never less than the owner-map granularity and
+        // never more than TUNING_MAXIMUM_BUCKET_SIZE.
+        uint aunit = getBucketAllocationUnit(i, 0);
+        uint minimumElements = (MemoryOwnerMap::GRANULARITY + aunit - 1) /
+                               aunit;
+        minimumElements = t_max(minimumElements,
+                            (uint)MemorySizeClass::MINIMUM_BUCKET_ELEMENTS);
+        uint maximumElements = TUNING_MAXIMUM_BUCKET_SIZE / aunit;
+        maximumElements = t_max(maximumElements, minimumElements);
+
+        // Grow at once, with a little headroom. Shrink slowly, in case the
+        // period was a quiet one.
+        uint elements = requests[i] + (requests[i] >> TUNING_HEADROOM_SHIFT);
+        if (elements < m_bucketElements[i])
+            elements = (m_bucketElements[i] + elements) / 2;
+        elements = t_max(elements, minimumElements);
+        elements = t_min(elements, maximumElements);
+        m_bucketElements[i] = elements;
     }
 }
 
+void SuperiorMemoryManager::setReclaimIdlePeriods(uint periods)
+{
+    cLock lock(m_lock);
+    m_reclaimIdlePeriods = periods;
+}
+
+void SuperiorMemoryManager::setDirectMappingThreshold(uint length)
+{
+    cLock lock(m_lock);
+    m_directMappingThreshold = length;
+}
+
+void* SuperiorMemoryManager::allocateDirect(uint length)
+{
+    uint regionLength = LargeMemoryHeapManager::getSuperblockLength(length);
+    if (regionLength == 0)
+        return NULL;
+    regionLength = t_max(regionLength, (uint)MemoryOwnerMap::GRANULARITY);
+
+    cLock lock(m_lock);
+    // The owner-map reservations are serialized by this flag. See
+    // 'manageMemory'
+    if (m_manageInProgress)
+        return NULL;
+    memorySize usedSize = m_osMemorySize + m_directMemorySize;
+    if ((usedSize > m_osMaximumSize) ||
+        (regionLength > (m_osMaximumSize - usedSize)))
+    {
+        return NULL;
+    }
+
+    // This code should be executed without any guards.
+    m_manageInProgress = true;
+    m_lock.unlock();
+    // {
+    void* buffer = m_osmem->allocateNewSuperblock(regionLength);
+    if ((buffer != NULL) && (!m_ownerMap.reserve(buffer, regionLength)))
+    {
+        // Not enough memory for the owner-map
+        m_osmem->freeSuperblock(buffer);
+        buffer = NULL;
+    }
+    // }
+    m_lock.lock();
+    m_manageInProgress = false;
+
+    if (buffer == NULL)
+        return NULL;
+    if (!reserveMetadata())
+    {
+        // No room for the descriptor. The region is returned outside the
+        // lock, and the block is allocated from the regions.
+        lock.unlock();
+        m_osmem->freeSuperblock(buffer);
+        return NULL;
+    }
+
+    // The bucket is never in the partial set
+    const uint bucket = MemorySizeClass::NUMBER_OF_CLASSES;
+    Bucket* newBucket = new(m_metadataPool) Bucket(buffer,
+                                    regionLength,
+                                    LargeMemoryHeapManager::PAGE_SIZE,
+                                    bucket,
+                                    ENGINE_LARGE,
+                                    m_firstBucketHandler[bucket]);
+    newBucket->m_isDirect = true;
+    MemoryAtomic::exchange(&newBucket->m_isFull, 1);
+    m_ownerMap.insert(buffer, regionLength, newBucket);
+    m_firstBucketHandler[bucket] = newBucket;
+    m_directMemorySize+= regionLength;
+
+    void* ret = newBucket->getManager().allocate(length);
+    ASSERT(ret != NULL);
+    return ret;
+}
+
+void SuperiorMemoryManager::freeDirect(Bucket* bucket)
+{
+    ASSERT(bucket->m_isDirect);
+    void* buffer = bucket->getBuffer();
+    uint length = bucket->getLength();
+
+    {
+        cLock lock(m_lock);
+        Bucket* previous = NULL;
+        Bucket* current = m_firstBucketHandler[bucket->getSizeClass()];
+        while (current != bucket)
+        {
+            ASSERT(current != NULL);
+            previous = current;
+            current = current->getNextBucket();
+        }
+        if (previous != NULL)
+            previous->m_nextHandler = bucket->m_nextHandler;
+        else
+            m_firstBucketHandler[bucket->getSizeClass()] =
+                bucket->m_nextHandler;
+        m_ownerMap.remove(buffer, length);
+        m_directMemorySize-= length;
+
+        bucket->~Bucket();
+        bucket->operator delete(bucket, m_metadataPool);
+    }
+
+    // Outside the lock
+    m_osmem->freeSuperblock(buffer);
+}
+
+void SuperiorMemoryManager::reclaimBuckets()
+{
+    for (uint i = 0; i < MAX_BUCKETS; i++)
+    {
+        Bucket* previous = NULL;
+        Bucket* bucket = m_firstBucketHandler[i];
+        while (bucket != NULL)
+        {
+            Bucket* next = bucket->getNextBucket();
+            reclaimRemoteFrees(bucket);
+
+            // A free adds itself as a user before it frees it's block, so
+            // the users are read after the bucket is found empty. Direct
+            // buckets are returned by 'free'.
+            if ((bucket->m_isDirect) || (!bucket->isEmpty()) ||
+                (bucket->m_users != 0))
+            {
+                bucket->m_idlePeriods = 0;
+                previous = bucket;
+                bucket = next;
+                continue;
+            }
+
+            // A free which raced with 'markBucketFull' might leave an empty
+            // bucket inside the full set
+            if (bucket->isFull())
+            {
+                cLock partialLock(m_partialLocks[i]);
+                MemoryAtomic::exchange(&bucket->m_isFull, 0);
+                linkPartialBucket(bucket);
+                bucket->m_idlePeriods = 0;
+            }
+
+            bucket->m_idlePeriods++;
+            if (bucket->m_idlePeriods < m_reclaimIdlePeriods)
+            {
+                previous = bucket;
+                bucket = next;
+                continue;
+            }
+
+            {
+                // Allocations pin the buckets of the partial set under the
+                // partial lock only. Once unlinked, the bucket cannot be
+                // found by them.
+                cLock partialLock(m_partialLocks[i]);
+                if ((!bucket->isEmpty()) || (bucket->m_users != 0))
+                {
+                    bucket->m_idlePeriods = 0;
+                    previous = bucket;
+                    bucket = next;
+                    continue;
+                }
+                unlinkPartialBucket(bucket);
+            }
+
+            detachBucket(bucket, previous);
+            bucket = next;
+        }
+    }
+}
+
+void SuperiorMemoryManager::detachBucket(Bucket* bucket, Bucket* previous)
+{
+    ASSERT(!bucket->isFull());
+    ASSERT(bucket->m_users == 0);
+
+    void* buffer = bucket->getBuffer();
+    uint length = bucket->getLength();
+
+    // Remove the bucket from the lists. From now on, the bucket cannot be
+    // found by frees. It's already out of the partial set.
+    if (previous != NULL)
+        previous->m_nextHandler = bucket->m_nextHandler;
+    else
+        m_firstBucketHandler[bucket->getSizeClass()] = bucket->m_nextHandler;
+    m_ownerMap.remove(buffer, length);
+
+    // Recycle the memory
+    releaseSuperblockMemory(buffer, length);
+
+    bucket->~Bucket();
+    bucket->operator delete(bucket, m_metadataPool);
+}
+
+void SuperiorMemoryManager::releaseSuperblockMemory(void* buffer, uint length)
+{
+    SuperblockRepository* superblock = m_superBlockRepository;
+    while (!superblock->isInside(buffer))
+    {
+        superblock = superblock->getNextRepository();
+        ASSERT(superblock != NULL);
+    }
+    superblock->release(buffer, length);
+    m_allocatedOsMemorySize-= length;
+}
+
+bool SuperiorMemoryManager::reserveMetadata()
+{
+    if (!m_metadataPool.isExhausted())
+        return true;
+    // The first superblock is being constructed
+    if (m_superBlockRepository == NULL)
+        return false;
+
+    // A shorter chunk is better than nothing
+    uint minimumLength = m_metadataPool.getMinimumChunkLength();
+    uint chunkLength = 0;
+    void* chunk = m_superBlockRepository->allocate(METADATA_CHUNK_SIZE,
+                                        minimumLength,
+                                        m_metadataPool.getObjectLength(),
+                                        chunkLength);
+    if (chunk == NULL)
+        return false;
+
+    m_allocatedOsMemorySize+= chunkLength;
+    m_metadataPool.addChunk(chunk, chunkLength);
+    return true;
+}
+
+void SuperiorMemoryManager::releaseMetadataChunks()
+{
+    uint length = 0;
+    void* chunk = m_metadataPool.removeEmptyChunk(length);
+    while (chunk != NULL)
+    {
+        releaseSuperblockMemory(chunk, length);
+        chunk = m_metadataPool.removeEmptyChunk(length);
+    }
+}
+
+SuperiorMemoryManager::SuperblockRepository*
+    SuperiorMemoryManager::newSuperblockRepository(void* buffer, uint length)
+{
+    if (reserveMetadata())
+    {
+        return new(m_metadataPool) SuperblockRepository(buffer,
+                                                       length,
+                                                       m_superBlockRepository);
+    }
+
+    // Store the descriptor at the beginning of the new superblock. The chunk
+    // is counted as a used memory of the superblock, so the superblock is
+    // never returned as long as the descriptor is inside it.
+    uint chunkLength = t_min(length, (uint)METADATA_CHUNK_SIZE);
+    m_metadataPool.addChunk(buffer, chunkLength);
+    SuperblockRepository* ret = new(m_metadataPool)
+        SuperblockRepository(buffer, length, m_superBlockRepository);
+    void* chunk = ret->privateMalloc(chunkLength);
+    ASSERT(chunk == buffer);
+    m_allocatedOsMemorySize+= chunkLength;
+    return ret;
+}
+
+SuperiorMemoryManager::SuperblockRepository*
+    SuperiorMemoryManager::detachIdleSuperblock()
+{
+    SuperblockRepository* ret = NULL;
+    SuperblockRepository* retPrevious = NULL;
+
+    // All superblocks should count the period
+    SuperblockRepository* previous = NULL;
+    SuperblockRepository* superblock = m_superBlockRepository;
+    while (superblock != NULL)
+    {
+        uint length = superblock->getLength();
+        if ((superblock->countIdlePeriod() >= m_reclaimIdlePeriods) &&
+            (ret == NULL) &&
+            // Keep the initialize size
+            ((m_osMemorySize - length) >= m_osMinimumSize) &&
+            // Don't expand again soon. See 'expandMemory'
+            ((m_allocatedOsMemorySize * 4) <= (m_osMemorySize - length)) &&
+            ((m_osMemorySize - length - m_allocatedOsMemorySize) >=
+             m_lowWatermark))
+        {
+            ret = superblock;
+            retPrevious = previous;
+        }
+
+        previous = superblock;
+        superblock = superblock->getNextRepository();
+    }
+
+    if (ret == NULL)
+        return NULL;
+
+    if (retPrevious != NULL)
+        retPrevious->setNextRepository(ret->getNextRepository());
+    else
+        m_superBlockRepository = ret->getNextRepository();
+    m_osMemorySize-= ret->getLength();
+    return ret;
+}
+
+uint SuperiorMemoryManager::getBucketElements(uint length) const
+{
+    uint bucket = getBucketIndex(length);
+    cLock lock(m_lock);
+    return m_bucketElements[bucket];
+}
+
+void SuperiorMemoryManager::recordSizeHistogram(uint length, uint count)
+{
+    MemoryAtomic::add(&m_requestsHistogram[getBucketIndex(length)], count);
+}
+
+#ifdef SUPERIOR_MEMORY_MANAGER_STATISTICS
+void SuperiorMemoryManager::countStatistics(ProcessorCache* cache,
+                                            uint bucket,
+                                            StatisticsEvent event,
+                                            uint length,
+                                            uint blockLength)
+{
+    if (cache != NULL)
+    {
+        updateStatistics(cache->m_statistics, bucket, event, length,
+                         blockLength);
+        return;
+    }
+
+    ProcessorCacheGuard guard(m_processorCaches);
+    if (guard.getCache() != NULL)
+    {
+        updateStatistics(guard.getCache()->m_statistics, bucket, event,
+                         length, blockLength);
+        return;
+    }
+
+    #ifdef XDK_TEST
+    // The slot of the thread is used by another thread. The shared slot is
+    // held only for the update itself.
+    while (MemoryAtomic::exchange(&m_sharedStatisticsBusy, 1) != 0)
+        ;
+    updateStatistics(m_sharedStatistics, bucket, event, length, blockLength);
+    MemoryAtomic::exchange(&m_sharedStatisticsBusy, 0);
+    #endif
+}
+
+void SuperiorMemoryManager::updateStatistics(StatisticsSlot& slot,
+                                             uint bucket,
+                                             StatisticsEvent event,
+                                             uint length,
+                                             uint blockLength)
+{
+    ASSERT(bucket < MAX_BUCKETS);
+
+    // The counters are written only by the owner of the slot, so there is no
+    // need for interlocked operations. The volatile accesses keep the order
+    // of the writes, which is all the readers need. See readStatistics
+    volatile SizeClassCounters& counters = slot.m_counters[bucket];
+    slot.m_sequence++;
+    switch (event)
+    {
+    case EVENT_ALLOCATE:
+        counters.m_allocations++;
+        counters.m_requestedBytes+= length;
+        counters.m_allocatedBytes+= blockLength;
+        break;
+    case EVENT_FREE:
+        counters.m_frees++;
+        counters.m_freedBytes+= blockLength;
+        break;
+    case EVENT_FAILURE:
+        counters.m_failures++;
+        break;
+    }
+    slot.m_sequence++;
+}
+
+void SuperiorMemoryManager::readStatistics(uint bucket,
+                                           SizeClassCounters& total) const
+{
+    ASSERT(bucket < MAX_BUCKETS);
+
+    uint slots = PROCESSOR_CACHES;
+    #ifdef XDK_TEST
+    // And the shared slot
+    slots++;
+    #endif
+
+    for (uint i = 0; i < slots; i++)
+    {
+        #ifdef XDK_TEST
+        const StatisticsSlot& slot = (i == PROCESSOR_CACHES) ?
+            m_sharedStatistics : m_processorCaches[i].m_statistics;
+        #else
+        const StatisticsSlot& slot = m_processorCaches[i].m_statistics;
+        #endif
+        const volatile SizeClassCounters& counters = slot.m_counters[bucket];
+
+        // Retry until the owner of the slot didn't update it during the copy
+        SizeClassCounters copy;
+        uint32 sequence;
+        do {
+            sequence = slot.m_sequence;
+            copy.m_allocations = counters.m_allocations;
+            copy.m_frees = counters.m_frees;
+            copy.m_failures = counters.m_failures;
+            copy.m_requestedBytes = counters.m_requestedBytes;
+            copy.m_allocatedBytes = counters.m_allocatedBytes;
+            copy.m_freedBytes = counters.m_freedBytes;
+        } while (((sequence & 1) != 0) || (sequence != slot.m_sequence));
+
+        total.m_allocations+= copy.m_allocations;
+        total.m_frees+= copy.m_frees;
+        total.m_failures+= copy.m_failures;
+        total.m_requestedBytes+= copy.m_requestedBytes;
+        total.m_allocatedBytes+= copy.m_allocatedBytes;
+        total.m_freedBytes+= copy.m_freedBytes;
+    }
+}
+
+void SuperiorMemoryManager::samplePeaks()
+{
+    uint64 totalBytesInUse = 0;
+    for (uint i = 0; i < MAX_BUCKETS; i++)
+    {
+        SizeClassCounters counters;
+        memset(&counters, 0, sizeof(counters));
+        readStatistics(i, counters);
+
+        // A block might be freed before the allocation is counted
+        uint64 bytesInUse = 0;
+        if (counters.m_allocatedBytes > counters.m_freedBytes)
+            bytesInUse = counters.m_allocatedBytes - counters.m_freedBytes;
+
+        m_peakBytesInUse[i] = t_max(m_peakBytesInUse[i], bytesInUse);
+        totalBytesInUse+= bytesInUse;
+    }
+    m_peakTotalBytesInUse = t_max(m_peakTotalBytesInUse, totalBytesInUse);
+}
+
+void SuperiorMemoryManager::getStatistics(MemoryStatistics& statistics)
+{
+    cLock lock(m_lock);
+
+    samplePeaks();
+
+    statistics.m_osMemorySize = m_osMemorySize;
+    statistics.m_allocatedOsMemorySize = m_allocatedOsMemorySize;
+    statistics.m_directMemorySize = m_directMemorySize;
+    statistics.m_bytesInUse = 0;
+    statistics.m_peakBytesInUse = m_peakTotalBytesInUse;
+
+    for (uint i = 0; i < MAX_BUCKETS; i++)
+    {
+        MemorySizeClassStatistics& sizeClass = statistics.m_classes[i];
+
+        SizeClassCounters counters;
+        memset(&counters, 0, sizeof(counters));
+        readStatistics(i, counters);
+
+        sizeClass.m_unitSize = (i == MemorySizeClass::NUMBER_OF_CLASSES) ? 0 :
+                               m_bucketSizes[i].m_bucketUnitSize;
+        sizeClass.m_allocations = counters.m_allocations;
+        sizeClass.m_frees = counters.m_frees;
+        sizeClass.m_failures = counters.m_failures;
+        sizeClass.m_bytesInUse = 0;
+        if (counters.m_allocatedBytes > counters.m_freedBytes)
+        {
+            sizeClass.m_bytesInUse = counters.m_allocatedBytes -
+                                     counters.m_freedBytes;
+        }
+        // The counters might be read after the peak was sampled
+        sizeClass.m_peakBytesInUse = t_max(m_peakBytesInUse[i],
+                                           sizeClass.m_bytesInUse);
+
+        // The rounding of all requests so far, in 1/65536 units, applied to
+        // the blocks in use
+        sizeClass.m_internalFragmentation = 0;
+        if (counters.m_allocatedBytes > counters.m_requestedBytes)
+        {
+            uint64 waste = counters.m_allocatedBytes -
+                           counters.m_requestedBytes;
+            uint64 scale = counters.m_allocatedBytes >> 16;
+            uint64 ratio = (scale == 0) ?
+                ((waste << 16) / counters.m_allocatedBytes) : (waste / scale);
+            sizeClass.m_internalFragmentation =
+                (sizeClass.m_bytesInUse * ratio) >> 16;
+        }
+
+        // The bucket chain is protected by the lock
+        sizeClass.m_buckets = 0;
+        sizeClass.m_reserved = 0;
+        sizeClass.m_bucketBytes = 0;
+        Bucket* bucket = m_firstBucketHandler[i];
+        while (bucket != NULL)
+        {
+            sizeClass.m_buckets++;
+            sizeClass.m_bucketBytes+= bucket->getLength();
+            bucket = bucket->getNextBucket();
+        }
+
+        statistics.m_bytesInUse+= sizeClass.m_bytesInUse;
+    }
+    statistics.m_peakBytesInUse = t_max(statistics.m_peakBytesInUse,
+                                        statistics.m_bytesInUse);
+}
+#endif // SUPERIOR_MEMORY_MANAGER_STATISTICS
+
 #ifdef XDK_TRACE_MEMORY
 void SuperiorMemoryManager::traceMemory(cStringerStream& out)
 {
     out << "SuperiorMemoryManager: ***** INFO ********************" << endl;
     out << "SuperiorMemoryManager: Allocated OS memory - " <<
-           m_osMemorySize / (1024 * 1024) << "Mb" << endl;
+           (uint)(m_osMemorySize / (1024 * 1024)) << "Mb" << endl;
     out << "SuperiorMemoryManager: Allocated superblocks - " <<
-           m_allocatedOsMemorySize / (1024 * 1024) << "Mb" << endl;
+           (uint)(m_allocatedOsMemorySize / (1024 * 1024)) << "Mb" << endl;
 
     // Scan all memory
     for (uint i = 0; i < MAX_BUCKETS; i++)
@@ -495,8 +1971,21 @@ void SuperiorMemoryManager::traceMemory(cStringerStream& out)
         if (bucket != NULL)
         {
             out << "SuperiorMemoryManager: Bucket " << i << "  Units: "
-                << m_bucketSizes[i].m_bucketUnitSize << endl;
+                << m_bucketSizes[i].m_bucketUnitSize << "  Elements: "
+                << m_bucketElements[i] << endl;
+        }
+
+        #ifdef SUPERIOR_MEMORY_MANAGER_STATISTICS
+        SizeClassCounters counters;
+        memset(&counters, 0, sizeof(counters));
+        readStatistics(i, counters);
+        if ((counters.m_allocations != 0) || (counters.m_failures != 0))
+        {
+            out << "SuperiorMemoryManager: Bucket " << i << "  Allocations: "
+                << counters.m_allocations << "  Frees: " << counters.m_frees
+                << "  Failures: " << counters.m_failures << endl;
         }
+        #endif
 
         while (bucket != NULL)
         {
@@ -518,17 +2007,64 @@ void SuperiorMemoryManager::traceMemory(cStringerStream& out)
 SuperiorMemoryManager::Bucket::Bucket(void* buffer,
                                       uint length,
                                       uint unitSize,
+                                      uint sizeClass,
+                                      uint engine,
                                       Bucket* nextHandler) :
-    m_manager(buffer, length, unitSize),
-    m_nextHandler(nextHandler)
+    m_nextHandler(nextHandler),
+    m_sizeClass(sizeClass),
+    m_isFull(0),
+    m_nextPartial(NULL),
+    m_previousPartial(NULL),
+    m_buffer(buffer),
+    m_length(length),
+    m_users(0),
+    m_idlePeriods(0),
+    m_isDirect(false),
+    m_owner(0),
+    m_remoteFrees(NULL),
+    m_remoteBytes(0)
 {
+    // Both engines share the same allocation unit overhead
+    ASSERT((uint)SmallMemoryHeapManager::ALLOCATED_UNIT_OVERHEAD ==
+           (uint)BitmapMemoryHeapManager::ALLOCATED_UNIT_OVERHEAD);
+
+    if (engine == ENGINE_BITMAP)
+    {
+        m_manager = new(&m_managerStorage) BitmapMemoryHeapManager(buffer,
+                                                                   length,
+                                                                   unitSize);
+    } else if (engine == ENGINE_LARGE)
+    {
+        // The extents are page-granular. 'unitSize' is not used.
+        m_manager = new(&m_managerStorage) LargeMemoryHeapManager(buffer,
+                                                                  length);
+    } else if ((length / unitSize) >
+               (uint)SmallMemoryHeapManager::MAX_BLOCKS)
+    {
+        // The 16 bit descriptors cannot reach the units after MAX_BLOCKS.
+        // The wide descriptors are longer, so each unit grows by the
+        // difference and still holds a block of the bucket group.
+        uint wideUnitSize = unitSize +
+                            WideMemoryHeapManager::ALLOCATED_UNIT_OVERHEAD -
+                            SmallMemoryHeapManager::ALLOCATED_UNIT_OVERHEAD;
+        m_manager = new(&m_managerStorage) WideMemoryHeapManager(buffer,
+                                                                 length,
+                                                                 wideUnitSize);
+    } else
+    {
+        m_manager = new(&m_managerStorage) SmallMemoryHeapManager(buffer,
+                                                                  length,
+                                                                  unitSize);
+    }
 }
 
 void* SuperiorMemoryManager::Bucket::operator new (
           uint cbSize,
-          SmallMemoryHeapManager& privateStash)
+          MemoryMetadataPool& privateStash)
 {
-    void* ret = privateStash.allocate(cbSize);
+    // The pool is reserved by the caller. See reserveMetadata
+    ASSERT(cbSize <= privateStash.getObjectLength());
+    void* ret = privateStash.allocate();
     // Not enough private stash memory
     CHECK(ret != NULL);
     return ret;
@@ -536,15 +2072,15 @@ void* SuperiorMemoryManager::Bucket::operator new (
 
 void SuperiorMemoryManager::Bucket::operator delete (
           void *ptr,
-          SmallMemoryHeapManager& privateStash)
+          MemoryMetadataPool& privateStash)
 {
     // Serious bug if this check is failed.
     CHECK(privateStash.free(ptr));
 }
 
-SmallMemoryHeapManager& SuperiorMemoryManager::Bucket::getManager()
+MemorySuperblockHeapManager& SuperiorMemoryManager::Bucket::getManager()
 {
-    return m_manager;
+    return *m_manager;
 }
 
 SuperiorMemoryManager::Bucket* SuperiorMemoryManager::Bucket::getNextBucket()
@@ -552,6 +2088,36 @@ SuperiorMemoryManager::Bucket* SuperiorMemoryManager::Bucket::getNextBucket()
     return m_nextHandler;
 }
 
+uint SuperiorMemoryManager::Bucket::getSizeClass() const
+{
+    return m_sizeClass;
+}
+
+bool SuperiorMemoryManager::Bucket::isFull() const
+{
+    return m_isFull != 0;
+}
+
+SuperiorMemoryManager::Bucket::~Bucket()
+{
+    m_manager->~MemorySuperblockHeapManager();
+}
+
+void* SuperiorMemoryManager::Bucket::getBuffer() const
+{
+    return m_buffer;
+}
+
+uint SuperiorMemoryManager::Bucket::getLength() const
+{
+    return m_length;
+}
+
+bool SuperiorMemoryManager::Bucket::isEmpty()
+{
+    return m_manager->getNumberOfAllocatedBytes() == 0;
+}
+
 //////////////////////////////////////////////////////////////////////////
 // SuperblockRepository
 SuperiorMemoryManager::SuperblockRepository::SuperblockRepository(
@@ -561,6 +2127,9 @@ SuperiorMemoryManager::SuperblockRepository::SuperblockRepository(
     m_buffer(buffer),
     m_bufferLength(length),
     m_position(m_buffer),
+    m_releasedRanges(NULL),
+    m_usedBytes(0),
+    m_idlePeriods(0),
     m_nextRepository(nextRepository)
 {
 }
@@ -578,9 +2147,11 @@ void* SuperiorMemoryManager::SuperblockRepository::getOSBuffer()
 
 void* SuperiorMemoryManager::SuperblockRepository::operator new (
     uint cbSize,
-    SmallMemoryHeapManager& privateStash)
+    MemoryMetadataPool& privateStash)
 {
-    void* ret = privateStash.allocate(cbSize);
+    // The pool is reserved by the caller. See newSuperblockRepository
+    ASSERT(cbSize <= privateStash.getObjectLength());
+    void* ret = privateStash.allocate();
     // Not engouth private stash memory
     CHECK(ret != NULL);
     return ret;
@@ -588,7 +2159,7 @@ void* SuperiorMemoryManager::SuperblockRepository::operator new (
 
 void SuperiorMemoryManager::SuperblockRepository::operator delete (
     void *ptr,
-    SmallMemoryHeapManager& privateStash)
+    MemoryMetadataPool& privateStash)
 {
     // Serious bug if this check is failed.
     CHECK(privateStash.free(ptr));
@@ -606,9 +2177,137 @@ void* SuperiorMemoryManager::SuperblockRepository::privateMalloc(uint length)
 
     void* ret = m_position;
     m_position = getPtr(getNumeric(m_position) + length);
+    m_usedBytes+= length;
     return ret;
 }
 
+void* SuperiorMemoryManager::SuperblockRepository::allocateReleased(
+               uint requestedLength,
+               uint minimumLength,
+               uint allocationUnit,
+               uint& realAllocatedBlockSize)
+{
+    // First-fit
+    ReleasedRange** link = &m_releasedRanges;
+    while (*link != NULL)
+    {
+        ReleasedRange* range = *link;
+        if (range->m_length < minimumLength)
+        {
+            link = &range->m_next;
+            continue;
+        }
+
+        // Allocate best-fit size
+        uint bestFitSize = requestedLength;
+        if (range->m_length < requestedLength)
+        {
+            uint numOfElements = (range->m_length - minimumLength) /
+                                 allocationUnit;
+            bestFitSize = minimumLength + (allocationUnit * numOfElements);
+        }
+
+        // The allocation is taken from the end of the range, so the range
+        // descriptor stays in place. A leftover which cannot hold a
+        // descriptor is allocated as well.
+        uint leftSize = range->m_length - bestFitSize;
+        void* ret;
+        if (leftSize < sizeof(ReleasedRange))
+        {
+            bestFitSize = range->m_length;
+            *link = range->m_next;
+            ret = range;
+        } else
+        {
+            range->m_length = leftSize;
+            ret = getPtr(getNumeric(range) + leftSize);
+        }
+
+        m_usedBytes+= bestFitSize;
+        realAllocatedBlockSize = bestFitSize;
+        return ret;
+    }
+
+    return NULL;
+}
+
+void SuperiorMemoryManager::SuperblockRepository::release(void* buffer,
+                                                         uint length)
+{
+    ASSERT(isInside(buffer));
+    ASSERT(length <= m_usedBytes);
+    m_usedBytes-= length;
+
+    // Find the place of the range
+    addressNumericValue start = getNumeric(buffer);
+    ReleasedRange* previous = NULL;
+    ReleasedRange* next = m_releasedRanges;
+    while ((next != NULL) && (getNumeric(next) < start))
+    {
+        previous = next;
+        next = next->m_next;
+    }
+
+    ReleasedRange* range = (ReleasedRange*)buffer;
+    range->m_length = length;
+    range->m_next = next;
+    if (previous != NULL)
+        previous->m_next = range;
+    else
+        m_releasedRanges = range;
+
+    // Merge with the neighbours
+    if ((next != NULL) && ((start + length) == getNumeric(next)))
+    {
+        range->m_length+= next->m_length;
+        range->m_next = next->m_next;
+    }
+    if ((previous != NULL) &&
+        ((getNumeric(previous) + previous->m_length) == start))
+    {
+        previous->m_length+= range->m_length;
+        previous->m_next = range->m_next;
+    }
+
+    // The last range returns to the non-allocated buffer
+    ReleasedRange** link = &m_releasedRanges;
+    while ((*link)->m_next != NULL)
+        link = &(*link)->m_next;
+    if ((getNumeric(*link) + (*link)->m_length) == getNumeric(m_position))
+    {
+        m_position = *link;
+        *link = NULL;
+    }
+}
+
+bool SuperiorMemoryManager::SuperblockRepository::isInside(
+                                                        void* buffer) const
+{
+    addressNumericValue address = getNumeric(buffer);
+    return (address >= getNumeric(m_buffer)) &&
+           (address < (getNumeric(m_buffer) + m_bufferLength));
+}
+
+uint SuperiorMemoryManager::SuperblockRepository::getLength() const
+{
+    return m_bufferLength;
+}
+
+uint SuperiorMemoryManager::SuperblockRepository::countIdlePeriod()
+{
+    if (m_usedBytes != 0)
+        m_idlePeriods = 0;
+    else
+        m_idlePeriods++;
+    return m_idlePeriods;
+}
+
+void SuperiorMemoryManager::SuperblockRepository::setNextRepository(
+                                    SuperblockRepository* nextRepository)
+{
+    m_nextRepository = nextRepository;
+}
+
 void* SuperiorMemoryManager::SuperblockRepository::allocate(
                uint requestedLength,
                uint minimumLength,
@@ -626,6 +2325,14 @@ void* SuperiorMemoryManager::SuperblockRepository::allocate(
             return ret;
     }
 
+    // Try to recycle the released memory of this superblock
+    void* ret = allocateReleased(requestedLength,
+                                 minimumLength,
+                                 allocationUnit,
+                                 realAllocatedBlockSize);
+    if (ret != NULL)
+        return ret;
+
     // Try to allocate from this superblock
     uint leftSize = getLeftSize();
 
@@ -663,6 +2370,14 @@ void* SuperiorMemoryManager::SuperblockRepository::minimumAllocation(
             return ret;
     }
 
+    // Any released range of at least 'allocationUnit' is good enough
+    void* ret = allocateReleased(m_bufferLength,
+                                 allocationUnit,
+                                 allocationUnit,
+                                 realAllocatedBlockSize);
+    if (ret != NULL)
+        return ret;
+
     uint leftSize = getLeftSize();
     uint numOfElements = leftSize / allocationUnit;
 
@@ -85,6 +85,14 @@ cConsoleDevice::cConsoleDevice(const cString& device) :
         IOCTL_INSTANCE(handleGetNextLineIoctl));
     m_ioctlDispatcher.registerIoctlHandler(cConsoleDeviceIoctl::IOCTL_CONSOLE_POOL_LINE,
         IOCTL_INSTANCE(handlePoolLineIoctl));
+    m_ioctlDispatcher.registerIoctlHandler(cConsoleDeviceIoctl::IOCTL_CONSOLE_MEMORY_STATISTICS,
+        IOCTL_INSTANCE(handleMemoryStatisticsIoctl));
+    m_ioctlDispatcher.registerIoctlHandler(cConsoleDeviceIoctl::IOCTL_CONSOLE_MEMORY_PROFILE,
+        IOCTL_INSTANCE(handleMemoryProfileIoctl));
+    m_ioctlDispatcher.registerIoctlHandler(cConsoleDeviceIoctl::IOCTL_CONSOLE_MEMORY_TRACE_CONTROL,
+        IOCTL_INSTANCE(handleMemoryTraceControlIoctl));
+    m_ioctlDispatcher.registerIoctlHandler(cConsoleDeviceIoctl::IOCTL_CONSOLE_MEMORY_TRACE,
+        IOCTL_INSTANCE(handleMemoryTraceIoctl));
 
     // Link the device into a name
     ret = IoCreateSymbolicLink(m_deviceSymbolicName, m_deviceNtName);
@@ -219,3 +227,74 @@ uint cConsoleDevice::handlePoolLineIoctl(uint    ioctlCode,
 
     return outputBufferLength;
 }
+
+uint cConsoleDevice::handleMemoryStatisticsIoctl(uint    ioctlCode,
+                            const uint8* inputBuffer,
+                            uint         inputBufferLength,
+                            uint8*       outputBuffer,
+                            uint         outputBufferLength)
+{
+    ASSERT(ioctlCode == cConsoleDeviceIoctl::IOCTL_CONSOLE_MEMORY_STATISTICS);
+    CHECK((inputBufferLength == 0) &&
+          (outputBufferLength == sizeof(MemoryStatistics)));
+    CHECK(outputBuffer != NULL);
+
+    // The snapshot is written directly into the system buffer
+    CHECK(m_consoleControls.queryMemoryStatistics(
+        *((MemoryStatistics*)outputBuffer)));
+
+    return sizeof(MemoryStatistics);
+}
+
+uint cConsoleDevice::handleMemoryProfileIoctl(uint    ioctlCode,
+                         const uint8* inputBuffer,
+                         uint         inputBufferLength,
+                         uint8*       outputBuffer,
+                         uint         outputBufferLength)
+{
+    ASSERT(ioctlCode == cConsoleDeviceIoctl::IOCTL_CONSOLE_MEMORY_PROFILE);
+    CHECK((inputBufferLength == 0) &&
+          (outputBufferLength == sizeof(MemoryProfileDump)));
+    CHECK(outputBuffer != NULL);
+
+    // The dump is written directly into the system buffer
+    CHECK(m_consoleControls.queryMemoryProfile(
+        *((MemoryProfileDump*)outputBuffer)));
+
+    return sizeof(MemoryProfileDump);
+}
+
+uint cConsoleDevice::handleMemoryTraceControlIoctl(uint    ioctlCode,
+                              const uint8* inputBuffer,
+                              uint         inputBufferLength,
+                              uint8*       outputBuffer,
+                              uint         outputBufferLength)
+{
+    ASSERT(ioctlCode == cConsoleDeviceIoctl::IOCTL_CONSOLE_MEMORY_TRACE_CONTROL);
+    CHECK((inputBufferLength == sizeof(uint32)) &&
+          (outputBufferLength == 0));
+    CHECK(inputBuffer != NULL);
+
+    CHECK(m_consoleControls.controlMemoryTrace(
+        *((const uint32*)inputBuffer) != 0));
+
+    return 0;
+}
+
+uint cConsoleDevice::handleMemoryTraceIoctl(uint    ioctlCode,
+                       const uint8* inputBuffer,
+                       uint         inputBufferLength,
+                       uint8*       outputBuffer,
+                       uint         outputBufferLength)
+{
+    ASSERT(ioctlCode == cConsoleDeviceIoctl::IOCTL_CONSOLE_MEMORY_TRACE);
+    CHECK((inputBufferLength == 0) &&
+          (outputBufferLength == sizeof(MemoryTraceDump)));
+    CHECK(outputBuffer != NULL);
+
+    // The records are moved directly into the system buffer
+    CHECK(m_consoleControls.drainMemoryTrace(
+        *((MemoryTraceDump*)outputBuffer)));
+
+    return sizeof(MemoryTraceDump);
+}
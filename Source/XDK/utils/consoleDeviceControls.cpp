@@ -40,6 +40,7 @@
 #include "xStl/stream/iostream.h"
 #include "XDK/kernel.h"
 #include "XDK/driver.h"
+#include "XDK/memory.h"
 #include "XDK/utils/consoleDeviceIoctl.h"
 #include "XDK/utils/consoleDeviceControls.h"
 
@@ -74,3 +75,36 @@ bool cConsoleDeviceControls::poolLine(uint8* outputLine, uint outputLineLength)
     cOS::memcpy(outputLine, ret.getBuffer(), (ret.length() + 1) * sizeof(character));
     return true;
 }
+
+bool cConsoleDeviceControls::queryMemoryStatistics(MemoryStatistics& statistics)
+{
+    return cXdkDriverMemoryManager::getStatistics(statistics);
+}
+
+bool cConsoleDeviceControls::queryMemoryProfile(MemoryProfileDump& dump)
+{
+    if (!cXdkDriverMemoryManager::getProfile(dump))
+        return false;
+
+    // The samples are symbolized by the driver module
+    PDRIVER_OBJECT driverObject = cDriver::getDriverObject();
+    dump.m_imageBase = getNumeric(driverObject->DriverStart);
+    dump.m_imageSize = driverObject->DriverSize;
+    return true;
+}
+
+bool cConsoleDeviceControls::controlMemoryTrace(bool shouldRecord)
+{
+    if (!shouldRecord)
+    {
+        cXdkDriverMemoryManager::stopTrace();
+        return true;
+    }
+
+    return cXdkDriverMemoryManager::startTrace();
+}
+
+bool cConsoleDeviceControls::drainMemoryTrace(MemoryTraceDump& dump)
+{
+    return cXdkDriverMemoryManager::drainTrace(dump);
+}
@@ -37,15 +37,18 @@
  * Author: Elad Raz <e@eladraz.com>
  */
 #include "xStl/types.h"
+#include "xStl/except/trace.h"
 #include "xStl/os/os.h"
 #include "xStl/data/char.h"
 #include "xStl/data/string.h"
+#include "xStl/data/smartptr.h"
 #include "xStl/stream/iostream.h"
 #include "loader/loader.h"
 #include "loader/device.h"
 #include "loader/deviceException.h"
 #include "loader/NTDeviceLoader.h"
 #include "loader/console/consolePooler.h"
+#include "loader/console/memoryProfileReport.h"
 #include "InfiniteProgressBar.h"
 #include "KbHit.h"
 
@@ -62,6 +65,7 @@ void printUsage()
     cout << "Manager.exe L <file> <device>           Dynamic loading of a device." << endl;
     cout << "Manager.exe C <file> <device>           Dynamic loading of a console device." << endl;
 	cout << "Manager.exe U <device>                  Stop and unregister the device."  << endl;
+    cout << "Manager.exe R <dump> [<file>]           Print a saved memory profile dump." << endl;
     cout << endl << "(C) Integrity Project" << endl;
 }
 
@@ -92,6 +96,108 @@ void handleRegularDevice(const cString& filename,
 }
 
 
+// The file which holds the last memory profile dump of a console device
+#define MEMORY_PROFILE_FILENAME XSTL_STRING("memory.mprf")
+
+// Prints the memory profile report of 'dump'. The symbols are taken from
+// 'filename', the driver image.
+void printMemoryProfile(const MemoryProfileDump& dump,
+                        const cString& filename)
+{
+    cMemoryProfileReport report(dump);
+    if ((filename.length() > 0) && (!report.symbolize(filename)))
+    {
+        cout << "Cannot load the symbols of '" << filename << "'" << endl;
+    }
+    report.print();
+}
+
+// Query the memory profile of the driver, save it and print the report
+void handleMemoryProfile(cConsolePooler& pooler,
+                         const cString& filename)
+{
+    // The dump is too big for the stack
+    cSmartPtr<MemoryProfileDump> dump(new MemoryProfileDump);
+    if (!pooler.queryMemoryProfile(*dump))
+    {
+        cout << "The memory profile isn't available" << endl;
+        return;
+    }
+
+    cMemoryProfileReport::saveDump(*dump, MEMORY_PROFILE_FILENAME);
+    cout << endl << "Memory profile saved to '" << MEMORY_PROFILE_FILENAME
+         << "'" << endl;
+    printMemoryProfile(*dump, filename);
+}
+
+// Print a memory profile which was saved by handleMemoryProfile
+void handleMemoryProfileReport(const cString& dumpFilename,
+                               const cString& filename)
+{
+    cSmartPtr<MemoryProfileDump> dump(new MemoryProfileDump);
+    cMemoryProfileReport::loadDump(*dump, dumpFilename);
+    printMemoryProfile(*dump, filename);
+}
+
+// The file which holds the allocation trace of a console device
+#define MEMORY_TRACE_FILENAME XSTL_STRING("memory.mtrc")
+
+// Drain the pending records of the allocation trace and append them into
+// 'traceFile'. Each drain is written as a MemoryTraceHeader followed by its
+// records (See MemoryTrace.h), until the ring of the driver is empty.
+void drainMemoryTrace(cConsolePooler& pooler,
+                      MemoryTraceDump& dump,
+                      HANDLE traceFile)
+{
+    do
+    {
+        CHECK(pooler.drainMemoryTrace(dump));
+        if (dump.m_header.m_numberOfRecords == 0)
+            break;
+
+        DWORD length = sizeof(MemoryTraceHeader) +
+            dump.m_header.m_numberOfRecords * sizeof(MemoryTraceRecord);
+        DWORD written = 0;
+        CHECK(WriteFile(traceFile, &dump, length, &written, NULL));
+        CHECK(written == length);
+    } while (dump.m_header.m_numberOfRecords == MemoryTraceDump::MAX_RECORDS);
+}
+
+// Start the allocation trace into MEMORY_TRACE_FILENAME, or stop it and
+// drain the records which are left in the driver
+void toggleMemoryTrace(cConsolePooler& pooler,
+                       MemoryTraceDump& dump,
+                       HANDLE& traceFile)
+{
+    if (traceFile == INVALID_HANDLE_VALUE)
+    {
+        traceFile = CreateFile(MEMORY_TRACE_FILENAME, GENERIC_WRITE, 0, NULL,
+                               CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (traceFile == INVALID_HANDLE_VALUE)
+        {
+            cout << "Cannot create '" << MEMORY_TRACE_FILENAME << "'" << endl;
+            return;
+        }
+        if (!pooler.controlMemoryTrace(true))
+        {
+            cout << "The memory trace isn't available" << endl;
+            CloseHandle(traceFile);
+            traceFile = INVALID_HANDLE_VALUE;
+            return;
+        }
+        cout << endl << "Recording the memory trace into '"
+             << MEMORY_TRACE_FILENAME << "'..." << endl;
+        return;
+    }
+
+    pooler.controlMemoryTrace(false);
+    drainMemoryTrace(pooler, dump, traceFile);
+    CloseHandle(traceFile);
+    traceFile = INVALID_HANDLE_VALUE;
+    cout << endl << "Memory trace saved to '" << MEMORY_TRACE_FILENAME << "' ("
+         << dump.m_header.m_droppedRecords << " records were dropped)" << endl;
+}
+
 void handleConsoleDevice(const cString& filename,
 						 const cString& devicename)
 {
@@ -100,9 +206,15 @@ void handleConsoleDevice(const cString& filename,
 	InfiniteProgressBar bar;
 	KbHit hit;
     cString readString;
-	cout << "Press 'Q' key to stop application..." << endl << endl;
+	cout << "Press 'Q' key to stop application..." << endl;
+	cout << "Press 'P' key to print the memory profile..." << endl;
+	cout << "Press 'T' key to start/stop the memory trace..." << endl << endl;
     bool shouldExit = false;
 
+    // The dump is too big for the stack
+    cSmartPtr<MemoryTraceDump> traceDump(new MemoryTraceDump);
+    HANDLE traceFile = INVALID_HANDLE_VALUE;
+
 	uint32 start = GetTickCount();
 	//uint32 i = 0;
 	uint32 i = 580;
@@ -111,10 +223,25 @@ void handleConsoleDevice(const cString& filename,
 	{
         if (hit.isHit())
         {
-            if (cChar::getUppercase(hit.readKey()) == XSTL_CHAR('Q'))
+            character key = cChar::getUppercase(hit.readKey());
+            if (key == XSTL_CHAR('Q'))
                 shouldExit = true;
+            if (key == XSTL_CHAR('P'))
+            {
+                bar.clear();
+                handleMemoryProfile(pooler, filename);
+            }
+            if (key == XSTL_CHAR('T'))
+            {
+                bar.clear();
+                toggleMemoryTrace(pooler, *traceDump, traceFile);
+            }
         }
 
+        // Keep the ring of the driver from overflowing
+        if (traceFile != INVALID_HANDLE_VALUE)
+            drainMemoryTrace(pooler, *traceDump, traceFile);
+
 		if ((GetTickCount() - start) > 15000)
 		{
 			cout << i << endl;
@@ -152,6 +279,8 @@ void handleConsoleDevice(const cString& filename,
 		bar.out();
 		Sleep(30);
 	}
+    if (traceFile != INVALID_HANDLE_VALUE)
+        toggleMemoryTrace(pooler, *traceDump, traceFile);
 	Sleep(30);
 	cout << "Unloading device." << endl;
 }
@@ -263,6 +392,22 @@ int main(const uint argc, const char** argv)
 			return RC_OK;
 		}
 
+		// Print a saved memory profile
+		if (command == XSTL_STRING("R"))
+		{
+			if ((argc != 3) && (argc != 4))
+			{
+				RETURN_USAGE_ERROR("Wrong parameters for printing a memory profile.");
+			}
+			cString dumpFilename = argv[2];
+			cString filename;
+			if (argc == 4)
+				filename = argv[3];
+
+			handleMemoryProfileReport(dumpFilename, filename);
+			return RC_OK;
+		}
+
         // Unknown command
         RETURN_USAGE_ERROR("Unknown commad");
 
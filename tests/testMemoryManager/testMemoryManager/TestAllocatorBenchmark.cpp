@@ -0,0 +1,892 @@
+/*
+ * Copyright (c) 2008-2016, Integrity Project Ltd. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * Neither the name of the Integrity Project nor the names of its contributors
+ * may be used to endorse or promote products derived from this software
+ * without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE
+ */
+
+
+
+
+
+/*
+ * TestAllocatorBenchmark.cpp
+ *
+ * A multi-threaded benchmark suite which compares the heaps to the system
+ * malloc. The results are written as comma-separated lines which start with
+ * "allocbench,", so they can be collected by scripts:
+ *
+ *     allocbench,scenario,allocator,threads,operations,failures,
+ *         ops_per_second,p50_ns,p99_ns,p999_ns,peak_footprint_bytes,
+ *         peak_live_bytes,fragmentation_percent
+ *
+ * Scenarios:
+ *     churn    - Each thread allocates and frees blocks of it's own.
+ *     producer - Half of the threads allocate blocks and pass them to the
+ *                other half, which frees them (Cross-thread frees).
+ *     remote   - Like producer, with blocks of 1.5kb to 12kb which are not
+ *                cached per processor. Every other block is expanded in
+ *                place into several units, so it's free reaches the remote
+ *                list of it's bucket (See SuperiorMemoryManager::freeRemote).
+ *                The rest are freed by the quick list of the bucket.
+ *     larson   - Each thread replaces random blocks of a shared array. The
+ *                arrays move between the threads every round, so most of
+ *                the blocks are freed by another thread. (Larson & Krishnan)
+ *     replay   - Like churn, with a recorded distribution of kernel request
+ *                sizes.
+ *
+ * The footprint is the memory the allocator holds: The superblocks of
+ * SuperiorMemoryManager, the allocated units of SmallMemoryHeapManager, and
+ * the used chunks of malloc (Linux only). The fragmentation is the part of
+ * the peak footprint which is not used by live blocks.
+ */
+#include "xStl/types.h"
+#include "xStl/os/os.h"
+#include "xStl/os/lock.h"
+#include "xStl/os/threadedClass.h"
+#include "xStl/data/char.h"
+#include "xStl/except/trace.h"
+#include "xStl/stream/iostream.h"
+#include "xStl/except/exception.h"
+#include "xdk/memory/MemoryAtomic.h"
+#include "xdk/memory/MemoryBitScan.h"
+#include "xdk/memory/MemoryLockableObject.h"
+#include "xdk/memory/SmallMemoryHeapManager.h"
+#include "xdk/memory/SuperiorMemoryManager.h"
+#include "TestOSMemory.h"
+
+#ifdef XSTL_LINUX
+    #include <time.h>
+    #include <sched.h>
+    #include <stdlib.h>
+    #include <malloc.h>
+#endif
+
+// The thread counts of each scenario
+#define BENCH_MAX_THREADS (8)
+// Every n-th operation is timed
+#define BENCH_LATENCY_PERIOD (8)
+// Every n-th operation the footprint is sampled. Must be a power of 2.
+#define BENCH_SAMPLE_PERIOD (1024)
+// Latency histogram: 8 sub-buckets for each power of 2
+#define BENCH_HISTOGRAM_BUCKETS (30 * 8)
+
+#define CHURN_OPERATIONS (400000)
+#define CHURN_SLOTS (256)
+#define PRODUCER_ITEMS (200000)
+#define PRODUCER_RING (256)
+#define LARSON_SLOTS (512)
+#define LARSON_ROUNDS (20)
+#define LARSON_OPERATIONS (20000)
+#define REPLAY_OPERATIONS (400000)
+#define REPLAY_SLOTS (256)
+
+/*
+ * Return a monotonic time in nanoseconds
+ */
+static uint64 readNanoseconds()
+{
+    #ifdef XSTL_LINUX
+        timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return ((uint64)now.tv_sec) * 1000000000 + now.tv_nsec;
+    #else
+        LARGE_INTEGER counter;
+        LARGE_INTEGER frequency;
+        QueryPerformanceCounter(&counter);
+        QueryPerformanceFrequency(&frequency);
+        uint64 seconds = counter.QuadPart / frequency.QuadPart;
+        uint64 rest = counter.QuadPart % frequency.QuadPart;
+        return seconds * 1000000000 + (rest * 1000000000) / frequency.QuadPart;
+    #endif
+}
+
+// The cost of reading the time, which is removed from the latencies
+static uint64 gTimerOverhead = 0;
+
+/*
+ * Set gTimerOverhead to the shortest interval between two readings
+ */
+static void calibrateTimer()
+{
+    uint64 overhead = (uint64)-1;
+    for (uint i = 0; i < 10000; i++)
+    {
+        uint64 start = readNanoseconds();
+        uint64 interval = readNanoseconds() - start;
+        if (interval < overhead)
+            overhead = interval;
+    }
+    gTimerOverhead = overhead;
+}
+
+/*
+ * Give the processor to another thread while spinning
+ */
+static void benchYield()
+{
+    #ifdef XSTL_LINUX
+        sched_yield();
+    #else
+        SwitchToThread();
+    #endif
+}
+
+//////////////////////////////////////////////////////////////////////////
+// The allocators
+
+/*
+ * The interface of a tested allocator
+ */
+class BenchAllocator {
+public:
+    virtual ~BenchAllocator() {}
+
+    // The name of the allocator in the report
+    virtual const char* getName() const = 0;
+    // Return NULL if there isn't enough memory
+    virtual void* allocate(uint length) = 0;
+    virtual void free(void* block) = 0;
+    // Try to expand 'block' without moving it. Return false by default.
+    virtual bool tryExpand(void*, uint) { return false; }
+    // Return the number of bytes the allocator holds
+    virtual memorySize getFootprint() = 0;
+};
+
+class BenchSmallAllocator : public BenchAllocator {
+public:
+    // 2mb of 32 bytes units. The maximum of SmallMemoryHeapManager.
+    enum { SUPERBLOCK_LENGTH = 32 * SmallMemoryHeapManager::MAX_BLOCKS };
+
+    BenchSmallAllocator() :
+        m_superblock(new uint8[SUPERBLOCK_LENGTH]),
+        m_heap(NULL)
+    {
+        m_heap = new SmallMemoryHeapManager(m_superblock, SUPERBLOCK_LENGTH,
+                                            32);
+    }
+
+    virtual ~BenchSmallAllocator()
+    {
+        delete m_heap;
+        delete[] m_superblock;
+    }
+
+    virtual const char* getName() const { return "small"; }
+    virtual void* allocate(uint length) { return m_heap->allocate(length); }
+    virtual void free(void* block) { CHECK(m_heap->free(block)); }
+    virtual memorySize getFootprint()
+    {
+        return m_heap->getNumberOfAllocatedBytes();
+    }
+
+private:
+    uint8* m_superblock;
+    SmallMemoryHeapManager* m_heap;
+};
+
+class BenchSuperiorAllocator : public BenchAllocator {
+public:
+    BenchSuperiorAllocator() :
+        m_privatePool(new uint8[
+            SuperiorMemoryManager::DEFAULT_SUPRIOR_MEMORY_PRIVATE_MEM]),
+        m_footprint(0),
+        m_manager(NULL)
+    {
+        m_manager = new SuperiorMemoryManager(
+            SuperiorOSMemePtr(new TestCountingOSMemory(m_footprint)),
+            SuperiorMemoryManager::INITIALIZE_SIZE_MINIMUM_SIZE,
+            m_privatePool,
+            SuperiorMemoryManager::DEFAULT_SUPRIOR_MEMORY_PRIVATE_MEM);
+    }
+
+    virtual ~BenchSuperiorAllocator()
+    {
+        delete m_manager;
+        delete[] m_privatePool;
+    }
+
+    virtual const char* getName() const { return "superior"; }
+    virtual void* allocate(uint length) { return m_manager->allocate(length); }
+    virtual void free(void* block) { CHECK(m_manager->free(block)); }
+    virtual bool tryExpand(void* block, uint length)
+    {
+        return m_manager->tryExpandInPlace(block, length);
+    }
+    virtual memorySize getFootprint() { return m_footprint; }
+
+private:
+    uint8* m_privatePool;
+    volatile memorySize m_footprint;
+    SuperiorMemoryManager* m_manager;
+};
+
+class BenchMallocAllocator : public BenchAllocator {
+public:
+    // The arenas are shared with the whole process, and they are not
+    // returned between the runs. Count the growth of the used memory.
+    BenchMallocAllocator() : m_baseline(0) { m_baseline = getArenas(); }
+
+    virtual const char* getName() const { return "malloc"; }
+    virtual void* allocate(uint length) { return ::malloc(length); }
+    virtual void free(void* block) { ::free(block); }
+
+    virtual memorySize getFootprint()
+    {
+        memorySize arenas = getArenas();
+        return (arenas > m_baseline) ? (arenas - m_baseline) : 0;
+    }
+
+private:
+    static memorySize getArenas()
+    {
+        #if defined(XSTL_LINUX) && defined(__GLIBC__) && \
+            ((__GLIBC__ > 2) || (__GLIBC_MINOR__ >= 33))
+            // The used chunks and the mmap-ed blocks. The fields of
+            // 'mallinfo' are int, which overflow above 2gb.
+            struct mallinfo2 info = ::mallinfo2();
+            return (memorySize)info.uordblks + (memorySize)info.hblkhd;
+        #elif defined(XSTL_LINUX)
+            struct mallinfo info = ::mallinfo();
+            return (memorySize)(uint)info.uordblks +
+                   (memorySize)(uint)info.hblkhd;
+        #else
+            return 0;
+        #endif
+    }
+
+    memorySize m_baseline;
+};
+
+enum BenchAllocatorType {
+    BENCH_SMALL,
+    BENCH_SUPERIOR,
+    BENCH_MALLOC,
+    BENCH_ALLOCATORS
+};
+
+static BenchAllocator* createAllocator(uint type)
+{
+    switch (type)
+    {
+    case BENCH_SMALL: return new BenchSmallAllocator();
+    case BENCH_SUPERIOR: return new BenchSuperiorAllocator();
+    default: return new BenchMallocAllocator();
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Shared state
+
+/*
+ * A barrier for 'threads' threads
+ */
+class BenchBarrier {
+public:
+    BenchBarrier(uint threads) :
+        m_threads(threads),
+        m_count(0),
+        m_generation(0)
+    {
+    }
+
+    void wait()
+    {
+        uint32 generation = m_generation;
+        if (MemoryAtomic::increment(&m_count) == m_threads)
+        {
+            MemoryAtomic::exchange(&m_count, 0);
+            MemoryAtomic::increment(&m_generation);
+            return;
+        }
+        while (m_generation == generation)
+            benchYield();
+    }
+
+private:
+    uint m_threads;
+    volatile uint32 m_count;
+    volatile uint32 m_generation;
+};
+
+/*
+ * A live block and it's length
+ */
+struct BenchBlock {
+    void* m_block;
+    uint m_length;
+};
+
+/*
+ * A single-producer single-consumer queue of blocks
+ */
+struct BenchRing {
+    void* volatile m_blocks[PRODUCER_RING];
+    uint m_lengths[PRODUCER_RING];
+};
+
+/*
+ * The state of a single run, shared by all threads
+ */
+class BenchContext {
+public:
+    BenchContext(BenchAllocator& allocator, uint threads) :
+        m_allocator(allocator),
+        m_threads(threads),
+        m_barrier(threads),
+        m_peakLiveBytes(0),
+        m_peakFootprint(0)
+    {
+        uint i;
+        for (i = 0; i < BENCH_MAX_THREADS; i++)
+            m_published[i].m_liveBytes = 0;
+
+        m_larsonBlocks = new BenchBlock[threads * LARSON_SLOTS];
+        m_rings = new BenchRing[threads];
+        for (i = 0; i < threads; i++)
+            for (uint j = 0; j < PRODUCER_RING; j++)
+                m_rings[i].m_blocks[j] = NULL;
+    }
+
+    ~BenchContext()
+    {
+        delete[] m_larsonBlocks;
+        delete[] m_rings;
+    }
+
+    /*
+     * Update the peaks
+     */
+    void sample()
+    {
+        uint32 total = 0;
+        for (uint i = 0; i < m_threads; i++)
+            total+= m_published[i].m_liveBytes;
+        memorySize footprint = m_allocator.getFootprint();
+
+        cLock lock(m_peaksLock);
+        if (total > m_peakLiveBytes)
+            m_peakLiveBytes = total;
+        if (footprint > m_peakFootprint)
+            m_peakFootprint = footprint;
+    }
+
+    BenchAllocator& m_allocator;
+    uint m_threads;
+    BenchBarrier m_barrier;
+
+    // The live bytes of each thread, updated by every operation. A thread
+    // which frees blocks of another thread counts below zero, the sum is
+    // still correct.
+    struct {
+        volatile uint32 m_liveBytes;
+        // Keep each thread in a cache line of it's own
+        uint8 m_padding[60];
+    } m_published[BENCH_MAX_THREADS];
+    // Protects the peaks
+    MemoryLockableObject m_peaksLock;
+    uint32 m_peakLiveBytes;
+    memorySize m_peakFootprint;
+
+    // LARSON_SLOTS blocks for each thread. See BenchLarsonThread
+    BenchBlock* m_larsonBlocks;
+    // A queue for each producer. See BenchProducerThread
+    BenchRing* m_rings;
+};
+
+//////////////////////////////////////////////////////////////////////////
+// The threads
+
+/*
+ * Base class of the scenarios. Counts and times the operations.
+ */
+class BenchThread : public cThreadedClass {
+public:
+    BenchThread(BenchContext& context, uint id) :
+        m_context(context),
+        m_id(id),
+        m_seed(id * 7919 + 1),
+        m_operations(0),
+        m_failures(0),
+        m_liveBytes(context.m_published[id].m_liveBytes)
+    {
+        for (uint i = 0; i < BENCH_HISTOGRAM_BUCKETS; i++)
+            m_histogram[i] = 0;
+    }
+
+    uint getOperations() const { return m_operations; }
+    uint getFailures() const { return m_failures; }
+    const uint32* getHistogram() const { return m_histogram; }
+
+    /*
+     * Return the histogram bucket of 'nanoseconds'. The buckets below 8ns
+     * are exact, above it each power of 2 is divided into 8 buckets.
+     */
+    static uint getBucket(uint32 nanoseconds)
+    {
+        if (nanoseconds < 8)
+            return nanoseconds;
+        uint msb = MemoryBitScan::highestSetBit(nanoseconds);
+        return (msb - 2) * 8 + ((nanoseconds >> (msb - 3)) & 7);
+    }
+
+    /*
+     * Return the lowest value of a histogram bucket
+     */
+    static uint32 getBucketValue(uint bucket)
+    {
+        if (bucket < 8)
+            return bucket;
+        uint msb = (bucket / 8) + 2;
+        return (8 + (bucket % 8)) << (msb - 3);
+    }
+
+protected:
+    void* benchAllocate(uint length)
+    {
+        void* ret;
+        if ((m_operations % BENCH_LATENCY_PERIOD) == 0)
+        {
+            uint64 start = readNanoseconds();
+            ret = m_context.m_allocator.allocate(length);
+            record(readNanoseconds() - start);
+        } else
+        {
+            ret = m_context.m_allocator.allocate(length);
+        }
+
+        if (ret == NULL)
+        {
+            m_failures++;
+        } else
+        {
+            // Touch the block
+            *((uint8*)ret) = (uint8)length;
+            m_liveBytes+= length;
+        }
+        count();
+        return ret;
+    }
+
+    void benchFree(void* block, uint length)
+    {
+        if ((m_operations % BENCH_LATENCY_PERIOD) == 0)
+        {
+            uint64 start = readNanoseconds();
+            m_context.m_allocator.free(block);
+            record(readNanoseconds() - start);
+        } else
+        {
+            m_context.m_allocator.free(block);
+        }
+
+        m_liveBytes-= length;
+        count();
+    }
+
+    /*
+     * Try to expand 'block' to twice it's 'length' without moving it. On
+     * success 'length' is updated. Not counted as an operation.
+     */
+    void benchExpand(void* block, uint& length)
+    {
+        if (m_context.m_allocator.tryExpand(block, length * 2))
+        {
+            m_liveBytes+= length;
+            length*= 2;
+        }
+    }
+
+    // Thread-safe linear congruential generator
+    uint random()
+    {
+        m_seed = m_seed * 1103515245 + 12345;
+        return (m_seed >> 16) & 0x7FFF;
+    }
+
+    BenchContext& m_context;
+    uint m_id;
+
+private:
+    void record(uint64 nanoseconds)
+    {
+        nanoseconds = (nanoseconds > gTimerOverhead) ?
+                      (nanoseconds - gTimerOverhead) : 0;
+        if (nanoseconds > 0xFFFFFFFF)
+            nanoseconds = 0xFFFFFFFF;
+        m_histogram[getBucket((uint32)nanoseconds)]++;
+    }
+
+    void count()
+    {
+        m_operations++;
+        if ((m_operations & (BENCH_SAMPLE_PERIOD - 1)) == 0)
+            m_context.sample();
+    }
+
+    uint32 m_seed;
+    uint m_operations;
+    uint m_failures;
+    volatile uint32& m_liveBytes;
+    uint32 m_histogram[BENCH_HISTOGRAM_BUCKETS];
+};
+
+// A recorded distribution of kernel request sizes. The weights are in 1/1000.
+static const struct {
+    uint m_length;
+    uint m_weight;
+} gBenchRecordedSizes[] = {
+    {    24, 700 },
+    {    48, 150 },
+    {   100,  60 },
+    {   200,  40 },
+    {   700,  20 },
+    {  1500,  10 },
+    {  3000,  10 },
+    {  6000,   5 },
+    { 12000,   5 }
+};
+
+#define BENCH_RECORDED_SIZES \
+    (sizeof(gBenchRecordedSizes) / sizeof(gBenchRecordedSizes[0]))
+
+/*
+ * churn and replay. Random blocks of a private working-set are replaced.
+ */
+class BenchChurnThread : public BenchThread {
+public:
+    BenchChurnThread(BenchContext& context, uint id, bool isReplay) :
+        BenchThread(context, id),
+        m_isReplay(isReplay)
+    {
+    }
+
+protected:
+    virtual void run()
+    {
+        BenchBlock blocks[CHURN_SLOTS];
+        uint slots = m_isReplay ? REPLAY_SLOTS : CHURN_SLOTS;
+        uint operations = m_isReplay ? REPLAY_OPERATIONS : CHURN_OPERATIONS;
+        uint i;
+        for (i = 0; i < slots; i++)
+            blocks[i].m_block = NULL;
+
+        while (getOperations() < operations)
+        {
+            BenchBlock& block = blocks[random() % slots];
+            if (block.m_block != NULL)
+            {
+                benchFree(block.m_block, block.m_length);
+                block.m_block = NULL;
+            } else
+            {
+                block.m_length = getLength();
+                block.m_block = benchAllocate(block.m_length);
+            }
+        }
+
+        for (i = 0; i < slots; i++)
+            if (blocks[i].m_block != NULL)
+                benchFree(blocks[i].m_block, blocks[i].m_length);
+    }
+
+private:
+    uint getLength()
+    {
+        if (!m_isReplay)
+            return ((random() % 32) + 1) * 8;
+
+        uint weight = random() % 1000;
+        for (uint i = 0; i < BENCH_RECORDED_SIZES; i++)
+        {
+            if (weight < gBenchRecordedSizes[i].m_weight)
+                return gBenchRecordedSizes[i].m_length;
+            weight-= gBenchRecordedSizes[i].m_weight;
+        }
+        return gBenchRecordedSizes[0].m_length;
+    }
+
+    bool m_isReplay;
+};
+
+/*
+ * producer and remote. The even threads allocate, the odd threads free.
+ */
+class BenchProducerThread : public BenchThread {
+public:
+    BenchProducerThread(BenchContext& context, uint id, bool isRemote) :
+        BenchThread(context, id),
+        m_isRemote(isRemote)
+    {
+    }
+
+protected:
+    virtual void run()
+    {
+        BenchRing& ring = m_context.m_rings[m_id / 2];
+        uint position = 0;
+        for (uint i = 0; i < PRODUCER_ITEMS; i++)
+        {
+            if ((m_id & 1) == 0)
+            {
+                while (ring.m_blocks[position] != NULL)
+                    benchYield();
+
+                // The expanded remote blocks start at half the length, so
+                // the live bytes are the same as without expanding
+                bool isExpanded = m_isRemote && ((i & 1) == 0);
+                uint length = m_isRemote ? (((random() % 8) + 1) * 1536) :
+                                           (((random() % 32) + 1) * 16);
+                if (isExpanded)
+                    length = (length + 1536) / 2;
+                void* block = benchAllocate(length);
+                // The consumer skips failed allocations
+                if (block == NULL)
+                {
+                    block = &ring;
+                    length = 0;
+                } else if (isExpanded)
+                {
+                    benchExpand(block, length);
+                }
+                ring.m_lengths[position] = length;
+                MemoryAtomic::exchangePointer(&ring.m_blocks[position], block);
+            } else
+            {
+                while (ring.m_blocks[position] == NULL)
+                    benchYield();
+
+                void* block = ring.m_blocks[position];
+                uint length = ring.m_lengths[position];
+                MemoryAtomic::exchangePointer(&ring.m_blocks[position], NULL);
+                if (block != &ring)
+                    benchFree(block, length);
+            }
+            position = (position + 1) % PRODUCER_RING;
+        }
+    }
+
+private:
+    bool m_isRemote;
+};
+
+/*
+ * larson. Every round each thread works on the blocks of another thread.
+ */
+class BenchLarsonThread : public BenchThread {
+public:
+    BenchLarsonThread(BenchContext& context, uint id) :
+        BenchThread(context, id)
+    {
+    }
+
+protected:
+    virtual void run()
+    {
+        uint threads = m_context.m_threads;
+        BenchBlock* blocks = getBlocks(m_id);
+        uint i;
+        for (i = 0; i < LARSON_SLOTS; i++)
+        {
+            blocks[i].m_length = getLength();
+            blocks[i].m_block = benchAllocate(blocks[i].m_length);
+        }
+
+        for (uint round = 0; round < LARSON_ROUNDS; round++)
+        {
+            m_context.m_barrier.wait();
+            blocks = getBlocks((m_id + round) % threads);
+            for (i = 0; i < LARSON_OPERATIONS; i++)
+            {
+                BenchBlock& block = blocks[random() % LARSON_SLOTS];
+                if (block.m_block != NULL)
+                    benchFree(block.m_block, block.m_length);
+                block.m_length = getLength();
+                block.m_block = benchAllocate(block.m_length);
+            }
+        }
+
+        // Each thread frees a different array
+        m_context.m_barrier.wait();
+        blocks = getBlocks((m_id + LARSON_ROUNDS) % threads);
+        for (i = 0; i < LARSON_SLOTS; i++)
+            if (blocks[i].m_block != NULL)
+                benchFree(blocks[i].m_block, blocks[i].m_length);
+    }
+
+private:
+    BenchBlock* getBlocks(uint thread)
+    {
+        return m_context.m_larsonBlocks + thread * LARSON_SLOTS;
+    }
+
+    uint getLength()
+    {
+        return (random() % 500) + 16;
+    }
+};
+
+//////////////////////////////////////////////////////////////////////////
+// The runner
+
+enum BenchScenario {
+    SCENARIO_CHURN,
+    SCENARIO_PRODUCER,
+    SCENARIO_LARSON,
+    SCENARIO_REPLAY,
+    SCENARIO_REMOTE,
+    BENCH_SCENARIOS
+};
+
+static const char* gBenchScenarioNames[BENCH_SCENARIOS] = {
+    "churn", "producer", "larson", "replay", "remote"
+};
+
+/*
+ * Return the value of the 'fraction' / 1000 percentile
+ */
+static uint32 getPercentile(const uint32* histogram, uint fraction)
+{
+    uint64 total = 0;
+    uint i;
+    for (i = 0; i < BENCH_HISTOGRAM_BUCKETS; i++)
+        total+= histogram[i];
+
+    uint64 rank = (total * fraction + 999) / 1000;
+    uint64 sum = 0;
+    for (i = 0; i < BENCH_HISTOGRAM_BUCKETS; i++)
+    {
+        sum+= histogram[i];
+        if ((sum >= rank) && (sum > 0))
+            return BenchThread::getBucketValue(i);
+    }
+    return 0;
+}
+
+static void runBenchmark(uint scenario, uint allocatorType, uint threads)
+{
+    BenchAllocator* allocator = createAllocator(allocatorType);
+    BenchContext* context = new BenchContext(*allocator, threads);
+
+    BenchThread* workers[BENCH_MAX_THREADS];
+    uint i;
+    for (i = 0; i < threads; i++)
+    {
+        switch (scenario)
+        {
+        case SCENARIO_CHURN:
+            workers[i] = new BenchChurnThread(*context, i, false);
+            break;
+        case SCENARIO_PRODUCER:
+            workers[i] = new BenchProducerThread(*context, i, false);
+            break;
+        case SCENARIO_REMOTE:
+            workers[i] = new BenchProducerThread(*context, i, true);
+            break;
+        case SCENARIO_LARSON:
+            workers[i] = new BenchLarsonThread(*context, i);
+            break;
+        default:
+            workers[i] = new BenchChurnThread(*context, i, true);
+            break;
+        }
+    }
+
+    uint64 start = readNanoseconds();
+    for (i = 0; i < threads; i++)
+        workers[i]->start();
+    for (i = 0; i < threads; i++)
+        workers[i]->wait();
+    uint64 time = readNanoseconds() - start;
+    if (time == 0)
+        time = 1;
+
+    uint32* histogram = new uint32[BENCH_HISTOGRAM_BUCKETS];
+    uint64 operations = 0;
+    uint failures = 0;
+    for (i = 0; i < BENCH_HISTOGRAM_BUCKETS; i++)
+        histogram[i] = 0;
+    for (i = 0; i < threads; i++)
+    {
+        operations+= workers[i]->getOperations();
+        failures+= workers[i]->getFailures();
+        for (uint j = 0; j < BENCH_HISTOGRAM_BUCKETS; j++)
+            histogram[j]+= workers[i]->getHistogram()[j];
+        delete workers[i];
+    }
+
+    memorySize footprint = context->m_peakFootprint;
+    uint32 live = context->m_peakLiveBytes;
+    uint fragmentation = 0;
+    if (footprint > live)
+        fragmentation = (uint)(((uint64)(footprint - live) * 100) / footprint);
+    char footprintText[24];
+
+    cout << "allocbench," << gBenchScenarioNames[scenario] << ","
+         << allocator->getName() << "," << threads << ","
+         << (uint)operations << "," << failures << ","
+         << (uint)((operations * 1000000000) / time) << ","
+         << getPercentile(histogram, 500) << ","
+         << getPercentile(histogram, 990) << ","
+         << getPercentile(histogram, 999) << ","
+         << formatMemorySize(footprint, footprintText) << "," << live << ","
+         << fragmentation << endl;
+
+    delete[] histogram;
+    delete context;
+    delete allocator;
+}
+
+/*
+ * Run all scenarios with 1, 2, 4 and 8 threads for each allocator. The
+ * producer and remote scenarios run with pairs of threads.
+ */
+void benchmarkAllocators()
+{
+    // The percentiles are accurate to 1/8 of their power of 2
+    CHECK(BenchThread::getBucket(7) == 7);
+    CHECK(BenchThread::getBucketValue(BenchThread::getBucket(1000)) <= 1000);
+    CHECK(BenchThread::getBucketValue(BenchThread::getBucket(1000) + 1) >
+          1000);
+    CHECK(BenchThread::getBucket(0xFFFFFFFF) < BENCH_HISTOGRAM_BUCKETS);
+
+    calibrateTimer();
+    cout << "allocbench,scenario,allocator,threads,operations,failures,"
+            "ops_per_second,p50_ns,p99_ns,p999_ns,peak_footprint_bytes,"
+            "peak_live_bytes,fragmentation_percent" << endl;
+
+    for (uint scenario = 0; scenario < BENCH_SCENARIOS; scenario++)
+    {
+        uint threads = ((scenario == SCENARIO_PRODUCER) ||
+                        (scenario == SCENARIO_REMOTE)) ? 2 : 1;
+        for (; threads <= BENCH_MAX_THREADS; threads<<= 1)
+        {
+            for (uint allocator = 0; allocator < BENCH_ALLOCATORS; allocator++)
+                runBenchmark(scenario, allocator, threads);
+        }
+    }
+}
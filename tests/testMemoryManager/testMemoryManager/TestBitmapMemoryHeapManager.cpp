@@ -0,0 +1,199 @@
+/*
+ * Copyright (c) 2008-2016, Integrity Project Ltd. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * Neither the name of the Integrity Project nor the names of its contributors
+ * may be used to endorse or promote products derived from this software
+ * without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE
+ */
+
+/*
+ * TestBitmapMemoryHeapManager.cpp
+ *
+ * Implementation file
+ */
+#include "xStl/types.h"
+#include "xStl/os/os.h"
+#include "xStl/data/char.h"
+#include "xStl/except/trace.h"
+#include "xStl/stream/iostream.h"
+#include "xStl/except/exception.h"
+#include "xdk/memory/SmallMemoryHeapManager.h"
+#include "xdk/memory/BitmapMemoryHeapManager.h"
+#include "TestSuperBlock.h"
+
+void bitmapOverrunTest()
+{
+    // 4 units of 8 bytes and the bitmap word
+    uint superblockLength = 36;
+    uint8* superblockBuffer = new uint8[superblockLength];
+
+    BitmapMemoryHeapManager newManager(superblockBuffer,
+                                       superblockLength,
+                                       8);
+
+    CHECK(newManager.allocate(0) == NULL);
+
+    // All 4 units
+    void* x = newManager.allocate(28); CHECK(x != NULL);
+    CHECK(newManager.allocate(1) == NULL);
+    CHECK(newManager.getBlockLength(x) == 28);
+    CHECK(newManager.free(x));
+    CHECK(!newManager.free(x));
+
+    void* a = newManager.allocate(4); CHECK(a != NULL);
+    void* b = newManager.allocate(4); CHECK(b != NULL);
+    void* c = newManager.allocate(4); CHECK(c != NULL);
+    void* d = newManager.allocate(4); CHECK(d != NULL);
+    CHECK(newManager.allocate(1) == NULL);
+
+    // Invalid pointers
+    CHECK(!newManager.free((uint8*)a + 1));
+    CHECK(!newManager.free(superblockBuffer));
+
+    // Free blocks are merged with their neighbours
+    CHECK(newManager.free(b));
+    CHECK(newManager.free(c));
+    x = newManager.allocate(12); CHECK(x != NULL);
+    CHECK(x == b);
+    CHECK(newManager.allocate(1) == NULL);
+
+    CHECK(newManager.free(a));
+    CHECK(newManager.free(x));
+    CHECK(newManager.free(d));
+    CHECK(newManager.getNumberOfAllocatedBytes() == 0);
+
+    x = newManager.allocate(28); CHECK(x != NULL);
+    CHECK(newManager.free(x));
+
+    delete[] superblockBuffer;
+}
+
+void bitmapRunsTest()
+{
+    // Runs which are crossing the bitmap words
+    uint superblockLength = 64*1024;
+    uint8* superblockBuffer = new uint8[superblockLength];
+
+    BitmapMemoryHeapManager newManager(superblockBuffer,
+                                       superblockLength,
+                                       8);
+
+    // Fill with single blocks, free a hole of 40 blocks which starts
+    // in the middle of a word
+    #define RUNS_BLOCKS (100)
+    void* blocks[RUNS_BLOCKS];
+    uint i;
+    for (i = 0; i < RUNS_BLOCKS; i++)
+    {
+        blocks[i] = newManager.allocate(4);
+        CHECK(blocks[i] != NULL);
+    }
+    for (i = 20; i < 60; i++)
+        CHECK(newManager.free(blocks[i]));
+
+    // 40 blocks are fit, 41 blocks are not
+    void* x = newManager.allocate(40 * 8 - 4);
+    CHECK(x == blocks[20]);
+    CHECK(newManager.free(x));
+    x = newManager.allocate(41 * 8 - 4);
+    CHECK(getNumeric(x) > getNumeric(blocks[RUNS_BLOCKS - 1]));
+    CHECK(newManager.free(x));
+
+    for (i = 0; i < 20; i++)
+        CHECK(newManager.free(blocks[i]));
+    for (i = 60; i < RUNS_BLOCKS; i++)
+        CHECK(newManager.free(blocks[i]));
+    CHECK(newManager.getNumberOfAllocatedBytes() == 0);
+
+    delete[] superblockBuffer;
+}
+
+void bitmapRandomTest()
+{
+    uint superblockLength = 5*1024*1024; // Allocate 5mb
+    uint8* superblockBuffer = new uint8[superblockLength];
+
+    BitmapMemoryHeapManager newManager(superblockBuffer,
+        superblockLength,
+        16);
+    TestSuperBlock test(newManager, cout, 1, 200);
+    test.test();
+
+    delete[] superblockBuffer;
+}
+
+//////////////////////////////////////////////////////////////////////////
+
+/*
+ * Run the TestSuperBlock random test and return the number of milliseconds
+ * it took. The test allocates up to 5 blocks at once.
+ */
+static uint measureEngine(MemorySuperblockHeapManager& manager)
+{
+    cOSDef::systemTime start = cOS::getSystemTime();
+    TestSuperBlock test(manager, cout, 1, 64);
+    test.test();
+    return cOS::calculateTimesDiffMilli(cOS::getSystemTime(), start);
+}
+
+/*
+ * Compare the free-list engine (SmallMemoryHeapManager) with the bitmap
+ * engine (BitmapMemoryHeapManager) while allocating multiple blocks.
+ */
+void benchmarkBitmapMemoryHeapManager()
+{
+    // 16kb units of 16 bytes. Fits the free-list engine 16bit indexes.
+    uint superblockLength = 16*16*1024;
+    uint8* superblockBuffer = new uint8[superblockLength];
+
+    uint freeListTime;
+    {
+        SmallMemoryHeapManager freeList(superblockBuffer,
+                                        superblockLength,
+                                        16);
+        freeListTime = measureEngine(freeList);
+    }
+
+    uint bitmapTime;
+    {
+        BitmapMemoryHeapManager bitmap(superblockBuffer,
+                                       superblockLength,
+                                       16);
+        bitmapTime = measureEngine(bitmap);
+    }
+
+    cout << endl << "Free-list engine: " << freeListTime << "ms"
+         << "  Bitmap engine: " << bitmapTime << "ms" << endl;
+
+    delete[] superblockBuffer;
+}
+
+void testBitmapMemoryHeapManager()
+{
+    bitmapOverrunTest();
+    bitmapRunsTest();
+    bitmapRandomTest();
+}
@@ -0,0 +1,182 @@
+/*
+ * Copyright (c) 2008-2016, Integrity Project Ltd. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * Neither the name of the Integrity Project nor the names of its contributors
+ * may be used to endorse or promote products derived from this software
+ * without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE
+ */
+
+
+
+
+/*
+ * TestDeferredFreeQueue.cpp
+ *
+ * Implementation file
+ */
+#include "xStl/types.h"
+#include "xStl/os/os.h"
+#include "xStl/os/threadedClass.h"
+#include "xStl/data/char.h"
+#include "xStl/except/trace.h"
+#include "xStl/stream/iostream.h"
+#include "xStl/except/exception.h"
+#include "xdk/memory/DeferredFreeQueue.h"
+
+/*
+ * A queued block. The first pointer is used by the queue
+ */
+struct DeferredBlock {
+    void* m_link;
+    uint m_producer;
+    uint m_sequence;
+};
+
+void deferredFreeQueueOrderTest()
+{
+    #define DEFERRED_ORDER_BLOCKS (100)
+    DeferredBlock blocks[DEFERRED_ORDER_BLOCKS];
+    DeferredFreeQueue queue;
+    uint i;
+
+    CHECK(queue.popAll() == NULL);
+    CHECK(queue.getNumberOfBlocks() == 0);
+
+    for (uint round = 0; round < 3; round++)
+    {
+        uint count = (round + 1) * DEFERRED_ORDER_BLOCKS / 3;
+        for (i = 0; i < count; i++)
+        {
+            blocks[i].m_sequence = i;
+            queue.push(&blocks[i]);
+        }
+        CHECK(queue.getNumberOfBlocks() == count);
+
+        // The batch keeps the push order
+        void* block = queue.popAll();
+        for (i = 0; i < count; i++)
+        {
+            CHECK(block == &blocks[i]);
+            block = DeferredFreeQueue::getNext(block);
+        }
+        CHECK(block == NULL);
+        CHECK(queue.getNumberOfBlocks() == 0);
+        CHECK(queue.popAll() == NULL);
+    }
+}
+
+#define DEFERRED_PRODUCERS (4)
+#define DEFERRED_BLOCKS_PER_PRODUCER (100000)
+
+/*
+ * Pushes it's blocks by order
+ */
+class DeferredProducerThread : public cThreadedClass {
+public:
+    DeferredProducerThread(DeferredFreeQueue& queue,
+                           DeferredBlock* blocks,
+                           uint producer) :
+        m_queue(queue),
+        m_blocks(blocks),
+        m_producer(producer)
+    {
+    }
+
+protected:
+    virtual void run()
+    {
+        for (uint i = 0; i < DEFERRED_BLOCKS_PER_PRODUCER; i++)
+        {
+            m_blocks[i].m_producer = m_producer;
+            m_blocks[i].m_sequence = i;
+            m_queue.push(&m_blocks[i]);
+        }
+    }
+
+private:
+    DeferredFreeQueue& m_queue;
+    DeferredBlock* m_blocks;
+    uint m_producer;
+};
+
+void deferredFreeQueueProducersTest()
+{
+    DeferredFreeQueue queue;
+    DeferredBlock* blocks =
+        new DeferredBlock[DEFERRED_PRODUCERS * DEFERRED_BLOCKS_PER_PRODUCER];
+    DeferredProducerThread* producers[DEFERRED_PRODUCERS];
+    uint nextSequence[DEFERRED_PRODUCERS];
+    uint i;
+
+    for (i = 0; i < DEFERRED_PRODUCERS; i++)
+    {
+        nextSequence[i] = 0;
+        producers[i] = new DeferredProducerThread(queue,
+            blocks + i * DEFERRED_BLOCKS_PER_PRODUCER, i);
+    }
+    for (i = 0; i < DEFERRED_PRODUCERS; i++)
+        producers[i]->start();
+
+    // Drain while the producers are running. Every block is received once,
+    // and the blocks of each producer are received by their order.
+    uint received = 0;
+    uint batches = 0;
+    while (received < DEFERRED_PRODUCERS * DEFERRED_BLOCKS_PER_PRODUCER)
+    {
+        void* block = queue.popAll();
+        if (block != NULL)
+            batches++;
+        while (block != NULL)
+        {
+            DeferredBlock* deferred = (DeferredBlock*)block;
+            block = DeferredFreeQueue::getNext(block);
+
+            CHECK(deferred->m_producer < DEFERRED_PRODUCERS);
+            CHECK(deferred->m_sequence ==
+                  nextSequence[deferred->m_producer]);
+            nextSequence[deferred->m_producer]++;
+            received++;
+        }
+    }
+
+    for (i = 0; i < DEFERRED_PRODUCERS; i++)
+    {
+        producers[i]->wait();
+        delete producers[i];
+        CHECK(nextSequence[i] == DEFERRED_BLOCKS_PER_PRODUCER);
+    }
+    CHECK(queue.popAll() == NULL);
+    CHECK(queue.getNumberOfBlocks() == 0);
+    CHECK(batches > 0);
+
+    delete[] blocks;
+}
+
+void testDeferredFreeQueue()
+{
+    deferredFreeQueueOrderTest();
+    deferredFreeQueueProducersTest();
+}
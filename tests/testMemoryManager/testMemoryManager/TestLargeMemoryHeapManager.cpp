@@ -0,0 +1,183 @@
+/*
+ * Copyright (c) 2008-2016, Integrity Project Ltd. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * Neither the name of the Integrity Project nor the names of its contributors
+ * may be used to endorse or promote products derived from this software
+ * without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE
+ */
+
+
+/*
+ * TestLargeMemoryHeapManager.cpp
+ *
+ * Implementation file
+ */
+#include "xStl/types.h"
+#include "xStl/os/os.h"
+#include "xStl/data/char.h"
+#include "xStl/except/trace.h"
+#include "xStl/stream/iostream.h"
+#include "xStl/except/exception.h"
+#include "xdk/memory/LargeMemoryHeapManager.h"
+#include "TestSuperBlock.h"
+
+#define LARGE_TEST_PAGE (LargeMemoryHeapManager::PAGE_SIZE)
+#define LARGE_TEST_OVERHEAD (LargeMemoryHeapManager::ALLOCATED_UNIT_OVERHEAD)
+
+/*
+ * Return the length of a block which uses exactly 'pages' pages
+ */
+static uint largePages(uint pages)
+{
+    return pages * LARGE_TEST_PAGE - LARGE_TEST_OVERHEAD;
+}
+
+void largeBestFitTest()
+{
+    // 16 pages
+    uint superblockLength = LargeMemoryHeapManager::getSuperblockLength(
+                                                            largePages(16));
+    uint8* superblockBuffer = new uint8[superblockLength];
+
+    LargeMemoryHeapManager newManager(superblockBuffer, superblockLength);
+
+    CHECK(newManager.allocate(0) == NULL);
+    CHECK(newManager.allocate(largePages(16) + 1) == NULL);
+
+    // All 16 pages
+    void* x = newManager.allocate(largePages(16)); CHECK(x != NULL);
+    CHECK((getNumeric(x) & 0xF) == 0);
+    CHECK(newManager.allocate(1) == NULL);
+    CHECK(newManager.getBlockLength(x) == largePages(16));
+    CHECK(newManager.getMaximumAllocationUnit() == 0);
+    CHECK(newManager.free(x));
+    CHECK(!newManager.free(x));
+    CHECK(newManager.getMaximumAllocationUnit() == largePages(16));
+
+    // Holes of 3, 2 and 4 pages
+    void* a = newManager.allocate(largePages(1)); CHECK(a != NULL);
+    void* b = newManager.allocate(largePages(3)); CHECK(b != NULL);
+    void* c = newManager.allocate(largePages(1)); CHECK(c != NULL);
+    void* d = newManager.allocate(largePages(2)); CHECK(d != NULL);
+    void* e = newManager.allocate(largePages(1)); CHECK(e != NULL);
+    void* f = newManager.allocate(largePages(4)); CHECK(f != NULL);
+    void* g = newManager.allocate(largePages(4)); CHECK(g != NULL);
+    CHECK(newManager.allocate(1) == NULL);
+    CHECK(newManager.free(b));
+    CHECK(newManager.free(d));
+    CHECK(newManager.free(f));
+
+    // Invalid pointers
+    CHECK(!newManager.free((uint8*)a + 1));
+    CHECK(!newManager.free((uint8*)a + LARGE_TEST_PAGE));
+    CHECK(!newManager.free(superblockBuffer));
+    CHECK(!newManager.free(b));
+    CHECK(newManager.getBlockLength(b) == 0);
+
+    // The smallest hole which fits is used
+    x = newManager.allocate(largePages(2)); CHECK(x == d);
+    CHECK(newManager.free(x));
+    x = newManager.allocate(largePages(2) + 1); CHECK(x == b);
+    CHECK(newManager.getBlockLength(x) == largePages(3));
+    void* y = newManager.allocate(largePages(4)); CHECK(y == f);
+    CHECK(newManager.allocate(largePages(3)) == NULL);
+    CHECK(newManager.free(x));
+    CHECK(newManager.free(y));
+
+    // The tail of an extent is returned to the tree
+    x = newManager.allocate(largePages(1));
+    CHECK(x == d);
+    y = newManager.allocate(largePages(1)); CHECK(y != NULL);
+    CHECK(getNumeric(y) == getNumeric(d) + LARGE_TEST_PAGE);
+    CHECK(newManager.free(x));
+    CHECK(newManager.free(y));
+
+    CHECK(newManager.free(a));
+    CHECK(newManager.free(c));
+    CHECK(newManager.free(e));
+    CHECK(newManager.free(g));
+    CHECK(newManager.getNumberOfAllocatedBytes() == 0);
+
+    delete[] superblockBuffer;
+}
+
+void largeCoalescingTest()
+{
+    // 64 pages, not aligned
+    uint superblockLength = LargeMemoryHeapManager::getSuperblockLength(
+                                                            largePages(64));
+    uint8* superblockBuffer = new uint8[superblockLength + 1];
+
+    LargeMemoryHeapManager newManager(superblockBuffer + 1, superblockLength);
+
+    #define COALESCING_BLOCKS (16)
+    void* blocks[COALESCING_BLOCKS];
+    uint i;
+    for (i = 0; i < COALESCING_BLOCKS; i++)
+    {
+        blocks[i] = newManager.allocate(largePages(4));
+        CHECK(blocks[i] != NULL);
+    }
+    CHECK(newManager.allocate(1) == NULL);
+
+    // Free the odd blocks, then the even ones. Each even block is merged
+    // with both of its neighbours.
+    for (i = 1; i < COALESCING_BLOCKS; i+= 2)
+        CHECK(newManager.free(blocks[i]));
+    CHECK(newManager.getMaximumAllocationUnit() == largePages(4));
+    CHECK(newManager.allocate(largePages(4) + 1) == NULL);
+    for (i = 0; i < COALESCING_BLOCKS; i+= 2)
+        CHECK(newManager.free(blocks[i]));
+    CHECK(newManager.getNumberOfAllocatedBytes() == 0);
+    CHECK(newManager.getMaximumAllocationUnit() == largePages(64));
+
+    // The whole superblock is a single extent again
+    void* x = newManager.allocate(largePages(64));
+    CHECK(x == blocks[0]);
+    CHECK(newManager.free(x));
+
+    delete[] superblockBuffer;
+}
+
+void largeRandomTest()
+{
+    uint superblockLength = 512*1024;
+    uint8* superblockBuffer = new uint8[superblockLength];
+
+    LargeMemoryHeapManager newManager(superblockBuffer,
+                                      superblockLength);
+    TestSuperBlock test(newManager, cout, 1, 12000);
+    test.test();
+
+    delete[] superblockBuffer;
+}
+
+void testLargeMemoryHeapManager()
+{
+    largeBestFitTest();
+    largeCoalescingTest();
+    largeRandomTest();
+}
@@ -0,0 +1,390 @@
+/*
+ * Copyright (c) 2008-2016, Integrity Project Ltd. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * Neither the name of the Integrity Project nor the names of its contributors
+ * may be used to endorse or promote products derived from this software
+ * without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE
+ */
+
+
+
+
+
+
+/*
+ * TestLargePageAllocator.cpp
+ *
+ * Tests for MemoryLargePageAllocator, and a pointer-chasing benchmark which
+ * compares a heap of small pages to a heap of large pages.
+ */
+#include "xStl/types.h"
+#include "xStl/os/os.h"
+#include "xStl/data/char.h"
+#include "xStl/except/trace.h"
+#include "xStl/stream/iostream.h"
+#include "xStl/except/exception.h"
+#include "xdk/memory/MemoryLargePageAllocator.h"
+#include "xdk/memory/SuperiorMemoryManager.h"
+#include "TestOSMemory.h"
+
+#ifdef XSTL_LINUX
+    #include <string.h>
+    #include <unistd.h>
+    #include <sys/mman.h>
+    #include <sys/ioctl.h>
+    #include <sys/syscall.h>
+    #include <linux/perf_event.h>
+#else
+    #include <windows.h>
+#endif
+
+/*
+ * Counts the superblocks which were forwarded to the fallback interface
+ */
+class LargePageFallbackOSMem : public TestOSMemory {
+public:
+    LargePageFallbackOSMem(uint& superblocks) : m_superblocks(superblocks) {}
+
+    virtual void* allocateNewSuperblock(uint length) {
+        m_superblocks++;
+        return TestOSMemory::allocateNewSuperblock(length);
+    }
+
+    virtual void freeSuperblock(void* pointer) {
+        m_superblocks--;
+        TestOSMemory::freeSuperblock(pointer);
+    }
+
+private:
+    uint& m_superblocks;
+};
+
+/*
+ * Test the routing of the superblocks between the large pages and the
+ * fallback interface
+ */
+static void testLargePageRouting()
+{
+    uint fallbackSuperblocks = 0;
+    MemoryLargePageAllocator* allocator = new MemoryLargePageAllocator(
+        SuperiorOSMemePtr(new LargePageFallbackOSMem(fallbackSuperblocks)));
+    SuperiorOSMemePtr osmem(allocator);
+
+    uint largePageSize = allocator->getLargePageSize();
+    if (largePageSize == 0)
+    {
+        cout << "Large pages are not available" << endl;
+        CHECK(osmem->getSuperblockPageAlignment() == 1);
+        void* superblock = osmem->allocateNewSuperblock(4*1024*1024);
+        CHECK(superblock != NULL);
+        CHECK(fallbackSuperblocks == 1);
+        osmem->freeSuperblock(superblock);
+        CHECK(fallbackSuperblocks == 0);
+        return;
+    }
+
+    cout << "Large page size: " << largePageSize << endl;
+    CHECK(osmem->getSuperblockPageAlignment() == largePageSize);
+
+    // A multiple of the large page size
+    uint8* large = (uint8*)osmem->allocateNewSuperblock(largePageSize * 2);
+    CHECK(large != NULL);
+    CHECK((getNumeric(large) % largePageSize) == 0);
+    large[0] = 1;
+    large[largePageSize * 2 - 1] = 1;
+    CHECK(allocator->getNumberOfLargePageBytes() == largePageSize * 2);
+    CHECK(fallbackSuperblocks == 0);
+
+    // Other lengths
+    void* small = osmem->allocateNewSuperblock(largePageSize + 4096);
+    CHECK(small != NULL);
+    CHECK(fallbackSuperblocks == 1);
+    CHECK(allocator->getNumberOfLargePageBytes() == largePageSize * 2);
+
+    osmem->freeSuperblock(small);
+    CHECK(fallbackSuperblocks == 0);
+    osmem->freeSuperblock(large);
+    CHECK(allocator->getNumberOfLargePageBytes() == 0);
+
+    // When the table is full the superblocks are forwarded
+    void* blocks[MemoryLargePageAllocator::MAX_LARGE_BLOCKS + 1];
+    uint i;
+    for (i = 0; i <= MemoryLargePageAllocator::MAX_LARGE_BLOCKS; i++)
+    {
+        blocks[i] = osmem->allocateNewSuperblock(largePageSize);
+        CHECK(blocks[i] != NULL);
+    }
+    CHECK(fallbackSuperblocks == 1);
+    CHECK(allocator->getNumberOfLargePageBytes() ==
+          largePageSize * MemoryLargePageAllocator::MAX_LARGE_BLOCKS);
+    for (i = 0; i <= MemoryLargePageAllocator::MAX_LARGE_BLOCKS; i++)
+        osmem->freeSuperblock(blocks[i]);
+    CHECK(fallbackSuperblocks == 0);
+    CHECK(allocator->getNumberOfLargePageBytes() == 0);
+}
+
+/*
+ * Test a SuperiorMemoryManager on top of the large pages
+ */
+static void testLargePageHeap()
+{
+    uint fallbackSuperblocks = 0;
+    MemoryLargePageAllocator* allocator = new MemoryLargePageAllocator(
+        SuperiorOSMemePtr(new LargePageFallbackOSMem(fallbackSuperblocks)));
+    uint largePageSize = allocator->getLargePageSize();
+
+    uint privatePoolLength =
+        SuperiorMemoryManager::DEFAULT_SUPRIOR_MEMORY_PRIVATE_MEM;
+    uint8* privatePool = new uint8[privatePoolLength];
+    {
+        SuperiorMemoryManager memmanager(SuperiorOSMemePtr(allocator),
+            SuperiorMemoryManager::INITIALIZE_SIZE_MINIMUM_SIZE,
+            privatePool,
+            privatePoolLength);
+        if (largePageSize != 0)
+        {
+            CHECK(allocator->getNumberOfLargePageBytes() >=
+                  SuperiorMemoryManager::INITIALIZE_SIZE_MINIMUM_SIZE);
+        }
+
+        void* blocks[1000];
+        uint i;
+        for (i = 0; i < 1000; i++)
+        {
+            blocks[i] = memmanager.allocate(16 + (i % 100) * 8);
+            CHECK(blocks[i] != NULL);
+            memset(blocks[i], 0xCC, 16);
+        }
+        for (i = 0; i < 1000; i++)
+            CHECK(memmanager.free(blocks[i]));
+    }
+    delete[] privatePool;
+    CHECK(fallbackSuperblocks == 0);
+}
+
+void testLargePageAllocator()
+{
+    testLargePageRouting();
+    testLargePageHeap();
+}
+
+//////////////////////////////////////////////////////////////////////////
+
+/*
+ * Superblocks of small pages
+ */
+class SmallPagesOSMem : public SuperiorMemoryManagerInterface {
+public:
+    enum { PAGE = 4096 };
+
+    virtual uint getSuperblockPageAlignment() {
+        return PAGE;
+    }
+
+    virtual void* allocateNewSuperblock(uint length) {
+        #ifdef XSTL_LINUX
+            // The first page keeps the length for the free
+            uint8* ret = (uint8*)mmap(NULL, length + PAGE,
+                                      PROT_READ | PROT_WRITE,
+                                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (ret == MAP_FAILED)
+                return NULL;
+            // Transparent huge pages might be enabled for all the regions
+            madvise(ret, length + PAGE, MADV_NOHUGEPAGE);
+            *((uint*)ret) = length;
+            return ret + PAGE;
+        #else
+            return VirtualAlloc(NULL, length, MEM_RESERVE | MEM_COMMIT,
+                                PAGE_READWRITE);
+        #endif
+    }
+
+    virtual void freeSuperblock(void* pointer) {
+        #ifdef XSTL_LINUX
+            uint8* region = ((uint8*)pointer) - PAGE;
+            munmap(region, *((uint*)region) + PAGE);
+        #else
+            VirtualFree(pointer, 0, MEM_RELEASE);
+        #endif
+    }
+};
+
+/*
+ * Counts the data TLB misses of the current thread, when the processor and
+ * the operating system allow it (Linux only)
+ */
+class TlbMissCounter {
+public:
+    TlbMissCounter() : m_handle(-1)
+    {
+        #ifdef XSTL_LINUX
+            perf_event_attr attributes;
+            memset(&attributes, 0, sizeof(attributes));
+            attributes.size = sizeof(attributes);
+            attributes.type = PERF_TYPE_HW_CACHE;
+            attributes.config = PERF_COUNT_HW_CACHE_DTLB |
+                                (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+            attributes.disabled = 1;
+            attributes.exclude_kernel = 1;
+            attributes.exclude_hv = 1;
+            m_handle = (int)syscall(__NR_perf_event_open, &attributes, 0, -1,
+                                    -1, 0);
+        #endif
+    }
+
+    ~TlbMissCounter()
+    {
+        #ifdef XSTL_LINUX
+            if (m_handle >= 0)
+                close(m_handle);
+        #endif
+    }
+
+    bool isValid() const { return m_handle >= 0; }
+
+    void start()
+    {
+        #ifdef XSTL_LINUX
+            if (m_handle < 0)
+                return;
+            ioctl(m_handle, PERF_EVENT_IOC_RESET, 0);
+            ioctl(m_handle, PERF_EVENT_IOC_ENABLE, 0);
+        #endif
+    }
+
+    /*
+     * Return the number of misses since 'start()'
+     */
+    uint64 stop()
+    {
+        uint64 count = 0;
+        #ifdef XSTL_LINUX
+            if (m_handle < 0)
+                return 0;
+            ioctl(m_handle, PERF_EVENT_IOC_DISABLE, 0);
+            if (read(m_handle, &count, sizeof(count)) != sizeof(count))
+                count = 0;
+        #endif
+        return count;
+    }
+
+private:
+    int m_handle;
+};
+
+// 128mb of nodes, which are visited in a random order
+#define CHASE_NODES (2*1024*1024)
+#define CHASE_STEPS (20*1000*1000)
+// Holds all the nodes in the first superblock
+#define CHASE_HEAP_SIZE (192*1024*1024)
+#define CHASE_PRIVATE_POOL (256*1024)
+
+/*
+ * A cache line which points to the next one
+ */
+struct ChaseNode {
+    ChaseNode* m_next;
+    uint8 m_padding[64 - sizeof(ChaseNode*)];
+};
+
+/*
+ * Link CHASE_NODES nodes of 'osmem' into a random cycle, and follow it
+ */
+static void chasePointers(const char* name, const SuperiorOSMemePtr& osmem)
+{
+    uint8* privatePool = new uint8[CHASE_PRIVATE_POOL];
+    ChaseNode** nodes = new ChaseNode*[CHASE_NODES];
+    {
+        SuperiorMemoryManager memmanager(osmem, CHASE_HEAP_SIZE, privatePool,
+                                         CHASE_PRIVATE_POOL);
+        uint i;
+        for (i = 0; i < CHASE_NODES; i++)
+        {
+            nodes[i] = (ChaseNode*)memmanager.allocate(sizeof(ChaseNode));
+            CHECK(nodes[i] != NULL);
+        }
+
+        // Shuffle
+        uint32 seed = 1;
+        for (i = CHASE_NODES - 1; i > 0; i--)
+        {
+            seed = seed * 1103515245 + 12345;
+            uint j = ((seed >> 8) % (i + 1));
+            ChaseNode* temp = nodes[i];
+            nodes[i] = nodes[j];
+            nodes[j] = temp;
+        }
+        for (i = 0; i < CHASE_NODES; i++)
+            nodes[i]->m_next = nodes[(i + 1) % CHASE_NODES];
+
+        TlbMissCounter counter;
+        ChaseNode* node = nodes[0];
+        cOSDef::systemTime start = cOS::getSystemTime();
+        counter.start();
+        for (i = 0; i < CHASE_STEPS; i++)
+            node = node->m_next;
+        uint64 misses = counter.stop();
+        uint time = cOS::calculateTimesDiffMilli(cOS::getSystemTime(), start);
+        // Keep the loop
+        CHECK(node != NULL);
+
+        cout << "Pointer chase (" << name << "): " << time << "ms  "
+             << (uint)(((uint64)time * 1000000) / CHASE_STEPS) << "ns/step  ";
+        if (counter.isValid())
+        {
+            cout << (uint)((misses * 1000) / CHASE_STEPS)
+                 << " dTLB misses per 1000 steps" << endl;
+        } else
+        {
+            cout << "dTLB misses are not available" << endl;
+        }
+
+        for (i = 0; i < CHASE_NODES; i++)
+            CHECK(memmanager.free(nodes[i], sizeof(ChaseNode)));
+    }
+    delete[] nodes;
+    delete[] privatePool;
+}
+
+/*
+ * Compares random accesses into a heap of small pages, to the same heap of
+ * large pages
+ */
+void benchmarkLargePageAllocator()
+{
+    chasePointers("small pages", SuperiorOSMemePtr(new SmallPagesOSMem()));
+
+    MemoryLargePageAllocator* allocator = new MemoryLargePageAllocator(
+        SuperiorOSMemePtr(new SmallPagesOSMem()));
+    SuperiorOSMemePtr osmem(allocator);
+    if (allocator->getLargePageSize() == 0)
+    {
+        cout << "Large pages are not available" << endl;
+        return;
+    }
+    chasePointers("large pages", osmem);
+}
@@ -0,0 +1,257 @@
+/*
+ * Copyright (c) 2008-2016, Integrity Project Ltd. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * Neither the name of the Integrity Project nor the names of its contributors
+ * may be used to endorse or promote products derived from this software
+ * without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE
+ */
+
+
+
+
+
+/*
+ * TestMemoryArena.cpp
+ *
+ * Implementation file
+ */
+#include "xStl/types.h"
+#include "xStl/os/os.h"
+#include "xStl/data/char.h"
+#include "xStl/except/trace.h"
+#include "xStl/stream/iostream.h"
+#include "xStl/except/exception.h"
+#include "xdk/memory/MemoryArena.h"
+#include "xdk/memory/SmallMemoryHeapManager.h"
+#include "xdk/memory/SuperiorMemoryManager.h"
+#include "TestOSMemory.h"
+
+void memoryArenaBumpTest()
+{
+    #define ARENA_BLOCKS (300)
+
+    uint superblockLength = 256*1024;
+    uint8* superblockBuffer = new uint8[superblockLength];
+    SmallMemoryHeapManager heap(superblockBuffer, superblockLength, 16);
+
+    MemoryArena arena(heap, 1024);
+    CHECK(arena.allocate(0) == NULL);
+    CHECK(arena.allocate(16, 0) == NULL);
+    CHECK(arena.allocate(16, 3) == NULL);
+    CHECK(heap.getNumberOfAllocatedBytes() == 0);
+
+    uint8* blocks[ARENA_BLOCKS];
+    uint lengths[ARENA_BLOCKS];
+    uint i;
+    for (uint round = 0; round < 2; round++)
+    {
+        uint total = 0;
+        for (i = 0; i < ARENA_BLOCKS; i++)
+        {
+            // 1 to 64 bytes alignments, lengths up to 100 bytes
+            uint alignment = 1 << (i % 7);
+            lengths[i] = ((i * 37 + round) % 100) + 1;
+            blocks[i] = (uint8*)arena.allocate(lengths[i], alignment);
+            CHECK(blocks[i] != NULL);
+            CHECK((getNumeric(blocks[i]) & (alignment - 1)) == 0);
+            CHECK(arena.isOwner(blocks[i]));
+            memset(blocks[i], (uint8)i, lengths[i]);
+            total+= lengths[i];
+        }
+        CHECK(arena.getNumberOfAllocatedBytes() == total);
+
+        // The blocks don't overlap
+        for (i = 0; i < ARENA_BLOCKS; i++)
+        {
+            CHECK(blocks[i][0] == (uint8)i);
+            CHECK(blocks[i][lengths[i] - 1] == (uint8)i);
+        }
+
+        // Many blocks for each chunk
+        CHECK(arena.getNumberOfChunks() > 0);
+        CHECK(arena.getNumberOfChunks() < (ARENA_BLOCKS / 4));
+        CHECK(heap.getNumberOfAllocatedBytes() > 0);
+
+        // Everything is released at once
+        arena.release();
+        CHECK(heap.getNumberOfAllocatedBytes() == 0);
+        CHECK(arena.getNumberOfChunks() == 0);
+        CHECK(arena.getNumberOfAllocatedBytes() == 0);
+        CHECK(!arena.isOwner(blocks[0]));
+    }
+
+    // Large blocks get a chunk of their own, the current chunk stays
+    uint8* first = (uint8*)arena.allocate(8);
+    CHECK(first != NULL);
+    uint8* large = (uint8*)arena.allocate(4000);
+    CHECK(large != NULL);
+    CHECK(arena.getNumberOfChunks() == 2);
+    CHECK(arena.isOwner(large + 3999));
+    uint8* second = (uint8*)arena.allocate(8);
+    CHECK(second == first + 8);
+
+    // A foreign pointer
+    uint8 foreign[16];
+    CHECK(!arena.isOwner(foreign));
+
+    // The destructor releases
+    {
+        MemoryArena temporary(heap);
+        CHECK(temporary.allocate(100) != NULL);
+    }
+    arena.release();
+    CHECK(heap.getNumberOfAllocatedBytes() == 0);
+
+    delete[] superblockBuffer;
+}
+
+void memoryArenaInitialBufferTest()
+{
+    uint superblockLength = 64*1024;
+    uint8* superblockBuffer = new uint8[superblockLength];
+    SmallMemoryHeapManager heap(superblockBuffer, superblockLength, 16);
+
+    // The first blocks don't touch the heap. The buffer is aligned to the
+    // blocks.
+    uint64 initialQwords[32];
+    uint8* initialBuffer = (uint8*)initialQwords;
+    MemoryArena arena(heap, 1024, initialBuffer, sizeof(initialQwords));
+    for (uint round = 0; round < 2; round++)
+    {
+        uint i;
+        for (i = 0; i < 16; i++)
+        {
+            void* block = arena.allocate(16);
+            CHECK(block == initialBuffer + i * 16);
+        }
+        CHECK(arena.getNumberOfChunks() == 0);
+        CHECK(heap.getNumberOfAllocatedBytes() == 0);
+        CHECK(arena.isOwner(initialBuffer + 255));
+
+        // And the next blocks are taken from the heap
+        void* block = arena.allocate(16);
+        CHECK(block != NULL);
+        CHECK(!((block >= initialBuffer) &&
+                (block < initialBuffer + sizeof(initialQwords))));
+        CHECK(arena.getNumberOfChunks() == 1);
+
+        // The initial buffer serves again after the release
+        arena.release();
+        CHECK(heap.getNumberOfAllocatedBytes() == 0);
+    }
+
+    delete[] superblockBuffer;
+}
+
+void memoryArenaExhaustedTest()
+{
+    uint superblockLength = 4*1024;
+    uint8* superblockBuffer = new uint8[superblockLength];
+    SmallMemoryHeapManager heap(superblockBuffer, superblockLength, 16);
+
+    // The heap holds a single chunk
+    MemoryArena arena(heap, 3*1024);
+    uint count = 0;
+    while (arena.allocate(96) != NULL)
+        count++;
+    CHECK((count >= (3*1024 - 64) / 96) && (count <= (3*1024) / 96));
+    CHECK(arena.getNumberOfChunks() == 1);
+
+    arena.release();
+    CHECK(heap.getNumberOfAllocatedBytes() == 0);
+    CHECK(arena.allocate(96) != NULL);
+    arena.release();
+
+    delete[] superblockBuffer;
+}
+
+void testMemoryArena()
+{
+    memoryArenaBumpTest();
+    memoryArenaInitialBufferTest();
+    memoryArenaExhaustedTest();
+}
+
+//////////////////////////////////////////////////////////////////////////
+
+#define ARENA_REQUESTS (20000)
+#define ARENA_REQUEST_OBJECTS (200)
+
+/*
+ * Compares the temporary objects of a request which are allocated and freed
+ * by the heap, to the same objects inside an arena.
+ */
+void benchmarkMemoryArena()
+{
+    uint privatePoolLength =
+        SuperiorMemoryManager::DEFAULT_SUPRIOR_MEMORY_PRIVATE_MEM;
+    uint8* privatePool = new uint8[privatePoolLength];
+
+    SuperiorMemoryManager* memmanager = new SuperiorMemoryManager(
+        SuperiorOSMemePtr(new TestOSMemory()),
+        8*1024*1024,
+        privatePool,
+        privatePoolLength);
+
+    void* objects[ARENA_REQUEST_OBJECTS];
+    uint i, j;
+
+    cOSDef::systemTime start = cOS::getSystemTime();
+    for (i = 0; i < ARENA_REQUESTS; i++)
+    {
+        for (j = 0; j < ARENA_REQUEST_OBJECTS; j++)
+        {
+            objects[j] = memmanager->allocate(((i + j * 13) % 200) + 8);
+            CHECK(objects[j] != NULL);
+        }
+        for (j = 0; j < ARENA_REQUEST_OBJECTS; j++)
+            CHECK(memmanager->free(objects[j]));
+    }
+    uint heapTime = cOS::calculateTimesDiffMilli(cOS::getSystemTime(), start);
+
+    uint chunks = 0;
+    start = cOS::getSystemTime();
+    for (i = 0; i < ARENA_REQUESTS; i++)
+    {
+        MemoryArena arena(*memmanager);
+        for (j = 0; j < ARENA_REQUEST_OBJECTS; j++)
+        {
+            objects[j] = arena.allocate(((i + j * 13) % 200) + 8);
+            CHECK(objects[j] != NULL);
+        }
+        chunks+= arena.getNumberOfChunks();
+    }
+    uint arenaTime = cOS::calculateTimesDiffMilli(cOS::getSystemTime(),
+                                                  start);
+
+    cout << "Request objects: heap " << heapTime << "ms ("
+         << ARENA_REQUEST_OBJECTS << " heap allocations per request)  arena "
+         << arenaTime << "ms (" << (chunks / ARENA_REQUESTS)
+         << " heap allocations per request)" << endl;
+
+    delete memmanager;
+    delete[] privatePool;
+}
@@ -0,0 +1,174 @@
+/*
+ * Copyright (c) 2008-2016, Integrity Project Ltd. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * Neither the name of the Integrity Project nor the names of its contributors
+ * may be used to endorse or promote products derived from this software
+ * without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE
+ */
+
+
+
+/*
+ * TestMemoryProfiler.cpp
+ *
+ * Implementation file
+ */
+#include "xStl/types.h"
+#include "xStl/os/os.h"
+#include "xStl/data/char.h"
+#include "xStl/except/trace.h"
+#include "xStl/stream/iostream.h"
+#include "xStl/except/exception.h"
+#include "xdk/memory/MemoryProfile.h"
+#include "xdk/memory/MemoryProfiler.h"
+
+/*
+ * Return a fake block address. The profiler never touches the blocks.
+ */
+static void* profiledBlock(uint index)
+{
+    return getPtr(0x10000 + index * 0x40);
+}
+
+void profilerSampleRateTest()
+{
+    #define PROFILER_TEST_RATE (64*1024)
+    #define PROFILER_TEST_BLOCK (4096)
+    #define PROFILER_TEST_BLOCKS (10000)
+
+    MemoryProfiler* profiler = new MemoryProfiler(PROFILER_TEST_RATE);
+    uint i;
+
+    // 40mb in blocks of 4kb. About 625 samples are expected.
+    for (i = 0; i < PROFILER_TEST_BLOCKS; i++)
+        profiler->recordAllocation(profiledBlock(i), PROFILER_TEST_BLOCK);
+    uint expected = PROFILER_TEST_BLOCKS * PROFILER_TEST_BLOCK /
+                    PROFILER_TEST_RATE;
+    uint samples = profiler->getNumberOfSamples();
+    cout << "Profiler samples: " << samples << " (Expected " << expected
+         << ")" << endl;
+    CHECK(samples > expected - expected / 6);
+    CHECK(samples < expected + expected / 6);
+
+    // Freeing all blocks forgets all samples
+    for (i = 0; i < PROFILER_TEST_BLOCKS; i++)
+        profiler->recordFree(profiledBlock(i));
+    CHECK(profiler->getNumberOfSamples() == 0);
+
+    // Blocks which are much larger than the rate are always sampled
+    for (i = 0; i < 100; i++)
+        profiler->recordAllocation(profiledBlock(i), PROFILER_TEST_RATE * 32);
+    CHECK(profiler->getNumberOfSamples() == 100);
+    for (i = 0; i < 100; i++)
+        profiler->recordFree(profiledBlock(i));
+
+    // A disabled profiler samples nothing
+    profiler->setSampleRate(0);
+    for (i = 0; i < 100; i++)
+        profiler->recordAllocation(profiledBlock(i), PROFILER_TEST_RATE * 32);
+    CHECK(profiler->getNumberOfSamples() == 0);
+
+    delete profiler;
+}
+
+void profilerDumpTest()
+{
+    #define PROFILER_DUMP_LIVE (400)
+    #define PROFILER_DUMP_ROUNDS (100000)
+
+    // Every block of more than 22 bytes is sampled. (The longest interval
+    // is -ln(2^-32) times the rate)
+    MemoryProfiler* profiler = new MemoryProfiler(1);
+    MemoryProfileDump* dump = new MemoryProfileDump;
+    bool* isLive = new bool[PROFILER_DUMP_LIVE * 4];
+    uint live = 0;
+    uint i;
+    for (i = 0; i < PROFILER_DUMP_LIVE * 4; i++)
+        isLive[i] = false;
+
+    // Random allocations and frees over colliding addresses
+    for (i = 0; i < PROFILER_DUMP_ROUNDS; i++)
+    {
+        uint index = cOS::rand() % (PROFILER_DUMP_LIVE * 4);
+        if (isLive[index])
+        {
+            profiler->recordFree(profiledBlock(index));
+            isLive[index] = false;
+            live--;
+        } else if (live < PROFILER_DUMP_LIVE)
+        {
+            profiler->recordAllocation(profiledBlock(index), index + 100);
+            isLive[index] = true;
+            live++;
+        }
+        CHECK(profiler->getNumberOfSamples() == live);
+    }
+
+    // The dump holds exactly the live blocks
+    profiler->dump(*dump);
+    CHECK(dump->m_magic == MemoryProfileDump::MAGIC);
+    CHECK(dump->m_version == MemoryProfileDump::VERSION);
+    CHECK(dump->m_sampleRate == 1);
+    CHECK(dump->m_numberOfSamples == live);
+    CHECK(dump->m_droppedSamples == 0);
+    for (i = 0; i < dump->m_numberOfSamples; i++)
+    {
+        MemoryProfileSample& sample = dump->m_samples[i];
+        uint index = ((uint)sample.m_block - 0x10000) / 0x40;
+        CHECK(profiledBlock(index) == getPtr((addressNumericValue)sample.m_block));
+        CHECK(isLive[index]);
+        CHECK(sample.m_length == index + 100);
+        CHECK(sample.m_numberOfFrames > 0);
+        CHECK(sample.m_numberOfFrames <= MemoryProfileSample::MAX_FRAMES);
+        CHECK(sample.m_frames[0] != 0);
+        isLive[index] = false;
+    }
+
+    // Unknown blocks are ignored
+    profiler->recordFree(profiledBlock(PROFILER_DUMP_LIVE * 8));
+    CHECK(profiler->getNumberOfSamples() == live);
+
+    // A full table drops samples
+    for (i = 0; i < MemoryProfiler::MAX_LIVE_SAMPLES; i++)
+    {
+        profiler->recordAllocation(profiledBlock(PROFILER_DUMP_LIVE * 4 + i),
+                                   100);
+    }
+    CHECK(profiler->getNumberOfSamples() == MemoryProfiler::MAX_LIVE_SAMPLES);
+    profiler->dump(*dump);
+    CHECK(dump->m_numberOfSamples == MemoryProfiler::MAX_LIVE_SAMPLES);
+    CHECK(dump->m_droppedSamples == live);
+
+    delete[] isLive;
+    delete dump;
+    delete profiler;
+}
+
+void testMemoryProfiler()
+{
+    profilerSampleRateTest();
+    profilerDumpTest();
+}
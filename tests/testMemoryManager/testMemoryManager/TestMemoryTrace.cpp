@@ -0,0 +1,827 @@
+/*
+ * Copyright (c) 2008-2016, Integrity Project Ltd. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * Neither the name of the Integrity Project nor the names of its contributors
+ * may be used to endorse or promote products derived from this software
+ * without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE
+ */
+
+
+
+
+
+
+/*
+ * TestMemoryTrace.cpp
+ *
+ * Tests for the allocation trace recorder, and the replay of recorded traces.
+ *
+ * A trace file is recorded by the Manager sample ('T' key) and replayed by:
+ *     testMemoryManager replay <file>
+ *
+ * The replay runs a thread for each recorded processor against a
+ * SuperiorMemoryManager. Each thread executes the operations of it's
+ * processor by the recorded order, and a free waits until the allocation of
+ * the block was replayed by it's thread. The operations are replayed as fast
+ * as possible: The recorded times are not kept. The result is written as a
+ * comma-separated line:
+ *
+ *     tracereplay,records,threads,failures,time_ms,ops_per_second,
+ *         peak_footprint_bytes,peak_live_bytes,dropped_records
+ */
+#include "xStl/types.h"
+#include "xStl/os/os.h"
+#include "xStl/os/threadedClass.h"
+#include "xStl/data/char.h"
+#include "xStl/data/smartptr.h"
+#include "xStl/except/trace.h"
+#include "xStl/stream/iostream.h"
+#include "xStl/except/exception.h"
+#include "xdk/memory/MemoryAtomic.h"
+#include "xdk/memory/MemoryTrace.h"
+#include "xdk/memory/MemoryTraceRecorder.h"
+#include "xdk/memory/SuperiorMemoryManager.h"
+#include "TestOSMemory.h"
+
+#include <stdio.h>
+
+#ifdef XSTL_LINUX
+    #include <sched.h>
+#endif
+
+// The maximum number of replay threads. Higher processors are folded.
+#define REPLAY_MAX_THREADS (64)
+// The allocation of a block wasn't replayed yet
+#define REPLAY_PENDING ((void*)NULL)
+// The allocation of a block failed
+#define REPLAY_FAILED ((void*)&gReplayFailed)
+// The free of a block doesn't have a known allocation
+#define REPLAY_NO_ALLOCATION (0xFFFFFFFF)
+
+// See REPLAY_FAILED
+static uint8 gReplayFailed = 0;
+
+/*
+ * Give the processor to another thread while spinning
+ */
+static void replayYield()
+{
+    #ifdef XSTL_LINUX
+        sched_yield();
+    #else
+        SwitchToThread();
+    #endif
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Trace files
+
+/*
+ * Drain all the records of 'recorder' and append them into 'file', in the
+ * format of the Manager sample.
+ *
+ * Return the number of records.
+ */
+static uint appendTrace(MemoryTraceRecorder& recorder,
+                        MemoryTraceDump& dump,
+                        FILE* file)
+{
+    uint total = 0;
+    while (true)
+    {
+        uint count = recorder.drain(dump);
+        if (count == 0)
+            return total;
+
+        uint length = sizeof(MemoryTraceHeader) +
+                      count * sizeof(MemoryTraceRecord);
+        CHECK(fwrite(&dump, 1, length, file) == length);
+        total+= count;
+    }
+}
+
+/*
+ * A loaded trace, and the dependencies between it's records
+ */
+class ReplayTrace {
+public:
+    ReplayTrace() :
+        m_records(NULL),
+        m_numberOfRecords(0),
+        m_droppedRecords(0),
+        m_allocations(NULL),
+        m_threads(0),
+        m_order(NULL),
+        m_peakLiveBytes(0),
+        m_unknownFrees(0)
+    {
+        for (uint i = 0; i <= REPLAY_MAX_THREADS; i++)
+            m_threadStart[i] = 0;
+    }
+
+    ~ReplayTrace()
+    {
+        delete[] m_records;
+        delete[] m_allocations;
+        delete[] m_order;
+    }
+
+    /*
+     * Load the batches of a trace file. Throws exception if the file is not
+     * a valid trace.
+     */
+    void load(const char* filename)
+    {
+        FILE* file = fopen(filename, "rb");
+        if (file == NULL)
+        {
+            cout << "Cannot open trace '" << filename << "'" << endl;
+            XSTL_THROW(cException, EXCEPTION_FAILED);
+        }
+
+        // The file length is a limit for the number of records
+        fseek(file, 0, SEEK_END);
+        long fileLength = ftell(file);
+        fseek(file, 0, SEEK_SET);
+        CHECK(fileLength >= 0);
+        uint maximumRecords = (uint)fileLength / sizeof(MemoryTraceRecord);
+        m_records = new MemoryTraceRecord[maximumRecords + 1];
+
+        MemoryTraceHeader header;
+        bool isValid = true;
+        while (fread(&header, sizeof(header), 1, file) == 1)
+        {
+            if ((header.m_magic != MemoryTraceHeader::MAGIC) ||
+                (header.m_version != MemoryTraceHeader::VERSION) ||
+                (header.m_numberOfRecords >
+                    (maximumRecords - m_numberOfRecords)) ||
+                (fread(m_records + m_numberOfRecords,
+                       sizeof(MemoryTraceRecord),
+                       header.m_numberOfRecords,
+                       file) != header.m_numberOfRecords))
+            {
+                isValid = false;
+                break;
+            }
+            m_numberOfRecords+= header.m_numberOfRecords;
+            m_droppedRecords = header.m_droppedRecords;
+        }
+        fclose(file);
+
+        if (!isValid)
+        {
+            cout << "Invalid trace '" << filename << "'" << endl;
+            XSTL_THROW(cException, EXCEPTION_FAILED);
+        }
+    }
+
+    /*
+     * Match each free to it's allocation, compute the peak of the live bytes
+     * and divide the records between the replay threads.
+     */
+    void prepare()
+    {
+        uint i;
+        m_allocations = new uint32[m_numberOfRecords + 1];
+
+        // The live allocations by their block identifier: Each bucket is a
+        // list which is linked through 'next'
+        uint buckets = 1;
+        while (buckets < m_numberOfRecords)
+            buckets<<= 1;
+        uint32* heads = new uint32[buckets];
+        uint32* next = new uint32[m_numberOfRecords + 1];
+        for (i = 0; i < buckets; i++)
+            heads[i] = REPLAY_NO_ALLOCATION;
+
+        uint32 liveBytes = 0;
+        for (i = 0; i < m_numberOfRecords; i++)
+        {
+            const MemoryTraceRecord& record = m_records[i];
+            uint32* bucket = heads + ((record.m_blockId * 2654435761U) &
+                                      (buckets - 1));
+            m_allocations[i] = REPLAY_NO_ALLOCATION;
+
+            // Find the live allocation of the block, and unlink it
+            uint32* link = bucket;
+            while ((*link != REPLAY_NO_ALLOCATION) &&
+                   (m_records[*link].m_blockId != record.m_blockId))
+                link = next + *link;
+            uint32 allocation = *link;
+            if (allocation != REPLAY_NO_ALLOCATION)
+            {
+                *link = next[allocation];
+                // The free of an allocation which is replaced was dropped
+                liveBytes-= m_records[allocation].m_length;
+            }
+
+            if (record.m_operation == MemoryTraceRecord::OPERATION_ALLOCATE)
+            {
+                next[i] = *bucket;
+                *bucket = i;
+                liveBytes+= record.m_length;
+                if (liveBytes > m_peakLiveBytes)
+                    m_peakLiveBytes = liveBytes;
+                if (allocation != REPLAY_NO_ALLOCATION)
+                    m_unknownFrees++;
+            } else
+            {
+                m_allocations[i] = allocation;
+                if (allocation == REPLAY_NO_ALLOCATION)
+                    m_unknownFrees++;
+            }
+        }
+        delete[] heads;
+        delete[] next;
+
+        // Sort the records by their thread, keeping the recorded order
+        m_threads = 0;
+        for (i = 0; i < m_numberOfRecords; i++)
+        {
+            uint thread = getThread(m_records[i]);
+            m_threadStart[thread + 1]++;
+            if (thread >= m_threads)
+                m_threads = thread + 1;
+        }
+        for (i = 0; i < REPLAY_MAX_THREADS; i++)
+            m_threadStart[i + 1]+= m_threadStart[i];
+
+        uint32 position[REPLAY_MAX_THREADS];
+        for (i = 0; i < REPLAY_MAX_THREADS; i++)
+            position[i] = m_threadStart[i];
+        m_order = new uint32[m_numberOfRecords + 1];
+        for (i = 0; i < m_numberOfRecords; i++)
+            m_order[position[getThread(m_records[i])]++] = i;
+    }
+
+    /*
+     * Return the replay thread of 'record'
+     */
+    static uint getThread(const MemoryTraceRecord& record)
+    {
+        return record.m_processor % REPLAY_MAX_THREADS;
+    }
+
+    // The records of the trace
+    MemoryTraceRecord* m_records;
+    uint m_numberOfRecords;
+    // The number of records the recorder dropped
+    uint m_droppedRecords;
+    // For each free, the index of the allocation of the block.
+    // REPLAY_NO_ALLOCATION for allocations and for frees whose allocation
+    // isn't in the trace.
+    uint32* m_allocations;
+    // The number of replay threads
+    uint m_threads;
+    // The indexes of the records of thread 't' are
+    // m_order[m_threadStart[t]...m_threadStart[t+1]-1]
+    uint32 m_threadStart[REPLAY_MAX_THREADS + 1];
+    uint32* m_order;
+    // The peak of the bytes of the live blocks
+    uint32 m_peakLiveBytes;
+    // The number of frees which are not replayed since their allocation isn't
+    // in the trace, plus the allocations whose free was dropped (The block
+    // was allocated again before it was freed).
+    uint m_unknownFrees;
+};
+
+//////////////////////////////////////////////////////////////////////////
+// The replay
+
+/*
+ * Replays the records of a single processor
+ */
+class ReplayThread : public cThreadedClass {
+public:
+    ReplayThread(const ReplayTrace& trace,
+                 SuperiorMemoryManager& manager,
+                 void* volatile* blocks,
+                 uint thread) :
+        m_trace(trace),
+        m_manager(manager),
+        m_blocks(blocks),
+        m_thread(thread),
+        m_failures(0)
+    {
+    }
+
+    uint getFailures() const { return m_failures; }
+
+protected:
+    virtual void run()
+    {
+        for (uint32 i = m_trace.m_threadStart[m_thread];
+             i < m_trace.m_threadStart[m_thread + 1]; i++)
+        {
+            uint32 index = m_trace.m_order[i];
+            const MemoryTraceRecord& record = m_trace.m_records[index];
+            if (record.m_operation == MemoryTraceRecord::OPERATION_ALLOCATE)
+            {
+                void* block = m_manager.allocate(record.m_length);
+                if (block == NULL)
+                {
+                    m_failures++;
+                    block = REPLAY_FAILED;
+                } else
+                {
+                    // Touch the block
+                    *((uint8*)block) = (uint8)record.m_length;
+                }
+                MemoryAtomic::exchangePointer((void**)(m_blocks + index),
+                                              block);
+                continue;
+            }
+
+            uint32 allocation = m_trace.m_allocations[index];
+            if (allocation == REPLAY_NO_ALLOCATION)
+                continue;
+
+            // Wait for the thread of the allocation
+            void* block;
+            while ((block = m_blocks[allocation]) == REPLAY_PENDING)
+                replayYield();
+            m_blocks[allocation] = REPLAY_FAILED;
+            if (block != REPLAY_FAILED)
+                CHECK(m_manager.free(block));
+        }
+    }
+
+private:
+    const ReplayTrace& m_trace;
+    SuperiorMemoryManager& m_manager;
+    void* volatile* m_blocks;
+    uint m_thread;
+    uint m_failures;
+};
+
+/*
+ * The result of a replay
+ */
+struct ReplayResult {
+    uint m_failures;
+    uint m_time;
+    memorySize m_peakFootprint;
+};
+
+/*
+ * Replay 'trace' against a new SuperiorMemoryManager
+ */
+static void replayTrace(const ReplayTrace& trace, ReplayResult& result)
+{
+    uint i;
+    void* volatile* blocks = new void* volatile[trace.m_numberOfRecords + 1];
+    for (i = 0; i < trace.m_numberOfRecords; i++)
+        blocks[i] = REPLAY_PENDING;
+
+    uint8* privatePool =
+        new uint8[SuperiorMemoryManager::DEFAULT_SUPRIOR_MEMORY_PRIVATE_MEM];
+    volatile memorySize footprint = 0;
+    volatile memorySize peakFootprint = 0;
+    SuperiorMemoryManager* manager = new SuperiorMemoryManager(
+        SuperiorOSMemePtr(new TestCountingOSMemory(footprint,
+                                                   &peakFootprint)),
+        SuperiorMemoryManager::INITIALIZE_SIZE_MINIMUM_SIZE,
+        privatePool,
+        SuperiorMemoryManager::DEFAULT_SUPRIOR_MEMORY_PRIVATE_MEM);
+
+    ReplayThread* threads[REPLAY_MAX_THREADS];
+    for (i = 0; i < trace.m_threads; i++)
+        threads[i] = new ReplayThread(trace, *manager, blocks, i);
+
+    cOSDef::systemTime start = cOS::getSystemTime();
+    for (i = 0; i < trace.m_threads; i++)
+        threads[i]->start();
+    for (i = 0; i < trace.m_threads; i++)
+        threads[i]->wait();
+    result.m_time = cOS::calculateTimesDiffMilli(cOS::getSystemTime(), start);
+
+    result.m_failures = 0;
+    for (i = 0; i < trace.m_threads; i++)
+    {
+        result.m_failures+= threads[i]->getFailures();
+        delete threads[i];
+    }
+    result.m_peakFootprint = peakFootprint;
+
+    // Free the blocks whose free isn't in the trace
+    for (i = 0; i < trace.m_numberOfRecords; i++)
+    {
+        if ((trace.m_records[i].m_operation ==
+                MemoryTraceRecord::OPERATION_ALLOCATE) &&
+            (blocks[i] != REPLAY_FAILED) && (blocks[i] != REPLAY_PENDING))
+            CHECK(manager->free(blocks[i]));
+    }
+
+    delete manager;
+    delete[] privatePool;
+    delete[] blocks;
+}
+
+/*
+ * Load the trace file 'filename', replay it and print the result
+ */
+void replayMemoryTrace(const char* filename)
+{
+    ReplayTrace trace;
+    trace.load(filename);
+    trace.prepare();
+
+    ReplayResult result;
+    replayTrace(trace, result);
+
+    char footprint[24];
+    uint time = (result.m_time == 0) ? 1 : result.m_time;
+    cout << "tracereplay,records,threads,failures,time_ms,ops_per_second,"
+            "peak_footprint_bytes,peak_live_bytes,dropped_records" << endl;
+    cout << "tracereplay," << trace.m_numberOfRecords << ","
+         << trace.m_threads << "," << result.m_failures << ","
+         << result.m_time << ","
+         << (uint)(((uint64)trace.m_numberOfRecords * 1000) / time) << ","
+         << formatMemorySize(result.m_peakFootprint, footprint) << ","
+         << trace.m_peakLiveBytes << ","
+         << trace.m_droppedRecords << endl;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Tests
+
+#define TRACE_TEST_FILENAME "testMemoryTrace.mtrc"
+#define TRACE_STRESS_RECORDS (20000)
+#define TRACE_STRESS_THREADS (4)
+
+/*
+ * A recorder and it's ring
+ */
+class TestTraceRecorder {
+public:
+    TestTraceRecorder(uint records) :
+        m_buffer(new uint8[records * MemoryTraceRecorder::BYTES_PER_RECORD])
+    {
+        m_recorder.setBuffer(m_buffer,
+                             records * MemoryTraceRecorder::BYTES_PER_RECORD);
+    }
+
+    ~TestTraceRecorder()
+    {
+        delete[] m_buffer;
+    }
+
+    MemoryTraceRecorder m_recorder;
+
+private:
+    uint8* m_buffer;
+};
+
+/*
+ * Records allocations of an increasing length
+ */
+class TraceStressThread : public cThreadedClass {
+public:
+    TraceStressThread(MemoryTraceRecorder& recorder,
+                      volatile uint32& finished,
+                      uint id) :
+        m_recorder(recorder),
+        m_finished(finished),
+        m_id(id)
+    {
+    }
+
+protected:
+    virtual void run()
+    {
+        for (uint i = 0; i < TRACE_STRESS_RECORDS; i++)
+            m_recorder.recordAllocation((void*)((m_id + 1) * 8), i);
+        MemoryAtomic::increment(&m_finished);
+    }
+
+private:
+    MemoryTraceRecorder& m_recorder;
+    volatile uint32& m_finished;
+    uint m_id;
+};
+
+/*
+ * Allocates and frees blocks of a SuperiorMemoryManager, and records the
+ * operations
+ */
+class TraceWorkloadThread : public cThreadedClass {
+public:
+    enum { SLOTS = 64, OPERATIONS = 20000 };
+
+    TraceWorkloadThread(MemoryTraceRecorder& recorder,
+                        SuperiorMemoryManager& manager,
+                        volatile uint32& finished,
+                        uint id) :
+        m_recorder(recorder),
+        m_manager(manager),
+        m_finished(finished),
+        m_seed(id * 7919 + 1)
+    {
+    }
+
+protected:
+    virtual void run()
+    {
+        void* blocks[SLOTS];
+        uint i;
+        for (i = 0; i < SLOTS; i++)
+            blocks[i] = NULL;
+
+        for (i = 0; i < OPERATIONS; i++)
+        {
+            uint slot = random() % SLOTS;
+            if (blocks[slot] != NULL)
+            {
+                m_recorder.recordFree(blocks[slot]);
+                CHECK(m_manager.free(blocks[slot]));
+                blocks[slot] = NULL;
+            } else
+            {
+                uint length = 8 + (random() % 512);
+                blocks[slot] = m_manager.allocate(length);
+                CHECK(blocks[slot] != NULL);
+                m_recorder.recordAllocation(blocks[slot], length);
+            }
+        }
+
+        // The frees of half of the blocks are not recorded. They are left for
+        // the end of the replay.
+        for (i = 0; i < SLOTS; i++)
+        {
+            if (blocks[i] != NULL)
+            {
+                if ((i % 2) == 0)
+                    m_recorder.recordFree(blocks[i]);
+                CHECK(m_manager.free(blocks[i]));
+            }
+        }
+        MemoryAtomic::increment(&m_finished);
+    }
+
+private:
+    uint random()
+    {
+        m_seed = m_seed * 1103515245 + 12345;
+        return (m_seed >> 16) & 0x7FFF;
+    }
+
+    MemoryTraceRecorder& m_recorder;
+    SuperiorMemoryManager& m_manager;
+    volatile uint32& m_finished;
+    uint32 m_seed;
+};
+
+/*
+ * Test the order and the content of the records
+ */
+static void testTraceRecords()
+{
+    TestTraceRecorder test(16);
+    MemoryTraceRecorder& recorder = test.m_recorder;
+    cSmartPtr<MemoryTraceDump> dump(new MemoryTraceDump);
+    CHECK(recorder.getCapacity() == 16);
+
+    // A stopped recorder doesn't record
+    recorder.recordAllocation((void*)0x1000, 10);
+    CHECK(recorder.drain(*dump) == 0);
+    CHECK(dump->m_header.m_magic == MemoryTraceHeader::MAGIC);
+    CHECK(dump->m_header.m_version == MemoryTraceHeader::VERSION);
+    CHECK(dump->m_header.m_numberOfRecords == 0);
+
+    CHECK(recorder.start());
+    CHECK(recorder.isEnabled());
+    recorder.recordAllocation((void*)0x1000, 10);
+    recorder.recordAllocation((void*)0x2000, 20);
+    recorder.recordFree((void*)0x1000);
+    recorder.stop();
+    recorder.recordFree((void*)0x2000);
+
+    CHECK(recorder.drain(*dump) == 3);
+    CHECK(dump->m_header.m_numberOfRecords == 3);
+    CHECK(dump->m_header.m_droppedRecords == 0);
+    CHECK(dump->m_records[0].m_blockId == (0x1000 >> 3));
+    CHECK(dump->m_records[0].m_length == 10);
+    CHECK(dump->m_records[0].m_operation ==
+          MemoryTraceRecord::OPERATION_ALLOCATE);
+    CHECK(dump->m_records[1].m_blockId == (0x2000 >> 3));
+    CHECK(dump->m_records[1].m_length == 20);
+    CHECK(dump->m_records[2].m_blockId == (0x1000 >> 3));
+    CHECK(dump->m_records[2].m_length == 0);
+    CHECK(dump->m_records[2].m_operation == MemoryTraceRecord::OPERATION_FREE);
+    CHECK(dump->m_records[0].m_processor == dump->m_records[2].m_processor);
+    CHECK(dump->m_records[0].m_time <= dump->m_records[2].m_time);
+    CHECK(recorder.drain(*dump) == 0);
+}
+
+/*
+ * Test that a full ring drops the new records, and recovers after a drain
+ */
+static void testTraceOverflow()
+{
+    TestTraceRecorder test(16);
+    MemoryTraceRecorder& recorder = test.m_recorder;
+    cSmartPtr<MemoryTraceDump> dump(new MemoryTraceDump);
+    CHECK(recorder.start());
+
+    uint i;
+    for (i = 0; i < 20; i++)
+        recorder.recordAllocation((void*)((i + 1) * 8), i);
+    CHECK(recorder.getDroppedRecords() == 4);
+
+    // The oldest records are kept
+    CHECK(recorder.drain(*dump) == 16);
+    CHECK(dump->m_header.m_droppedRecords == 4);
+    for (i = 0; i < 16; i++)
+        CHECK(dump->m_records[i].m_length == i);
+
+    for (i = 0; i < 10; i++)
+        recorder.recordAllocation((void*)((i + 1) * 8), 100 + i);
+    CHECK(recorder.drain(*dump) == 10);
+    CHECK(dump->m_records[9].m_length == 109);
+    CHECK(recorder.getDroppedRecords() == 4);
+
+    // A drain is limited to a single dump
+    TestTraceRecorder big(8192);
+    CHECK(big.m_recorder.start());
+    for (i = 0; i < 5000; i++)
+        big.m_recorder.recordAllocation((void*)8, i);
+    CHECK(big.m_recorder.drain(*dump) == MemoryTraceDump::MAX_RECORDS);
+    CHECK(big.m_recorder.drain(*dump) == 5000 - MemoryTraceDump::MAX_RECORDS);
+    CHECK(dump->m_records[0].m_length == MemoryTraceDump::MAX_RECORDS);
+}
+
+/*
+ * Drain the records of several producers while they are recording. Each
+ * producer records increasing lengths, which must be drained in order.
+ */
+static void testTraceStress()
+{
+    TestTraceRecorder test(1024);
+    MemoryTraceRecorder& recorder = test.m_recorder;
+    cSmartPtr<MemoryTraceDump> dump(new MemoryTraceDump);
+    CHECK(recorder.start());
+
+    TraceStressThread* threads[TRACE_STRESS_THREADS];
+    volatile uint32 finished = 0;
+    uint i;
+    for (i = 0; i < TRACE_STRESS_THREADS; i++)
+        threads[i] = new TraceStressThread(recorder, finished, i);
+    for (i = 0; i < TRACE_STRESS_THREADS; i++)
+        threads[i]->start();
+
+    // The last length of each producer, by it's block
+    int32 lastLength[TRACE_STRESS_THREADS + 1];
+    for (i = 0; i <= TRACE_STRESS_THREADS; i++)
+        lastLength[i] = -1;
+    uint total = 0;
+    while (true)
+    {
+        // Test the producers before the drain, so their last records are
+        // drained
+        bool isFinished = (finished == TRACE_STRESS_THREADS);
+        uint count = recorder.drain(*dump);
+        for (uint j = 0; j < count; j++)
+        {
+            const MemoryTraceRecord& record = dump->m_records[j];
+            CHECK((record.m_blockId >= 1) &&
+                  (record.m_blockId <= TRACE_STRESS_THREADS));
+            CHECK((int32)record.m_length > lastLength[record.m_blockId]);
+            lastLength[record.m_blockId] = record.m_length;
+        }
+        total+= count;
+
+        if (count == 0)
+        {
+            if (isFinished)
+                break;
+            replayYield();
+        }
+    }
+
+    for (i = 0; i < TRACE_STRESS_THREADS; i++)
+    {
+        threads[i]->wait();
+        delete threads[i];
+    }
+    CHECK(total + recorder.getDroppedRecords() ==
+          TRACE_STRESS_THREADS * TRACE_STRESS_RECORDS);
+}
+
+/*
+ * Record a workload into a trace file and replay it
+ */
+static void testTraceReplay()
+{
+    TestTraceRecorder test(1 << 16);
+    MemoryTraceRecorder& recorder = test.m_recorder;
+    cSmartPtr<MemoryTraceDump> dump(new MemoryTraceDump);
+    CHECK(recorder.start());
+
+    // Recorded blocks which are not in the trace are ignored by the replay
+    recorder.recordFree((void*)0x10);
+
+    uint8* privatePool =
+        new uint8[SuperiorMemoryManager::DEFAULT_SUPRIOR_MEMORY_PRIVATE_MEM];
+    volatile memorySize footprint = 0;
+    volatile memorySize peakFootprint = 0;
+    SuperiorMemoryManager* manager = new SuperiorMemoryManager(
+        SuperiorOSMemePtr(new TestCountingOSMemory(footprint,
+                                                   &peakFootprint)),
+        SuperiorMemoryManager::INITIALIZE_SIZE_MINIMUM_SIZE,
+        privatePool,
+        SuperiorMemoryManager::DEFAULT_SUPRIOR_MEMORY_PRIVATE_MEM);
+
+    FILE* file = fopen(TRACE_TEST_FILENAME, "wb");
+    CHECK(file != NULL);
+    uint records = appendTrace(recorder, *dump, file);
+    TraceWorkloadThread* threads[2];
+    volatile uint32 finished = 0;
+    uint i;
+    for (i = 0; i < 2; i++)
+    {
+        threads[i] = new TraceWorkloadThread(recorder, *manager, finished, i);
+        threads[i]->start();
+    }
+    while (finished != 2)
+    {
+        records+= appendTrace(recorder, *dump, file);
+        replayYield();
+    }
+    for (i = 0; i < 2; i++)
+    {
+        threads[i]->wait();
+        delete threads[i];
+    }
+    records+= appendTrace(recorder, *dump, file);
+    fclose(file);
+    recorder.stop();
+    CHECK(recorder.getDroppedRecords() == 0);
+
+    delete manager;
+    delete[] privatePool;
+
+    ReplayTrace trace;
+    trace.load(TRACE_TEST_FILENAME);
+    CHECK(trace.m_numberOfRecords == records);
+    CHECK(trace.m_droppedRecords == 0);
+    trace.prepare();
+    // The free of 0x10. The blocks which were left allocated are freed by
+    // the replay.
+    CHECK(trace.m_unknownFrees == 1);
+    CHECK(trace.m_threads >= 2);
+    CHECK(trace.m_peakLiveBytes > 0);
+
+    // Each free follows it's allocation
+    uint frees = 0;
+    for (i = 0; i < trace.m_numberOfRecords; i++)
+    {
+        if (trace.m_allocations[i] == REPLAY_NO_ALLOCATION)
+            continue;
+        CHECK(trace.m_allocations[i] < i);
+        CHECK(trace.m_records[trace.m_allocations[i]].m_blockId ==
+              trace.m_records[i].m_blockId);
+        frees++;
+    }
+    CHECK(frees > 0);
+
+    ReplayResult result;
+    replayTrace(trace, result);
+    CHECK(result.m_failures == 0);
+    CHECK(result.m_peakFootprint >= trace.m_peakLiveBytes);
+
+    replayMemoryTrace(TRACE_TEST_FILENAME);
+    remove(TRACE_TEST_FILENAME);
+}
+
+void testMemoryTrace()
+{
+    cout << "Testing memory trace recorder..." << endl;
+    testTraceRecords();
+    testTraceOverflow();
+    testTraceStress();
+    testTraceReplay();
+    cout << "Memory trace recorder OK" << endl;
+}
@@ -0,0 +1,122 @@
+/*
+ * Copyright (c) 2008-2016, Integrity Project Ltd. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * Neither the name of the Integrity Project nor the names of its contributors
+ * may be used to endorse or promote products derived from this software
+ * without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE
+ */
+
+#ifndef __TBA_TESTMEMORY_TESTOSMEMORY_H
+#define __TBA_TESTMEMORY_TESTOSMEMORY_H
+
+/*
+ * TestOSMemory.h
+ *
+ * The operating system memory of the SuperiorMemoryManager tests
+ */
+#include "xStl/types.h"
+#include "xStl/os/lock.h"
+#include "xdk/memory/MemoryLockableObject.h"
+#include "xdk/memory/MemorySuperblockHeapManager.h"
+#include "xdk/memory/SuperiorMemoryManagerInterface.h"
+
+/*
+ * Superblocks which are allocated from the C++ heap
+ */
+class TestOSMemory : public SuperiorMemoryManagerInterface {
+public:
+    virtual uint getSuperblockPageAlignment() {
+        return 1;
+    }
+
+    virtual void* allocateNewSuperblock(uint length) {
+        return new uint8[length];
+    }
+
+    virtual void freeSuperblock(void* pointer) {
+        delete [] (uint8*)pointer;
+    }
+};
+
+/*
+ * Superblocks which are allocated from the C++ heap. The number of bytes
+ * which are held is kept in 'footprint', and it's peak in 'peakFootprint'
+ * (Optional).
+ */
+class TestCountingOSMemory : public TestOSMemory {
+public:
+    TestCountingOSMemory(volatile memorySize& footprint,
+                         volatile memorySize* peakFootprint = NULL) :
+        m_footprint(footprint),
+        m_peakFootprint(peakFootprint)
+    {
+    }
+
+    virtual void* allocateNewSuperblock(uint length) {
+        // Keep the length for the free
+        uint8* ret = new uint8[length + sizeof(uint64)];
+        *((uint*)ret) = length;
+
+        cLock lock(m_lock);
+        m_footprint+= length;
+        if ((m_peakFootprint != NULL) && (m_footprint > *m_peakFootprint))
+            *m_peakFootprint = m_footprint;
+        return ret + sizeof(uint64);
+    }
+
+    virtual void freeSuperblock(void* pointer) {
+        uint8* block = ((uint8*)pointer) - sizeof(uint64);
+        {
+            cLock lock(m_lock);
+            m_footprint-= *((uint*)block);
+        }
+        delete [] block;
+    }
+
+private:
+    // Protects the counters
+    MemoryLockableObject m_lock;
+    volatile memorySize& m_footprint;
+    volatile memorySize* m_peakFootprint;
+};
+
+/*
+ * Write 'value' in decimal into 'buffer' and return it. Byte counters above
+ * 4gb cannot be written as 'uint'.
+ */
+inline const char* formatMemorySize(memorySize value, char (&buffer)[24])
+{
+    char* position = buffer + sizeof(buffer) - 1;
+    *position = 0;
+    do {
+        position--;
+        *position = (char)('0' + (value % 10));
+        value/= 10;
+    } while (value != 0);
+    return position;
+}
+
+#endif // __TBA_TESTMEMORY_TESTOSMEMORY_H
@@ -0,0 +1,345 @@
+/*
+ * Copyright (c) 2008-2016, Integrity Project Ltd. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * Neither the name of the Integrity Project nor the names of its contributors
+ * may be used to endorse or promote products derived from this software
+ * without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE
+ */
+
+
+
+
+
+/*
+ * TestObjectPool.cpp
+ *
+ * Implementation file
+ */
+#include "xStl/types.h"
+#include "xStl/os/os.h"
+#include "xStl/os/threadedClass.h"
+#include "xStl/data/char.h"
+#include "xStl/except/trace.h"
+#include "xStl/stream/iostream.h"
+#include "xStl/except/exception.h"
+#include "xdk/memory/ObjectPool.h"
+#include "xdk/memory/SmallMemoryHeapManager.h"
+#include "xdk/memory/SuperiorMemoryManager.h"
+#include "TestOSMemory.h"
+
+/*
+ * A list node. 24 bytes on 64-bit platforms, 12 bytes on 32-bit platforms.
+ */
+struct PoolNode {
+    PoolNode* m_next;
+    void* m_data;
+    uint32 m_tag;
+};
+
+void objectPoolBasicTest()
+{
+    #define POOL_OBJECTS (1000)
+
+    uint superblockLength = 256*1024;
+    uint8* superblockBuffer = new uint8[superblockLength];
+    SmallMemoryHeapManager heap(superblockBuffer, superblockLength, 16);
+
+    // The objects are long enough for the free list, and aligned
+    {
+        MemorySlabPool tiny(heap, 1);
+        CHECK(tiny.getObjectLength() == 8);
+        MemorySlabPool odd(heap, 13);
+        CHECK(odd.getObjectLength() == 16);
+        CHECK(tiny.getNumberOfSlabs() == 0);
+        CHECK(heap.getNumberOfAllocatedBytes() == 0);
+    }
+
+    {
+        ObjectPool<PoolNode> pool(heap, 64);
+        CHECK(pool.getObjectLength() >= sizeof(PoolNode));
+        PoolNode* nodes[POOL_OBJECTS];
+        uint i;
+        for (uint round = 0; round < 2; round++)
+        {
+            for (i = 0; i < POOL_OBJECTS; i++)
+            {
+                nodes[i] = pool.allocate();
+                CHECK(nodes[i] != NULL);
+                CHECK((getNumeric(nodes[i]) & 7) == 0);
+                nodes[i]->m_next = NULL;
+                nodes[i]->m_data = nodes[i];
+                nodes[i]->m_tag = i;
+            }
+            CHECK(pool.getNumberOfObjects() == POOL_OBJECTS);
+            // The slabs are allocated once, and reused by the second round
+            CHECK(pool.getNumberOfSlabs() == (POOL_OBJECTS + 63) / 64);
+
+            // The objects don't overlap
+            for (i = 0; i < POOL_OBJECTS; i++)
+            {
+                CHECK(nodes[i]->m_data == nodes[i]);
+                CHECK(nodes[i]->m_tag == i);
+                CHECK(pool.isOwner(nodes[i]));
+            }
+            CHECK(!pool.isOwner(((uint8*)nodes[0]) + 1));
+
+            for (i = 0; i < POOL_OBJECTS; i++)
+                pool.free(nodes[(i * 7) % POOL_OBJECTS]);
+            CHECK(pool.getNumberOfObjects() == 0);
+        }
+
+        // A foreign pointer
+        PoolNode foreign;
+        CHECK(!pool.isOwner(&foreign));
+        CHECK(heap.getNumberOfAllocatedBytes() > 0);
+    }
+
+    // The destructor returns the slabs
+    CHECK(heap.getNumberOfAllocatedBytes() == 0);
+
+    delete[] superblockBuffer;
+}
+
+void objectPoolExhaustedTest()
+{
+    #define EXHAUSTED_SUPERBLOCK (16*1024)
+
+    uint superblockLength = EXHAUSTED_SUPERBLOCK;
+    uint8* superblockBuffer = new uint8[superblockLength];
+    SmallMemoryHeapManager heap(superblockBuffer, superblockLength, 16);
+
+    {
+        // Slabs of 1kb
+        MemorySlabPool pool(heap, 64, 16);
+        void* objects[EXHAUSTED_SUPERBLOCK / 64];
+        uint count = 0;
+        while (count < (superblockLength / 64))
+        {
+            objects[count] = pool.allocate();
+            if (objects[count] == NULL)
+                break;
+            count++;
+        }
+        CHECK(count < (superblockLength / 64));
+        CHECK(count >= (pool.getNumberOfSlabs() * 16));
+        CHECK(count > 0);
+
+        // Freed objects can be allocated again, without touching the heap
+        uint slabs = pool.getNumberOfSlabs();
+        for (uint i = 0; i < count; i++)
+            pool.free(objects[i]);
+        CHECK(pool.getNumberOfObjects() == 0);
+        void* object = pool.allocate();
+        CHECK(object != NULL);
+        CHECK(pool.getNumberOfSlabs() == slabs);
+        pool.free(object);
+    }
+    CHECK(heap.getNumberOfAllocatedBytes() == 0);
+
+    delete[] superblockBuffer;
+}
+
+#define POOL_STRESS_THREADS (8)
+#define POOL_STRESS_ITERATIONS (200000)
+#define POOL_STRESS_SLOTS (256)
+
+/*
+ * Allocates and frees objects of a shared pool. The content of each object
+ * is verified before it's freed.
+ */
+class ObjectPoolStressThread : public cThreadedClass {
+public:
+    ObjectPoolStressThread(ObjectPool<PoolNode>& pool, uint id) :
+        m_pool(pool),
+        m_id(id),
+        m_seed(id),
+        m_succeeded(true)
+    {
+    }
+
+    bool isSucceeded() const { return m_succeeded; }
+
+protected:
+    virtual void run()
+    {
+        PoolNode* nodes[POOL_STRESS_SLOTS];
+        uint i;
+        for (i = 0; i < POOL_STRESS_SLOTS; i++)
+            nodes[i] = NULL;
+
+        for (i = 0; i < POOL_STRESS_ITERATIONS; i++)
+        {
+            uint slot = random() % POOL_STRESS_SLOTS;
+            if (nodes[slot] != NULL)
+            {
+                m_succeeded&= verify(nodes[slot], slot);
+                m_pool.free(nodes[slot]);
+                nodes[slot] = NULL;
+            } else
+            {
+                nodes[slot] = m_pool.allocate();
+                if (nodes[slot] == NULL)
+                {
+                    m_succeeded = false;
+                    continue;
+                }
+                nodes[slot]->m_next = nodes[slot];
+                nodes[slot]->m_data = this;
+                nodes[slot]->m_tag = slot;
+            }
+        }
+
+        for (i = 0; i < POOL_STRESS_SLOTS; i++)
+        {
+            if (nodes[i] != NULL)
+            {
+                m_succeeded&= verify(nodes[i], i);
+                m_pool.free(nodes[i]);
+            }
+        }
+    }
+
+private:
+    bool verify(PoolNode* node, uint slot)
+    {
+        return (node->m_next == node) && (node->m_data == this) &&
+               (node->m_tag == slot);
+    }
+
+    // Thread-safe linear congruential generator
+    uint random()
+    {
+        m_seed = m_seed * 1103515245 + 12345;
+        return (m_seed >> 16) & 0x7FFF;
+    }
+
+    ObjectPool<PoolNode>& m_pool;
+    uint m_id;
+    uint32 m_seed;
+    bool m_succeeded;
+};
+
+void objectPoolStressTest()
+{
+    uint superblockLength = 1024*1024;
+    uint8* superblockBuffer = new uint8[superblockLength];
+    SmallMemoryHeapManager heap(superblockBuffer, superblockLength, 16);
+
+    {
+        ObjectPool<PoolNode> pool(heap);
+        ObjectPoolStressThread* threads[POOL_STRESS_THREADS];
+        uint i;
+        for (i = 0; i < POOL_STRESS_THREADS; i++)
+            threads[i] = new ObjectPoolStressThread(pool, i * 37 + 1);
+        for (i = 0; i < POOL_STRESS_THREADS; i++)
+            threads[i]->start();
+        for (i = 0; i < POOL_STRESS_THREADS; i++)
+            threads[i]->wait();
+        for (i = 0; i < POOL_STRESS_THREADS; i++)
+        {
+            CHECK(threads[i]->isSucceeded());
+            delete threads[i];
+        }
+
+        // All objects are back. The caches don't hold more than a few slabs.
+        CHECK(pool.getNumberOfObjects() == 0);
+        CHECK(pool.getNumberOfSlabs() * pool.getObjectLength() <=
+              (POOL_STRESS_THREADS * POOL_STRESS_SLOTS + 512) *
+              pool.getObjectLength() + MemorySlabPool::DEFAULT_SLAB_LENGTH);
+    }
+    CHECK(heap.getNumberOfAllocatedBytes() == 0);
+
+    delete[] superblockBuffer;
+}
+
+void testObjectPool()
+{
+    objectPoolBasicTest();
+    objectPoolExhaustedTest();
+    objectPoolStressTest();
+}
+
+//////////////////////////////////////////////////////////////////////////
+
+#define POOL_BENCHMARK_ROUNDS (20000)
+#define POOL_BENCHMARK_OBJECTS (500)
+
+/*
+ * Compares list nodes which are allocated by the heap, to the same nodes
+ * inside a pool of their own.
+ */
+void benchmarkObjectPool()
+{
+    uint privatePoolLength =
+        SuperiorMemoryManager::DEFAULT_SUPRIOR_MEMORY_PRIVATE_MEM;
+    uint8* privatePool = new uint8[privatePoolLength];
+
+    SuperiorMemoryManager* memmanager = new SuperiorMemoryManager(
+        SuperiorOSMemePtr(new TestOSMemory()),
+        8*1024*1024,
+        privatePool,
+        privatePoolLength);
+
+    PoolNode* nodes[POOL_BENCHMARK_OBJECTS];
+    uint i, j;
+
+    cOSDef::systemTime start = cOS::getSystemTime();
+    for (i = 0; i < POOL_BENCHMARK_ROUNDS; i++)
+    {
+        for (j = 0; j < POOL_BENCHMARK_OBJECTS; j++)
+        {
+            nodes[j] = (PoolNode*)memmanager->allocate(sizeof(PoolNode));
+            CHECK(nodes[j] != NULL);
+        }
+        for (j = 0; j < POOL_BENCHMARK_OBJECTS; j++)
+            CHECK(memmanager->free(nodes[j], sizeof(PoolNode)));
+    }
+    uint heapTime = cOS::calculateTimesDiffMilli(cOS::getSystemTime(), start);
+
+    uint slabs;
+    start = cOS::getSystemTime();
+    {
+        ObjectPool<PoolNode> pool(*memmanager);
+        for (i = 0; i < POOL_BENCHMARK_ROUNDS; i++)
+        {
+            for (j = 0; j < POOL_BENCHMARK_OBJECTS; j++)
+            {
+                nodes[j] = pool.allocate();
+                CHECK(nodes[j] != NULL);
+            }
+            for (j = 0; j < POOL_BENCHMARK_OBJECTS; j++)
+                pool.free(nodes[j]);
+        }
+        slabs = pool.getNumberOfSlabs();
+    }
+    uint poolTime = cOS::calculateTimesDiffMilli(cOS::getSystemTime(), start);
+
+    cout << "List nodes: heap (sized free) " << heapTime << "ms  pool "
+         << poolTime << "ms (" << slabs << " slabs)" << endl;
+
+    delete memmanager;
+    delete[] privatePool;
+}
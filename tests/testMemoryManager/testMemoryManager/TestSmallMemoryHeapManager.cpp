@@ -37,6 +37,8 @@
  * Author: Elad Raz <e@eladraz.com>
  */
 #include "xStl/types.h"
+#include "xStl/os/os.h"
+#include "xStl/os/threadedClass.h"
 #include "xStl/data/char.h"
 #include "xStl/except/trace.h"
 #include "xStl/stream/iostream.h"
@@ -73,8 +75,189 @@ void simpleOverrunTest()
     CHECK(newManager.allocate(17) == NULL);
     CHECK(newManager.allocate(16) == NULL);
 
-    // Allocating two blocks here will decline since the memory is defragment.
-    // TODO for future works
+    // The two free blocks are merged
+    x = newManager.allocate(12); CHECK(x != NULL);
+    CHECK(newManager.free(x));
+    CHECK(!newManager.free(x));
+}
+
+void coalescingTest()
+{
+    #define COALESCING_BLOCKS (64)
+    uint superblockLength = COALESCING_BLOCKS * 16;
+    uint8* superblockBuffer = new uint8[superblockLength];
+
+    for (uint round = 0; round < 2; round++)
+    {
+        SmallMemoryHeapManager newManager(superblockBuffer,
+                                          superblockLength,
+                                          16,
+                                          round == 0);
+
+        // Fill the superblock with single blocks
+        void* blocks[COALESCING_BLOCKS];
+        uint i;
+        for (i = 0; i < COALESCING_BLOCKS; i++)
+        {
+            blocks[i] = newManager.allocate(12);
+            CHECK(blocks[i] != NULL);
+        }
+        CHECK(newManager.allocate(1) == NULL);
+
+        // Free the odd blocks, and then the even ones in reverse order. Every
+        // free merges both neighbours. The first and the last blocks are
+        // kept.
+        for (i = 1; i < (COALESCING_BLOCKS - 1); i+= 2)
+            CHECK(newManager.free(blocks[i]));
+        CHECK(newManager.allocate(28) == NULL);
+        for (i = COALESCING_BLOCKS - 2; i > 0; i-= 2)
+            CHECK(newManager.free(blocks[i]));
+
+        // The whole superblock, except the first and last blocks, is a single
+        // run
+        void* x = newManager.allocate((COALESCING_BLOCKS - 2) * 16 - 4);
+        CHECK(x == blocks[1]);
+        CHECK(newManager.allocate(1) == NULL);
+        CHECK(newManager.free(x));
+        CHECK(newManager.free(blocks[0]));
+        CHECK(newManager.free(blocks[COALESCING_BLOCKS - 1]));
+        CHECK(newManager.getNumberOfAllocatedBytes() == 0);
+
+        // And everything is free again
+        x = newManager.allocate(COALESCING_BLOCKS * 16 - 4);
+        CHECK(x != NULL);
+        CHECK(newManager.free(x));
+    }
+
+    delete[] superblockBuffer;
+}
+
+void mixedSizesRandomTest()
+{
+    uint superblockLength = 1024*1024;
+    uint8* superblockBuffer = new uint8[superblockLength];
+
+    SmallMemoryHeapManager newManager(superblockBuffer,
+        superblockLength,
+        16);
+    TestSuperBlock test(newManager, cout, 1, 1000);
+    test.test();
+
+    delete[] superblockBuffer;
+}
+
+void lazyFormatTest()
+{
+    uint superblockLength = 64; // 8 units
+    uint8* superblockBuffer = new uint8[superblockLength];
+    // The constructor mustn't touch the superblock
+    memset(superblockBuffer, 0xCC, superblockLength);
+
+    SmallMemoryHeapManager newManager(superblockBuffer,
+                                      superblockLength,
+                                      8);
+    for (uint i = 0; i < superblockLength; i++)
+        CHECK(superblockBuffer[i] == 0xCC);
+
+    // Blocks are handed out by order
+    void* x = newManager.allocate(4);  CHECK(x == superblockBuffer + 4);
+    void* y = newManager.allocate(12); CHECK(y == superblockBuffer + 12);
+    void* z = newManager.allocate(4);  CHECK(z == superblockBuffer + 28);
+
+    // The last blocks are returned to the untouched area
+    CHECK(newManager.free(z));
+    z = newManager.allocate(36); CHECK(z == superblockBuffer + 28);
+    CHECK(newManager.allocate(1) == NULL);
+
+    // Other blocks are returned to the free list
+    CHECK(newManager.free(x));
+    CHECK(newManager.allocate(1) == x);
+    CHECK(newManager.free(x));
+    CHECK(newManager.free(y));
+    CHECK(newManager.free(z));
+    CHECK(newManager.getNumberOfAllocatedBytes() == 0);
+
+    delete[] superblockBuffer;
+}
+
+void inPlaceExpansionTest()
+{
+    uint superblockLength = 128; // 16 units
+    uint8* superblockBuffer = new uint8[superblockLength];
+
+    SmallMemoryHeapManager newManager(superblockBuffer,
+                                      superblockLength,
+                                      8);
+    uint8* x = (uint8*)newManager.allocate(4);  CHECK(x == superblockBuffer + 4);
+    uint8* y = (uint8*)newManager.allocate(12); CHECK(y == superblockBuffer + 12);
+    uint8* z = (uint8*)newManager.allocate(4);  CHECK(z == superblockBuffer + 28);
+    memset(x, 0xA5, 4);
+    memset(z, 0x5A, 4);
+
+    // The last run grows into the untouched blocks
+    CHECK(newManager.tryExpandInPlace(z, 20));
+    CHECK(newManager.getBlockLength(z) == 20);
+    CHECK((z[0] == 0x5A) && (z[3] == 0x5A));
+
+    // The next run is allocated
+    CHECK(!newManager.tryExpandInPlace(x, 12));
+    CHECK(newManager.getBlockLength(x) == 4);
+
+    // The next free run is split, and then taken completely
+    CHECK(newManager.free(y));
+    CHECK(newManager.tryExpandInPlace(x, 12));
+    CHECK(newManager.getBlockLength(x) == 12);
+    CHECK(newManager.tryExpandInPlace(x, 20));
+    CHECK(newManager.getBlockLength(x) == 20);
+    CHECK(!newManager.tryExpandInPlace(x, 28));
+    CHECK((x[0] == 0xA5) && (x[3] == 0xA5));
+    CHECK(newManager.getNumberOfAllocatedBytes() == 48);
+
+    // The next block is inside the quick list
+    void* w = newManager.allocate(4); CHECK(w == superblockBuffer + 52);
+    void* v = newManager.allocate(4); CHECK(v == superblockBuffer + 60);
+    CHECK(newManager.free(v));
+    CHECK(newManager.tryExpandInPlace(w, 12));
+    CHECK(newManager.getBlockLength(w) == 12);
+
+    // Invalid blocks and lengths
+    CHECK(!newManager.tryExpandInPlace(superblockBuffer + 5, 12));
+    CHECK(!newManager.tryExpandInPlace(z, superblockLength));
+
+    // A block which cannot grow is moved
+    uint8* newX = (uint8*)newManager.reallocate(x, 28);
+    CHECK(newX == superblockBuffer + 68);
+    CHECK((newX[0] == 0xA5) && (newX[3] == 0xA5));
+    CHECK(newManager.reallocate(newX, 12) == newX);
+    CHECK(newManager.reallocate(newX, superblockLength) == NULL);
+
+    CHECK(newManager.free(newX));
+    CHECK(newManager.free(w));
+    CHECK(newManager.free(z));
+    CHECK(newManager.getNumberOfAllocatedBytes() == 0);
+
+    // NULL blocks are allocated, empty blocks are freed
+    x = (uint8*)newManager.reallocate(NULL, 4);
+    CHECK(x != NULL);
+    CHECK(newManager.reallocate(x, 0) == NULL);
+    CHECK(newManager.getNumberOfAllocatedBytes() == 0);
+
+    delete[] superblockBuffer;
+}
+
+void eagerFormatRandomTest()
+{
+    uint superblockLength = 1024*1024;
+    uint8* superblockBuffer = new uint8[superblockLength];
+
+    SmallMemoryHeapManager newManager(superblockBuffer,
+        superblockLength,
+        16,
+        false);
+    TestSuperBlock test(newManager, cout, 8, 12);
+    test.test();
+
+    delete[] superblockBuffer;
 }
 
 void simpleRandomTest()
@@ -92,8 +275,276 @@ void simpleRandomTest()
     delete[] superblockBuffer;
 }
 
+//////////////////////////////////////////////////////////////////////////
+
+#define STRESS_THREADS (8)
+#define STRESS_ITERATIONS (200000)
+#define STRESS_SLOTS (128)
+
+/*
+ * Allocates and frees blocks of a shared manager. Most of the blocks are
+ * single units (The lock-free path), some are longer. The content of each
+ * block is verified before it's freed.
+ */
+class QuickListStressThread : public cThreadedClass {
+public:
+    QuickListStressThread(SmallMemoryHeapManager& manager, uint id) :
+        m_manager(manager),
+        m_id(id),
+        m_seed(id),
+        m_succeeded(true)
+    {
+    }
+
+    bool isSucceeded() const { return m_succeeded; }
+
+protected:
+    virtual void run()
+    {
+        uint8* blocks[STRESS_SLOTS];
+        uint lengths[STRESS_SLOTS];
+        uint i;
+        for (i = 0; i < STRESS_SLOTS; i++)
+            blocks[i] = NULL;
+
+        for (i = 0; i < STRESS_ITERATIONS; i++)
+        {
+            uint slot = random() % STRESS_SLOTS;
+            if (blocks[slot] != NULL)
+            {
+                m_succeeded&= verify(blocks[slot], lengths[slot], slot);
+                m_succeeded&= m_manager.free(blocks[slot]);
+                blocks[slot] = NULL;
+            } else
+            {
+                uint length = ((random() & 7) == 0) ? (random() % 60) + 1 :
+                                                      (random() % 12) + 1;
+                blocks[slot] = (uint8*)m_manager.allocate(length);
+                if (blocks[slot] != NULL)
+                {
+                    lengths[slot] = length;
+                    memset(blocks[slot], (uint8)(m_id + slot), length);
+                }
+            }
+        }
+
+        for (i = 0; i < STRESS_SLOTS; i++)
+        {
+            if (blocks[i] != NULL)
+            {
+                m_succeeded&= verify(blocks[i], lengths[i], i);
+                m_succeeded&= m_manager.free(blocks[i]);
+            }
+        }
+    }
+
+private:
+    bool verify(uint8* block, uint length, uint slot)
+    {
+        for (uint i = 0; i < length; i++)
+            if (block[i] != (uint8)(m_id + slot))
+                return false;
+        return true;
+    }
+
+    // Thread-safe linear congruential generator
+    uint random()
+    {
+        m_seed = m_seed * 1103515245 + 12345;
+        return (m_seed >> 16) & 0x7FFF;
+    }
+
+    SmallMemoryHeapManager& m_manager;
+    uint m_id;
+    uint32 m_seed;
+    bool m_succeeded;
+};
+
+void quickListStressTest()
+{
+    uint superblockLength = 256*1024;
+    uint8* superblockBuffer = new uint8[superblockLength];
+
+    SmallMemoryHeapManager newManager(superblockBuffer,
+                                      superblockLength,
+                                      16);
+
+    QuickListStressThread* threads[STRESS_THREADS];
+    uint i;
+    for (i = 0; i < STRESS_THREADS; i++)
+        threads[i] = new QuickListStressThread(newManager, i * 37 + 1);
+    for (i = 0; i < STRESS_THREADS; i++)
+        threads[i]->start();
+    for (i = 0; i < STRESS_THREADS; i++)
+        threads[i]->wait();
+    for (i = 0; i < STRESS_THREADS; i++)
+    {
+        CHECK(threads[i]->isSucceeded());
+        delete threads[i];
+    }
+
+    // All blocks are back, and they are merged together
+    CHECK(newManager.getNumberOfAllocatedBytes() == 0);
+    void* x = newManager.allocate(superblockLength - 4);
+    CHECK(x != NULL);
+    CHECK(newManager.free(x));
+
+    delete[] superblockBuffer;
+}
+
+#define WIDE_BLOCKS (200000)
+
+/*
+ * Fill a wide superblock, which has more units than a 16 bit index can
+ * address, with single unit blocks. Then merge it back into a single run.
+ */
+void wideHeapTest()
+{
+    CHECK(WIDE_BLOCKS > SmallMemoryHeapManager::MAX_BLOCKS);
+    uint superblockLength = WIDE_BLOCKS * 16;
+    uint8* superblockBuffer = new uint8[superblockLength];
+    void** blocks = new void*[WIDE_BLOCKS];
+
+    WideMemoryHeapManager newManager(superblockBuffer,
+                                     superblockLength,
+                                     16);
+
+    uint i;
+    for (i = 0; i < WIDE_BLOCKS; i++)
+    {
+        blocks[i] = newManager.allocate(8);
+        CHECK(blocks[i] != NULL);
+        // The header of a wide block is 8 bytes long
+        CHECK(newManager.getBlockLength(blocks[i]) == 8);
+    }
+    CHECK(newManager.allocate(1) == NULL);
+    CHECK(newManager.getNumberOfAllocatedBytes() == superblockLength);
+
+    // Free the odd blocks. Only single units are free
+    for (i = 1; i < WIDE_BLOCKS; i+= 2)
+        CHECK(newManager.free(blocks[i]));
+    CHECK(newManager.allocate(24) == NULL);
+
+    // Free the even blocks beyond the 16 bit range, and use the run
+    #define WIDE_RUN_BLOCKS (WIDE_BLOCKS - 0x10001)
+    for (i = 0x10002; i < WIDE_BLOCKS; i+= 2)
+        CHECK(newManager.free(blocks[i]));
+    void* x = newManager.allocate(WIDE_RUN_BLOCKS * 16 - 8);
+    CHECK(x == blocks[0x10001]);
+    CHECK(newManager.getBlockLength(x) == WIDE_RUN_BLOCKS * 16 - 8);
+    CHECK(newManager.free(x));
+
+    // And everything is free again
+    for (i = 0; i <= 0x10000; i+= 2)
+        CHECK(newManager.free(blocks[i]));
+    CHECK(newManager.getNumberOfAllocatedBytes() == 0);
+    x = newManager.allocate(superblockLength - 8);
+    CHECK(x == blocks[0]);
+    CHECK(newManager.free(x));
+
+    delete[] blocks;
+    delete[] superblockBuffer;
+}
+
+//////////////////////////////////////////////////////////////////////////
+
+#define CONTENTION_MAX_THREADS (8)
+#define CONTENTION_ITERATIONS (500000)
+
+/*
+ * Allocates and frees a single unit in a loop, either using the lock-free
+ * path (allocate/free) or the locked path (allocateBlocks/freeBlocks).
+ */
+class ContentionThread : public cThreadedClass {
+public:
+    ContentionThread(SmallMemoryHeapManager& manager, bool isLocked) :
+        m_manager(manager),
+        m_isLocked(isLocked)
+    {
+    }
+
+protected:
+    virtual void run()
+    {
+        for (uint i = 0; i < CONTENTION_ITERATIONS; i++)
+        {
+            if (m_isLocked)
+            {
+                void* block;
+                CHECK(m_manager.allocateBlocks(8, &block, 1) == 1);
+                m_manager.freeBlocks(&block, 1);
+            } else
+            {
+                void* block = m_manager.allocate(8);
+                CHECK(block != NULL);
+                CHECK(m_manager.free(block));
+            }
+        }
+    }
+
+private:
+    SmallMemoryHeapManager& m_manager;
+    bool m_isLocked;
+};
+
+static uint measureContention(SmallMemoryHeapManager& manager,
+                              uint threads,
+                              bool isLocked)
+{
+    ContentionThread* workers[CONTENTION_MAX_THREADS];
+    uint i;
+    for (i = 0; i < threads; i++)
+        workers[i] = new ContentionThread(manager, isLocked);
+
+    cOSDef::systemTime start = cOS::getSystemTime();
+    for (i = 0; i < threads; i++)
+        workers[i]->start();
+    for (i = 0; i < threads; i++)
+        workers[i]->wait();
+    uint time = cOS::calculateTimesDiffMilli(cOS::getSystemTime(), start);
+
+    for (i = 0; i < threads; i++)
+        delete workers[i];
+
+    if (time == 0)
+        time = 1;
+    return threads * CONTENTION_ITERATIONS / time;
+}
+
+/*
+ * Compare the throughput of single unit allocations through the lock-free
+ * path and through the locked path, while the number of threads grows.
+ */
+void benchmarkSmallMemoryHeapManager()
+{
+    uint superblockLength = 64*1024;
+    uint8* superblockBuffer = new uint8[superblockLength];
+
+    SmallMemoryHeapManager newManager(superblockBuffer,
+                                      superblockLength,
+                                      16);
+
+    for (uint threads = 1; threads <= CONTENTION_MAX_THREADS; threads<<= 1)
+    {
+        cout << "Threads: " << threads
+             << "  lock-free pairs/ms: "
+             << measureContention(newManager, threads, false)
+             << "  locked pairs/ms: "
+             << measureContention(newManager, threads, true) << endl;
+    }
+
+    delete[] superblockBuffer;
+}
+
 void testSmallMemoryHeapManager()
 {
     simpleOverrunTest();
+    lazyFormatTest();
+    coalescingTest();
+    inPlaceExpansionTest();
     simpleRandomTest();
+    eagerFormatRandomTest();
+    mixedSizesRandomTest();
+    quickListStressTest();
+    wideHeapTest();
 }
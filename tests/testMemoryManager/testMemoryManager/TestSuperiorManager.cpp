@@ -38,29 +38,45 @@
  */
 #include "xStl/types.h"
 #include "xStl/types.h"
+#include "xStl/os/os.h"
+#include "xStl/os/threadedClass.h"
 #include "xStl/data/char.h"
 #include "xStl/except/trace.h"
 #include "xStl/stream/iostream.h"
 #include "xStl/except/exception.h"
+#include "xdk/memory/MemoryAtomic.h"
+#include "xdk/memory/MemorySizeClass.h"
+#include "xdk/memory/MemoryStatistics.h"
 #include "xdk/memory/SuperiorMemoryManager.h"
-#include "xdk/memory/SuperiorMemoryManagerInterface.h"
 #include "TestSuperBlock.h"
+#include "TestOSMemory.h"
 
 //////////////////////////////////////////////////////////////////////////
 
-class OSMem : public SuperiorMemoryManagerInterface {
+/*
+ * Counts the number of bytes which are held from the operating system
+ */
+class CountingOSMem : public TestOSMemory {
 public:
-    virtual uint getSuperblockPageAlignment() {
-        return 1;
-    }
+    CountingOSMem(uint& footprint) : m_footprint(footprint) {}
 
     virtual void* allocateNewSuperblock(uint length) {
-        return new uint8[length];
+        uint8* ret = new uint8[length + HEADER_SIZE];
+        *((uint*)ret) = length;
+        m_footprint+= length;
+        return ret + HEADER_SIZE;
     }
 
     virtual void freeSuperblock(void* pointer) {
-        delete [] pointer;
+        uint8* header = ((uint8*)pointer) - HEADER_SIZE;
+        m_footprint-= *((uint*)header);
+        delete [] header;
     }
+
+private:
+    // Keeps the alignment of the returned memory
+    enum { HEADER_SIZE = 16 };
+    uint& m_footprint;
 };
 
 //////////////////////////////////////////////////////////////////////////
@@ -72,7 +88,7 @@ void test1()
     uint8* privatePool = new uint8[privatePoolLength];
 
     SuperiorMemoryManager* memmanager = new SuperiorMemoryManager(
-        SuperiorOSMemePtr(new OSMem()),
+        SuperiorOSMemePtr(new TestOSMemory()),
         10*1024*1024,
         privatePool,
         privatePoolLength);
@@ -94,7 +110,7 @@ void testMemoryExpander()
     uint8* privatePool = new uint8[privatePoolLength];
 
     SuperiorMemoryManager* memmanager = new SuperiorMemoryManager(
-        SuperiorOSMemePtr(new OSMem()),
+        SuperiorOSMemePtr(new TestOSMemory()),
         SuperiorMemoryManager::INITIALIZE_SIZE_MINIMUM_SIZE,
         privatePool,
         privatePoolLength);
@@ -137,11 +153,1436 @@ void testMemoryExpander()
     delete[] privatePool;
 }
 
+/*
+ * Test the size class translation. The classes must be contiguous and
+ * increasing, and the compile-time units must match their boundaries.
+ */
+void sizeClassTest()
+{
+    // The first classes
+    CHECK(MemorySizeClass::getSizeClass(0) == 0);
+    CHECK(MemorySizeClass::getSizeClass(4) == 0);
+    CHECK(MemorySizeClass::getSizeClass(5) == 1);
+    CHECK(MemorySizeClass::getSizeClass(32) == 4);
+    CHECK(MemorySizeClass::getSizeClass(33) == 5);
+
+    // Each length is mapped into the same class of the previous length or
+    // into the next one
+    uint lastClass = 0;
+    uint length;
+    for (length = 1; length <= MemorySizeClass::MAXIMUM_UNIT_SIZE; length++)
+    {
+        uint sizeClass = MemorySizeClass::getSizeClass(length);
+        CHECK((sizeClass == lastClass) || (sizeClass == lastClass + 1));
+        lastClass = sizeClass;
+    }
+    CHECK(lastClass == MemorySizeClass::NUMBER_OF_CLASSES - 1);
+    CHECK(MemorySizeClass::getSizeClass(length) ==
+          MemorySizeClass::NUMBER_OF_CLASSES);
+
+    // Test the compile-time units
+    #define CHECK_SIZE_CLASS(index, unitSize)                               \
+        CHECK(MemorySizeClassUnit<index>::UNIT_SIZE == unitSize);           \
+        CHECK(MemorySizeClass::getSizeClass(unitSize) == index);            \
+        CHECK(MemorySizeClass::getSizeClass(unitSize + 1) == index + 1);
+
+    CHECK_SIZE_CLASS(0, 4);
+    CHECK_SIZE_CLASS(3, 24);
+    CHECK_SIZE_CLASS(5, 40);
+    CHECK_SIZE_CLASS(8, 64);
+    CHECK_SIZE_CLASS(9, 80);
+    CHECK_SIZE_CLASS(24, 1024);
+    CHECK_SIZE_CLASS(30, 3072);
+    CHECK_SIZE_CLASS(32, 4096);
+    CHECK_SIZE_CLASS(56, 256*1024);
+    #undef CHECK_SIZE_CLASS
+}
+
+
+/*
+ * Feed a histogram of a single hot size class and test that new buckets
+ * follow it.
+ */
+void adaptiveSizeClassesTest()
+{
+    uint privatePoolLength =
+        SuperiorMemoryManager::DEFAULT_SUPRIOR_MEMORY_PRIVATE_MEM;
+    uint8* privatePool = new uint8[privatePoolLength];
+
+    SuperiorMemoryManager* memmanager = new SuperiorMemoryManager(
+        SuperiorOSMemePtr(new TestOSMemory()),
+        SuperiorMemoryManager::INITIALIZE_SIZE_MINIMUM_SIZE,
+        privatePool,
+        privatePoolLength);
+
+    uint hotElements = memmanager->getBucketElements(3000);
+    uint coldElements = memmanager->getBucketElements(100);
+
+    // Not enough requests yet
+    memmanager->recordSizeHistogram(3000, 100);
+    memmanager->manageMemory();
+    CHECK(memmanager->getBucketElements(3000) == hotElements);
+
+    // Now the period is long enough
+    memmanager->recordSizeHistogram(3000, 10000);
+    memmanager->manageMemory();
+    CHECK(memmanager->getBucketElements(3000) > hotElements);
+    CHECK(memmanager->getBucketElements(100) < coldElements);
+    // Both are the same size class
+    CHECK(memmanager->getBucketElements(3000) ==
+          memmanager->getBucketElements(2900));
+    // The default bucket is never tuned
+    CHECK(memmanager->getBucketElements(1024*1024) == 0);
+
+    // The tuned buckets are working
+    void* hot = memmanager->allocate(3000);
+    void* cold = memmanager->allocate(100);
+    CHECK((hot != NULL) && (cold != NULL));
+    CHECK(memmanager->getBlockLength(hot) >= 3000);
+    CHECK(memmanager->getBlockLength(cold) >= 100);
+    CHECK(memmanager->free(hot));
+    CHECK(memmanager->free(cold));
+
+    delete memmanager;
+    delete[] privatePool;
+}
+
+
+/*
+ * Fill a few buckets of two bucket groups, free half of the blocks and test
+ * that the full buckets are used again before the heap is expanded.
+ */
+void partialBucketsTest()
+{
+    #define PARTIAL_LARGE_BLOCKS (60)
+    #define PARTIAL_SMALL_BLOCKS (30000)
+
+    uint privatePoolLength =
+        SuperiorMemoryManager::DEFAULT_SUPRIOR_MEMORY_PRIVATE_MEM;
+    uint8* privatePool = new uint8[privatePoolLength];
+
+    SuperiorMemoryManager* memmanager = new SuperiorMemoryManager(
+        SuperiorOSMemePtr(new TestOSMemory()),
+        8*1024*1024,
+        privatePool,
+        privatePoolLength);
+
+    void** large = new void*[PARTIAL_LARGE_BLOCKS];
+    void** small = new void*[PARTIAL_SMALL_BLOCKS];
+    uint i;
+    for (i = 0; i < PARTIAL_LARGE_BLOCKS; i++)
+    {
+        large[i] = memmanager->allocate(40000);
+        CHECK(large[i] != NULL);
+    }
+    for (i = 0; i < PARTIAL_SMALL_BLOCKS; i++)
+    {
+        small[i] = memmanager->allocate(24);
+        CHECK(small[i] != NULL);
+    }
+
+    memorySize totalBytes = memmanager->getNumberOfAllocatedBytes() +
+                            memmanager->getNumberOfFreeBytes();
+
+    // Free half of the blocks, from all buckets
+    for (i = 0; i < PARTIAL_LARGE_BLOCKS; i+= 2)
+        CHECK(memmanager->free(large[i]));
+    for (i = 0; i < PARTIAL_SMALL_BLOCKS; i+= 2)
+        CHECK(memmanager->free(small[i]));
+
+    // And allocate them again
+    for (i = 0; i < PARTIAL_LARGE_BLOCKS; i+= 2)
+    {
+        large[i] = memmanager->allocate(40000);
+        CHECK(large[i] != NULL);
+    }
+    for (i = 0; i < PARTIAL_SMALL_BLOCKS; i+= 2)
+    {
+        small[i] = memmanager->allocate(24);
+        CHECK(small[i] != NULL);
+    }
+
+    // No new bucket was needed
+    CHECK(memmanager->getNumberOfAllocatedBytes() +
+          memmanager->getNumberOfFreeBytes() == totalBytes);
+
+    for (i = 0; i < PARTIAL_LARGE_BLOCKS; i++)
+        CHECK(memmanager->free(large[i]));
+    for (i = 0; i < PARTIAL_SMALL_BLOCKS; i++)
+        CHECK(memmanager->free(small[i]));
+    delete[] large;
+    delete[] small;
+
+    delete memmanager;
+    delete[] privatePool;
+}
+
+
+/*
+ * Allocate 'length' bytes. Expand the heap when it's full.
+ */
+static void* allocateOrExpand(SuperiorMemoryManager& memmanager, uint length)
+{
+    void* ret = memmanager.allocate(length);
+    for (uint i = 0; (ret == NULL) && (i < 16); i++)
+    {
+        memmanager.manageMemory();
+        ret = memmanager.allocate(length);
+    }
+    CHECK(ret != NULL);
+    return ret;
+}
+
+/*
+ * Drive a few cycles of a burst followed by an idle period. The heap should
+ * return to it's initialize footprint after each idle period, unless the
+ * reclamation is disabled.
+ */
+void burstIdleTest()
+{
+    #define BURST_BLOCKS (3000)
+    #define BURST_CYCLES (3)
+    #define IDLE_PERIODS (64)
+
+    for (uint isReclaiming = 0; isReclaiming < 2; isReclaiming++)
+    {
+        uint privatePoolLength = 64*1024;
+        uint8* privatePool = new uint8[privatePoolLength];
+
+        uint footprint = 0;
+        SuperiorMemoryManager* memmanager = new SuperiorMemoryManager(
+            SuperiorOSMemePtr(new CountingOSMem(footprint)),
+            SuperiorMemoryManager::INITIALIZE_SIZE_MINIMUM_SIZE,
+            privatePool,
+            privatePoolLength);
+        if (isReclaiming == 0)
+            memmanager->setReclaimIdlePeriods(0);
+
+        void** blocks = new void*[BURST_BLOCKS];
+        uint firstIdleFootprint = 0;
+        for (uint cycle = 0; cycle < BURST_CYCLES; cycle++)
+        {
+            uint idleFootprint = footprint;
+
+            // The burst. Large blocks are not kept by the processor caches
+            uint i;
+            for (i = 0; i < BURST_BLOCKS; i++)
+            {
+                blocks[i] = allocateOrExpand(*memmanager,
+                                             1500 * ((i & 3) + 1));
+            }
+            uint peakFootprint = footprint;
+            // Without reclamation, the next bursts reuse the same memory
+            CHECK((peakFootprint > idleFootprint) ||
+                  ((isReclaiming == 0) && (cycle > 0)));
+
+            for (i = 0; i < BURST_BLOCKS; i++)
+                CHECK(memmanager->free(blocks[i]));
+
+            // The idle period
+            for (i = 0; i < IDLE_PERIODS; i++)
+                memmanager->manageMemory();
+
+            if (isReclaiming == 0)
+            {
+                // Nothing is returned
+                CHECK(footprint >= peakFootprint);
+                continue;
+            }
+
+            // Most of the burst memory was returned
+            CHECK(footprint < (peakFootprint / 2));
+            CHECK(footprint < (SuperiorMemoryManager::INITIALIZE_SIZE_MINIMUM_SIZE
+                               + 1024*1024));
+            // And the footprint doesn't grow between the cycles
+            if (cycle == 0)
+                firstIdleFootprint = footprint;
+            CHECK(footprint == firstIdleFootprint);
+        }
+        delete[] blocks;
+
+        delete memmanager;
+        delete[] privatePool;
+        CHECK(footprint == 0);
+    }
+}
+
+#define LARGE_LIVE_BLOCKS (3)
+#define LARGE_ROUNDS (64)
+#define LARGE_WARMUP_ROUNDS (16)
+
+/*
+ * Return the length of the capture buffer of 'round'. Between 1mb and 8mb.
+ */
+static uint largeBlockLength(uint round, uint i)
+{
+    return (((round * 5 + i * 3) & 7) + 1) * 1024*1024 - i * 100;
+}
+
+/*
+ * Cycle capture buffers of 1mb to 8mb. After the first rounds the freed
+ * regions are merged and reused, so the heap doesn't grow anymore. Direct
+ * mapped buffers are returned to the operating system by 'free'.
+ */
+void largeBlocksTest()
+{
+    uint privatePoolLength = 64*1024;
+    uint8* privatePool = new uint8[privatePoolLength];
+
+    uint footprint = 0;
+    SuperiorMemoryManager* memmanager = new SuperiorMemoryManager(
+        SuperiorOSMemePtr(new CountingOSMem(footprint)),
+        48*1024*1024,
+        privatePool,
+        privatePoolLength);
+
+    void* blocks[LARGE_LIVE_BLOCKS];
+    uint regionsFootprint = 0;
+    memorySize regionsBytes = 0;
+    uint round, i;
+    for (round = 0; round < LARGE_ROUNDS; round++)
+    {
+        for (i = 0; i < LARGE_LIVE_BLOCKS; i++)
+        {
+            uint length = largeBlockLength(round, i);
+            uint8* block = (uint8*)memmanager->allocate(length);
+            CHECK(block != NULL);
+            CHECK(memmanager->getBlockLength(block) >= length);
+            block[0] = (uint8)i;
+            block[length - 1] = (uint8)i;
+            blocks[i] = block;
+        }
+        for (i = 0; i < LARGE_LIVE_BLOCKS; i++)
+        {
+            uint8* block = (uint8*)blocks[i];
+            CHECK(block[0] == (uint8)i);
+            CHECK(block[largeBlockLength(round, i) - 1] == (uint8)i);
+            CHECK(memmanager->free(block));
+        }
+        CHECK(memmanager->getNumberOfAllocatedBytes() == 0);
+
+        // No more regions after the warmup
+        if (round == LARGE_WARMUP_ROUNDS)
+        {
+            regionsFootprint = footprint;
+            regionsBytes = memmanager->getNumberOfFreeBytes();
+        }
+        if (round > LARGE_WARMUP_ROUNDS)
+        {
+            CHECK(footprint == regionsFootprint);
+            CHECK(memmanager->getNumberOfFreeBytes() == regionsBytes);
+        }
+    }
+
+    // Direct mapping
+    memmanager->setDirectMappingThreshold(1024*1024);
+    for (round = 0; round < 2; round++)
+    {
+        uint idleFootprint = footprint;
+        void* block = memmanager->allocate(8*1024*1024);
+        CHECK(block != NULL);
+        CHECK(footprint >= idleFootprint + 8*1024*1024);
+        CHECK(memmanager->getBlockLength(block) >= 8*1024*1024);
+        CHECK(memmanager->getNumberOfFreeBytes() < regionsBytes +
+                                                   LargeMemoryHeapManager::PAGE_SIZE);
+        CHECK(memmanager->free(block));
+        CHECK(!memmanager->free(block));
+        // The first mapping might reserve owner-map nodes
+        CHECK((footprint == idleFootprint) || (round == 0));
+        CHECK(footprint < idleFootprint + 8*1024*1024);
+    }
+    CHECK(memmanager->getNumberOfFreeBytes() == regionsBytes);
+
+    delete memmanager;
+    delete[] privatePool;
+    CHECK(footprint == 0);
+}
+
+/*
+ * The allocations request an expansion when the superblocks are getting
+ * full, or when a bucket couldn't be allocated. The request is served by
+ * 'expandMemory()' without any 'manageMemory()' period.
+ */
+void expansionRequestTest()
+{
+    uint privatePoolLength = 64*1024;
+    uint8* privatePool = new uint8[privatePoolLength];
+
+    uint footprint = 0;
+    SuperiorMemoryManager* memmanager = new SuperiorMemoryManager(
+        SuperiorOSMemePtr(new CountingOSMem(footprint)),
+        SuperiorMemoryManager::INITIALIZE_SIZE_MINIMUM_SIZE,
+        privatePool,
+        privatePoolLength);
+    memmanager->setLowWatermark(1024*1024);
+
+    // Nothing to expand
+    uint initialFootprint = footprint;
+    CHECK(!memmanager->isExpansionRequested());
+    memmanager->expandMemory();
+    CHECK(footprint == initialFootprint);
+
+    // Fill the superblock until the watermark is crossed
+    #define EXPANSION_BLOCKS (2048)
+    void* blocks[EXPANSION_BLOCKS];
+    uint count = 0;
+    while (!memmanager->isExpansionRequested())
+    {
+        CHECK(count < EXPANSION_BLOCKS);
+        blocks[count] = memmanager->allocate(2000);
+        CHECK(blocks[count] != NULL);
+        count++;
+    }
+    memmanager->expandMemory();
+    CHECK(!memmanager->isExpansionRequested());
+    CHECK(footprint > initialFootprint);
+    uint expandedFootprint = footprint;
+
+    // The expansion covers the demand, the next blocks don't fail
+    uint i;
+    for (i = 0; i < count; i++)
+    {
+        void* block = memmanager->allocate(2000);
+        CHECK(block != NULL);
+        CHECK(memmanager->free(block));
+    }
+    CHECK(footprint == expandedFootprint);
+
+    // A block which cannot fit into any superblock
+    void* large = memmanager->allocate(8*1024*1024);
+    CHECK(large == NULL);
+    CHECK(memmanager->isExpansionRequested());
+    memmanager->expandMemory();
+    large = memmanager->allocate(8*1024*1024);
+    CHECK(large != NULL);
+    CHECK(memmanager->free(large));
+
+    for (i = 0; i < count; i++)
+        CHECK(memmanager->free(blocks[i]));
+
+    delete memmanager;
+    delete[] privatePool;
+    CHECK(footprint == 0);
+}
+
+/*
+ * Create far more buckets than the private memory can describe. The
+ * descriptors are carved out of the superblocks, and returned to them after
+ * the idle periods. Without any private memory, the descriptor of the first
+ * superblock is stored inside the superblock itself.
+ */
+void metadataGrowthTest()
+{
+    #define METADATA_DIRECT_BLOCKS (200)
+    #define METADATA_BLOCKS (1500)
+    #define METADATA_IDLE_PERIODS (64)
+
+    for (uint isPrivate = 0; isPrivate < 2; isPrivate++)
+    {
+        // Enough for a few descriptors only
+        uint privatePoolLength = (isPrivate != 0) ? 1024 : 0;
+        uint8* privatePool = (isPrivate != 0) ?
+                                new uint8[privatePoolLength] : NULL;
+
+        uint footprint = 0;
+        SuperiorMemoryManager* memmanager = new SuperiorMemoryManager(
+            SuperiorOSMemePtr(new CountingOSMem(footprint)),
+            SuperiorMemoryManager::INITIALIZE_SIZE_MINIMUM_SIZE,
+            privatePool,
+            privatePoolLength);
+        uint initialFootprint = footprint;
+
+        // Each direct block gets a bucket of it's own
+        uint directLength = MemorySizeClass::MAXIMUM_UNIT_SIZE + 1;
+        memmanager->setDirectMappingThreshold(directLength);
+        void** directBlocks = new void*[METADATA_DIRECT_BLOCKS];
+        uint i;
+        for (i = 0; i < METADATA_DIRECT_BLOCKS; i++)
+        {
+            uint8* block = (uint8*)memmanager->allocate(directLength);
+            CHECK(block != NULL);
+            block[0] = (uint8)i;
+            directBlocks[i] = block;
+        }
+
+        // And the buckets of many size classes. Large blocks are not kept by
+        // the processor caches
+        void** blocks = new void*[METADATA_BLOCKS];
+        for (i = 0; i < METADATA_BLOCKS; i++)
+        {
+            uint length = 1500 * ((i % 15) + 1);
+            uint8* block = (uint8*)allocateOrExpand(*memmanager, length);
+            block[length - 1] = (uint8)i;
+            blocks[i] = block;
+        }
+
+        for (i = 0; i < METADATA_DIRECT_BLOCKS; i++)
+        {
+            CHECK(((uint8*)directBlocks[i])[0] == (uint8)i);
+            CHECK(memmanager->free(directBlocks[i]));
+        }
+        for (i = 0; i < METADATA_BLOCKS; i++)
+        {
+            CHECK(((uint8*)blocks[i])[1500 * ((i % 15) + 1) - 1] == (uint8)i);
+            CHECK(memmanager->free(blocks[i]));
+        }
+        CHECK(memmanager->getNumberOfAllocatedBytes() == 0);
+        delete[] blocks;
+        delete[] directBlocks;
+
+        // The descriptors chunks don't keep the superblocks
+        for (i = 0; i < METADATA_IDLE_PERIODS; i++)
+            memmanager->manageMemory();
+        CHECK(footprint < (initialFootprint + 1024*1024));
+
+        // The memory is reused
+        void* block = memmanager->allocate(1500);
+        CHECK(block != NULL);
+        CHECK(memmanager->free(block));
+
+        delete memmanager;
+        delete[] privatePool;
+        CHECK(footprint == 0);
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+
+/*
+ * Measure the latency of free operations while the number of buckets grows.
+ * Each large allocation is mapped directly into a new bucket of the default
+ * cache, so the bucket count can be controlled precisely.
+ *
+ * Three operations are measured:
+ *    - A pair of allocate/free of a small block.
+ *    - A pair of allocate/free of a large block. The full buckets of the
+ *      large blocks should be skipped.
+ *    - Rejection of a pointer which doesn't belong to the heap.
+ */
+void statisticsTest()
+{
+    #define STATISTICS_SMALL_BLOCKS (1000)
+    #define STATISTICS_MEDIUM_BLOCKS (10)
+
+    uint privatePoolLength =
+        SuperiorMemoryManager::DEFAULT_SUPRIOR_MEMORY_PRIVATE_MEM;
+    uint8* privatePool = new uint8[privatePoolLength];
+
+    // The heap cannot be expanded
+    SuperiorMemoryManager* memmanager = new SuperiorMemoryManager(
+        SuperiorOSMemePtr(new TestOSMemory()),
+        8*1024*1024,
+        privatePool,
+        privatePoolLength,
+        8*1024*1024);
+
+    MemoryStatistics* statistics = new MemoryStatistics;
+    memmanager->getStatistics(*statistics);
+    CHECK(statistics->m_bytesInUse == 0);
+    CHECK(statistics->m_osMemorySize == 8*1024*1024);
+
+    // Cached blocks of 20 bytes are rounded into 24 bytes
+    uint smallClass = MemorySizeClass::getSizeClass(20);
+    uint mediumClass = MemorySizeClass::getSizeClass(40000);
+    uint defaultClass = MemorySizeClass::NUMBER_OF_CLASSES;
+    CHECK(statistics->m_classes[smallClass].m_unitSize == 24);
+    CHECK(statistics->m_classes[defaultClass].m_unitSize == 0);
+
+    void* small[STATISTICS_SMALL_BLOCKS];
+    void* medium[STATISTICS_MEDIUM_BLOCKS];
+    uint i;
+    for (i = 0; i < STATISTICS_SMALL_BLOCKS; i++)
+    {
+        small[i] = memmanager->allocate(20);
+        CHECK(small[i] != NULL);
+    }
+    for (i = 0; i < STATISTICS_MEDIUM_BLOCKS; i++)
+    {
+        medium[i] = memmanager->allocate(40000);
+        CHECK(medium[i] != NULL);
+    }
+    // No room for such a block
+    CHECK(memmanager->allocate(16*1024*1024) == NULL);
+
+    memmanager->getStatistics(*statistics);
+    MemorySizeClassStatistics& smallStatistics =
+        statistics->m_classes[smallClass];
+    MemorySizeClassStatistics& mediumStatistics =
+        statistics->m_classes[mediumClass];
+    CHECK(smallStatistics.m_allocations == STATISTICS_SMALL_BLOCKS);
+    CHECK(smallStatistics.m_frees == 0);
+    CHECK(smallStatistics.m_failures == 0);
+    CHECK(smallStatistics.m_bytesInUse == STATISTICS_SMALL_BLOCKS * 24);
+    // The estimation is rounded down
+    CHECK(smallStatistics.m_internalFragmentation <=
+          STATISTICS_SMALL_BLOCKS * 4);
+    CHECK(smallStatistics.m_internalFragmentation + 16 >=
+          STATISTICS_SMALL_BLOCKS * 4);
+    CHECK(smallStatistics.m_buckets >= 1);
+    CHECK(smallStatistics.m_bucketBytes >= STATISTICS_SMALL_BLOCKS * 24);
+    CHECK(mediumStatistics.m_allocations == STATISTICS_MEDIUM_BLOCKS);
+    CHECK(mediumStatistics.m_bytesInUse ==
+          STATISTICS_MEDIUM_BLOCKS * mediumStatistics.m_unitSize);
+    CHECK(statistics->m_classes[defaultClass].m_failures == 1);
+    CHECK(statistics->m_classes[defaultClass].m_allocations == 0);
+    CHECK(statistics->m_bytesInUse == smallStatistics.m_bytesInUse +
+                                      mediumStatistics.m_bytesInUse);
+
+    // Free half of the small blocks. The peak stays.
+    for (i = 0; i < STATISTICS_SMALL_BLOCKS; i+= 2)
+        CHECK(memmanager->free(small[i]));
+    uint8 foreign[16];
+    CHECK(!memmanager->free(foreign));
+
+    memmanager->getStatistics(*statistics);
+    CHECK(smallStatistics.m_frees == STATISTICS_SMALL_BLOCKS / 2);
+    CHECK(smallStatistics.m_bytesInUse == STATISTICS_SMALL_BLOCKS / 2 * 24);
+    CHECK(smallStatistics.m_peakBytesInUse == STATISTICS_SMALL_BLOCKS * 24);
+    CHECK(statistics->m_peakBytesInUse > statistics->m_bytesInUse);
+
+    for (i = 1; i < STATISTICS_SMALL_BLOCKS; i+= 2)
+        CHECK(memmanager->free(small[i]));
+    for (i = 0; i < STATISTICS_MEDIUM_BLOCKS; i++)
+        CHECK(memmanager->free(medium[i]));
+
+    memmanager->getStatistics(*statistics);
+    CHECK(statistics->m_bytesInUse == 0);
+    CHECK(smallStatistics.m_frees == STATISTICS_SMALL_BLOCKS);
+    CHECK(mediumStatistics.m_frees == STATISTICS_MEDIUM_BLOCKS);
+
+    delete statistics;
+    delete memmanager;
+    delete[] privatePool;
+}
+
+void alignedAllocationTest()
+{
+    #define ALIGNED_BLOCKS (400)
+
+    uint privatePoolLength =
+        SuperiorMemoryManager::DEFAULT_SUPRIOR_MEMORY_PRIVATE_MEM;
+    uint8* privatePool = new uint8[privatePoolLength];
+
+    SuperiorMemoryManager* memmanager = new SuperiorMemoryManager(
+        SuperiorOSMemePtr(new TestOSMemory()),
+        8*1024*1024,
+        privatePool,
+        privatePoolLength);
+
+    // Invalid alignments
+    CHECK(memmanager->allocateAligned(16, 0) == NULL);
+    CHECK(memmanager->allocateAligned(16, 48) == NULL);
+    CHECK(memmanager->allocateAligned(16,
+        SuperiorMemoryManager::MAXIMUM_ALIGNMENT * 2) == NULL);
+
+    void* blocks[ALIGNED_BLOCKS];
+    uint lengths[ALIGNED_BLOCKS];
+    uint i;
+    for (i = 0; i < ALIGNED_BLOCKS; i++)
+    {
+        // 1 byte to 4kb alignments, lengths up to 6kb
+        uint alignment = 1 << (i % 13);
+        lengths[i] = ((i * 7919) % 6000) + 1;
+        blocks[i] = memmanager->allocateAligned(lengths[i], alignment);
+        CHECK(blocks[i] != NULL);
+        CHECK((getNumeric(blocks[i]) & (alignment - 1)) == 0);
+        CHECK(memmanager->getBlockLength(blocks[i]) >= lengths[i]);
+        memset(blocks[i], (uint8)i, lengths[i]);
+    }
+
+    // The blocks don't overlap
+    for (i = 0; i < ALIGNED_BLOCKS; i++)
+    {
+        uint8* data = (uint8*)blocks[i];
+        CHECK(data[0] == (uint8)i);
+        CHECK(data[lengths[i] - 1] == (uint8)i);
+    }
+
+    // Aligned blocks are freed by the normal free
+    for (i = 0; i < ALIGNED_BLOCKS; i++)
+        CHECK(memmanager->free(blocks[i]));
+
+    MemoryStatistics* statistics = new MemoryStatistics;
+    memmanager->getStatistics(*statistics);
+    CHECK(statistics->m_bytesInUse == 0);
+
+    // Page aligned blocks of the default bucket group
+    void* large = memmanager->allocateAligned(300*1024, 64*1024);
+    CHECK(large != NULL);
+    CHECK((getNumeric(large) & (64*1024 - 1)) == 0);
+    CHECK(memmanager->getBlockLength(large) >= 300*1024);
+    CHECK(memmanager->free(large));
+
+    delete statistics;
+    delete memmanager;
+    delete[] privatePool;
+}
+
+void sizedFreeTest()
+{
+    #define SIZED_BLOCKS (2000)
+
+    uint privatePoolLength =
+        SuperiorMemoryManager::DEFAULT_SUPRIOR_MEMORY_PRIVATE_MEM;
+    uint8* privatePool = new uint8[privatePoolLength];
+
+    SuperiorMemoryManager* memmanager = new SuperiorMemoryManager(
+        SuperiorOSMemePtr(new TestOSMemory()),
+        8*1024*1024,
+        privatePool,
+        privatePoolLength);
+
+    void* blocks[SIZED_BLOCKS];
+    uint lengths[SIZED_BLOCKS];
+    uint i;
+    for (uint round = 0; round < 3; round++)
+    {
+        for (i = 0; i < SIZED_BLOCKS; i++)
+        {
+            // Cached and non-cached size classes
+            lengths[i] = ((i * 131 + round) % 3000) + 1;
+            blocks[i] = memmanager->allocate(lengths[i]);
+            CHECK(blocks[i] != NULL);
+        }
+        for (i = 0; i < SIZED_BLOCKS; i++)
+            CHECK(memmanager->free(blocks[i], lengths[i]));
+
+        // The cached blocks are counted as well
+        MemoryStatistics* statistics = new MemoryStatistics;
+        memmanager->getStatistics(*statistics);
+        CHECK(statistics->m_bytesInUse == 0);
+        delete statistics;
+    }
+
+    // Foreign pointers are rejected
+    uint8 foreign[16];
+    CHECK(!memmanager->free(foreign, sizeof(foreign)));
+
+    // Interior pointers are rejected even with the right length
+    void* interior = memmanager->allocate(16);
+    CHECK(interior != NULL);
+    CHECK(!memmanager->free((uint8*)interior + 8, 16));
+    CHECK(memmanager->free(interior, 16));
+
+    // Double free of a cached block is rejected, and the block is handed out
+    // only once
+    void* x = memmanager->allocate(16);
+    CHECK(x != NULL);
+    CHECK(memmanager->free(x));
+    CHECK(!memmanager->free(x));
+    CHECK(!memmanager->free(x, 16));
+    void* y = memmanager->allocate(16);
+    void* z = memmanager->allocate(16);
+    CHECK((y != NULL) && (z != NULL) && (y != z));
+    CHECK(memmanager->free(y));
+    CHECK(memmanager->free(z));
+
+    // So is a block which was flushed from the cache meanwhile
+    for (i = 0; i < SIZED_BLOCKS; i++)
+    {
+        blocks[i] = memmanager->allocate(16);
+        CHECK(blocks[i] != NULL);
+    }
+    CHECK(memmanager->free(blocks[0]));
+    for (i = 1; i < SIZED_BLOCKS; i++)
+        CHECK(memmanager->free(blocks[i]));
+    CHECK(!memmanager->free(blocks[0]));
+
+    delete memmanager;
+    delete[] privatePool;
+}
+
+void reallocateTest()
+{
+    #define REALLOCATE_STEP (256)
+    #define REALLOCATE_LENGTH (128*1024)
+
+    uint privatePoolLength =
+        SuperiorMemoryManager::DEFAULT_SUPRIOR_MEMORY_PRIVATE_MEM;
+    uint8* privatePool = new uint8[privatePoolLength];
+
+    SuperiorMemoryManager* memmanager = new SuperiorMemoryManager(
+        SuperiorOSMemePtr(new TestOSMemory()),
+        8*1024*1024,
+        privatePool,
+        privatePoolLength);
+
+    // A growing buffer of the free-list engine stays in it's bucket
+    uint8* buffer = (uint8*)memmanager->allocate(1100);
+    CHECK(buffer != NULL);
+    memset(buffer, 0x11, 1100);
+    uint length = 1100;
+    uint moves = 0;
+    while (length < REALLOCATE_LENGTH)
+    {
+        uint8* newBuffer = (uint8*)memmanager->reallocate(buffer,
+                                                  length + REALLOCATE_STEP);
+        CHECK(newBuffer != NULL);
+        CHECK(memmanager->getBlockLength(newBuffer) >=
+              length + REALLOCATE_STEP);
+        CHECK((newBuffer[0] == 0x11) && (newBuffer[length - 1] == 0x11));
+        memset(newBuffer + length, 0x11, REALLOCATE_STEP);
+        if (newBuffer != buffer)
+            moves++;
+        buffer = newBuffer;
+        length+= REALLOCATE_STEP;
+    }
+    CHECK(moves == 0);
+
+    // A block which cannot grow is moved
+    void* neighbour = memmanager->allocate(1100);
+    CHECK(neighbour != NULL);
+    uint8* moved = (uint8*)memmanager->allocate(1100);
+    CHECK(moved != NULL);
+    memset(moved, 0x22, 1100);
+    void* blocker = memmanager->allocate(1100);
+    CHECK(blocker != NULL);
+    if (!memmanager->tryExpandInPlace(moved, 4000))
+    {
+        uint8* newMoved = (uint8*)memmanager->reallocate(moved, 4000);
+        CHECK(newMoved != NULL);
+        CHECK(newMoved != moved);
+        CHECK((newMoved[0] == 0x22) && (newMoved[1099] == 0x22));
+        moved = newMoved;
+    }
+    CHECK(memmanager->getBlockLength(moved) >= 4000);
+
+    // Cached blocks keep their length. Shorter lengths always fit.
+    uint8* cached = (uint8*)memmanager->allocate(100);
+    CHECK(cached != NULL);
+    memset(cached, 0x33, 100);
+    CHECK(memmanager->tryExpandInPlace(cached, 50));
+    CHECK(memmanager->reallocate(cached, 50) == cached);
+    cached = (uint8*)memmanager->reallocate(cached, 3000);
+    CHECK(cached != NULL);
+    CHECK((cached[0] == 0x33) && (cached[99] == 0x33));
+
+    // Aligned blocks keep their alignment
+    uint8* aligned = (uint8*)memmanager->allocateAligned(1000, 256);
+    CHECK(aligned != NULL);
+    memset(aligned, 0x44, 1000);
+    aligned = (uint8*)memmanager->reallocate(aligned, 20000);
+    CHECK(aligned != NULL);
+    CHECK((getNumeric(aligned) & 255) == 0);
+    CHECK((aligned[0] == 0x44) && (aligned[999] == 0x44));
+
+    // Foreign pointers are rejected
+    uint8 foreign[16];
+    CHECK(!memmanager->tryExpandInPlace(foreign, 32));
+    CHECK(memmanager->reallocate(foreign, 32) == NULL);
+
+    CHECK(memmanager->free(buffer));
+    CHECK(memmanager->free(neighbour));
+    CHECK(memmanager->free(moved));
+    CHECK(memmanager->free(blocker));
+    CHECK(memmanager->free(cached));
+    CHECK(memmanager->free(aligned));
+
+    // The grown blocks are balanced in the statistics
+    MemoryStatistics* statistics = new MemoryStatistics;
+    memmanager->getStatistics(*statistics);
+    CHECK(statistics->m_bytesInUse == 0);
+
+    delete statistics;
+    delete memmanager;
+    delete[] privatePool;
+}
+
+/*
+ * A bucket group of more than 2^16-1 units. The buckets grow with the group,
+ * so the last buckets use the wide descriptors.
+ */
+void wideBucketsTest()
+{
+    #define WIDE_BUCKET_BLOCKS (200000)
+    #define WIDE_BUCKET_LENGTH (1100)
+
+    uint privatePoolLength =
+        SuperiorMemoryManager::DEFAULT_SUPRIOR_MEMORY_PRIVATE_MEM;
+    uint8* privatePool = new uint8[privatePoolLength];
+
+    SuperiorMemoryManager* memmanager = new SuperiorMemoryManager(
+        SuperiorOSMemePtr(new TestOSMemory()),
+        8*1024*1024,
+        privatePool,
+        privatePoolLength);
+
+    void** blocks = new void*[WIDE_BUCKET_BLOCKS];
+    uint i;
+    for (i = 0; i < WIDE_BUCKET_BLOCKS; i++)
+    {
+        blocks[i] = allocateOrExpand(*memmanager, WIDE_BUCKET_LENGTH);
+        CHECK(memmanager->getBlockLength(blocks[i]) >= WIDE_BUCKET_LENGTH);
+        memset(blocks[i], (uint8)i, WIDE_BUCKET_LENGTH);
+    }
+
+    // The blocks don't overlap
+    for (i = 0; i < WIDE_BUCKET_BLOCKS; i++)
+    {
+        CHECK(((uint8*)blocks[i])[0] == (uint8)i);
+        CHECK(((uint8*)blocks[i])[WIDE_BUCKET_LENGTH - 1] == (uint8)i);
+    }
+
+    // The freed units are reused
+    for (i = 0; i < WIDE_BUCKET_BLOCKS; i+= 2)
+        CHECK(memmanager->free(blocks[i]));
+    memorySize totalBytes = memmanager->getNumberOfAllocatedBytes() +
+                            memmanager->getNumberOfFreeBytes();
+    for (i = 0; i < WIDE_BUCKET_BLOCKS; i+= 2)
+    {
+        blocks[i] = memmanager->allocate(WIDE_BUCKET_LENGTH);
+        CHECK(blocks[i] != NULL);
+    }
+    CHECK(memmanager->getNumberOfAllocatedBytes() +
+          memmanager->getNumberOfFreeBytes() == totalBytes);
+
+    for (i = 0; i < WIDE_BUCKET_BLOCKS; i++)
+        CHECK(memmanager->free(blocks[i]));
+    CHECK(memmanager->getNumberOfAllocatedBytes() == 0);
+    delete[] blocks;
+
+    delete memmanager;
+    delete[] privatePool;
+}
+
+#define REMOTE_BLOCKS (256)
+#define REMOTE_ROUNDS (8)
+#define REMOTE_THREADS (4)
+#define REMOTE_ITERATIONS (50000)
+#define REMOTE_SLOTS (64)
+
+/*
+ * Allocates blocks of the free-list size classes, which are freed by
+ * another thread. The blocks are expanded in place into several units, since
+ * single-unit blocks are not pushed into the remote lists.
+ */
+class RemoteAllocatorThread : public cThreadedClass {
+public:
+    RemoteAllocatorThread(SuperiorMemoryManager& manager, void** blocks) :
+        m_manager(manager),
+        m_blocks(blocks),
+        m_succeeded(true)
+    {
+    }
+
+    bool isSucceeded() const { return m_succeeded; }
+
+protected:
+    virtual void run()
+    {
+        for (uint i = 0; i < REMOTE_BLOCKS; i++)
+        {
+            uint length = 1500 * ((i % 8) + 1);
+            m_blocks[i] = m_manager.allocate(length);
+            m_succeeded&= (m_blocks[i] != NULL);
+            m_manager.tryExpandInPlace(m_blocks[i], length * 2);
+        }
+    }
+
+private:
+    SuperiorMemoryManager& m_manager;
+    void** m_blocks;
+    bool m_succeeded;
+};
+
+/*
+ * Each iteration of a producer allocates a block and exchanges it with a
+ * shared slot. Each iteration of a consumer takes the block of a slot, until
+ * all producers are done. The blocks which are taken out of the slots are
+ * freed, usually by another thread than the one which allocated them.
+ */
+class RemoteExchangeThread : public cThreadedClass {
+public:
+    RemoteExchangeThread(SuperiorMemoryManager& manager,
+                         void* volatile* slots,
+                         volatile uint32& producers,
+                         uint seed,
+                         bool isProducer) :
+        m_manager(manager),
+        m_slots(slots),
+        m_producers(producers),
+        m_seed(seed),
+        m_isProducer(isProducer),
+        m_succeeded(true)
+    {
+    }
+
+    bool isSucceeded() const { return m_succeeded; }
+
+protected:
+    virtual void run()
+    {
+        for (uint i = 0; m_isProducer ? (i < REMOTE_ITERATIONS) :
+                                        (m_producers != 0); i++)
+        {
+            void* block = NULL;
+            if (m_isProducer)
+            {
+                uint length = 1500 * (((i + m_seed) % 8) + 1);
+                block = m_manager.allocate(length);
+                m_succeeded&= (block != NULL);
+                if ((i & 1) == 0)
+                    m_manager.tryExpandInPlace(block, length * 2);
+            }
+            uint slot = (i * 13 + m_seed) % REMOTE_SLOTS;
+            block = MemoryAtomic::exchangePointer(&m_slots[slot], block);
+            if (block != NULL)
+                m_succeeded&= m_manager.free(block);
+        }
+
+        if (m_isProducer)
+            MemoryAtomic::decrement(&m_producers);
+    }
+
+private:
+    SuperiorMemoryManager& m_manager;
+    void* volatile* m_slots;
+    volatile uint32& m_producers;
+    uint m_seed;
+    bool m_isProducer;
+    bool m_succeeded;
+};
+
+void remoteFreeTest()
+{
+    uint privatePoolLength =
+        SuperiorMemoryManager::DEFAULT_SUPRIOR_MEMORY_PRIVATE_MEM;
+    uint8* privatePool = new uint8[privatePoolLength];
+
+    SuperiorMemoryManager* memmanager = new SuperiorMemoryManager(
+        SuperiorOSMemePtr(new TestOSMemory()),
+        8*1024*1024,
+        privatePool,
+        privatePoolLength);
+
+    // Blocks which are allocated by a thread and freed by another
+    void* blocks[REMOTE_BLOCKS];
+    memorySize totalBytes = 0;
+    uint i;
+    for (uint round = 0; round < REMOTE_ROUNDS; round++)
+    {
+        RemoteAllocatorThread* allocator =
+            new RemoteAllocatorThread(*memmanager, blocks);
+        allocator->start();
+        allocator->wait();
+        CHECK(allocator->isSucceeded());
+        delete allocator;
+
+        for (i = 0; i < REMOTE_BLOCKS; i++)
+            CHECK(memmanager->free(blocks[i]));
+        // The blocks of the remote lists are free
+        CHECK(memmanager->getNumberOfAllocatedBytes() == 0);
+        // Double free is rejected, even inside a remote list
+        CHECK(!memmanager->free(blocks[0]));
+        CHECK(!memmanager->free(blocks[REMOTE_BLOCKS - 1]));
+
+        // The next allocations reuse the freed blocks
+        memorySize bytes = memmanager->getNumberOfAllocatedBytes() +
+                           memmanager->getNumberOfFreeBytes();
+        if (round == 0)
+            totalBytes = bytes;
+        CHECK(bytes == totalBytes);
+    }
+
+    // Concurrent frees and reclaims. The odd threads only free blocks.
+    void* volatile slots[REMOTE_SLOTS];
+    for (i = 0; i < REMOTE_SLOTS; i++)
+        slots[i] = NULL;
+    volatile uint32 producers = REMOTE_THREADS / 2;
+    RemoteExchangeThread* workers[REMOTE_THREADS];
+    for (i = 0; i < REMOTE_THREADS; i++)
+    {
+        workers[i] = new RemoteExchangeThread(*memmanager, slots, producers,
+                                              i * 7, (i & 1) == 0);
+    }
+    for (i = 0; i < REMOTE_THREADS; i++)
+        workers[i]->start();
+    for (i = 0; i < REMOTE_THREADS; i++)
+        workers[i]->wait();
+    for (i = 0; i < REMOTE_THREADS; i++)
+    {
+        CHECK(workers[i]->isSucceeded());
+        delete workers[i];
+    }
+    for (i = 0; i < REMOTE_SLOTS; i++)
+    {
+        if (slots[i] != NULL)
+            CHECK(memmanager->free(slots[i]));
+    }
+    CHECK(memmanager->getNumberOfAllocatedBytes() == 0);
+
+    MemoryStatistics* statistics = new MemoryStatistics;
+    memmanager->getStatistics(*statistics);
+    CHECK(statistics->m_bytesInUse == 0);
+    delete statistics;
+
+    // The remote lists are reclaimed by the destructor
+    delete memmanager;
+    delete[] privatePool;
+}
+
+void benchmarkFreeLatency()
+{
+    #define LATENCY_MAX_BUCKETS (256)
+    #define LATENCY_LARGE_BLOCK (300*1024)
+    #define LATENCY_ITERATIONS (200000)
+
+    // The private pool must hold all the buckets
+    uint privatePoolLength = 1024*1024;
+    uint8* privatePool = new uint8[privatePoolLength];
+
+    SuperiorMemoryManager* memmanager = new SuperiorMemoryManager(
+        SuperiorOSMemePtr(new TestOSMemory()),
+        (LATENCY_MAX_BUCKETS + 16) * LATENCY_LARGE_BLOCK,
+        privatePool,
+        privatePoolLength);
+
+    void* large[LATENCY_MAX_BUCKETS];
+    uint buckets = 0;
+    memmanager->setDirectMappingThreshold(LATENCY_LARGE_BLOCK);
+    uint8 foreign[16];
+    uint i;
+
+    for (uint step = 1; step <= LATENCY_MAX_BUCKETS; step<<= 1)
+    {
+        // Grow the number of buckets
+        for (; buckets < step; buckets++)
+        {
+            large[buckets] = memmanager->allocate(LATENCY_LARGE_BLOCK);
+            CHECK(large[buckets] != NULL);
+        }
+
+        cOSDef::systemTime start = cOS::getSystemTime();
+        for (i = 0; i < LATENCY_ITERATIONS; i++)
+        {
+            void* ptr = memmanager->allocate(32);
+            CHECK(memmanager->free(ptr));
+        }
+        uint pairTime = cOS::calculateTimesDiffMilli(cOS::getSystemTime(),
+                                                     start);
+
+        start = cOS::getSystemTime();
+        for (i = 0; i < LATENCY_ITERATIONS; i++)
+        {
+            void* ptr = memmanager->allocate(32);
+            CHECK(memmanager->free(ptr, 32));
+        }
+        uint sizedPairTime = cOS::calculateTimesDiffMilli(
+                                            cOS::getSystemTime(), start);
+
+        // The measured large blocks are served by the regions
+        memmanager->setDirectMappingThreshold(0);
+        start = cOS::getSystemTime();
+        for (i = 0; i < LATENCY_ITERATIONS; i++)
+        {
+            void* ptr = memmanager->allocate(LATENCY_LARGE_BLOCK);
+            CHECK(memmanager->free(ptr));
+        }
+        uint largePairTime = cOS::calculateTimesDiffMilli(
+                                            cOS::getSystemTime(), start);
+        memmanager->setDirectMappingThreshold(LATENCY_LARGE_BLOCK);
+
+        start = cOS::getSystemTime();
+        for (i = 0; i < LATENCY_ITERATIONS; i++)
+        {
+            CHECK(!memmanager->free(foreign + (i & 7)));
+        }
+        uint rejectTime = cOS::calculateTimesDiffMilli(cOS::getSystemTime(),
+                                                       start);
+
+        // Convert milliseconds per LATENCY_ITERATIONS into nanoseconds
+        cout << "Buckets: " << buckets
+             << "  allocate+free: "
+             << (pairTime * 1000000 / LATENCY_ITERATIONS) << "ns"
+             << "  sized: "
+             << (sizedPairTime * 1000000 / LATENCY_ITERATIONS) << "ns"
+             << "  large allocate+free: "
+             << (largePairTime * 1000000 / LATENCY_ITERATIONS) << "ns"
+             << "  reject: "
+             << (rejectTime * 1000000 / LATENCY_ITERATIONS) << "ns" << endl;
+    }
+
+    for (i = 0; i < buckets; i++)
+        CHECK(memmanager->free(large[i]));
+
+    delete memmanager;
+    delete[] privatePool;
+}
+
+#define THROUGHPUT_MAX_THREADS (8)
+#define THROUGHPUT_ITERATIONS (200000)
+#define THROUGHPUT_WORKING_SET (64)
+
+/*
+ * Allocates and frees small blocks of a few size classes, keeping a small
+ * working-set of live blocks.
+ */
+class ThroughputThread : public cThreadedClass {
+public:
+    ThroughputThread(SuperiorMemoryManager& manager, uint seed) :
+        m_manager(manager),
+        m_seed(seed),
+        m_succeeded(true)
+    {
+    }
+
+    bool isSucceeded() const { return m_succeeded; }
+
+protected:
+    virtual void run()
+    {
+        void* blocks[THROUGHPUT_WORKING_SET];
+        uint i;
+        for (i = 0; i < THROUGHPUT_WORKING_SET; i++)
+            blocks[i] = NULL;
+
+        for (i = 0; i < THROUGHPUT_ITERATIONS; i++)
+        {
+            uint slot = (i * 7 + m_seed) % THROUGHPUT_WORKING_SET;
+            if (blocks[slot] != NULL)
+                m_succeeded&= m_manager.free(blocks[slot]);
+            blocks[slot] = m_manager.allocate(8 << ((i + m_seed) & 3));
+            m_succeeded&= (blocks[slot] != NULL);
+        }
+
+        for (i = 0; i < THROUGHPUT_WORKING_SET; i++)
+        {
+            if (blocks[i] != NULL)
+                m_succeeded&= m_manager.free(blocks[i]);
+        }
+    }
+
+private:
+    SuperiorMemoryManager& m_manager;
+    uint m_seed;
+    bool m_succeeded;
+};
+
+void benchmarkThroughput()
+{
+    uint privatePoolLength = 64*1024;
+    uint8* privatePool = new uint8[privatePoolLength];
+
+    SuperiorMemoryManager* memmanager = new SuperiorMemoryManager(
+        SuperiorOSMemePtr(new TestOSMemory()),
+        8*1024*1024,
+        privatePool,
+        privatePoolLength);
+
+    for (uint threads = 1; threads <= THROUGHPUT_MAX_THREADS; threads<<= 1)
+    {
+        ThroughputThread* workers[THROUGHPUT_MAX_THREADS];
+        uint i;
+        for (i = 0; i < threads; i++)
+            workers[i] = new ThroughputThread(*memmanager, i * 13);
+
+        cOSDef::systemTime start = cOS::getSystemTime();
+        for (i = 0; i < threads; i++)
+            workers[i]->start();
+        for (i = 0; i < threads; i++)
+            workers[i]->wait();
+        uint time = cOS::calculateTimesDiffMilli(cOS::getSystemTime(), start);
+
+        for (i = 0; i < threads; i++)
+        {
+            CHECK(workers[i]->isSucceeded());
+            delete workers[i];
+        }
+
+        // The counters of all processors sum up
+        MemoryStatistics* statistics = new MemoryStatistics;
+        memmanager->getStatistics(*statistics);
+        CHECK(statistics->m_bytesInUse == 0);
+        delete statistics;
+
+        if (time == 0)
+            time = 1;
+        cout << "Threads: " << threads
+             << "  allocate+free pairs/ms: "
+             << (threads * THROUGHPUT_ITERATIONS / time) << endl;
+    }
+
+    delete memmanager;
+    delete[] privatePool;
+}
+
+//////////////////////////////////////////////////////////////////////////
+
+#define RECORDED_LIVE_BLOCKS (20000)
+
+// A recorded request sizes distribution. The weights are in 1/1000.
+static const struct {
+    uint m_length;
+    uint m_weight;
+} gRecordedSizes[] = {
+    {    24, 700 },
+    {    48, 150 },
+    {   100,  60 },
+    {   200,  40 },
+    {   700,  20 },
+    {  1500,  10 },
+    {  3000,  10 },
+    {  6000,   5 },
+    { 12000,   3 },
+    { 40000,   2 }
+};
+
+#define RECORDED_SIZES (sizeof(gRecordedSizes) / sizeof(gRecordedSizes[0]))
+
+/*
+ * Allocate RECORDED_LIVE_BLOCKS blocks according to the recorded
+ * distribution, with and without feeding it into the manager first, and
+ * print the buckets layout and the unused bucket memory.
+ */
+void benchmarkAdaptiveSizeClasses()
+{
+    for (uint isAdaptive = 0; isAdaptive < 2; isAdaptive++)
+    {
+        uint privatePoolLength = 64*1024;
+        uint8* privatePool = new uint8[privatePoolLength];
+
+        SuperiorMemoryManager* memmanager = new SuperiorMemoryManager(
+            SuperiorOSMemePtr(new TestOSMemory()),
+            32*1024*1024,
+            privatePool,
+            privatePoolLength,
+            SuperiorMemoryManager::DEFAULT_MAXIMUM_SIZE,
+            isAdaptive != 0);
+
+        uint i, j;
+        if (isAdaptive != 0)
+        {
+            // A few periods of the recorded distribution
+            for (j = 0; j < 4; j++)
+            {
+                for (i = 0; i < RECORDED_SIZES; i++)
+                {
+                    memmanager->recordSizeHistogram(gRecordedSizes[i].m_length,
+                        gRecordedSizes[i].m_weight * RECORDED_LIVE_BLOCKS /
+                        1000);
+                }
+                memmanager->manageMemory();
+            }
+        }
+
+        // Allocate the live blocks. Each thousand blocks follow the weights.
+        void** blocks = new void*[RECORDED_LIVE_BLOCKS];
+        uint count = 0;
+        while (count < RECORDED_LIVE_BLOCKS)
+        {
+            for (i = 0; i < RECORDED_SIZES; i++)
+            {
+                for (j = 0; (j < gRecordedSizes[i].m_weight) &&
+                            (count < RECORDED_LIVE_BLOCKS); j++)
+                {
+                    blocks[count] =
+                        memmanager->allocate(gRecordedSizes[i].m_length);
+                    CHECK(blocks[count] != NULL);
+                    count++;
+                }
+            }
+        }
+
+        cout << (isAdaptive ? "Adaptive" : "Static") << " layout:";
+        for (i = 0; i < RECORDED_SIZES; i++)
+        {
+            cout << "  " << gRecordedSizes[i].m_length << "b:"
+                 << memmanager->getBucketElements(gRecordedSizes[i].m_length);
+        }
+        cout << endl;
+        cout << (isAdaptive ? "Adaptive" : "Static")
+             << " used: "
+             << (uint)(memmanager->getNumberOfAllocatedBytes() / 1024)
+             << "kb  unused: "
+             << (uint)(memmanager->getNumberOfFreeBytes() / 1024)
+             << "kb" << endl;
+
+        for (i = 0; i < RECORDED_LIVE_BLOCKS; i++)
+            CHECK(memmanager->free(blocks[i]));
+        delete[] blocks;
+
+        delete memmanager;
+        delete[] privatePool;
+    }
+}
+
+#define LARGE_BENCHMARK_ROUNDS (20000)
+
+/*
+ * Cycle capture buffers of 1mb to 8mb, served by the regions of the default
+ * bucket group and by direct mapping.
+ */
+void benchmarkLargeBlocks()
+{
+    for (uint isDirect = 0; isDirect < 2; isDirect++)
+    {
+        uint privatePoolLength = 64*1024;
+        uint8* privatePool = new uint8[privatePoolLength];
+
+        SuperiorMemoryManager* memmanager = new SuperiorMemoryManager(
+            SuperiorOSMemePtr(new TestOSMemory()),
+            48*1024*1024,
+            privatePool,
+            privatePoolLength);
+        if (isDirect != 0)
+            memmanager->setDirectMappingThreshold(1024*1024);
+
+        void* blocks[LARGE_LIVE_BLOCKS];
+        uint i;
+        cOSDef::systemTime start = cOS::getSystemTime();
+        for (uint round = 0; round < LARGE_BENCHMARK_ROUNDS; round++)
+        {
+            for (i = 0; i < LARGE_LIVE_BLOCKS; i++)
+            {
+                blocks[i] = memmanager->allocate(largeBlockLength(round, i));
+                CHECK(blocks[i] != NULL);
+            }
+            for (i = 0; i < LARGE_LIVE_BLOCKS; i++)
+                CHECK(memmanager->free(blocks[i]));
+        }
+        uint cycleTime = cOS::calculateTimesDiffMilli(cOS::getSystemTime(),
+                                                      start);
+
+        // Convert milliseconds per pairs into nanoseconds
+        cout << (isDirect ? "Direct" : "Regions")
+             << " 1mb-8mb allocate+free: "
+             << (cycleTime * 1000000 /
+                 (LARGE_BENCHMARK_ROUNDS * LARGE_LIVE_BLOCKS)) << "ns"
+             << "  unused: "
+             << (uint)(memmanager->getNumberOfFreeBytes() / 1024)
+             << "kb" << endl;
+
+        delete memmanager;
+        delete[] privatePool;
+    }
+}
+
 //////////////////////////////////////////////////////////////////////////
 
 void testSuperiorManager()
 {
+    sizeClassTest();
+    adaptiveSizeClassesTest();
+    partialBucketsTest();
+    burstIdleTest();
+    largeBlocksTest();
+    expansionRequestTest();
+    metadataGrowthTest();
+    statisticsTest();
+    alignedAllocationTest();
+    sizedFreeTest();
+    reallocateTest();
+    wideBucketsTest();
+    remoteFreeTest();
     test1();
     testMemoryExpander();
 }
 
+void benchmarkSuperiorManager()
+{
+    benchmarkFreeLatency();
+    benchmarkThroughput();
+    benchmarkAdaptiveSizeClasses();
+    benchmarkLargeBlocks();
+}
+
@@ -41,11 +41,29 @@
 #include "xStl/except/trace.h"
 #include "xStl/stream/iostream.h"
 
+#include <string.h>
+
 /*
  * Extern modules
  */
 void testSmallMemoryHeapManager();
+void testBitmapMemoryHeapManager();
+void testLargeMemoryHeapManager();
+void testMemoryProfiler();
+void testDeferredFreeQueue();
+void testMemoryArena();
+void testObjectPool();
+void testMemoryTrace();
+void testLargePageAllocator();
 void testSuperiorManager();
+void benchmarkSuperiorManager();
+void benchmarkBitmapMemoryHeapManager();
+void benchmarkSmallMemoryHeapManager();
+void benchmarkMemoryArena();
+void benchmarkObjectPool();
+void benchmarkAllocators();
+void benchmarkLargePageAllocator();
+void replayMemoryTrace(const char* filename);
 
 /*
  * The main entry point. Captures all unexpected exceptions and make sure
@@ -53,13 +71,39 @@ void testSuperiorManager();
  *
  * Invoke a call to the following modules:
  *   1.
+ *
+ * Usage:
+ *   testMemoryManager                 Run the tests
+ *   testMemoryManager replay <file>   Replay an allocation trace file which
+ *                                     was recorded by the Manager sample
  */
 int main(const uint argc, const char** argv)
 {
     XSTL_TRY
     {
+        if ((argc == 3) && (strcmp(argv[1], "replay") == 0))
+        {
+            replayMemoryTrace(argv[2]);
+            return RC_OK;
+        }
+
         //testSmallMemoryHeapManager();
+        //testBitmapMemoryHeapManager();
+        //testLargeMemoryHeapManager();
+        //testMemoryProfiler();
+        //testDeferredFreeQueue();
+        //testMemoryArena();
+        //testObjectPool();
+        //testMemoryTrace();
+        //testLargePageAllocator();
         //testSuperiorManager();
+        //benchmarkSuperiorManager();
+        //benchmarkBitmapMemoryHeapManager();
+        //benchmarkSmallMemoryHeapManager();
+        //benchmarkMemoryArena();
+        //benchmarkObjectPool();
+        //benchmarkAllocators();
+        //benchmarkLargePageAllocator();
         return RC_OK;
     }
     XSTL_CATCH(cException& e)